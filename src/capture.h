@@ -0,0 +1,33 @@
+#ifndef CAPTURE_H
+#define CAPTURE_H
+
+#include <stdint.h>
+
+/*
+ * Capture stream: what a CDC function's USART received and sent, as
+ * records on its IN endpoint in place of the received bytes.
+ *
+ *   len, flags, time_us (u32 LE), data[len]
+ *
+ * time_us is timebase_now_us() when the device saw the data: RX as it was
+ * put in the RX ring (with DMA, at the idle line or half ring that
+ * published it), TX as it was started out of the USART.  It wraps after
+ * 71 minutes.  A chunk longer than CAPTURE_DATA_MAX goes as several
+ * records with the same time.  Records are made by a main loop task, a
+ * chunk of each stream at a time, so records of different streams can be
+ * out of time order.
+ */
+#define CAPTURE_HDR_SIZE    6
+#define CAPTURE_DATA_MAX    (64 - CAPTURE_HDR_SIZE)     // a record to a packet
+
+#define CAPTURE_TX          0x01    // sent; received if clear
+#define CAPTURE_LOST        0x02    // records were dropped before this one
+#define CAPTURE_PEER        0x04    // the tap's other USART (usb_cdc_set_peer())
+
+typedef struct {
+    uint8_t len;
+    uint8_t flags;
+    uint32_t time_us;
+} __attribute__((packed)) capture_hdr_t;
+
+#endif /* CAPTURE_H */
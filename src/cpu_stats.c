@@ -0,0 +1,65 @@
+#include <libopencm3/cm3/cortex.h>
+#include <libopencm3/cm3/dwt.h>
+#include <libopencm3/stm32/rcc.h>
+
+#include "cpu_stats.h"
+
+static uint32_t window_start;
+static cpu_stats_t stats;
+
+void cpu_stats_init(void)
+{
+    dwt_enable_cycle_counter();
+    cpu_stats_reset();
+}
+
+void cpu_stats_reset(void)
+{
+    uint32_t masked = cm_mask_interrupts(1);
+
+    window_start = dwt_read_cycle_counter();
+    stats.idle_cycles = 0;
+    stats.usb_irqs = 0;
+    stats.usb_cycles = 0;
+    stats.usb_max_cycles = 0;
+
+    cm_mask_interrupts(masked);
+}
+
+void cpu_stats_get(cpu_stats_t *out)
+{
+    uint32_t masked = cm_mask_interrupts(1);
+
+    *out = stats;
+    out->cpu_hz = rcc_ahb_frequency;
+    out->cycles = dwt_read_cycle_counter() - window_start;
+
+    cm_mask_interrupts(masked);
+}
+
+void cpu_stats_wait(void)
+{
+    cm_disable_interrupts();
+    cpu_stats_sleep();
+    cm_enable_interrupts();
+}
+
+void cpu_stats_sleep(void)
+{
+    /* Masked, WFI still wakes on a pending interrupt but it is only taken
+       once the idle time is booked */
+    uint32_t start = dwt_read_cycle_counter();
+    __WFI();
+    stats.idle_cycles += dwt_read_cycle_counter() - start;
+}
+
+void cpu_stats_usb_leave(uint32_t start)
+{
+    uint32_t cycles = dwt_read_cycle_counter() - start;
+
+    stats.usb_irqs++;
+    stats.usb_cycles += cycles;
+    if (cycles > stats.usb_max_cycles) {
+        stats.usb_max_cycles = cycles;
+    }
+}
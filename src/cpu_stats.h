@@ -0,0 +1,39 @@
+#ifndef CPU_STATS_H
+#define CPU_STATS_H
+
+#include <stdint.h>
+#include <libopencm3/cm3/dwt.h>
+
+/*
+ * Where the CPU time goes, from the DWT cycle counter.  A window runs from
+ * cpu_stats_reset() and holds 2^32 cycles (44 s at 96 MHz).
+ */
+typedef struct {
+    uint32_t cpu_hz;            // cycle counter rate
+    uint32_t cycles;            // window length
+    uint32_t idle_cycles;       // asleep in cpu_stats_wait()
+    uint32_t usb_irqs;          // OTG_FS interrupts taken
+    uint32_t usb_cycles;        // spent servicing them
+    uint32_t usb_max_cycles;    // longest one: USB latency for anything queued behind it
+} __attribute__((packed)) cpu_stats_t;
+
+void cpu_stats_init(void);
+void cpu_stats_reset(void);
+void cpu_stats_get(cpu_stats_t *stats);
+
+/* Sleep until an interrupt is pending, counted as idle.  The interrupt
+   itself runs after the count, before this returns */
+void cpu_stats_wait(void);
+
+/* The same with interrupts already masked, and left masked: the interrupt
+   runs once the caller unmasks */
+void cpu_stats_sleep(void);
+
+/* Bracket the OTG_FS ISR: start = cpu_stats_usb_enter() ... leave(start) */
+static inline uint32_t cpu_stats_usb_enter(void)
+{
+    return dwt_read_cycle_counter();
+}
+void cpu_stats_usb_leave(uint32_t start);
+
+#endif /* CPU_STATS_H */
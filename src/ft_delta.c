@@ -0,0 +1,60 @@
+#include <string.h>
+
+#include "ft_delta.h"
+
+void ft_delta_init(ft_delta_t *d)
+{
+    memset(d, 0, sizeof(*d));
+}
+
+void ft_delta_reset(ft_delta_t *d)
+{
+    d->used = 0;
+}
+
+bool ft_delta_changed(ft_delta_t *d, const ft_frame_t *frame)
+{
+    uint8_t oldest = 0;
+    uint8_t i;
+
+    d->clock++;
+    for (i = 0; i < d->used; i++) {
+        ft_frame_t *last = &d->last[i];
+
+        if (last->payload[0] != frame->payload[0]) {
+            if ((int32_t)(d->seen[i] - d->seen[oldest]) < 0) {
+                oldest = i;
+            }
+            continue;
+        }
+        d->seen[i] = d->clock;
+        if (last->len == frame->len && memcmp(last->payload, frame->payload, frame->len) == 0) {
+            d->stats.suppressed++;
+            return false;
+        }
+        break;
+    }
+
+    /* A type not kept yet: a free slot, or the one unseen the longest */
+    if (i == d->used) {
+        if (d->used < FT_DELTA_SLOTS) {
+            d->used++;
+        } else {
+            i = oldest;
+            d->stats.evicted++;
+        }
+        d->seen[i] = d->clock;
+    }
+    d->last[i].len = frame->len;
+    memcpy(d->last[i].payload, frame->payload, frame->len);
+    d->stats.passed++;
+    return true;
+}
+
+void ft_delta_replay(ft_delta_t *d, ft_frame_cb_t fn, void *ctx)
+{
+    for (uint8_t i = 0; i < d->used; i++) {
+        d->stats.replayed++;
+        fn(ctx, &d->last[i]);
+    }
+}
@@ -0,0 +1,49 @@
+#ifndef FT_DELTA_H
+#define FT_DELTA_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "ft_frame.h"
+
+/*
+ * Change-only forwarding of FT-7900 frames.  The head unit repeats its
+ * display state whether or not it changed; this keeps the last frame of
+ * each type, the first payload byte, and passes a frame on only when it
+ * differs from that.  ft_delta_replay() gives back everything kept, for a
+ * keyframe or a host that needs the whole state again.
+ *
+ * Up to FT_DELTA_SLOTS types are kept.  A new type beyond that takes the
+ * slot of the one seen least recently, which is then new again itself.
+ */
+#ifndef FT_DELTA_SLOTS
+#define FT_DELTA_SLOTS  16
+#endif
+
+typedef struct {
+    uint32_t passed;        // changed or new, sent on
+    uint32_t suppressed;    // same as the last of its type
+    uint32_t replayed;      // sent again by ft_delta_replay()
+    uint32_t evicted;       // types forgotten for want of a slot
+} __attribute__((packed)) ft_delta_stats_t;
+
+typedef struct {
+    ft_frame_t last[FT_DELTA_SLOTS];
+    uint32_t seen[FT_DELTA_SLOTS];  // clock when last matched, for eviction
+    uint8_t used;
+    uint32_t clock;
+    ft_delta_stats_t stats;
+} ft_delta_t;
+
+void ft_delta_init(ft_delta_t *d);
+
+/* Forget every frame kept, the stats stay */
+void ft_delta_reset(ft_delta_t *d);
+
+/* Keep frame as the last of its type: true if it is to be sent on */
+bool ft_delta_changed(ft_delta_t *d, const ft_frame_t *frame);
+
+/* Every frame kept, through fn */
+void ft_delta_replay(ft_delta_t *d, ft_frame_cb_t fn, void *ctx);
+
+#endif /* FT_DELTA_H */
@@ -0,0 +1,161 @@
+#include <string.h>
+
+#include "ft_frame.h"
+
+enum {
+    FT_FRAME_HUNT,          // looking for sync
+    FT_FRAME_LEN,
+    FT_FRAME_PAYLOAD,
+    FT_FRAME_SUM,
+};
+
+void ft_frame_parser_init(ft_frame_parser_t *p, ft_frame_cb_t fn, void *ctx)
+{
+    memset(p, 0, sizeof(*p));
+    p->state = FT_FRAME_HUNT;
+    p->fn = fn;
+    p->ctx = ctx;
+}
+
+/* False sync: the bytes taken after it go back in front of what is still
+   to be parsed.  They all came after the sync, so they fit in replay */
+static void ft_frame_resync(ft_frame_parser_t *p, const uint8_t *last, uint8_t nlast)
+{
+    uint8_t tmp[sizeof(p->replay)];
+    uint8_t rest = p->replay_len - p->replay_off;
+    uint8_t n = 0;
+
+    tmp[n++] = p->frame.len;
+    memcpy(&tmp[n], p->frame.payload, p->pos);
+    n += p->pos;
+    memcpy(&tmp[n], last, nlast);
+    n += nlast;
+    memcpy(&tmp[n], &p->replay[p->replay_off], rest);
+
+    memcpy(p->replay, tmp, n + rest);
+    p->replay_off = 0;
+    p->replay_len = n + rest;
+    p->state = FT_FRAME_HUNT;
+}
+
+static void ft_frame_byte(ft_frame_parser_t *p, uint8_t b)
+{
+    switch (p->state) {
+    case FT_FRAME_HUNT:
+        if (b == FT_FRAME_SYNC) {
+            p->state = FT_FRAME_LEN;
+        } else {
+            p->stats.noise++;
+        }
+        break;
+
+    case FT_FRAME_LEN:
+        p->frame.len = b;
+        p->pos = 0;
+        p->sum = b;
+        if (b == 0 || b > FT_FRAME_PAYLOAD_MAX) {
+            p->stats.bad_len++;
+            ft_frame_resync(p, &b, 0);
+        } else {
+            p->state = FT_FRAME_PAYLOAD;
+        }
+        break;
+
+    case FT_FRAME_PAYLOAD:
+        p->frame.payload[p->pos++] = b;
+        p->sum += b;
+        if (p->pos == p->frame.len) {
+            p->state = FT_FRAME_SUM;
+        }
+        break;
+
+    case FT_FRAME_SUM:
+        if (b == p->sum) {
+            p->stats.frames++;
+            p->state = FT_FRAME_HUNT;
+            p->fn(p->ctx, &p->frame);
+        } else {
+            p->stats.bad_sum++;
+            ft_frame_resync(p, &b, 1);
+        }
+        break;
+    }
+}
+
+void ft_frame_parse(ft_frame_parser_t *p, const uint8_t *data, size_t len)
+{
+    size_t i = 0;
+
+    while (i < len) {
+        if (p->replay_off < p->replay_len) {
+            ft_frame_byte(p, p->replay[p->replay_off++]);
+            continue;
+        }
+
+        /* The common cases a span at a time: noise up to the next sync,
+           and payload */
+        if (p->state == FT_FRAME_HUNT) {
+            const uint8_t *sync = memchr(&data[i], FT_FRAME_SYNC, len - i);
+            size_t skip = (sync != NULL) ? (size_t)(sync - &data[i]) : len - i;
+
+            p->stats.noise += skip;
+            i += skip;
+            if (sync != NULL) {
+                p->state = FT_FRAME_LEN;
+                i++;
+            }
+            continue;
+        }
+        if (p->state == FT_FRAME_PAYLOAD) {
+            size_t n = p->frame.len - p->pos;
+
+            if (n > len - i) {
+                n = len - i;
+            }
+            memcpy(&p->frame.payload[p->pos], &data[i], n);
+            for (size_t k = 0; k < n; k++) {
+                p->sum += data[i + k];
+            }
+            p->pos += n;
+            i += n;
+            if (p->pos == p->frame.len) {
+                p->state = FT_FRAME_SUM;
+            }
+            continue;
+        }
+        ft_frame_byte(p, data[i++]);
+    }
+
+    /* A false sync found in the last bytes still has its replay to do */
+    while (p->replay_off < p->replay_len) {
+        ft_frame_byte(p, p->replay[p->replay_off++]);
+    }
+}
+
+ringbuf_idx_t ft_frame_parse_ring(ft_frame_parser_t *p, ringbuf_t *rb)
+{
+    ringbuf_idx_t total = 0;
+    ringbuf_idx_t n;
+    uint8_t *span;
+
+    while ((n = ringbuf_read_span(rb, &span)) > 0) {
+        ft_frame_parse(p, span, n);
+        ringbuf_read_commit(rb, n);
+        total += n;
+    }
+    return total;
+}
+
+uint16_t ft_frame_encode(const ft_frame_t *frame, uint8_t *out)
+{
+    uint8_t sum = frame->len;
+
+    out[0] = FT_FRAME_SYNC;
+    out[1] = frame->len;
+    for (uint8_t i = 0; i < frame->len; i++) {
+        out[2 + i] = frame->payload[i];
+        sum += frame->payload[i];
+    }
+    out[2 + frame->len] = sum;
+    return FT_FRAME_OVERHEAD + frame->len;
+}
@@ -0,0 +1,69 @@
+#ifndef FT_FRAME_H
+#define FT_FRAME_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "ringbuf.h"
+
+/*
+ * Frames on the FT-7900 head unit link:
+ *
+ *   FT_FRAME_SYNC, len, payload[len], checksum
+ *
+ * len is 1 .. FT_FRAME_PAYLOAD_MAX and the checksum is the low byte of the
+ * sum of len and the payload.  Both constants can be set at build time.
+ *
+ * The parser takes the stream in pieces of any size and keeps no more than
+ * one frame.  A frame that fails its length or checksum was a false sync:
+ * the bytes after that sync are parsed again, so a real frame starting
+ * inside it is still found, once enough has come in to rule it out.
+ */
+#ifndef FT_FRAME_SYNC
+#define FT_FRAME_SYNC           0xA5
+#endif
+#ifndef FT_FRAME_PAYLOAD_MAX
+#define FT_FRAME_PAYLOAD_MAX    32
+#endif
+
+#define FT_FRAME_OVERHEAD       3       // sync, len, checksum
+
+typedef struct {
+    uint8_t len;
+    uint8_t payload[FT_FRAME_PAYLOAD_MAX];
+} ft_frame_t;
+
+/* A good frame, only valid during the call */
+typedef void (*ft_frame_cb_t)(void *ctx, const ft_frame_t *frame);
+
+typedef struct {
+    uint32_t frames;
+    uint32_t bad_len;
+    uint32_t bad_sum;
+    uint32_t noise;         // bytes skipped looking for sync
+} __attribute__((packed)) ft_frame_stats_t;
+
+typedef struct {
+    uint8_t state;
+    uint8_t pos;            // payload bytes so far
+    uint8_t sum;
+    ft_frame_t frame;
+    /* Bytes after a false sync, parsed again before new input */
+    uint8_t replay[FT_FRAME_PAYLOAD_MAX + 2];
+    uint8_t replay_off;
+    uint8_t replay_len;
+    ft_frame_cb_t fn;
+    void *ctx;
+    ft_frame_stats_t stats;
+} ft_frame_parser_t;
+
+void ft_frame_parser_init(ft_frame_parser_t *p, ft_frame_cb_t fn, void *ctx);
+void ft_frame_parse(ft_frame_parser_t *p, const uint8_t *data, size_t len);
+
+/* Consumer side of rb: parse all of it, returns the bytes taken */
+ringbuf_idx_t ft_frame_parse_ring(ft_frame_parser_t *p, ringbuf_t *rb);
+
+/* The frame back in wire form, FT_FRAME_OVERHEAD + len bytes */
+uint16_t ft_frame_encode(const ft_frame_t *frame, uint8_t *out);
+
+#endif /* FT_FRAME_H */
@@ -2,6 +2,8 @@
 #include <libopencm3/stm32/flash.h>
 #include <libopencm3/stm32/gpio.h>
 #include <libopencm3/stm32/usart.h>
+#include <libopencm3/stm32/dma.h>
+#include <libopencm3/stm32/exti.h>
 #include <libopencm3/usb/usbd.h>
 #include <libopencm3/stm32/f4/nvic.h> /* For interrupts */
 
@@ -9,13 +11,104 @@
 #include <stddef.h> /* for NULL */
 
 #include "usb_core.h"
+#include "usb_descriptors.h"
 #include "usb_cdc.h"
 #include "usart.h"
+#include "cpu_stats.h"
+#include "timebase.h"
+#include "usb_vendor.h"
+#include "recq.h"
+#include "ft_frame.h"
+#include "ft_delta.h"
+#include "ptt.h"
+#include "sched.h"
+#include "prof.h"
 
 //#define USE_USART1 
 
-/* Global usart context - available for ISR routines */
-usart_ctx_t usart_ctx;  /* USART context storage */
+/* DMA moves the USART data, build with -DUSE_USART_IRQ for one interrupt per byte */
+#ifndef USE_USART_IRQ
+#define USE_USART_DMA
+#endif
+
+/*
+ * -DUSE_USART_RTSCTS: RTS/CTS on GPIOs (USART2: RTS PA1, CTS PA4; USART1:
+ * RTS PB8, CTS PB1).  The USART's own CTS/RTS pins are taken by PTT (PA0)
+ * and USB (PA11/PA12), and hardware RTS could not follow the ring anyway.
+ */
+
+/*
+ * One bridge per CDC function.  A single function bridges USART2 (PA2/PA3),
+ * or USART1 (PB6/PB7) with USE_USART1, and the other USART is its tap peer
+ * (usb_cdc_set_peer()); with two, CDC0 is USART2 and CDC1 is USART1.
+ * Both USARTs always run, ports 0 .. USB_CDC_NUM - 1 for the functions.
+ */
+#if USB_CDC_NUM > 2
+#error "only USART1 and USART2 are wired up"
+#elif USB_CDC_NUM == 1 && defined(USE_USART1)
+#define BRIDGE_USART1 0
+#define BRIDGE_USART2 1
+#else
+#define BRIDGE_USART2 0
+#define BRIDGE_USART1 1
+#endif
+#define BRIDGE_PORTS 2
+
+typedef struct {
+    uint32_t usart;
+    uint8_t irq;
+    usart_dma_cfg_t dma;    // only with USE_USART_DMA
+    uint8_t dma_rx_irq;
+    uint8_t dma_tx_irq;
+    usart_flow_cfg_t flow;  // only with USE_USART_RTSCTS
+    uint8_t cts_irq;
+} bridge_port_t;
+
+static const bridge_port_t bridge_port[BRIDGE_PORTS] = {
+    [BRIDGE_USART2] = {
+        .usart = USART2, .irq = NVIC_USART2_IRQ,
+        .dma = { .dma = DMA1, .rx_stream = DMA_STREAM5, .tx_stream = DMA_STREAM6, .channel = DMA_SxCR_CHSEL_4 },
+        .dma_rx_irq = NVIC_DMA1_STREAM5_IRQ, .dma_tx_irq = NVIC_DMA1_STREAM6_IRQ,
+        .flow = { .rts_port = GPIOA, .rts_pin = GPIO1, .cts_port = GPIOA, .cts_pin = GPIO4 },
+        .cts_irq = NVIC_EXTI4_IRQ,
+    },
+    [BRIDGE_USART1] = {
+        .usart = USART1, .irq = NVIC_USART1_IRQ,
+        .dma = { .dma = DMA2, .rx_stream = DMA_STREAM2, .tx_stream = DMA_STREAM7, .channel = DMA_SxCR_CHSEL_4 },
+        .dma_rx_irq = NVIC_DMA2_STREAM2_IRQ, .dma_tx_irq = NVIC_DMA2_STREAM7_IRQ,
+        .flow = { .rts_port = GPIOB, .rts_pin = GPIO8, .cts_port = GPIOB, .cts_pin = GPIO1 },
+        .cts_irq = NVIC_EXTI1_IRQ,
+    },
+};
+
+/* Global usart contexts, one per port - available for ISR routines */
+usart_ctx_t usart_ctx[BRIDGE_PORTS];  /* USART context storage */
+
+/* Bridge rings: size fixed at build time, must be a power of two */
+RINGBUF_DEFINE(bridge_ring, 256);
+
+/* FT-7900 frames parsed from USART RX, sent instead of it when the host
+   asks for them */
+static ft_frame_parser_t frame_parser[USB_CDC_NUM];
+static ft_delta_t frame_delta[USB_CDC_NUM];
+static recq_t frame_q[USB_CDC_NUM];
+static uint8_t frame_q_buf[USB_CDC_NUM][256];
+
+/* PTT on PA0, whoever keys it */
+static ptt_ctx_t ptt;
+
+/*
+ * Main loop tasks, by id.  USB and the USARTs are serviced in their
+ * interrupts, where their latency is set; what can wait goes here
+ */
+enum {
+    TASK_LED,
+    TASK_CDC0_RX,
+    TASK_CDC1_RX,
+};
+
+/* The LED shows PTT, and nothing else drives it */
+static sched_task_t led_task;
 
 /* --------------------------------------------------------------------------
  * Clock Setup
@@ -33,16 +126,22 @@ static void clock_setup(void)
     rcc_periph_reset_pulse(RST_OTGFS);
 
     /* USART  */
-#ifdef USE_USART1
     rcc_periph_clock_enable(RCC_USART1);
     rcc_periph_clock_enable(RCC_GPIOB);
-#else
+#ifdef USE_USART_DMA
+    rcc_periph_clock_enable(RCC_DMA2);
+#endif
     rcc_periph_clock_enable(RCC_USART2);
     rcc_periph_clock_enable(RCC_GPIOA);
+#ifdef USE_USART_DMA
+    rcc_periph_clock_enable(RCC_DMA1);
 #endif
 
     /* PPT SWITCH */
     rcc_periph_clock_enable(RCC_GPIOA);
+
+    /* EXTI line selection: PTT, and CTS with USE_USART_RTSCTS */
+    rcc_periph_clock_enable(RCC_SYSCFG);
 }
 
 
@@ -73,28 +172,99 @@ static void gpio_setup(void)
     gpio_set(GPIOC, GPIO13); /* LED off (board-dependent) */
 
     /***************************************
-    *  PTT input PB2- enable GPIO for PTT on blackpill board 
+    *  PTT PA0 - open drain, released (high) from reset, so the switch
+    *  and the host (through the vendor interface) can both key it
     ****************************************/
-    gpio_mode_setup(GPIOA, GPIO_MODE_INPUT, GPIO_PUPD_PULLUP, GPIO0);
+    gpio_set(GPIOA, GPIO0);
+    gpio_mode_setup(GPIOA, GPIO_MODE_OUTPUT, GPIO_PUPD_PULLUP, GPIO0);
+    gpio_set_output_options(GPIOA, GPIO_OTYPE_OD, GPIO_OSPEED_2MHZ, GPIO0);
 
     /***************************************
-    *  USART - Enable USART1 output on alternate function pins 
+    *  USART - Enable USART1 (PB6/PB7) and USART2 (PA2/PA3) on
+    *  alternate function pins
     ****************************************/
 
-#ifdef USE_USART1
     gpio_mode_setup(GPIOB, GPIO_MODE_AF, GPIO_PUPD_NONE, GPIO6); /* Note: Can not have pullup on output, output stops */
     gpio_mode_setup(GPIOB, GPIO_MODE_AF, GPIO_PUPD_PULLUP, GPIO7);
     gpio_set_af(GPIOB, GPIO_AF7, GPIO6 | GPIO7);
     gpio_set_output_options(GPIOB, GPIO_OTYPE_PP, GPIO_OSPEED_50MHZ, GPIO6 | GPIO7);
-#else
+
     gpio_mode_setup(GPIOA, GPIO_MODE_AF, GPIO_PUPD_NONE, GPIO2); /* Note: Can not have pullup on output, output stops */
     gpio_mode_setup(GPIOA, GPIO_MODE_AF, GPIO_PUPD_PULLUP, GPIO3);
     gpio_set_af(GPIOA, GPIO_AF7, GPIO2 | GPIO3);
+
+    /***************************************
+    *  RTS/CTS - RTS asserted (low) from reset, CTS pulled up so an
+    *  unconnected line holds TX
+    ****************************************/
+#ifdef USE_USART_RTSCTS
+    for (uint8_t n = 0; n < BRIDGE_PORTS; n++) {
+        const usart_flow_cfg_t *flow = &bridge_port[n].flow;
+
+        gpio_clear(flow->rts_port, flow->rts_pin);
+        gpio_mode_setup(flow->rts_port, GPIO_MODE_OUTPUT, GPIO_PUPD_NONE, flow->rts_pin);
+        gpio_mode_setup(flow->cts_port, GPIO_MODE_INPUT, GPIO_PUPD_PULLUP, flow->cts_pin);
+    }
+#endif
+
+}
+
+
+
+/* PTT edge, debounced: the host is told from here, the LED is a task */
+static void ptt_event(void *ctx, bool active, uint32_t time_us)
+{
+    (void)ctx;
+    usb_cdc_ptt_event(active, time_us);
+    sched_post(&led_task);
+}
+
+static void led_task_fn(void *ctx)
+{
+    (void)ctx;
+    if (ptt_active(&ptt)) {
+        gpio_clear(GPIOC, GPIO13);
+    } else {
+        gpio_set(GPIOC, GPIO13);
+    }
+}
+
+#if USB_VENDOR
+static void ptt_set(bool on)
+{
+    if (on) {
+        gpio_clear(GPIOA, GPIO0);
+    } else {
+        gpio_set(GPIOA, GPIO0);
+    }
+}
 #endif
 
+void tim2_isr(void)
+{
+    PROF_BEGIN();
+
+    timebase_irq_handler();
+    PROF_END(PROF_TIMER_ISR);
 }
 
+void otg_fs_isr(void)
+{
+    uint32_t start = cpu_stats_usb_enter();
+    PROF_BEGIN();
+
+    usb_core_poll();
+    PROF_END(PROF_USB_ISR);
+    cpu_stats_usb_leave(start);
+}
+
+void exti0_isr(void)
+{
+    PROF_BEGIN();
 
+    ptt_irq_handler(&ptt);
+    PROF_END(PROF_PTT_ISR);
+}
 
 void hard_fault_handler(void)
 {
@@ -105,16 +275,69 @@ void hard_fault_handler(void)
 }
 
 
-#ifdef USE_USART1
 void usart1_isr(void) 
 {
-    usart_irq_handler(&usart_ctx);
+    PROF_BEGIN();
+
+    usart_irq_handler(&usart_ctx[BRIDGE_USART1]);
+    PROF_END(PROF_USART_ISR);
 }
 
-#else
+#ifdef USE_USART_RTSCTS
+void exti1_isr(void)
+{
+    usart_cts_irq_handler(&usart_ctx[BRIDGE_USART1]);
+}
+#endif
+
+#ifdef USE_USART_DMA
+void dma2_stream2_isr(void)
+{
+    PROF_BEGIN();
+
+    usart_dma_rx_irq_handler(&usart_ctx[BRIDGE_USART1]);
+    PROF_END(PROF_USART_DMA_RX_ISR);
+}
+
+void dma2_stream7_isr(void)
+{
+    PROF_BEGIN();
+
+    usart_dma_tx_irq_handler(&usart_ctx[BRIDGE_USART1]);
+    PROF_END(PROF_USART_DMA_TX_ISR);
+}
+#endif
+
 void usart2_isr(void) 
 {
-    usart_irq_handler(&usart_ctx);
+    PROF_BEGIN();
+
+    usart_irq_handler(&usart_ctx[BRIDGE_USART2]);
+    PROF_END(PROF_USART_ISR);
+}
+
+#ifdef USE_USART_RTSCTS
+void exti4_isr(void)
+{
+    usart_cts_irq_handler(&usart_ctx[BRIDGE_USART2]);
+}
+#endif
+
+#ifdef USE_USART_DMA
+void dma1_stream5_isr(void)
+{
+    PROF_BEGIN();
+
+    usart_dma_rx_irq_handler(&usart_ctx[BRIDGE_USART2]);
+    PROF_END(PROF_USART_DMA_RX_ISR);
+}
+
+void dma1_stream6_isr(void)
+{
+    PROF_BEGIN();
+
+    usart_dma_tx_irq_handler(&usart_ctx[BRIDGE_USART2]);
+    PROF_END(PROF_USART_DMA_TX_ISR);
 }
 #endif
 
@@ -124,59 +347,75 @@ void usart2_isr(void)
 int main(void)
 {
 
-    uint8_t usart_tx_buf[256];            // backing store
-    ringbuf_t usart_tx_rb;
-
-    uint8_t usb_cdc_tx_buf[256];            // backing store
-    ringbuf_t usb_cdc_tx_rb;
+    static bridge_ring_t usart_tx_ring[BRIDGE_PORTS];     // USB OUT -> USART TX
+    static bridge_ring_t usb_cdc_tx_ring[BRIDGE_PORTS];   // USART RX -> USB IN
 
 
     clock_setup();
     gpio_setup();
+    cpu_stats_init();
+    timebase_init();
 
+    usb_core_init();   
 
-    /* Initialise ring buffer structures */
-    ringbuf_init(&usart_tx_rb, usart_tx_buf, sizeof(usart_tx_buf));
-    ringbuf_init(&usb_cdc_tx_rb, usb_cdc_tx_buf, sizeof(usb_cdc_tx_buf));
+    for (uint8_t n = 0; n < BRIDGE_PORTS; n++) {
+        const bridge_port_t *port = &bridge_port[n];
+        ringbuf_t *usart_tx_rb = bridge_ring_rb(&usart_tx_ring[n]);
+        ringbuf_t *usb_cdc_tx_rb = bridge_ring_rb(&usb_cdc_tx_ring[n]);
 
+        /* Initialise ring buffer structures */
+        bridge_ring_init(&usart_tx_ring[n]);
+        bridge_ring_init(&usb_cdc_tx_ring[n]);
 
-    // Initialise USB-CDC and register callback 
-    usb_core_init();   
-    usb_cdc_init(&usb_cdc_tx_rb,&usart_tx_rb);   
-
-    // Initialise USART and register callback 
-#ifdef USE_USART1
-    usart_init(&usart_ctx, USART1, &usart_tx_rb, &usb_cdc_tx_rb);
-#else 
-    usart_init(&usart_ctx, USART2, &usart_tx_rb, &usb_cdc_tx_rb);
+        // Initialise USART and register callback 
+#ifdef USE_USART_DMA
+        usart_init_dma(&usart_ctx[n], port->usart, usart_tx_rb, usb_cdc_tx_rb, &port->dma);
+#else
+        usart_init(&usart_ctx[n], port->usart, usart_tx_rb, usb_cdc_tx_rb);
 #endif
-
-    // Enable USART1 in interrupt controller 
-#ifdef USE_USART1
-    nvic_enable_irq(NVIC_USART1_IRQ);
-#else 
-    nvic_enable_irq(NVIC_USART2_IRQ);
+#ifdef USE_USART_RTSCTS
+        usart_set_flow(&usart_ctx[n], &port->flow);
 #endif
-	
-   int count=0;
-
-    while (1) {
-        usb_core_poll();
 
-	if (gpio_get(GPIOA,GPIO0))
-        {
-            gpio_set(GPIOC,GPIO13);
+        if (n < USB_CDC_NUM) {
+            // Initialise USB-CDC and register callback 
+            usb_cdc_init(n, usb_cdc_tx_rb, usart_tx_rb);
+            usb_cdc_set_usart(n, &usart_ctx[n]);
+            recq_init(&frame_q[n], frame_q_buf[n], sizeof(frame_q_buf[n]), RECQ_DROP_OLDEST);
+            usb_cdc_set_tx_recq(n, &frame_q[n]);
+            usb_cdc_set_rx_parser(n, &frame_parser[n]);
+            usb_cdc_set_rx_delta(n, &frame_delta[n]);
+            usb_cdc_init_task(n, TASK_CDC0_RX + n, 2);
         } else {
-            gpio_clear(GPIOC,GPIO13);
+            /* No function of its own: the other side of CDC0's tap */
+            usb_cdc_set_peer(0, &usart_ctx[n]);
         }
 
+        // Enable USART in interrupt controller 
+        nvic_enable_irq(port->irq);
+#ifdef USE_USART_DMA
+        nvic_enable_irq(port->dma_rx_irq);
+        nvic_enable_irq(port->dma_tx_irq);
+#endif
+#ifdef USE_USART_RTSCTS
+        nvic_enable_irq(port->cts_irq);
+#endif
+    }
 
-        if ( count > 500000 )
-        {
-	    count = 0;
-        } else {
-            count++;
-        }
+#if USB_VENDOR
+    usb_vendor_init(usart_ctx, USB_CDC_NUM, ptt_set);
+#endif
+
+    sched_task_init(&led_task, TASK_LED, 7, led_task_fn, NULL);
+    ptt_init(&ptt, GPIOA, GPIO0, ptt_event, NULL);
+
+    /* USB is serviced from its interrupt, once every function is set up */
+    nvic_enable_irq(NVIC_OTG_FS_IRQ);
+    nvic_enable_irq(NVIC_EXTI0_IRQ);
+
+    /* Tasks as they are posted, asleep in between */
+    while (1) {
+        sched_run();
     }
     return 0;
 }
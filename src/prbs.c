@@ -0,0 +1,96 @@
+#include "prbs.h"
+
+#define PRBS_MASK 0x7fff
+
+static uint8_t prbs_popcount(uint8_t v)
+{
+    uint8_t n = 0;
+
+    for (; v != 0; v &= v - 1) {
+        n++;
+    }
+    return n;
+}
+
+/* Shift in one byte's bits, first one first */
+static uint16_t prbs_shift(uint16_t state, uint8_t b)
+{
+    for (uint8_t i = 0; i < 8; i++) {
+        state = ((state << 1) | ((b >> i) & 1)) & PRBS_MASK;
+    }
+    return state;
+}
+
+void prbs_init(prbs_gen_t *g)
+{
+    g->state = PRBS_MASK;
+}
+
+uint8_t prbs_byte(prbs_gen_t *g)
+{
+    uint16_t s = g->state;
+    uint8_t b = 0;
+
+    for (uint8_t i = 0; i < 8; i++) {
+        uint8_t bit = ((s >> 14) ^ (s >> 13)) & 1;
+
+        s = ((s << 1) | bit) & PRBS_MASK;
+        b |= bit << i;
+    }
+    g->state = s;
+    return b;
+}
+
+void prbs_fill(prbs_gen_t *g, uint8_t *buf, size_t len)
+{
+    for (size_t i = 0; i < len; i++) {
+        buf[i] = prbs_byte(g);
+    }
+}
+
+void prbs_check_init(prbs_check_t *c)
+{
+    c->gen.state = 0;
+    c->locked = 0;
+    c->seen = 0;
+    c->bad_run = 0;
+    c->run_errors = 0;
+    c->bytes = 0;
+    c->bit_errors = 0;
+    c->resyncs = 0;
+}
+
+void prbs_check(prbs_check_t *c, const uint8_t *data, size_t len)
+{
+    c->bytes += len;
+    for (size_t i = 0; i < len; i++) {
+        uint8_t b = data[i];
+
+        if (!c->locked) {
+            /* An all-zero register (a break, a dead line) never locks */
+            c->gen.state = prbs_shift(c->gen.state, b);
+            if (++c->seen >= 2 && c->gen.state != 0) {
+                c->locked = 1;
+            }
+            continue;
+        }
+
+        uint8_t errors = prbs_popcount(prbs_byte(&c->gen) ^ b);
+
+        if (errors == 0) {
+            c->bit_errors += c->run_errors;
+            c->run_errors = 0;
+            c->bad_run = 0;
+            continue;
+        }
+        c->run_errors += errors;
+        if (++c->bad_run >= PRBS_SLIP_BYTES) {
+            c->resyncs++;
+            c->run_errors = 0;
+            c->bad_run = 0;
+            c->locked = 0;
+            c->seen = 1;
+            c->gen.state = prbs_shift(0, b);
+        }
+    }
+}
@@ -0,0 +1,42 @@
+#ifndef PRBS_H
+#define PRBS_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ * PRBS-15 (x^15 + x^14 + 1, ITU-T O.150) a byte at a time, first bit in
+ * bit 0 as a UART sends it.  The register holds the last 15 bits sent, so
+ * a checker locks onto a stream from two bytes of it.
+ */
+typedef struct {
+    uint16_t state;         // never 0
+} prbs_gen_t;
+
+void prbs_init(prbs_gen_t *g);
+uint8_t prbs_byte(prbs_gen_t *g);
+void prbs_fill(prbs_gen_t *g, uint8_t *buf, size_t len);
+
+/*
+ * Checker.  It locks from the stream, then counts each bit that differs
+ * from what the generator would send next.  PRBS_SLIP_BYTES bad bytes in a
+ * row mean bytes were lost or added rather than bits flipped: that run's
+ * errors are dropped, a resync counted and the checker locks again.
+ */
+#define PRBS_SLIP_BYTES 4
+
+typedef struct {
+    prbs_gen_t gen;
+    uint8_t locked;
+    uint8_t seen;           // bytes towards a lock
+    uint8_t bad_run;        // bad bytes in a row
+    uint32_t run_errors;    // their bit errors, not yet counted
+    uint32_t bytes;
+    uint32_t bit_errors;
+    uint32_t resyncs;
+} prbs_check_t;
+
+void prbs_check_init(prbs_check_t *c);
+void prbs_check(prbs_check_t *c, const uint8_t *data, size_t len);
+
+#endif /* PRBS_H */
@@ -0,0 +1,55 @@
+#include <string.h>
+#include <libopencm3/cm3/cortex.h>
+
+#include "prof.h"
+
+#if PROF
+
+static prof_point_t points[PROF_POINTS];
+
+/* Callbacks also run from the main loop, so an ISR may record the same
+   point in the middle of an update */
+static void prof_add(prof_hist_t *h, uint32_t cycles)
+{
+    uint32_t masked = cm_mask_interrupts(1);
+    uint32_t b = (cycles == 0) ? 0 : 32 - __builtin_clz(cycles);
+
+    if (b >= PROF_BUCKETS) {
+        b = PROF_BUCKETS - 1;
+    }
+    if (h->count == 0 || cycles < h->min_cycles) {
+        h->min_cycles = cycles;
+    }
+    if (cycles > h->max_cycles) {
+        h->max_cycles = cycles;
+    }
+    h->count++;
+    h->total_cycles += cycles;
+    h->hist[b]++;
+
+    cm_mask_interrupts(masked);
+}
+
+void prof_duration(uint8_t point, uint32_t cycles)
+{
+    prof_add(&points[point].duration, cycles);
+}
+
+void prof_latency(uint8_t point, uint32_t cycles)
+{
+    prof_add(&points[point].latency, cycles);
+}
+
+void prof_get(uint8_t point, prof_point_t *out, bool reset)
+{
+    uint32_t masked = cm_mask_interrupts(1);
+
+    *out = points[point];
+    if (reset) {
+        memset(&points[point], 0, sizeof(points[point]));
+    }
+
+    cm_mask_interrupts(masked);
+}
+
+#endif
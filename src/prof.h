@@ -0,0 +1,62 @@
+#ifndef PROF_H
+#define PROF_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <libopencm3/cm3/dwt.h>
+
+/*
+ * Profiling of the ISRs and the ring callbacks, from the DWT cycle counter:
+ * how long each run took, and for the timer how late it was entered, as
+ * count / min / max / total and a log2 histogram per point.  Callbacks run
+ * inside an ISR, so their time is counted in it as well.  Build with
+ * -DPROF=1; without it the probes are empty and none of it is built.
+ */
+#ifndef PROF
+#define PROF 0
+#endif
+
+enum {
+    PROF_USB_ISR,           // OTG_FS, usbd_poll()
+    PROF_USART_ISR,         // usart_irq_handler(), either USART
+    PROF_USART_DMA_RX_ISR,
+    PROF_USART_DMA_TX_ISR,
+    PROF_TIMER_ISR,         // timebase; latency from the compare it was due at
+    PROF_PTT_ISR,
+    PROF_CDC_RX_NOTIFY,     // USART RX ring written, toward USB IN
+    PROF_CDC_RX_DRAINED,    // USB OUT ring read down to its low_wm
+    PROF_USART_TX_NOTIFY,   // USB OUT ring written, toward USART TX
+    PROF_POINTS
+};
+
+/* Bucket 0 counts runs of 0 cycles, bucket n those of 2^(n-1) .. 2^n - 1,
+   the last one everything longer (2.7 ms at 96 MHz) */
+#define PROF_BUCKETS 20
+
+typedef struct {
+    uint32_t count;
+    uint32_t min_cycles;            // 0 while count is
+    uint32_t max_cycles;
+    uint64_t total_cycles;
+    uint32_t hist[PROF_BUCKETS];
+} __attribute__((packed)) prof_hist_t;
+
+typedef struct {
+    prof_hist_t duration;           // entry to exit
+    prof_hist_t latency;            // due to entry, only where that is known
+} __attribute__((packed)) prof_point_t;
+
+#if PROF
+void prof_duration(uint8_t point, uint32_t cycles);
+void prof_latency(uint8_t point, uint32_t cycles);
+void prof_get(uint8_t point, prof_point_t *out, bool reset);
+
+/* One probe per function: PROF_BEGIN(); ... PROF_END(PROF_...); */
+#define PROF_BEGIN()        uint32_t prof_begin_ = dwt_read_cycle_counter()
+#define PROF_END(point)     prof_duration((point), dwt_read_cycle_counter() - prof_begin_)
+#else
+#define PROF_BEGIN()
+#define PROF_END(point)
+#endif
+
+#endif /* PROF_H */
@@ -0,0 +1,61 @@
+#include <libopencm3/stm32/gpio.h>
+#include <libopencm3/stm32/exti.h>
+
+#include "ptt.h"
+
+static bool ptt_read(const ptt_ctx_t *ctx)
+{
+    return gpio_get(ctx->port, ctx->pin) == 0;
+}
+
+/* The line changed: report it now and ignore it until it has settled */
+static void ptt_edge(ptt_ctx_t *ctx, bool active, uint32_t time_us)
+{
+    ctx->active = active;
+    exti_disable_request(ctx->pin);
+    timebase_timer_start(&ctx->debounce, PTT_DEBOUNCE_US);
+    ctx->fn(ctx->fn_ctx, active, time_us);
+}
+
+/* Debounce over: a bounce that ended the other way is an edge of its own */
+static void ptt_settled(void *passed_ctx)
+{
+    ptt_ctx_t *ctx = passed_ctx;
+    bool active = ptt_read(ctx);
+
+    exti_reset_request(ctx->pin);
+    if (active != ctx->active) {
+        ptt_edge(ctx, active, timebase_now_us());
+    } else {
+        exti_enable_request(ctx->pin);
+    }
+}
+
+void ptt_init(ptt_ctx_t *ctx, uint32_t port, uint16_t pin, ptt_event_cb_t fn, void *fn_ctx)
+{
+    ctx->port = port;
+    ctx->pin = pin;
+    ctx->fn = fn;
+    ctx->fn_ctx = fn_ctx;
+    ctx->active = ptt_read(ctx);
+    timebase_timer_init(&ctx->debounce, ptt_settled, ctx);
+
+    exti_select_source(pin, port);
+    exti_set_trigger(pin, EXTI_TRIGGER_BOTH);
+    exti_reset_request(pin);
+    exti_enable_request(pin);
+}
+
+void ptt_irq_handler(ptt_ctx_t *ctx)
+{
+    uint32_t now = timebase_now_us();
+    bool active;
+
+    exti_reset_request(ctx->pin);
+    active = ptt_read(ctx);
+
+    /* A glitch already gone by the time it is read is not an edge */
+    if (active != ctx->active) {
+        ptt_edge(ctx, active, now);
+    }
+}
@@ -0,0 +1,41 @@
+#ifndef PTT_H
+#define PTT_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "timebase.h"
+
+/*
+ * PTT input on a GPIO with EXTI on both edges, active low.  An edge is
+ * reported as soon as its interrupt runs, stamped with timebase_now_us(),
+ * and the line is then left alone for the debounce time: at its end the
+ * pin is read again, and if it settled the other way that is reported too.
+ * The pin mode, SYSCFG clock and the EXTI IRQ are set up by the caller;
+ * the EXTI line itself is configured here.
+ */
+#ifndef PTT_DEBOUNCE_US
+#define PTT_DEBOUNCE_US 5000
+#endif
+
+/* From the EXTI or timebase ISR */
+typedef void (*ptt_event_cb_t)(void *ctx, bool active, uint32_t time_us);
+
+typedef struct {
+    uint32_t port;
+    uint16_t pin;           // a single GPIOn, also its EXTI line
+    bool active;            // as last reported
+    timebase_timer_t debounce;
+    ptt_event_cb_t fn;
+    void *fn_ctx;
+} ptt_ctx_t;
+
+void ptt_init(ptt_ctx_t *ctx, uint32_t port, uint16_t pin, ptt_event_cb_t fn, void *fn_ctx);
+void ptt_irq_handler(ptt_ctx_t *ctx);  // from the line's EXTI ISR
+
+static inline bool ptt_active(const ptt_ctx_t *ctx)
+{
+    return ctx->active;
+}
+
+#endif /* PTT_H */
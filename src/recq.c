@@ -0,0 +1,193 @@
+
+#include <string.h>
+
+#include "recq.h"
+
+/* Storage copies that may wrap */
+static void recq_copy_in(recq_t *q, ringbuf_idx_t pos, const uint8_t *src, ringbuf_idx_t len)
+{
+    ringbuf_idx_t first = q->size - pos;
+    if (first > len)
+        first = len;
+    memcpy(&q->buf[pos], src, first);
+    memcpy(q->buf, &src[first], len - first);
+}
+
+static void recq_copy_out(const recq_t *q, ringbuf_idx_t pos, uint8_t *dst, ringbuf_idx_t len)
+{
+    ringbuf_idx_t first = q->size - pos;
+    if (first > len)
+        first = len;
+    memcpy(dst, &q->buf[pos], first);
+    memcpy(&dst[first], q->buf, len - first);
+}
+
+static uint16_t recq_len_at(const recq_t *q, ringbuf_idx_t pos)
+{
+    uint8_t hdr[RECQ_HDR_SIZE];
+    recq_copy_out(q, pos, hdr, RECQ_HDR_SIZE);
+    return hdr[0] | (hdr[1] << 8);
+}
+
+/* Producer: make room for need more bytes past wr, evicting if allowed */
+static int recq_reserve(recq_t *q, ringbuf_idx_t need)
+{
+    for (;;) {
+        ringbuf_idx_t tail = atomic_load_explicit(&q->tail, memory_order_acquire);
+        ringbuf_idx_t used = (q->wr - tail) & recq_mask(q);
+
+        if (used + need <= q->size - 1)
+            return 1;
+        if (!(q->flags & RECQ_DROP_OLDEST))
+            return 0;
+        if (tail == atomic_load_explicit(&q->head, memory_order_relaxed))
+            return 0;   /* nothing committed left to evict */
+
+        ringbuf_idx_t next = (tail + RECQ_HDR_SIZE + recq_len_at(q, tail)) & recq_mask(q);
+        if (atomic_compare_exchange_weak_explicit(&q->tail, &tail, next,
+                                                  memory_order_acq_rel,
+                                                  memory_order_acquire)) {
+            q->dropped++;
+        }
+    }
+}
+
+void recq_init(recq_t *q, uint8_t *storage, ringbuf_idx_t size, uint8_t flags)
+{
+    q->buf = storage;
+    q->size = size;
+    atomic_init(&q->head, 0);
+    atomic_init(&q->tail, 0);
+    q->wr = 0;
+    q->wr_len = 0;
+    q->wr_open = 0;
+    q->wr_overflow = 0;
+    q->flags = flags;
+    q->dropped = 0;
+    q->write_notify_cb = NULL;
+    q->write_notify_cb_ctx = NULL;
+}
+
+void recq_set_write_notify_fn(recq_t *q, ringbuf_notify_cb_t write_notify_cb_fn, void *write_notify_cb_ctx)
+{
+    q->write_notify_cb = write_notify_cb_fn;
+    q->write_notify_cb_ctx = write_notify_cb_ctx;
+}
+
+void recq_begin(recq_t *q)
+{
+    ringbuf_idx_t head = atomic_load_explicit(&q->head, memory_order_relaxed);
+
+    /* Header is filled in by recq_commit() once the length is known */
+    q->wr = head;
+    q->wr_len = 0;
+    q->wr_open = 1;
+    q->wr_overflow = !recq_reserve(q, RECQ_HDR_SIZE);
+    q->wr = (head + RECQ_HDR_SIZE) & recq_mask(q);
+}
+
+void recq_append(recq_t *q, const uint8_t *src, uint16_t len)
+{
+    if (!q->wr_open || q->wr_overflow)
+        return;
+
+    /* Never evict for a record that can not fit even in an empty queue */
+    if ((uint32_t)RECQ_HDR_SIZE + q->wr_len + len > (uint32_t)(q->size - 1) ||
+        (uint32_t)q->wr_len + len > RECQ_MAX_RECORD ||
+        !recq_reserve(q, len)) {
+        q->wr_overflow = 1;
+        return;
+    }
+
+    recq_copy_in(q, q->wr, src, len);
+    q->wr = (q->wr + len) & recq_mask(q);
+    q->wr_len += len;
+}
+
+int recq_commit(recq_t *q)
+{
+    if (!q->wr_open)
+        return 0;
+    q->wr_open = 0;
+
+    if (q->wr_overflow) {
+        q->dropped++;
+        return 0;
+    }
+
+    ringbuf_idx_t head = atomic_load_explicit(&q->head, memory_order_relaxed);
+    uint8_t hdr[RECQ_HDR_SIZE] = { q->wr_len & 0xFF, q->wr_len >> 8 };
+    recq_copy_in(q, head, hdr, RECQ_HDR_SIZE);
+
+    /* Publish header and payload together */
+    atomic_store_explicit(&q->head, q->wr, memory_order_release);
+
+    if (q->write_notify_cb) {
+        q->write_notify_cb(q->write_notify_cb_ctx);
+    }
+    return 1;
+}
+
+void recq_abort(recq_t *q)
+{
+    q->wr_open = 0;
+}
+
+int recq_write(recq_t *q, const uint8_t *src, uint16_t len)
+{
+    recq_begin(q);
+    recq_append(q, src, len);
+    return recq_commit(q);
+}
+
+int recq_peek_len(const recq_t *q)
+{
+    ringbuf_idx_t tail = atomic_load_explicit((_Atomic ringbuf_idx_t *)&q->tail, memory_order_relaxed);
+
+    if (tail == atomic_load_explicit((_Atomic ringbuf_idx_t *)&q->head, memory_order_acquire))
+        return -1;
+    return recq_len_at(q, tail);
+}
+
+/*
+ * Copy out the oldest record (truncated to max) and release it.
+ * Returns the full record length, so len > max tells the caller it was cut.
+ */
+int recq_read(recq_t *q, uint8_t *dst, uint16_t max)
+{
+    for (;;) {
+        ringbuf_idx_t tail = atomic_load_explicit(&q->tail, memory_order_acquire);
+        if (tail == atomic_load_explicit(&q->head, memory_order_acquire))
+            return -1;
+
+        uint16_t len = recq_len_at(q, tail);
+        ringbuf_idx_t n = (len < max) ? len : max;
+        if (n > q->size - 1)
+            n = q->size - 1;    /* header overwritten by an eviction */
+        recq_copy_out(q, (tail + RECQ_HDR_SIZE) & recq_mask(q), dst, n);
+
+        ringbuf_idx_t next = (tail + RECQ_HDR_SIZE + len) & recq_mask(q);
+        if (atomic_compare_exchange_strong_explicit(&q->tail, &tail, next,
+                                                    memory_order_acq_rel,
+                                                    memory_order_acquire)) {
+            return len;
+        }
+        /* evicted while it was being copied, take the next oldest */
+    }
+}
+
+void recq_discard(recq_t *q)
+{
+    for (;;) {
+        ringbuf_idx_t tail = atomic_load_explicit(&q->tail, memory_order_acquire);
+        if (tail == atomic_load_explicit(&q->head, memory_order_acquire))
+            return;
+
+        ringbuf_idx_t next = (tail + RECQ_HDR_SIZE + recq_len_at(q, tail)) & recq_mask(q);
+        if (atomic_compare_exchange_strong_explicit(&q->tail, &tail, next,
+                                                    memory_order_acq_rel,
+                                                    memory_order_acquire)) {
+            return;
+        }
+    }
+}
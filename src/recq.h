@@ -0,0 +1,85 @@
+#ifndef RECQ_H
+#define RECQ_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdatomic.h>
+
+#include "ringbuf.h"
+
+/*
+ * Variable-length record queue.
+ *
+ * Same storage model as ringbuf.h: user supplied power-of-two storage,
+ * masked indices, one slot kept free, single producer / single consumer
+ * with acquire/release index handover.  Each record is stored as a 16-bit
+ * little-endian length followed by the payload; either may wrap.
+ *
+ * Producer: recq_write() for a complete record, or recq_begin() /
+ *           recq_append() ... / recq_commit() (or recq_abort()) to build
+ *           one incrementally, e.g. a byte at a time from an ISR.  Nothing
+ *           is visible to the consumer until the whole record is committed.
+ * Consumer: recq_peek_len(), recq_read(), recq_discard().
+ *
+ * With RECQ_DROP_OLDEST a record that does not fit evicts the oldest
+ * committed records instead of being rejected.  The eviction moves tail
+ * with a compare-and-swap and recq_read() only accepts a record if its
+ * own compare-and-swap of tail succeeds, so a record being evicted under
+ * the consumer is never returned half overwritten.
+ */
+
+#define RECQ_HDR_SIZE       2
+#define RECQ_MAX_RECORD     0xFFFF
+
+/* recq_init() flags */
+#define RECQ_DROP_OLDEST    0x01
+
+typedef struct {
+    uint8_t  *buf;
+    ringbuf_idx_t size;
+    _Atomic ringbuf_idx_t head;     /* end of last committed record, stored by producer */
+    _Atomic ringbuf_idx_t tail;     /* start of oldest record, consumer (or eviction) */
+    ringbuf_idx_t wr;               /* producer: write position of the open record */
+    uint16_t wr_len;                /* producer: payload bytes in the open record */
+    uint8_t  wr_open;               /* producer: a record is being built */
+    uint8_t  wr_overflow;           /* producer: open record did not fit, drop it on commit */
+    uint8_t  flags;
+    uint32_t dropped;               /* records rejected or evicted */
+    ringbuf_notify_cb_t write_notify_cb;    /* runs after each commit */
+    void *write_notify_cb_ctx;
+} recq_t;
+
+void recq_init(recq_t *q, uint8_t *storage, ringbuf_idx_t size, uint8_t flags);
+void recq_set_write_notify_fn(recq_t *q, ringbuf_notify_cb_t write_notify_cb_fn, void *write_notify_cb_ctx);
+
+/* Producer side */
+int  recq_write(recq_t *q, const uint8_t *src, uint16_t len);   /* 1 if queued */
+void recq_begin(recq_t *q);
+void recq_append(recq_t *q, const uint8_t *src, uint16_t len);
+int  recq_commit(recq_t *q);                                    /* 1 if queued */
+void recq_abort(recq_t *q);
+
+/* Consumer side */
+int  recq_peek_len(const recq_t *q);                    /* -1 if empty */
+int  recq_read(recq_t *q, uint8_t *dst, uint16_t max);  /* record length, -1 if empty */
+void recq_discard(recq_t *q);
+
+static inline ringbuf_idx_t recq_mask(const recq_t *q)
+{
+    return q->size - 1;
+}
+
+static inline int recq_empty(const recq_t *q)
+{
+    return atomic_load_explicit((_Atomic ringbuf_idx_t *)&q->head, memory_order_acquire) ==
+           atomic_load_explicit((_Atomic ringbuf_idx_t *)&q->tail, memory_order_acquire);
+}
+
+/* Bytes in use, headers included */
+static inline ringbuf_idx_t recq_used(const recq_t *q)
+{
+    return (atomic_load_explicit((_Atomic ringbuf_idx_t *)&q->head, memory_order_acquire) -
+            atomic_load_explicit((_Atomic ringbuf_idx_t *)&q->tail, memory_order_acquire)) & recq_mask(q);
+}
+
+#endif /* RECQ_H */
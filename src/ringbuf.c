@@ -1,48 +1,151 @@
+
+#include <string.h>
+
 #include "ringbuf.h"
 
+/* Advance head without running the notify callback */
+static inline void ringbuf_advance_head(ringbuf_t *rb, ringbuf_idx_t n)
+{
+    ringbuf_idx_t head = ringbuf_load_head(rb, memory_order_relaxed);
+    ringbuf_publish_head(rb, (head + n) & ringbuf_mask(rb));
+}
+
+/* Producer side: n bytes were just published starting at old_head */
+static void ringbuf_write_notify(ringbuf_t *rb, ringbuf_idx_t old_head, ringbuf_idx_t n)
+{
+    if (rb->write_notify_cb == NULL)
+        return;
+
+    if (rb->write_notify_policy == RINGBUF_NOTIFY_EVERY_WRITE) {
+        rb->write_notify_cb(rb->write_notify_cb_ctx);
+        return;
+    }
+    if (n == 0)
+        return;
+
+    /* Order the head store above against the tail load below, so either the
+       consumer sees the new data or we see that it had drained the ring */
+    atomic_thread_fence(memory_order_seq_cst);
+    ringbuf_idx_t tail = ringbuf_load_tail(rb, memory_order_acquire);
+    ringbuf_idx_t count = (old_head + n - tail) & ringbuf_mask(rb);
+
+    if ((rb->write_notify_policy & RINGBUF_NOTIFY_EDGE) && tail == old_head) {
+        rb->write_notify_cb(rb->write_notify_cb_ctx);
+        return;
+    }
+    if ((rb->write_notify_policy & RINGBUF_NOTIFY_HIGH_WM) &&
+        count >= rb->high_wm && count - rb->high_wm < n) {
+        rb->write_notify_cb(rb->write_notify_cb_ctx);
+    }
+}
+
+void ringbuf_read_notify(ringbuf_t *rb, ringbuf_idx_t n)
+{
+    ringbuf_idx_t count = ringbuf_count(rb);
+
+    if (n > 0 && count <= rb->low_wm && count + n > rb->low_wm) {
+        rb->read_notify_cb(rb->read_notify_cb_ctx);
+    }
+}
+
 int ringbuf_read(ringbuf_t *rb, uint8_t *dst, int len)
 {   
     /* Return if ringbuffer pointer is still null*/
     if (rb == NULL)
         return 0; 
 
+    /* At most two block copies: up to the end of storage, then from the start */
     int n = 0;
-    while (n < len && !ringbuf_empty(rb)) {
-        dst[n++] = rb->buf[rb->tail];
-        rb->tail = ringbuf_next(rb, rb->tail);
+    while (n < len) {
+        uint8_t *span;
+        ringbuf_idx_t avail = ringbuf_read_span(rb, &span);
+        if (avail == 0)
+            break;
+        if ((int)avail > len - n)
+            avail = len - n;
+
+        memcpy(&dst[n], span, avail);
+        ringbuf_read_commit(rb, avail);
+        n += avail;
     }
     return n;
 }
 
+int ringbuf_peek(const ringbuf_t *rb, uint8_t *dst, int len)
+{
+    if (rb == NULL)
+        return 0;
+
+    ringbuf_idx_t head = ringbuf_load_head(rb, memory_order_acquire);
+    ringbuf_idx_t tail = ringbuf_load_tail(rb, memory_order_relaxed);
+    int n = (head - tail) & ringbuf_mask(rb);
+    if (n > len)
+        n = len;
+
+    /* Same two block copies as ringbuf_read(), tail left alone */
+    int first = rb->size - tail;
+    if (first > n)
+        first = n;
+    memcpy(dst, &rb->buf[tail], first);
+    memcpy(&dst[first], rb->buf, n - first);
+    return n;
+}
+
 int ringbuf_write(ringbuf_t *rb, const uint8_t *src, int len)
 {
     /* Return if ringbuffer pointer is still null*/
     if (rb == NULL)
         return 0; 
 
+    ringbuf_idx_t old_head = ringbuf_load_head(rb, memory_order_relaxed);
     int n = 0;
-    while (n < len && !ringbuf_full(rb)) {
-        rb->buf[rb->head] = src[n++];
-        rb->head = ringbuf_next(rb, rb->head);
+    while (n < len) {
+        uint8_t *span;
+        ringbuf_idx_t room = ringbuf_write_span(rb, &span);
+        if (room == 0)
+            break;
+        if ((int)room > len - n)
+            room = len - n;
+
+        memcpy(span, &src[n], room);
+        ringbuf_advance_head(rb, room);
+        n += room;
     }
 
-    /* Callback conditions:
-     *   fn_ptr not null and 
-     *   - n > 0: data was written, OR
-     *   - buffer is full: writer is blocked
+    /* Callback conditions: see write_notify_policy.  The default runs it
+     * on every call, including when the buffer is full and nothing fitted
+     * (writer is blocked)
      */
-
-//    if (rb->write_notify_cb && (n > 0 || ringbuf_full(rb))) {
-    if (rb->write_notify_cb) {
-        rb->write_notify_cb(rb->write_notify_cb_ctx);
-    }  
+    ringbuf_write_notify(rb, old_head, n);
     return n;
 }
 
+void ringbuf_write_commit(ringbuf_t *rb, ringbuf_idx_t n)
+{
+    ringbuf_idx_t old_head = ringbuf_load_head(rb, memory_order_relaxed);
+
+    ringbuf_advance_head(rb, n);
+
+    /* Same notify behaviour as ringbuf_write() */
+    ringbuf_write_notify(rb, old_head, n);
+}
+
 void ringbuf_set_write_notify_fn(ringbuf_t *rb, ringbuf_notify_cb_t write_notify_cb_fn, void *write_nofify_cb_ctx)
 {
     rb->write_notify_cb = write_notify_cb_fn;
     rb->write_notify_cb_ctx = write_nofify_cb_ctx;
 }
 
+void ringbuf_set_write_notify_policy(ringbuf_t *rb, uint8_t policy, ringbuf_idx_t high_wm)
+{
+    rb->write_notify_policy = policy;
+    rb->high_wm = high_wm;
+}
+
+void ringbuf_set_read_notify_fn(ringbuf_t *rb, ringbuf_notify_cb_t read_notify_cb_fn, void *read_notify_cb_ctx, ringbuf_idx_t low_wm)
+{
+    rb->low_wm = low_wm;
+    rb->read_notify_cb_ctx = read_notify_cb_ctx;
+    rb->read_notify_cb = read_notify_cb_fn;
+}
 
@@ -3,99 +3,318 @@
 
 #include <stdint.h>
 #include <stddef.h>
+#include <stdatomic.h>
 
 /* 
  * Power-of-two ring buffer for embedded systems.
  * User supplies storage and size.
  * Size MUST be a power of two: e.g. 32, 64, 128, 256, 512...
+ * Use RINGBUF_DEFINE() or ringbuf_init_array() to have that checked at
+ * build time.
+ *
+ * Lock-free single-producer / single-consumer.
+ *   Producer side: ringbuf_put, ringbuf_write, ringbuf_write_span/commit
+ *   Consumer side: ringbuf_get, ringbuf_read, ringbuf_peek, ringbuf_read_span/commit, ringbuf_flush
+ *   Neither running: ringbuf_reset
+ * The producer only stores head and the consumer only stores tail.  Each
+ * side publishes with a release store and observes the other side with an
+ * acquire load, so slot contents are visible before the index that covers
+ * them, whether the other side is an ISR or another core.
  */
 
 
+/*
+ * Index width.  16 bits (default) keeps the firmware rings small and the
+ * index stores single halfword accesses, for rings of up to 32 KB
+ * (RINGBUF_MAX_SIZE); build with -DRINGBUF_INDEX_BITS=32 for larger ones
+ * (host-side capture tools).
+ */
+#ifndef RINGBUF_INDEX_BITS
+#define RINGBUF_INDEX_BITS 16
+#endif
+
+#if RINGBUF_INDEX_BITS == 16
+typedef uint16_t ringbuf_idx_t;
+#elif RINGBUF_INDEX_BITS == 32
+typedef uint32_t ringbuf_idx_t;
+#else
+#error "RINGBUF_INDEX_BITS must be 16 or 32"
+#endif
+
+/* Largest power-of-two size that fits in ringbuf_idx_t */
+#define RINGBUF_MAX_SIZE    (1UL << (RINGBUF_INDEX_BITS - 1))
+#define RINGBUF_IS_POW2(n)  ((n) != 0 && ((n) & ((n) - 1)) == 0)
+
 // Callback function type definition 
 typedef void (*ringbuf_notify_cb_t)(void *ctx);
 
+/*
+ * Write notify policy (flags, may be combined).
+ *   EVERY_WRITE: every ringbuf_write()/ringbuf_write_commit(), even when
+ *                nothing fitted.  Default, as before.
+ *   EDGE:        data landed in a ring the consumer had fully drained
+ *                (empty -> non-empty).  Checked after head is published,
+ *                so a consumer that went idle mid-write is still woken.
+ *   HIGH_WM:     this write took the fill level up to or past high_wm.
+ */
+#define RINGBUF_NOTIFY_EVERY_WRITE  0x00
+#define RINGBUF_NOTIFY_EDGE         0x01
+#define RINGBUF_NOTIFY_HIGH_WM      0x02
+
 typedef struct {
     uint8_t  *buf;
-    uint16_t  size;
-    volatile uint16_t head;
-    volatile uint16_t tail;
+    ringbuf_idx_t  size;
+    _Atomic ringbuf_idx_t head;      /* stored by producer only */
+    _Atomic ringbuf_idx_t tail;      /* stored by consumer only */
     ringbuf_notify_cb_t write_notify_cb;
     void *write_notify_cb_ctx;
+    uint8_t  write_notify_policy;
+    ringbuf_idx_t high_wm;
+    ringbuf_notify_cb_t read_notify_cb;     /* fill level fell to low_wm */
+    void *read_notify_cb_ctx;
+    ringbuf_idx_t low_wm;
 } ringbuf_t;
 
 
 /* Initialise ring buffer using user-provided storage */
-static inline void ringbuf_init(ringbuf_t *rb, uint8_t *storage, uint16_t size)
+static inline void ringbuf_init(ringbuf_t *rb, uint8_t *storage, ringbuf_idx_t size)
 {
     rb->buf  = storage;
     rb->size = size;
-    rb->head = 0;
-    rb->tail = 0;
+    atomic_init(&rb->head, 0);
+    atomic_init(&rb->tail, 0);
     rb->write_notify_cb = NULL;
     rb->write_notify_cb_ctx = NULL;
+    rb->write_notify_policy = RINGBUF_NOTIFY_EVERY_WRITE;
+    rb->high_wm = 0;
+    rb->read_notify_cb = NULL;
+    rb->read_notify_cb_ctx = NULL;
+    rb->low_wm = 0;
 }
 
+/* Initialise from an array, rejecting non power-of-two sizes at build time */
+#define ringbuf_init_array(rb, array)                                          \
+    do {                                                                       \
+        _Static_assert(RINGBUF_IS_POW2(sizeof(array)) &&                       \
+                       sizeof(array) <= RINGBUF_MAX_SIZE,                      \
+                       "ring storage must be a power of two");                 \
+        ringbuf_init((rb), (array), sizeof(array));                            \
+    } while (0)
+
 /* Internal helper */
-static inline uint16_t ringbuf_mask(const ringbuf_t *rb)
+static inline ringbuf_idx_t ringbuf_mask(const ringbuf_t *rb)
 {
     return rb->size - 1;
 }
 
-static inline uint16_t ringbuf_next(const ringbuf_t *rb, uint16_t index)
+static inline ringbuf_idx_t ringbuf_next(const ringbuf_t *rb, ringbuf_idx_t index)
 {
     return (index + 1) & ringbuf_mask(rb);
 }
 
-/* Basic status checks */
+/* Index access.  Own index: relaxed, the other side's index: acquire */
+static inline ringbuf_idx_t ringbuf_load_head(const ringbuf_t *rb, memory_order order)
+{
+    return atomic_load_explicit((_Atomic ringbuf_idx_t *)&rb->head, order);
+}
+
+static inline ringbuf_idx_t ringbuf_load_tail(const ringbuf_t *rb, memory_order order)
+{
+    return atomic_load_explicit((_Atomic ringbuf_idx_t *)&rb->tail, order);
+}
+
+static inline void ringbuf_publish_head(ringbuf_t *rb, ringbuf_idx_t head)
+{
+    atomic_store_explicit(&rb->head, head, memory_order_release);
+}
+
+static inline void ringbuf_publish_tail(ringbuf_t *rb, ringbuf_idx_t tail)
+{
+    atomic_store_explicit(&rb->tail, tail, memory_order_release);
+}
+
+/*
+ * Core operations with the mask passed in.  The ringbuf_* wrappers pass
+ * rb->size - 1; RINGBUF_DEFINE() types pass a constant so it folds away.
+ */
+static inline ringbuf_idx_t ringbuf_count_mask(const ringbuf_t *rb, ringbuf_idx_t mask)
+{
+    return (ringbuf_load_head(rb, memory_order_acquire) -
+            ringbuf_load_tail(rb, memory_order_acquire)) & mask;
+}
+
+/* Basic status checks (either side) */
 static inline int ringbuf_empty(const ringbuf_t *rb)
 {
-    return rb->head == rb->tail;
+    return ringbuf_load_head(rb, memory_order_acquire) ==
+           ringbuf_load_tail(rb, memory_order_acquire);
 }
 
 static inline int ringbuf_full(const ringbuf_t *rb)
 {
-    return ringbuf_next(rb, rb->head) == rb->tail;
+    return ringbuf_next(rb, ringbuf_load_head(rb, memory_order_acquire)) ==
+           ringbuf_load_tail(rb, memory_order_acquire);
 }
 
-static inline uint16_t ringbuf_count(const ringbuf_t *rb)
+static inline ringbuf_idx_t ringbuf_count(const ringbuf_t *rb)
 {
-    return (rb->head - rb->tail) & ringbuf_mask(rb);
+    return ringbuf_count_mask(rb, ringbuf_mask(rb));
 }
 
-static inline uint16_t ringbuf_free(const ringbuf_t *rb)
+static inline ringbuf_idx_t ringbuf_free(const ringbuf_t *rb)
 {
     return rb->size - 1 - ringbuf_count(rb);
 }
 
+/* Consumer side: run the read notify if consuming n bytes crossed low_wm */
+void ringbuf_read_notify(ringbuf_t *rb, ringbuf_idx_t n);
+
+/* Consumer side: discard everything currently readable */
 static inline void ringbuf_flush(ringbuf_t *rb)
 {
-    rb->tail = rb->head;
+    ringbuf_idx_t n = ringbuf_count(rb);
+    ringbuf_publish_tail(rb, ringbuf_load_head(rb, memory_order_acquire));
+    if (rb->read_notify_cb) {
+        ringbuf_read_notify(rb, n);
+    }
+}
+
+/* Both sides stopped: discard everything and restart at the base of the
+   storage, where a circular DMA producer restarts too */
+static inline void ringbuf_reset(ringbuf_t *rb)
+{
+    ringbuf_publish_head(rb, 0);
+    ringbuf_publish_tail(rb, 0);
 }
 
 /* Single-byte operations (ISR safe, fully inline) */
-static inline void ringbuf_put(ringbuf_t *rb, uint8_t b)
+static inline void ringbuf_put_mask(ringbuf_t *rb, uint8_t b, ringbuf_idx_t mask)
 {
-    uint16_t next = ringbuf_next(rb, rb->head);
-    if (next == rb->tail) {
+    ringbuf_idx_t head = ringbuf_load_head(rb, memory_order_relaxed);
+    ringbuf_idx_t next = (head + 1) & mask;
+    if (next == ringbuf_load_tail(rb, memory_order_acquire)) {
         return; /* full, drop */
     }
-    rb->buf[rb->head] = b;
-    rb->head = next;
+    rb->buf[head] = b;
+    ringbuf_publish_head(rb, next);
 }
 
-static inline int ringbuf_get(ringbuf_t *rb, uint8_t *out)
+static inline int ringbuf_get_mask(ringbuf_t *rb, uint8_t *out, ringbuf_idx_t mask)
 {
-    if (ringbuf_empty(rb)) {
+    ringbuf_idx_t tail = ringbuf_load_tail(rb, memory_order_relaxed);
+    if (tail == ringbuf_load_head(rb, memory_order_acquire)) {
         return 0;
     }
-    *out = rb->buf[rb->tail];
-    rb->tail = ringbuf_next(rb, rb->tail);
+    *out = rb->buf[tail];
+    ringbuf_publish_tail(rb, (tail + 1) & mask);
+    if (rb->read_notify_cb) {
+        ringbuf_read_notify(rb, 1);
+    }
     return 1;
 }
 
+static inline void ringbuf_put(ringbuf_t *rb, uint8_t b)
+{
+    ringbuf_put_mask(rb, b, ringbuf_mask(rb));
+}
+
+static inline int ringbuf_get(ringbuf_t *rb, uint8_t *out)
+{
+    return ringbuf_get_mask(rb, out, ringbuf_mask(rb));
+}
+
+/*
+ * Zero-copy span access.
+ * A span is the largest contiguous region that can be read (or written)
+ * without wrapping. Access the storage through the returned pointer, then
+ * commit the number of bytes actually consumed (or produced).
+ */
+static inline ringbuf_idx_t ringbuf_read_span(const ringbuf_t *rb, uint8_t **ptr)
+{
+    ringbuf_idx_t head = ringbuf_load_head(rb, memory_order_acquire);
+    ringbuf_idx_t tail = ringbuf_load_tail(rb, memory_order_relaxed);
+
+    *ptr = &rb->buf[tail];
+    if (head >= tail) {
+        return head - tail;
+    }
+    return rb->size - tail;   /* up to end of storage, rest is at buf[0] */
+}
+
+static inline void ringbuf_read_commit(ringbuf_t *rb, ringbuf_idx_t n)
+{
+    ringbuf_idx_t tail = ringbuf_load_tail(rb, memory_order_relaxed);
+    ringbuf_publish_tail(rb, (tail + n) & ringbuf_mask(rb));
+    if (rb->read_notify_cb) {
+        ringbuf_read_notify(rb, n);
+    }
+}
+
+static inline ringbuf_idx_t ringbuf_write_span(const ringbuf_t *rb, uint8_t **ptr)
+{
+    ringbuf_idx_t head = ringbuf_load_head(rb, memory_order_relaxed);
+    ringbuf_idx_t tail = ringbuf_load_tail(rb, memory_order_acquire);
+
+    *ptr = &rb->buf[head];
+    if (head >= tail) {
+        /* up to end of storage, keeping one slot free if tail sits at 0 */
+        return rb->size - head - (tail == 0);
+    }
+    return tail - head - 1;
+}
+
 /* Bulk multi-byte ops (optional, non-inline) */
 int ringbuf_read(ringbuf_t *rb, uint8_t *dst, int len);
+int ringbuf_peek(const ringbuf_t *rb, uint8_t *dst, int len);     /* consumer, nothing consumed */
 int ringbuf_write(ringbuf_t *rb, const uint8_t *src, int len);
+void ringbuf_write_commit(ringbuf_t *rb, ringbuf_idx_t n);   /* also runs write notify */
 void ringbuf_set_write_notify_fn(ringbuf_t *rb, ringbuf_notify_cb_t write_notify_cb_fn, void *write_notify_cb_fn_ctx);
-#endif /* RINGBUF_H */
+void ringbuf_set_write_notify_policy(ringbuf_t *rb, uint8_t policy, ringbuf_idx_t high_wm);
+void ringbuf_set_read_notify_fn(ringbuf_t *rb, ringbuf_notify_cb_t read_notify_cb_fn, void *read_notify_cb_fn_ctx, ringbuf_idx_t low_wm);
 
+/*
+ * Statically sized ring type.
+ *
+ *     RINGBUF_DEFINE(usart_ring, 256);
+ *     static usart_ring_t tx;
+ *     usart_ring_init(&tx);
+ *     usart_ring_put(&tx, b);                 // mask is the constant 255
+ *     ringbuf_write(usart_ring_rb(&tx), ...); // generic API still works
+ *
+ * The size is checked at build time.  The generated type embeds a normal
+ * ringbuf_t, so drivers keep taking ringbuf_t * and notify callbacks, spans
+ * and bulk ops all apply unchanged.
+ */
+#define RINGBUF_DEFINE(name, SIZE)                                             \
+    _Static_assert(RINGBUF_IS_POW2(SIZE), #name ": size must be a power of two"); \
+    _Static_assert((SIZE) <= RINGBUF_MAX_SIZE, #name ": size too large for RINGBUF_INDEX_BITS"); \
+    typedef struct {                                                           \
+        ringbuf_t rb;                                                          \
+        uint8_t   storage[SIZE];                                               \
+    } name##_t;                                                                \
+    static inline void name##_init(name##_t *r)                                \
+    {                                                                          \
+        ringbuf_init(&r->rb, r->storage, (SIZE));                              \
+    }                                                                          \
+    static inline ringbuf_t *name##_rb(name##_t *r)                            \
+    {                                                                          \
+        return &r->rb;                                                         \
+    }                                                                          \
+    static inline void name##_put(name##_t *r, uint8_t b)                      \
+    {                                                                          \
+        ringbuf_put_mask(&r->rb, b, (SIZE) - 1);                               \
+    }                                                                          \
+    static inline int name##_get(name##_t *r, uint8_t *out)                    \
+    {                                                                          \
+        return ringbuf_get_mask(&r->rb, out, (SIZE) - 1);                      \
+    }                                                                          \
+    static inline ringbuf_idx_t name##_count(const name##_t *r)                \
+    {                                                                          \
+        return ringbuf_count_mask(&r->rb, (SIZE) - 1);                         \
+    }                                                                          \
+    static inline ringbuf_idx_t name##_free(const name##_t *r)                 \
+    {                                                                          \
+        return (SIZE) - 1 - ringbuf_count_mask(&r->rb, (SIZE) - 1);            \
+    }
+
+#endif /* RINGBUF_H */
@@ -0,0 +1,136 @@
+#include <stddef.h>
+#include <string.h>
+#include <libopencm3/cm3/cortex.h>
+#include <libopencm3/cm3/dwt.h>
+#include <libopencm3/stm32/rcc.h>
+
+#include "sched.h"
+#include "cpu_stats.h"
+
+static sched_task_t *tasks[SCHED_TASKS_MAX];   // highest priority first
+static uint8_t ntasks;
+
+static void sched_period_cb(void *passed_ctx)
+{
+    sched_task_t *t = passed_ctx;
+
+    timebase_timer_start(&t->timer, t->stats.period_us);
+    sched_post(t);
+}
+
+void sched_task_init(sched_task_t *t, uint8_t id, uint8_t prio,
+                     void (*fn)(void *ctx), void *ctx)
+{
+    uint8_t i;
+
+    t->fn = fn;
+    t->ctx = ctx;
+    t->pending = false;
+    t->posted_at = 0;
+    timebase_timer_init(&t->timer, sched_period_cb, t);
+    memset(&t->stats, 0, sizeof(t->stats));
+    t->stats.id = id;
+    t->stats.prio = prio;
+
+    uint32_t masked = cm_mask_interrupts(1);
+
+    if (ntasks < SCHED_TASKS_MAX) {
+        for (i = ntasks; i > 0 && tasks[i - 1]->stats.prio > prio; i--) {
+            tasks[i] = tasks[i - 1];
+        }
+        tasks[i] = t;
+        ntasks++;
+    }
+    cm_mask_interrupts(masked);
+}
+
+void sched_set_period(sched_task_t *t, uint32_t period_us)
+{
+    t->stats.period_us = period_us;
+    if (period_us == 0) {
+        timebase_timer_stop(&t->timer);
+    } else {
+        timebase_timer_start(&t->timer, period_us);
+    }
+}
+
+void sched_post(sched_task_t *t)
+{
+    uint32_t masked = cm_mask_interrupts(1);
+
+    if (t->pending) {
+        t->stats.merged++;
+    } else {
+        t->pending = true;
+        t->posted_at = dwt_read_cycle_counter();
+    }
+    cm_mask_interrupts(masked);
+}
+
+void sched_run(void)
+{
+    sched_task_t *t = NULL;
+    uint32_t start = 0;
+
+    /* A post after the last look must wake the sleep, so both are done
+       masked.  The interrupt that wakes it is taken on unmasking */
+    cm_disable_interrupts();
+    for (uint8_t i = 0; i < ntasks; i++) {
+        if (tasks[i]->pending) {
+            t = tasks[i];
+            t->pending = false;
+            start = dwt_read_cycle_counter();
+            break;
+        }
+    }
+    if (t == NULL) {
+        cpu_stats_sleep();
+    }
+    cm_enable_interrupts();
+    if (t == NULL) {
+        return;
+    }
+
+    uint32_t latency = start - t->posted_at;
+
+    t->fn(t->ctx);
+
+    uint32_t cycles = dwt_read_cycle_counter() - start;
+    uint32_t masked = cm_mask_interrupts(1);
+    sched_task_stats_t *st = &t->stats;
+
+    st->runs++;
+    st->cycles += cycles;
+    if (cycles > st->max_cycles) {
+        st->max_cycles = cycles;
+    }
+    if (latency > st->latency_max_cycles) {
+        st->latency_max_cycles = latency;
+    }
+    if (st->period_us != 0 && latency / (rcc_ahb_frequency / 1000000) >= st->period_us) {
+        st->late++;
+    }
+    cm_mask_interrupts(masked);
+}
+
+uint8_t sched_get_stats(sched_task_stats_t *out, uint8_t max, bool reset)
+{
+    uint32_t masked = cm_mask_interrupts(1);
+    uint8_t n = (ntasks < max) ? ntasks : max;
+
+    for (uint8_t i = 0; i < n; i++) {
+        sched_task_stats_t *st = &tasks[i]->stats;
+
+        out[i] = *st;
+        if (reset) {
+            st->runs = 0;
+            st->merged = 0;
+            st->late = 0;
+            st->cycles = 0;
+            st->max_cycles = 0;
+            st->latency_max_cycles = 0;
+        }
+    }
+    cm_mask_interrupts(masked);
+    return n;
+}
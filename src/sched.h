@@ -0,0 +1,60 @@
+#ifndef SCHED_H
+#define SCHED_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "timebase.h"
+
+/*
+ * Run-to-completion tasks for the main loop: the work that does not have
+ * to be done in an interrupt.  ISRs post tasks, sched_run() runs the
+ * highest priority one pending or sleeps.  A task posted again before it
+ * has run runs once.  A periodic task is posted every period_us as well,
+ * and is late if it has not started by the next one.
+ */
+#ifndef SCHED_TASKS_MAX
+#define SCHED_TASKS_MAX 8
+#endif
+
+/* What each task costs, from the DWT cycle counter */
+typedef struct {
+    uint8_t id;                     // as given to sched_task_init()
+    uint8_t prio;                   // 0 runs first
+    uint16_t reserved;
+    uint32_t period_us;             // 0: only when posted
+    uint32_t runs;
+    uint32_t merged;                // posts while it was already pending
+    uint32_t late;
+    uint32_t cycles;                // running, in total
+    uint32_t max_cycles;            // longest run
+    uint32_t latency_max_cycles;    // post to start, longest
+} __attribute__((packed)) sched_task_stats_t;
+
+typedef struct {
+    void (*fn)(void *ctx);
+    void *ctx;
+    volatile bool pending;
+    uint32_t posted_at;             // cycle counter at the post that made it pending
+    timebase_timer_t timer;         // periodic posts
+    sched_task_stats_t stats;
+} sched_task_t;
+
+/* Add a task, kept in priority order, equal ones in the order added */
+void sched_task_init(sched_task_t *t, uint8_t id, uint8_t prio,
+                     void (*fn)(void *ctx), void *ctx);
+
+/* Post every period_us from now on, 0 to stop */
+void sched_set_period(sched_task_t *t, uint32_t period_us);
+
+/* From any context */
+void sched_post(sched_task_t *t);
+
+/* From the main loop: run one task, or sleep until an interrupt */
+void sched_run(void);
+
+/* Stats of up to max tasks, in priority order; returns how many.  reset
+   clears them once read */
+uint8_t sched_get_stats(sched_task_stats_t *out, uint8_t max, bool reset);
+
+#endif /* SCHED_H */
@@ -0,0 +1,16 @@
+/*
+ * Host simulation of <libopencm3/cm3/cortex.h>.
+ * Interrupts held pending while masked are taken when unmasked.  __WFI()
+ * lets virtual time run until an enabled interrupt is pending, masked or
+ * not, and takes it if unmasked.
+ */
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+void cm_enable_interrupts(void);
+void cm_disable_interrupts(void);
+bool cm_is_masked_interrupts(void);
+uint32_t cm_mask_interrupts(uint32_t mask);
+void __WFI(void);
@@ -0,0 +1,11 @@
+/*
+ * Host simulation of <libopencm3/cm3/dwt.h>: the cycle counter runs at the
+ * AHB clock on the virtual time line.
+ */
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+bool dwt_enable_cycle_counter(void);
+uint32_t dwt_read_cycle_counter(void);
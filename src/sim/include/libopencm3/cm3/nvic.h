@@ -0,0 +1,14 @@
+/* Host simulation of <libopencm3/cm3/nvic.h> */
+#pragma once
+
+#include <stdint.h>
+
+#include <libopencm3/stm32/f4/nvic.h>
+
+void nvic_enable_irq(uint8_t irqn);
+void nvic_disable_irq(uint8_t irqn);
+uint8_t nvic_get_irq_enabled(uint8_t irqn);
+void nvic_set_pending_irq(uint8_t irqn);
+void nvic_clear_pending_irq(uint8_t irqn);
+uint8_t nvic_get_pending_irq(uint8_t irqn);
+void nvic_set_priority(uint8_t irqn, uint8_t priority);
@@ -0,0 +1,7 @@
+/* Host simulation of <libopencm3/stm32/desig.h> */
+#pragma once
+
+#include <stdint.h>
+
+void desig_get_unique_id(uint32_t *result);
+uint16_t desig_get_flash_size(void);
@@ -0,0 +1,38 @@
+/*
+ * Host simulation of <libopencm3/stm32/exti.h>, GPIO lines 0..15 only.
+ * The port selection is SYSCFG_EXTICRn on the target and needs the SYSCFG
+ * clock, as there.
+ */
+#pragma once
+
+#include <stdint.h>
+
+#define EXTI0   (1 << 0)
+#define EXTI1   (1 << 1)
+#define EXTI2   (1 << 2)
+#define EXTI3   (1 << 3)
+#define EXTI4   (1 << 4)
+#define EXTI5   (1 << 5)
+#define EXTI6   (1 << 6)
+#define EXTI7   (1 << 7)
+#define EXTI8   (1 << 8)
+#define EXTI9   (1 << 9)
+#define EXTI10  (1 << 10)
+#define EXTI11  (1 << 11)
+#define EXTI12  (1 << 12)
+#define EXTI13  (1 << 13)
+#define EXTI14  (1 << 14)
+#define EXTI15  (1 << 15)
+
+enum exti_trigger_type {
+    EXTI_TRIGGER_RISING,
+    EXTI_TRIGGER_FALLING,
+    EXTI_TRIGGER_BOTH,
+};
+
+void exti_set_trigger(uint32_t extis, enum exti_trigger_type trig);
+void exti_enable_request(uint32_t extis);
+void exti_disable_request(uint32_t extis);
+void exti_reset_request(uint32_t extis);
+void exti_select_source(uint32_t exti, uint32_t gpioport);
+uint32_t exti_get_flag_status(uint32_t exti);
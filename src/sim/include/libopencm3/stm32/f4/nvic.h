@@ -0,0 +1,73 @@
+/*
+ * Host simulation of <libopencm3/stm32/f4/nvic.h>: the STM32F411 IRQ
+ * numbers and handler names the simulator can dispatch.
+ */
+#pragma once
+
+#define NVIC_EXTI0_IRQ          6
+#define NVIC_EXTI1_IRQ          7
+#define NVIC_EXTI2_IRQ          8
+#define NVIC_EXTI3_IRQ          9
+#define NVIC_EXTI4_IRQ          10
+#define NVIC_DMA1_STREAM0_IRQ   11
+#define NVIC_DMA1_STREAM1_IRQ   12
+#define NVIC_DMA1_STREAM2_IRQ   13
+#define NVIC_DMA1_STREAM3_IRQ   14
+#define NVIC_DMA1_STREAM4_IRQ   15
+#define NVIC_DMA1_STREAM5_IRQ   16
+#define NVIC_DMA1_STREAM6_IRQ   17
+#define NVIC_EXTI9_5_IRQ        23
+#define NVIC_TIM2_IRQ           28
+#define NVIC_TIM3_IRQ           29
+#define NVIC_TIM4_IRQ           30
+#define NVIC_USART1_IRQ         37
+#define NVIC_USART2_IRQ         38
+#define NVIC_EXTI15_10_IRQ      40
+#define NVIC_DMA1_STREAM7_IRQ   47
+#define NVIC_TIM5_IRQ           50
+#define NVIC_DMA2_STREAM0_IRQ   56
+#define NVIC_DMA2_STREAM1_IRQ   57
+#define NVIC_DMA2_STREAM2_IRQ   58
+#define NVIC_DMA2_STREAM3_IRQ   59
+#define NVIC_DMA2_STREAM4_IRQ   60
+#define NVIC_OTG_FS_IRQ         67
+#define NVIC_DMA2_STREAM5_IRQ   68
+#define NVIC_DMA2_STREAM6_IRQ   69
+#define NVIC_DMA2_STREAM7_IRQ   70
+#define NVIC_USART6_IRQ         71
+
+#define NVIC_IRQ_COUNT          86
+
+void exti0_isr(void);
+void exti1_isr(void);
+void exti2_isr(void);
+void exti3_isr(void);
+void exti4_isr(void);
+void dma1_stream0_isr(void);
+void dma1_stream1_isr(void);
+void dma1_stream2_isr(void);
+void dma1_stream3_isr(void);
+void dma1_stream4_isr(void);
+void dma1_stream5_isr(void);
+void dma1_stream6_isr(void);
+void exti9_5_isr(void);
+void tim2_isr(void);
+void tim3_isr(void);
+void tim4_isr(void);
+void usart1_isr(void);
+void usart2_isr(void);
+void exti15_10_isr(void);
+void dma1_stream7_isr(void);
+void tim5_isr(void);
+void dma2_stream0_isr(void);
+void dma2_stream1_isr(void);
+void dma2_stream2_isr(void);
+void dma2_stream3_isr(void);
+void dma2_stream4_isr(void);
+void otg_fs_isr(void);
+void dma2_stream5_isr(void);
+void dma2_stream6_isr(void);
+void dma2_stream7_isr(void);
+void usart6_isr(void);
+
+#include <libopencm3/cm3/nvic.h>
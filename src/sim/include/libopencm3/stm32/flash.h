@@ -0,0 +1,6 @@
+/* Host simulation of <libopencm3/stm32/flash.h>: nothing to model */
+#pragma once
+
+#include <stdint.h>
+
+void flash_set_ws(uint32_t ws);
@@ -0,0 +1,107 @@
+/*
+ * Host simulation of <libopencm3/stm32/gpio.h> (F4 layout).
+ * Register macros are lvalues in the simulated register file, so code that
+ * pokes GPIO registers directly sees the same state as the API.
+ */
+#pragma once
+
+#include <stdint.h>
+
+#define PERIPH_BASE_AHB1    0x40020000U
+#define GPIO_PORT_A_BASE    (PERIPH_BASE_AHB1 + 0x0000)
+#define GPIO_PORT_B_BASE    (PERIPH_BASE_AHB1 + 0x0400)
+#define GPIO_PORT_C_BASE    (PERIPH_BASE_AHB1 + 0x0800)
+#define GPIO_PORT_D_BASE    (PERIPH_BASE_AHB1 + 0x0C00)
+#define GPIO_PORT_E_BASE    (PERIPH_BASE_AHB1 + 0x1000)
+#define GPIO_PORT_H_BASE    (PERIPH_BASE_AHB1 + 0x1C00)
+
+#define GPIOA   GPIO_PORT_A_BASE
+#define GPIOB   GPIO_PORT_B_BASE
+#define GPIOC   GPIO_PORT_C_BASE
+#define GPIOD   GPIO_PORT_D_BASE
+#define GPIOE   GPIO_PORT_E_BASE
+#define GPIOH   GPIO_PORT_H_BASE
+
+#define GPIO0   (1 << 0)
+#define GPIO1   (1 << 1)
+#define GPIO2   (1 << 2)
+#define GPIO3   (1 << 3)
+#define GPIO4   (1 << 4)
+#define GPIO5   (1 << 5)
+#define GPIO6   (1 << 6)
+#define GPIO7   (1 << 7)
+#define GPIO8   (1 << 8)
+#define GPIO9   (1 << 9)
+#define GPIO10  (1 << 10)
+#define GPIO11  (1 << 11)
+#define GPIO12  (1 << 12)
+#define GPIO13  (1 << 13)
+#define GPIO14  (1 << 14)
+#define GPIO15  (1 << 15)
+#define GPIO_ALL 0xffff
+
+#define GPIO_MODE_INPUT     0x0
+#define GPIO_MODE_OUTPUT    0x1
+#define GPIO_MODE_AF        0x2
+#define GPIO_MODE_ANALOG    0x3
+
+#define GPIO_PUPD_NONE      0x0
+#define GPIO_PUPD_PULLUP    0x1
+#define GPIO_PUPD_PULLDOWN  0x2
+
+#define GPIO_OTYPE_PP       0x0
+#define GPIO_OTYPE_OD       0x1
+
+#define GPIO_OSPEED_2MHZ    0x0
+#define GPIO_OSPEED_25MHZ   0x1
+#define GPIO_OSPEED_50MHZ   0x2
+#define GPIO_OSPEED_100MHZ  0x3
+
+#define GPIO_AF0    0x0
+#define GPIO_AF1    0x1
+#define GPIO_AF2    0x2
+#define GPIO_AF3    0x3
+#define GPIO_AF4    0x4
+#define GPIO_AF5    0x5
+#define GPIO_AF6    0x6
+#define GPIO_AF7    0x7
+#define GPIO_AF8    0x8
+#define GPIO_AF9    0x9
+#define GPIO_AF10   0xa
+#define GPIO_AF11   0xb
+#define GPIO_AF12   0xc
+#define GPIO_AF13   0xd
+#define GPIO_AF14   0xe
+#define GPIO_AF15   0xf
+
+typedef struct {
+    uint32_t moder;
+    uint32_t otyper;
+    uint32_t ospeedr;
+    uint32_t pupdr;
+    uint32_t idr;
+    uint32_t odr;
+    uint32_t afrl;
+    uint32_t afrh;
+} sim_gpio_regs_t;
+
+sim_gpio_regs_t *sim_gpio_regs(uint32_t gpioport);
+
+#define GPIO_MODER(port)    (sim_gpio_regs(port)->moder)
+#define GPIO_OTYPER(port)   (sim_gpio_regs(port)->otyper)
+#define GPIO_OSPEEDR(port)  (sim_gpio_regs(port)->ospeedr)
+#define GPIO_PUPDR(port)    (sim_gpio_regs(port)->pupdr)
+#define GPIO_IDR(port)      (sim_gpio_regs(port)->idr)
+#define GPIO_ODR(port)      (sim_gpio_regs(port)->odr)
+#define GPIO_AFRL(port)     (sim_gpio_regs(port)->afrl)
+#define GPIO_AFRH(port)     (sim_gpio_regs(port)->afrh)
+
+void gpio_set(uint32_t gpioport, uint16_t gpios);
+void gpio_clear(uint32_t gpioport, uint16_t gpios);
+uint16_t gpio_get(uint32_t gpioport, uint16_t gpios);
+void gpio_toggle(uint32_t gpioport, uint16_t gpios);
+uint16_t gpio_port_read(uint32_t gpioport);
+void gpio_port_write(uint32_t gpioport, uint16_t data);
+void gpio_mode_setup(uint32_t gpioport, uint8_t mode, uint8_t pull_up_down, uint16_t gpios);
+void gpio_set_output_options(uint32_t gpioport, uint8_t otype, uint8_t speed, uint16_t gpios);
+void gpio_set_af(uint32_t gpioport, uint8_t alt_func_num, uint16_t gpios);
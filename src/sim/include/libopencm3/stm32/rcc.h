@@ -0,0 +1,62 @@
+/*
+ * Host simulation of <libopencm3/stm32/rcc.h> (F4 subset).
+ * Clock setup only records the bus frequencies; peripheral clock enables
+ * are tracked so a driver touching an unclocked peripheral is caught.
+ */
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+struct rcc_clock_scale {
+    uint8_t pllm;
+    uint16_t plln;
+    uint8_t pllp;
+    uint8_t pllq;
+    uint8_t pllr;
+    uint8_t pll_source;
+    uint32_t flash_config;
+    uint8_t hpre;
+    uint8_t ppre1;
+    uint8_t ppre2;
+    uint8_t voltage_scale;
+    uint32_t ahb_frequency;
+    uint32_t apb1_frequency;
+    uint32_t apb2_frequency;
+};
+
+enum rcc_clock_3v3 {
+    RCC_CLOCK_3V3_84MHZ,
+    RCC_CLOCK_3V3_96MHZ,
+    RCC_CLOCK_3V3_168MHZ,
+    RCC_CLOCK_3V3_180MHZ,
+    RCC_CLOCK_3V3_END
+};
+
+extern const struct rcc_clock_scale rcc_hse_8mhz_3v3[RCC_CLOCK_3V3_END];
+extern const struct rcc_clock_scale rcc_hse_25mhz_3v3[RCC_CLOCK_3V3_END];
+
+extern uint32_t rcc_ahb_frequency;
+extern uint32_t rcc_apb1_frequency;
+extern uint32_t rcc_apb2_frequency;
+
+enum rcc_periph_clken {
+    RCC_GPIOA, RCC_GPIOB, RCC_GPIOC, RCC_GPIOD, RCC_GPIOE, RCC_GPIOH,
+    RCC_CRC, RCC_DMA1, RCC_DMA2, RCC_OTGFS,
+    RCC_TIM2, RCC_TIM3, RCC_TIM4, RCC_TIM5, RCC_WWDG, RCC_SPI2, RCC_SPI3,
+    RCC_USART2, RCC_I2C1, RCC_I2C2, RCC_I2C3, RCC_PWR,
+    RCC_TIM1, RCC_USART1, RCC_USART6, RCC_ADC1, RCC_SDIO, RCC_SPI1,
+    RCC_SPI4, RCC_SYSCFG, RCC_TIM9, RCC_TIM10, RCC_TIM11, RCC_SPI5,
+    RCC_PERIPH_CLKEN_COUNT
+};
+
+enum rcc_periph_rst {
+    RST_GPIOA, RST_GPIOB, RST_GPIOC, RST_DMA1, RST_DMA2, RST_OTGFS,
+    RST_TIM2, RST_TIM3, RST_USART2, RST_TIM1, RST_USART1, RST_USART6,
+    RST_SYSCFG,
+};
+
+void rcc_clock_setup_pll(const struct rcc_clock_scale *clock);
+void rcc_periph_clock_enable(enum rcc_periph_clken clken);
+void rcc_periph_clock_disable(enum rcc_periph_clken clken);
+void rcc_periph_reset_pulse(enum rcc_periph_rst rst);
@@ -0,0 +1,53 @@
+/*
+ * Host simulation of <libopencm3/stm32/timer.h>, general purpose timers
+ * TIM2..TIM5 counting up: prescaler, auto-reload, update and compare
+ * flags with their interrupts.  No outputs, input capture, one-pulse or
+ * down-counting.  TIM2 and TIM5 are 32 bit, TIM3 and TIM4 16 bit.
+ */
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#define TIM2    0x40000000U
+#define TIM3    0x40000400U
+#define TIM4    0x40000800U
+#define TIM5    0x40000C00U
+
+#define TIM_SR_UIF      (1 << 0)
+#define TIM_SR_CC1IF    (1 << 1)
+#define TIM_SR_CC2IF    (1 << 2)
+#define TIM_SR_CC3IF    (1 << 3)
+#define TIM_SR_CC4IF    (1 << 4)
+
+#define TIM_DIER_UIE    (1 << 0)
+#define TIM_DIER_CC1IE  (1 << 1)
+#define TIM_DIER_CC2IE  (1 << 2)
+#define TIM_DIER_CC3IE  (1 << 3)
+#define TIM_DIER_CC4IE  (1 << 4)
+
+#define TIM_EGR_UG      (1 << 0)
+
+enum tim_oc_id {
+    TIM_OC1 = 0,
+    TIM_OC1N,
+    TIM_OC2,
+    TIM_OC2N,
+    TIM_OC3,
+    TIM_OC3N,
+    TIM_OC4,
+};
+
+void timer_set_prescaler(uint32_t timer_peripheral, uint32_t value);
+void timer_set_period(uint32_t timer_peripheral, uint32_t period);
+void timer_enable_counter(uint32_t timer_peripheral);
+void timer_disable_counter(uint32_t timer_peripheral);
+uint32_t timer_get_counter(uint32_t timer_peripheral);
+void timer_set_counter(uint32_t timer_peripheral, uint32_t count);
+void timer_set_oc_value(uint32_t timer_peripheral, enum tim_oc_id oc_id, uint32_t value);
+void timer_enable_irq(uint32_t timer_peripheral, uint32_t irq);
+void timer_disable_irq(uint32_t timer_peripheral, uint32_t irq);
+bool timer_get_flag(uint32_t timer_peripheral, uint32_t flag);
+void timer_clear_flag(uint32_t timer_peripheral, uint32_t flag);
+bool timer_interrupt_source(uint32_t timer_peripheral, uint32_t flag);
+void timer_generate_event(uint32_t timer_peripheral, uint32_t event);
@@ -0,0 +1,137 @@
+/*
+ * Host simulation of <libopencm3/stm32/usart.h> (F4 layout).
+ * The register macros are lvalues in the simulated register file; the line
+ * model in sim_usart.c reads them, so direct register access and the API
+ * behave the same.
+ */
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#define USART1_BASE     0x40011000U
+#define USART2_BASE     0x40004400U
+#define USART6_BASE     0x40011400U
+
+#define USART1  USART1_BASE
+#define USART2  USART2_BASE
+#define USART6  USART6_BASE
+
+typedef struct {
+    uint32_t sr;
+    uint32_t dr;
+    uint32_t brr;
+    uint32_t cr1;
+    uint32_t cr2;
+    uint32_t cr3;
+    uint32_t gtpr;
+} sim_usart_regs_t;
+
+sim_usart_regs_t *sim_usart_regs(uint32_t usart);
+/* As sim_usart_regs(), noting the SR read that arms error clearing */
+sim_usart_regs_t *sim_usart_regs_sr(uint32_t usart);
+
+#define USART_SR(usart_base)    (sim_usart_regs_sr(usart_base)->sr)
+#define USART_DR(usart_base)    (sim_usart_regs(usart_base)->dr)
+#define USART_BRR(usart_base)   (sim_usart_regs(usart_base)->brr)
+#define USART_CR1(usart_base)   (sim_usart_regs(usart_base)->cr1)
+#define USART_CR2(usart_base)   (sim_usart_regs(usart_base)->cr2)
+#define USART_CR3(usart_base)   (sim_usart_regs(usart_base)->cr3)
+#define USART_GTPR(usart_base)  (sim_usart_regs(usart_base)->gtpr)
+
+/* SR */
+#define USART_SR_PE         (1 << 0)
+#define USART_SR_FE         (1 << 1)
+#define USART_SR_NE         (1 << 2)
+#define USART_SR_ORE        (1 << 3)
+#define USART_SR_IDLE       (1 << 4)
+#define USART_SR_RXNE       (1 << 5)
+#define USART_SR_TC         (1 << 6)
+#define USART_SR_TXE        (1 << 7)
+#define USART_SR_LBD        (1 << 8)
+#define USART_SR_CTS        (1 << 9)
+
+/* CR1 */
+#define USART_CR1_SBK       (1 << 0)
+#define USART_CR1_RWU       (1 << 1)
+#define USART_CR1_RE        (1 << 2)
+#define USART_CR1_TE        (1 << 3)
+#define USART_CR1_IDLEIE    (1 << 4)
+#define USART_CR1_RXNEIE    (1 << 5)
+#define USART_CR1_TCIE      (1 << 6)
+#define USART_CR1_TXEIE     (1 << 7)
+#define USART_CR1_PEIE      (1 << 8)
+#define USART_CR1_PS        (1 << 9)
+#define USART_CR1_PCE       (1 << 10)
+#define USART_CR1_WAKE      (1 << 11)
+#define USART_CR1_M         (1 << 12)
+#define USART_CR1_UE        (1 << 13)
+#define USART_CR1_OVER8     (1 << 15)
+
+/* CR2 */
+#define USART_CR2_STOPBITS_1    (0x00 << 12)
+#define USART_CR2_STOPBITS_0_5  (0x01 << 12)
+#define USART_CR2_STOPBITS_2    (0x02 << 12)
+#define USART_CR2_STOPBITS_1_5  (0x03 << 12)
+#define USART_CR2_STOPBITS_MASK (0x03 << 12)
+#define USART_CR2_LINEN         (1 << 14)
+
+/* CR3 */
+#define USART_CR3_EIE       (1 << 0)
+#define USART_CR3_IREN      (1 << 1)
+#define USART_CR3_HDSEL     (1 << 3)
+#define USART_CR3_DMAR      (1 << 6)
+#define USART_CR3_DMAT      (1 << 7)
+#define USART_CR3_RTSE      (1 << 8)
+#define USART_CR3_CTSE      (1 << 9)
+#define USART_CR3_CTSIE     (1 << 10)
+#define USART_CR3_ONEBIT    (1 << 11)
+
+#define USART_STOPBITS_0_5  USART_CR2_STOPBITS_0_5
+#define USART_STOPBITS_1    USART_CR2_STOPBITS_1
+#define USART_STOPBITS_1_5  USART_CR2_STOPBITS_1_5
+#define USART_STOPBITS_2    USART_CR2_STOPBITS_2
+
+#define USART_PARITY_NONE   0x00
+#define USART_PARITY_EVEN   USART_CR1_PCE
+#define USART_PARITY_ODD    (USART_CR1_PS | USART_CR1_PCE)
+#define USART_PARITY_MASK   (USART_CR1_PS | USART_CR1_PCE)
+
+#define USART_MODE_RX       USART_CR1_RE
+#define USART_MODE_TX       USART_CR1_TE
+#define USART_MODE_TX_RX    (USART_CR1_RE | USART_CR1_TE)
+#define USART_MODE_MASK     (USART_CR1_RE | USART_CR1_TE)
+
+#define USART_FLOWCONTROL_NONE      0x00
+#define USART_FLOWCONTROL_RTS       USART_CR3_RTSE
+#define USART_FLOWCONTROL_CTS       USART_CR3_CTSE
+#define USART_FLOWCONTROL_RTS_CTS   (USART_CR3_RTSE | USART_CR3_CTSE)
+#define USART_FLOWCONTROL_MASK      (USART_CR3_RTSE | USART_CR3_CTSE)
+
+void usart_set_baudrate(uint32_t usart, uint32_t baud);
+void usart_set_databits(uint32_t usart, uint32_t bits);
+void usart_set_stopbits(uint32_t usart, uint32_t stopbits);
+void usart_set_parity(uint32_t usart, uint32_t parity);
+void usart_set_mode(uint32_t usart, uint32_t mode);
+void usart_set_flow_control(uint32_t usart, uint32_t flowcontrol);
+void usart_enable(uint32_t usart);
+void usart_disable(uint32_t usart);
+void usart_send(uint32_t usart, uint16_t data);
+uint16_t usart_recv(uint32_t usart);
+void usart_wait_send_ready(uint32_t usart);
+void usart_wait_recv_ready(uint32_t usart);
+void usart_send_blocking(uint32_t usart, uint16_t data);
+uint16_t usart_recv_blocking(uint32_t usart);
+void usart_enable_rx_dma(uint32_t usart);
+void usart_disable_rx_dma(uint32_t usart);
+void usart_enable_tx_dma(uint32_t usart);
+void usart_disable_tx_dma(uint32_t usart);
+void usart_enable_rx_interrupt(uint32_t usart);
+void usart_disable_rx_interrupt(uint32_t usart);
+void usart_enable_tx_interrupt(uint32_t usart);
+void usart_disable_tx_interrupt(uint32_t usart);
+void usart_enable_tx_complete_interrupt(uint32_t usart);
+void usart_disable_tx_complete_interrupt(uint32_t usart);
+void usart_enable_error_interrupt(uint32_t usart);
+void usart_disable_error_interrupt(uint32_t usart);
+bool usart_get_flag(uint32_t usart, uint32_t flag);
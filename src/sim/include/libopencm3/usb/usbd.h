@@ -0,0 +1,69 @@
+/*
+ * Host simulation of <libopencm3/usb/usbd.h>.  The device side is the
+ * libopencm3 API; sim.h has the packet-level host side.
+ */
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include <libopencm3/usb/usbstd.h>
+
+enum usbd_request_return_codes {
+    USBD_REQ_NOTSUPP = 0,
+    USBD_REQ_HANDLED = 1,
+    USBD_REQ_NEXT_CALLBACK = 2,
+};
+
+typedef struct _usbd_driver usbd_driver;
+typedef struct _usbd_device usbd_device;
+
+extern const usbd_driver otgfs_usb_driver;
+
+typedef void (*usbd_control_complete_callback)(usbd_device *usbd_dev,
+        struct usb_setup_data *req);
+
+typedef enum usbd_request_return_codes (*usbd_control_callback)(
+        usbd_device *usbd_dev, struct usb_setup_data *req, uint8_t **buf,
+        uint16_t *len, usbd_control_complete_callback *complete);
+
+typedef void (*usbd_set_config_callback)(usbd_device *usbd_dev,
+        uint16_t wValue);
+
+typedef void (*usbd_set_altsetting_callback)(usbd_device *usbd_dev,
+        uint16_t wIndex, uint16_t wValue);
+
+typedef void (*usbd_endpoint_callback)(usbd_device *usbd_dev, uint8_t ep);
+
+usbd_device *usbd_init(const usbd_driver *driver,
+                       const struct usb_device_descriptor *dev,
+                       const struct usb_config_descriptor *conf,
+                       const char * const *strings, int num_strings,
+                       uint8_t *control_buffer,
+                       uint16_t control_buffer_size);
+
+void usbd_register_reset_callback(usbd_device *usbd_dev, void (*callback)(void));
+void usbd_register_suspend_callback(usbd_device *usbd_dev, void (*callback)(void));
+void usbd_register_resume_callback(usbd_device *usbd_dev, void (*callback)(void));
+void usbd_register_sof_callback(usbd_device *usbd_dev, void (*callback)(void));
+
+int usbd_register_control_callback(usbd_device *usbd_dev, uint8_t type,
+                                   uint8_t type_mask,
+                                   usbd_control_callback callback);
+int usbd_register_set_config_callback(usbd_device *usbd_dev,
+                                      usbd_set_config_callback callback);
+void usbd_register_set_altsetting_callback(usbd_device *usbd_dev,
+                                           usbd_set_altsetting_callback callback);
+
+void usbd_poll(usbd_device *usbd_dev);
+void usbd_disconnect(usbd_device *usbd_dev, bool disconnected);
+
+void usbd_ep_setup(usbd_device *usbd_dev, uint8_t addr, uint8_t type,
+                   uint16_t max_size, usbd_endpoint_callback callback);
+uint16_t usbd_ep_write_packet(usbd_device *usbd_dev, uint8_t addr,
+                              const void *buf, uint16_t len);
+uint16_t usbd_ep_read_packet(usbd_device *usbd_dev, uint8_t addr,
+                             void *buf, uint16_t len);
+void usbd_ep_stall_set(usbd_device *usbd_dev, uint8_t addr, uint8_t stall);
+uint8_t usbd_ep_stall_get(usbd_device *usbd_dev, uint8_t addr);
+void usbd_ep_nak_set(usbd_device *usbd_dev, uint8_t addr, uint8_t nak);
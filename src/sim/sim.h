@@ -0,0 +1,86 @@
+#pragma once
+
+/*
+ * Host side of the simulated STM32F411 HAL.
+ *
+ * The firmware (main.c and the unchanged drivers) is built against the
+ * fake libopencm3 headers in sim/include and runs as a coroutine of the
+ * host program.  Time is virtual: it only moves when the firmware polls
+ * USB (usbd_poll costs sim_set_poll_cost_ns() each), busy-waits in a HAL
+ * call or sleeps in __WFI(), and interrupts are taken at those points,
+ * when an API call makes one pending, or when interrupts are unmasked.  The host side only
+ * changes model state; it never runs firmware code itself.
+ *
+ * Linked non-PIE so static buffers keep the 32-bit addresses DMA needs.
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#include <libopencm3/usb/usbstd.h>
+
+/* -------------------------------------------------------------------------
+ * Core
+ * ------------------------------------------------------------------------- */
+void sim_init(void);                        /* reset every model, time 0 */
+void sim_start(int (*firmware_main)(void)); /* main() built as sim_firmware_main */
+void sim_run_for(uint64_t ns);              /* let the firmware run */
+bool sim_run_until(bool (*done)(void *arg), void *arg, uint64_t timeout_ns);
+uint64_t sim_now_ns(void);
+void sim_set_poll_cost_ns(uint32_t ns);     /* default 1000 */
+
+/* Firmware main() renamed with -Dmain=sim_firmware_main */
+int sim_firmware_main(void);
+
+/* -------------------------------------------------------------------------
+ * USART line.  Each TX line is wired to the RX of a peer USART (itself for
+ * loopback) or to the host.  Bytes keep their frame time on the line; a
+ * receiver more than 3% off the sender's bit rate sees framing errors.
+ * ------------------------------------------------------------------------- */
+#define SIM_USART_HOST  0
+
+void sim_usart_connect(uint32_t usart, uint32_t peer);
+/* Host-sent bytes: host_baud 0 follows the USART, gap_ns is idle between
+   bytes */
+void sim_usart_set_line_timing(uint32_t usart, uint32_t host_baud, uint32_t gap_ns);
+size_t sim_usart_host_write(uint32_t usart, const void *buf, size_t len);
+/* One character with bad parity (seen only with parity enabled), and a
+   break: the line held low for a frame */
+bool sim_usart_host_write_parity_error(uint32_t usart, uint8_t byte);
+bool sim_usart_host_break(uint32_t usart);
+size_t sim_usart_host_read(uint32_t usart, void *buf, size_t len);
+size_t sim_usart_rx_pending(uint32_t usart);  /* queued, not yet received */
+uint32_t sim_usart_overruns(uint32_t usart);
+uint32_t sim_usart_framing_errors(uint32_t usart);
+uint64_t sim_usart_frame_ns(uint32_t usart);
+
+/* -------------------------------------------------------------------------
+ * GPIO: external drive on input / open-drain pins
+ * ------------------------------------------------------------------------- */
+void sim_gpio_drive(uint32_t port, uint16_t pins, bool level);
+void sim_gpio_release(uint32_t port, uint16_t pins);
+uint16_t sim_gpio_output(uint32_t port);
+
+void sim_desig_set_unique_id(const uint32_t uid[3]);
+
+/* -------------------------------------------------------------------------
+ * USB host.  Bulk and interrupt endpoints are driven a packet at a time
+ * with OTG_FS behaviour: an OUT packet the device does not read in its
+ * callback is lost, a NAKed endpoint refuses packets, and an IN endpoint
+ * holds one packet until the host takes it.
+ * ------------------------------------------------------------------------- */
+enum sim_usb_status {
+    SIM_USB_ACK,
+    SIM_USB_NAK,
+    SIM_USB_STALL,
+    SIM_USB_TIMEOUT,
+};
+
+/* Whole control transfer; *len is wLength in, bytes returned out */
+int sim_usb_host_control(const struct usb_setup_data *req, void *data, uint16_t *len);
+int sim_usb_host_out(uint8_t ep, const void *buf, uint16_t len);
+int sim_usb_host_in(uint8_t ep, void *buf, uint16_t maxlen, uint16_t *len);
+/* Descriptors, SET_ADDRESS and SET_CONFIGURATION 1 */
+int sim_usb_host_enumerate(void);
+bool sim_usb_configured(void);
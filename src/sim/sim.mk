@@ -0,0 +1,26 @@
+# Host build of the firmware on the simulated HAL.  Included by
+# sim/Makefile and t/Makefile with SIM_DIR set to this directory.
+
+SIM_FW_DIR   := $(SIM_DIR)/..
+
+SIM_HAL_SRCS := $(addprefix $(SIM_DIR)/, sim_core.c sim_gpio.c sim_exti.c sim_usart.c sim_dma.c sim_usbd.c sim_timer.c)
+SIM_FW_SRCS  := $(addprefix $(SIM_FW_DIR)/, usb_core.c usb_descriptors.c ringbuf.c recq.c usb_cdc.c usart.c cpu_stats.c timebase.c usb_vendor.c ft_frame.c ft_delta.c ptt.c prbs.c sched.c prof.c)
+SIM_FW_MAIN  := $(SIM_FW_DIR)/main.c
+
+SIM_DEPS     := $(SIM_HAL_SRCS) $(SIM_FW_SRCS) $(SIM_FW_MAIN) \
+                $(wildcard $(SIM_DIR)/*.h $(SIM_DIR)/include/libopencm3/*/*.h \
+                           $(SIM_DIR)/include/libopencm3/*/*/*.h $(SIM_FW_DIR)/*.h)
+
+# Non-PIE so static buffers have the 32-bit addresses DMA registers hold;
+# the drivers cast those pointers to uint32_t as they do on the target
+SIM_CFLAGS   := -std=c11 -Wall -Wextra -Werror -O2 -g -fno-pie \
+                -I$(SIM_DIR)/include -I$(SIM_DIR) -I$(SIM_FW_DIR) \
+                -Wno-pointer-to-int-cast
+SIM_LDFLAGS  := -no-pie
+
+# $(call sim_link,output,host sources,extra firmware flags)
+define sim_link
+	$(CC) $(SIM_CFLAGS) $(3) -Dmain=sim_firmware_main -c $(SIM_FW_MAIN) -o $(1).main.o
+	$(CC) $(SIM_CFLAGS) $(3) -o $(1) $(2) $(1).main.o $(SIM_FW_SRCS) $(SIM_HAL_SRCS) $(SIM_LDFLAGS)
+	rm -f $(1).main.o
+endef
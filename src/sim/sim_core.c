@@ -0,0 +1,500 @@
+/*
+ * Simulator core: virtual clock, firmware coroutine, NVIC, PRIMASK, RCC
+ * and the device signature.
+ */
+#define _XOPEN_SOURCE 700
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <ucontext.h>
+
+#include <libopencm3/cm3/cortex.h>
+#include <libopencm3/cm3/nvic.h>
+#include <libopencm3/cm3/dwt.h>
+#include <libopencm3/stm32/rcc.h>
+#include <libopencm3/stm32/flash.h>
+#include <libopencm3/stm32/desig.h>
+
+#include "sim.h"
+#include "sim_internal.h"
+
+#define SIM_FW_STACK_SIZE   (1024 * 1024)
+#define SIM_THREAD_PRIO     0x100   /* below any NVIC priority */
+
+static uint64_t now_ns;
+static uint32_t poll_cost_ns = 1000;
+
+static ucontext_t host_uc;
+static ucontext_t fw_uc;
+static void *fw_stack;
+static int (*fw_main)(void);
+static bool in_firmware;
+static uint64_t run_deadline;
+
+void sim_fatal(const char *fmt, ...)
+{
+    va_list ap;
+
+    fprintf(stderr, "sim: ");
+    va_start(ap, fmt);
+    vfprintf(stderr, fmt, ap);
+    va_end(ap);
+    fprintf(stderr, " (at %llu ns)\n", (unsigned long long)now_ns);
+    abort();
+}
+
+/* -------------------------------------------------------------------------
+ * Interrupts
+ * ------------------------------------------------------------------------- */
+
+static bool primask;
+static bool irq_enabled[NVIC_IRQ_COUNT];
+static bool irq_soft_pending[NVIC_IRQ_COUNT];
+static uint8_t irq_priority[NVIC_IRQ_COUNT];
+static unsigned active_priority = SIM_THREAD_PRIO;
+static uint32_t irqs_taken;
+
+/* Handlers the firmware does not define stay NULL */
+#pragma weak exti0_isr
+#pragma weak exti1_isr
+#pragma weak exti2_isr
+#pragma weak exti3_isr
+#pragma weak exti4_isr
+#pragma weak dma1_stream0_isr
+#pragma weak dma1_stream1_isr
+#pragma weak dma1_stream2_isr
+#pragma weak dma1_stream3_isr
+#pragma weak dma1_stream4_isr
+#pragma weak dma1_stream5_isr
+#pragma weak dma1_stream6_isr
+#pragma weak exti9_5_isr
+#pragma weak tim2_isr
+#pragma weak tim3_isr
+#pragma weak tim4_isr
+#pragma weak usart1_isr
+#pragma weak usart2_isr
+#pragma weak exti15_10_isr
+#pragma weak dma1_stream7_isr
+#pragma weak tim5_isr
+#pragma weak dma2_stream0_isr
+#pragma weak dma2_stream1_isr
+#pragma weak dma2_stream2_isr
+#pragma weak dma2_stream3_isr
+#pragma weak dma2_stream4_isr
+#pragma weak otg_fs_isr
+#pragma weak dma2_stream5_isr
+#pragma weak dma2_stream6_isr
+#pragma weak dma2_stream7_isr
+#pragma weak usart6_isr
+
+enum irq_source { SRC_NONE, SRC_EXTI, SRC_USART, SRC_DMA1, SRC_DMA2, SRC_USB, SRC_TIM };
+
+static const struct {
+    uint8_t irqn;
+    void (*handler)(void);
+    enum irq_source source;
+    int index;              /* EXTI: mask of lines, TIM: TIM2..5 as 0..3 */
+} irq_table[] = {
+    { NVIC_EXTI0_IRQ,        exti0_isr,        SRC_EXTI,  1 << 0 },
+    { NVIC_EXTI1_IRQ,        exti1_isr,        SRC_EXTI,  1 << 1 },
+    { NVIC_EXTI2_IRQ,        exti2_isr,        SRC_EXTI,  1 << 2 },
+    { NVIC_EXTI3_IRQ,        exti3_isr,        SRC_EXTI,  1 << 3 },
+    { NVIC_EXTI4_IRQ,        exti4_isr,        SRC_EXTI,  1 << 4 },
+    { NVIC_DMA1_STREAM0_IRQ, dma1_stream0_isr, SRC_DMA1,  0 },
+    { NVIC_DMA1_STREAM1_IRQ, dma1_stream1_isr, SRC_DMA1,  1 },
+    { NVIC_DMA1_STREAM2_IRQ, dma1_stream2_isr, SRC_DMA1,  2 },
+    { NVIC_DMA1_STREAM3_IRQ, dma1_stream3_isr, SRC_DMA1,  3 },
+    { NVIC_DMA1_STREAM4_IRQ, dma1_stream4_isr, SRC_DMA1,  4 },
+    { NVIC_DMA1_STREAM5_IRQ, dma1_stream5_isr, SRC_DMA1,  5 },
+    { NVIC_DMA1_STREAM6_IRQ, dma1_stream6_isr, SRC_DMA1,  6 },
+    { NVIC_EXTI9_5_IRQ,      exti9_5_isr,      SRC_EXTI,  0x03e0 },
+    { NVIC_TIM2_IRQ,         tim2_isr,         SRC_TIM,   0 },
+    { NVIC_TIM3_IRQ,         tim3_isr,         SRC_TIM,   1 },
+    { NVIC_TIM4_IRQ,         tim4_isr,         SRC_TIM,   2 },
+    { NVIC_USART1_IRQ,       usart1_isr,       SRC_USART, 0 },
+    { NVIC_USART2_IRQ,       usart2_isr,       SRC_USART, 1 },
+    { NVIC_EXTI15_10_IRQ,    exti15_10_isr,    SRC_EXTI,  0xfc00 },
+    { NVIC_DMA1_STREAM7_IRQ, dma1_stream7_isr, SRC_DMA1,  7 },
+    { NVIC_TIM5_IRQ,         tim5_isr,         SRC_TIM,   3 },
+    { NVIC_DMA2_STREAM0_IRQ, dma2_stream0_isr, SRC_DMA2,  0 },
+    { NVIC_DMA2_STREAM1_IRQ, dma2_stream1_isr, SRC_DMA2,  1 },
+    { NVIC_DMA2_STREAM2_IRQ, dma2_stream2_isr, SRC_DMA2,  2 },
+    { NVIC_DMA2_STREAM3_IRQ, dma2_stream3_isr, SRC_DMA2,  3 },
+    { NVIC_DMA2_STREAM4_IRQ, dma2_stream4_isr, SRC_DMA2,  4 },
+    { NVIC_OTG_FS_IRQ,       otg_fs_isr,       SRC_USB,   0 },
+    { NVIC_DMA2_STREAM5_IRQ, dma2_stream5_isr, SRC_DMA2,  5 },
+    { NVIC_DMA2_STREAM6_IRQ, dma2_stream6_isr, SRC_DMA2,  6 },
+    { NVIC_DMA2_STREAM7_IRQ, dma2_stream7_isr, SRC_DMA2,  7 },
+    { NVIC_USART6_IRQ,       usart6_isr,       SRC_USART, 2 },
+};
+
+#define IRQ_TABLE_LEN (sizeof(irq_table) / sizeof(irq_table[0]))
+
+static bool source_pending(unsigned i)
+{
+    switch (irq_table[i].source) {
+    case SRC_EXTI:  return sim_exti_irq_pending(irq_table[i].index);
+    case SRC_USART: return sim_usart_irq_pending(irq_table[i].index);
+    case SRC_DMA1:  return sim_dma_irq_pending(0, irq_table[i].index);
+    case SRC_DMA2:  return sim_dma_irq_pending(1, irq_table[i].index);
+    case SRC_USB:   return sim_usb_irq_pending();
+    case SRC_TIM:   return sim_timer_irq_pending(irq_table[i].index);
+    default:        return false;
+    }
+}
+
+/* Highest priority runnable IRQ, or -1.  Equal priorities go by number */
+static int next_irq(void)
+{
+    int best = -1;
+
+    for (unsigned i = 0; i < IRQ_TABLE_LEN; i++) {
+        uint8_t n = irq_table[i].irqn;
+
+        if (!irq_enabled[n] || irq_priority[n] >= active_priority)
+            continue;
+        if (!irq_soft_pending[n] && !source_pending(i))
+            continue;
+        if (best < 0 || irq_priority[n] < irq_priority[irq_table[best].irqn])
+            best = i;
+    }
+    return best;
+}
+
+void sim_irq_update(void)
+{
+    int i;
+
+    if (!in_firmware)
+        return;
+
+    while (!primask && (i = next_irq()) >= 0) {
+        uint8_t n = irq_table[i].irqn;
+        unsigned saved = active_priority;
+
+        if (irq_table[i].handler == NULL)
+            sim_fatal("IRQ %u enabled and pending but no handler is defined", n);
+
+        irq_soft_pending[n] = false;
+        irqs_taken++;
+        active_priority = irq_priority[n];
+        irq_table[i].handler();
+        active_priority = saved;
+    }
+}
+
+void nvic_enable_irq(uint8_t irqn)
+{
+    if (irqn >= NVIC_IRQ_COUNT)
+        sim_fatal("nvic_enable_irq(%u): no such IRQ", irqn);
+    irq_enabled[irqn] = true;
+    sim_irq_update();
+}
+
+void nvic_disable_irq(uint8_t irqn)
+{
+    if (irqn < NVIC_IRQ_COUNT)
+        irq_enabled[irqn] = false;
+}
+
+uint8_t nvic_get_irq_enabled(uint8_t irqn)
+{
+    return irqn < NVIC_IRQ_COUNT && irq_enabled[irqn];
+}
+
+void nvic_set_pending_irq(uint8_t irqn)
+{
+    if (irqn >= NVIC_IRQ_COUNT)
+        sim_fatal("nvic_set_pending_irq(%u): no such IRQ", irqn);
+    irq_soft_pending[irqn] = true;
+    sim_irq_update();
+}
+
+void nvic_clear_pending_irq(uint8_t irqn)
+{
+    if (irqn < NVIC_IRQ_COUNT)
+        irq_soft_pending[irqn] = false;
+}
+
+uint8_t nvic_get_pending_irq(uint8_t irqn)
+{
+    return irqn < NVIC_IRQ_COUNT && irq_soft_pending[irqn];
+}
+
+void nvic_set_priority(uint8_t irqn, uint8_t priority)
+{
+    if (irqn < NVIC_IRQ_COUNT)
+        irq_priority[irqn] = priority;
+}
+
+void cm_enable_interrupts(void)
+{
+    primask = false;
+    sim_irq_update();
+}
+
+void cm_disable_interrupts(void)
+{
+    primask = true;
+}
+
+bool cm_is_masked_interrupts(void)
+{
+    return primask;
+}
+
+uint32_t cm_mask_interrupts(uint32_t mask)
+{
+    uint32_t old = primask;
+
+    primask = mask != 0;
+    if (!primask)
+        sim_irq_update();
+    return old;
+}
+
+/* Next line or timer event */
+static uint64_t next_event(void)
+{
+    uint64_t usart = sim_usart_next_event();
+    uint64_t timer = sim_timer_next_event();
+
+    return usart < timer ? usart : timer;
+}
+
+void __WFI(void)
+{
+    uint32_t taken = irqs_taken;
+
+    if (!in_firmware)
+        sim_fatal("__WFI() outside the firmware");
+
+    /* Sleep to the next line or timer event, or to the end of the host's
+       slice so it can make something pending */
+    while (irqs_taken == taken && next_irq() < 0) {
+        uint64_t t = next_event();
+
+        if (t > run_deadline)
+            t = run_deadline;
+        sim_advance(t > now_ns ? t - now_ns : 0);
+    }
+}
+
+/* -------------------------------------------------------------------------
+ * Time and the firmware coroutine
+ * ------------------------------------------------------------------------- */
+
+uint64_t sim_now_ns(void)
+{
+    return now_ns;
+}
+
+void sim_set_poll_cost_ns(uint32_t ns)
+{
+    poll_cost_ns = ns;
+}
+
+uint32_t sim_poll_cost_ns(void)
+{
+    return poll_cost_ns;
+}
+
+void sim_advance(uint64_t ns)
+{
+    uint64_t target = now_ns + ns;
+    uint64_t t;
+
+    while ((t = next_event()) <= target) {
+        if (t > now_ns)
+            now_ns = t;
+        sim_usart_step(now_ns);
+        sim_timer_step(now_ns);
+        sim_irq_update();
+    }
+    if (now_ns < target)
+        now_ns = target;
+    sim_irq_update();
+
+    /* Hand back to the host once its slice is used up */
+    if (in_firmware && now_ns >= run_deadline) {
+        in_firmware = false;
+        swapcontext(&fw_uc, &host_uc);
+        in_firmware = true;
+    }
+}
+
+static void firmware_entry(void)
+{
+    int rc = fw_main();
+
+    sim_fatal("firmware main() returned %d", rc);
+}
+
+void sim_start(int (*firmware_main)(void))
+{
+    if (fw_stack == NULL)
+        fw_stack = malloc(SIM_FW_STACK_SIZE);
+    if (fw_stack == NULL)
+        sim_fatal("no memory for the firmware stack");
+
+    fw_main = firmware_main;
+    getcontext(&fw_uc);
+    fw_uc.uc_stack.ss_sp = fw_stack;
+    fw_uc.uc_stack.ss_size = SIM_FW_STACK_SIZE;
+    fw_uc.uc_link = NULL;
+    makecontext(&fw_uc, firmware_entry, 0);
+
+    /* Run up to the first poll so the firmware has initialised */
+    sim_run_for(0);
+}
+
+void sim_run_for(uint64_t ns)
+{
+    if (fw_main == NULL)
+        sim_fatal("sim_run_for() before sim_start()");
+
+    run_deadline = now_ns + ns;
+    in_firmware = true;
+    swapcontext(&host_uc, &fw_uc);
+}
+
+bool sim_run_until(bool (*done)(void *arg), void *arg, uint64_t timeout_ns)
+{
+    uint64_t end = now_ns + timeout_ns;
+
+    while (!done(arg)) {
+        if (now_ns >= end)
+            return false;
+        sim_run_for(10000);
+    }
+    return true;
+}
+
+/* -------------------------------------------------------------------------
+ * DWT
+ * ------------------------------------------------------------------------- */
+
+static bool cyccnt_enabled;
+
+bool dwt_enable_cycle_counter(void)
+{
+    cyccnt_enabled = true;
+    return true;
+}
+
+uint32_t dwt_read_cycle_counter(void)
+{
+    if (!cyccnt_enabled)
+        return 0;
+    return (uint32_t)(now_ns * (rcc_ahb_frequency / 1000000) / 1000);
+}
+
+/* -------------------------------------------------------------------------
+ * RCC, FLASH, DESIG
+ * ------------------------------------------------------------------------- */
+
+uint32_t rcc_ahb_frequency = 16000000;
+uint32_t rcc_apb1_frequency = 16000000;
+uint32_t rcc_apb2_frequency = 16000000;
+
+#define SIM_CLOCK(ahb, apb1, apb2) \
+    { .ahb_frequency = (ahb), .apb1_frequency = (apb1), .apb2_frequency = (apb2) }
+
+const struct rcc_clock_scale rcc_hse_8mhz_3v3[RCC_CLOCK_3V3_END] = {
+    [RCC_CLOCK_3V3_84MHZ]  = SIM_CLOCK(84000000, 42000000, 84000000),
+    [RCC_CLOCK_3V3_96MHZ]  = SIM_CLOCK(96000000, 48000000, 96000000),
+    [RCC_CLOCK_3V3_168MHZ] = SIM_CLOCK(168000000, 42000000, 84000000),
+    [RCC_CLOCK_3V3_180MHZ] = SIM_CLOCK(180000000, 45000000, 90000000),
+};
+
+const struct rcc_clock_scale rcc_hse_25mhz_3v3[RCC_CLOCK_3V3_END] = {
+    [RCC_CLOCK_3V3_84MHZ]  = SIM_CLOCK(84000000, 42000000, 84000000),
+    [RCC_CLOCK_3V3_96MHZ]  = SIM_CLOCK(96000000, 48000000, 96000000),
+    [RCC_CLOCK_3V3_168MHZ] = SIM_CLOCK(168000000, 42000000, 84000000),
+    [RCC_CLOCK_3V3_180MHZ] = SIM_CLOCK(180000000, 45000000, 90000000),
+};
+
+static bool periph_clock[RCC_PERIPH_CLKEN_COUNT];
+
+void rcc_clock_setup_pll(const struct rcc_clock_scale *clock)
+{
+    rcc_ahb_frequency = clock->ahb_frequency;
+    rcc_apb1_frequency = clock->apb1_frequency;
+    rcc_apb2_frequency = clock->apb2_frequency;
+}
+
+void rcc_periph_clock_enable(enum rcc_periph_clken clken)
+{
+    periph_clock[clken] = true;
+}
+
+void rcc_periph_clock_disable(enum rcc_periph_clken clken)
+{
+    periph_clock[clken] = false;
+}
+
+void rcc_periph_reset_pulse(enum rcc_periph_rst rst)
+{
+    (void)rst;
+}
+
+bool sim_periph_clocked(enum rcc_periph_clken clken)
+{
+    return periph_clock[clken];
+}
+
+void sim_check_clock(enum rcc_periph_clken clken, const char *what)
+{
+    if (!periph_clock[clken])
+        sim_fatal("%s used with its clock disabled", what);
+}
+
+void flash_set_ws(uint32_t ws)
+{
+    (void)ws;
+}
+
+static uint32_t unique_id[3];
+
+void sim_desig_set_unique_id(const uint32_t uid[3])
+{
+    memcpy(unique_id, uid, sizeof(unique_id));
+}
+
+void desig_get_unique_id(uint32_t *result)
+{
+    memcpy(result, unique_id, sizeof(unique_id));
+}
+
+uint16_t desig_get_flash_size(void)
+{
+    return 512;
+}
+
+/* ------------------------------------------------------------------------- */
+
+void sim_init(void)
+{
+    static const uint32_t default_uid[3] = { 0x00300041, 0x3138510b, 0x34333532 };
+
+    now_ns = 0;
+    primask = false;
+    active_priority = SIM_THREAD_PRIO;
+    memset(irq_enabled, 0, sizeof(irq_enabled));
+    memset(irq_soft_pending, 0, sizeof(irq_soft_pending));
+    memset(irq_priority, 0, sizeof(irq_priority));
+    irqs_taken = 0;
+    cyccnt_enabled = false;
+    memset(periph_clock, 0, sizeof(periph_clock));
+    rcc_ahb_frequency = rcc_apb1_frequency = rcc_apb2_frequency = 16000000;
+    sim_desig_set_unique_id(default_uid);
+
+    sim_gpio_reset();
+    sim_exti_reset();
+    sim_usart_reset();
+    sim_dma_reset();
+    sim_usb_reset();
+    sim_timer_reset();
+}
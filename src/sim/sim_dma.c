@@ -0,0 +1,319 @@
+/*
+ * DMA1/DMA2 stream model, byte transfers between a USART DR and memory.
+ *
+ * Requests follow the F411 request mapping (RM0383 tables 27/28): a USART
+ * only reaches a stream that is wired to it and has the right channel
+ * selected.  Reprogramming an enabled stream is reported, since the
+ * hardware silently ignores it.
+ */
+#include <stddef.h>
+#include <string.h>
+
+#include <libopencm3/stm32/dma.h>
+#include <libopencm3/stm32/usart.h>
+
+#include "sim.h"
+#include "sim_internal.h"
+
+typedef struct {
+    uint32_t cr;
+    uint32_t ndtr;
+    uint32_t par;
+    uint32_t m0ar;
+    uint16_t loaded;    /* NDTR at enable, for circular reload */
+    uint8_t flags;
+} sim_dma_stream_t;
+
+static sim_dma_stream_t streams[2][8];
+
+enum { DIR_RX, DIR_TX };
+
+static const struct {
+    uint32_t usart;
+    uint8_t dir;
+    uint8_t controller;
+    uint8_t stream;
+    uint8_t channel;
+} request_map[] = {
+    { USART1, DIR_RX, 1, 2, 4 },
+    { USART1, DIR_RX, 1, 5, 4 },
+    { USART1, DIR_TX, 1, 7, 4 },
+    { USART2, DIR_RX, 0, 5, 4 },
+    { USART2, DIR_TX, 0, 6, 4 },
+    { USART6, DIR_RX, 1, 1, 5 },
+    { USART6, DIR_RX, 1, 2, 5 },
+    { USART6, DIR_TX, 1, 6, 5 },
+    { USART6, DIR_TX, 1, 7, 5 },
+};
+
+static sim_dma_stream_t *get(uint32_t dma, uint8_t stream)
+{
+    if ((dma != DMA1 && dma != DMA2) || stream > 7)
+        sim_fatal("DMA 0x%08x stream %u does not exist", (unsigned)dma, stream);
+    sim_check_clock(dma == DMA1 ? RCC_DMA1 : RCC_DMA2, "DMA");
+    return &streams[dma == DMA1 ? 0 : 1][stream];
+}
+
+uint32_t *sim_dma_scr(uint32_t dma, uint8_t stream)
+{
+    return &get(dma, stream)->cr;
+}
+
+/* Configuration is locked while EN is set */
+static sim_dma_stream_t *get_idle(uint32_t dma, uint8_t stream, const char *what)
+{
+    sim_dma_stream_t *s = get(dma, stream);
+
+    if (s->cr & DMA_SxCR_EN)
+        sim_fatal("DMA%u stream %u: %s written while the stream is enabled",
+                  dma == DMA1 ? 1 : 2, stream, what);
+    return s;
+}
+
+static void set_cr(uint32_t dma, uint8_t stream, uint32_t clear, uint32_t set)
+{
+    sim_dma_stream_t *s = get_idle(dma, stream, "CR");
+
+    s->cr = (s->cr & ~clear) | set;
+}
+
+/* Interrupt enables may change while the stream runs */
+static void set_ie(uint32_t dma, uint8_t stream, uint32_t bit, bool on)
+{
+    sim_dma_stream_t *s = get(dma, stream);
+
+    if (on)
+        s->cr |= bit;
+    else
+        s->cr &= ~bit;
+    sim_irq_update();
+}
+
+void dma_stream_reset(uint32_t dma, uint8_t stream)
+{
+    sim_dma_stream_t *s = get(dma, stream);
+
+    memset(s, 0, sizeof(*s));
+}
+
+void dma_clear_interrupt_flags(uint32_t dma, uint8_t stream, uint32_t interrupts)
+{
+    get(dma, stream)->flags &= ~interrupts;
+}
+
+bool dma_get_interrupt_flag(uint32_t dma, uint8_t stream, uint32_t interrupts)
+{
+    return (get(dma, stream)->flags & interrupts) != 0;
+}
+
+void dma_set_transfer_mode(uint32_t dma, uint8_t stream, uint32_t direction)
+{
+    set_cr(dma, stream, DMA_SxCR_DIR_MASK, direction);
+}
+
+void dma_set_priority(uint32_t dma, uint8_t stream, uint32_t prio)
+{
+    set_cr(dma, stream, DMA_SxCR_PL_MASK, prio);
+}
+
+void dma_set_memory_size(uint32_t dma, uint8_t stream, uint32_t mem_size)
+{
+    if (mem_size != DMA_SxCR_MSIZE_8BIT)
+        sim_fatal("DMA: only byte transfers are simulated");
+    set_cr(dma, stream, 0, mem_size);
+}
+
+void dma_set_peripheral_size(uint32_t dma, uint8_t stream, uint32_t peripheral_size)
+{
+    if (peripheral_size != DMA_SxCR_PSIZE_8BIT)
+        sim_fatal("DMA: only byte transfers are simulated");
+    set_cr(dma, stream, 0, peripheral_size);
+}
+
+void dma_enable_memory_increment_mode(uint32_t dma, uint8_t stream)
+{
+    set_cr(dma, stream, 0, DMA_SxCR_MINC);
+}
+
+void dma_disable_memory_increment_mode(uint32_t dma, uint8_t stream)
+{
+    set_cr(dma, stream, DMA_SxCR_MINC, 0);
+}
+
+void dma_enable_peripheral_increment_mode(uint32_t dma, uint8_t stream)
+{
+    set_cr(dma, stream, 0, DMA_SxCR_PINC);
+}
+
+void dma_disable_peripheral_increment_mode(uint32_t dma, uint8_t stream)
+{
+    set_cr(dma, stream, DMA_SxCR_PINC, 0);
+}
+
+void dma_enable_circular_mode(uint32_t dma, uint8_t stream)
+{
+    set_cr(dma, stream, 0, DMA_SxCR_CIRC);
+}
+
+void dma_channel_select(uint32_t dma, uint8_t stream, uint32_t channel)
+{
+    set_cr(dma, stream, DMA_SxCR_CHSEL_MASK, channel);
+}
+
+void dma_enable_transfer_error_interrupt(uint32_t dma, uint8_t stream)
+{
+    set_ie(dma, stream, DMA_SxCR_TEIE, true);
+}
+
+void dma_disable_transfer_error_interrupt(uint32_t dma, uint8_t stream)
+{
+    set_ie(dma, stream, DMA_SxCR_TEIE, false);
+}
+
+void dma_enable_half_transfer_interrupt(uint32_t dma, uint8_t stream)
+{
+    set_ie(dma, stream, DMA_SxCR_HTIE, true);
+}
+
+void dma_disable_half_transfer_interrupt(uint32_t dma, uint8_t stream)
+{
+    set_ie(dma, stream, DMA_SxCR_HTIE, false);
+}
+
+void dma_enable_transfer_complete_interrupt(uint32_t dma, uint8_t stream)
+{
+    set_ie(dma, stream, DMA_SxCR_TCIE, true);
+}
+
+void dma_disable_transfer_complete_interrupt(uint32_t dma, uint8_t stream)
+{
+    set_ie(dma, stream, DMA_SxCR_TCIE, false);
+}
+
+void dma_enable_stream(uint32_t dma, uint8_t stream)
+{
+    sim_dma_stream_t *s = get(dma, stream);
+
+    if (s->ndtr == 0)
+        sim_fatal("DMA%u stream %u enabled with NDTR 0", dma == DMA1 ? 1 : 2, stream);
+    if (s->m0ar == 0 || s->par == 0)
+        sim_fatal("DMA%u stream %u enabled without addresses", dma == DMA1 ? 1 : 2, stream);
+    if (s->flags & (DMA_TCIF | DMA_HTIF | DMA_TEIF))
+        sim_fatal("DMA%u stream %u enabled with event flags still set", dma == DMA1 ? 1 : 2, stream);
+
+    s->loaded = s->ndtr;
+    s->cr |= DMA_SxCR_EN;
+    sim_usart_service();
+    sim_irq_update();
+}
+
+void dma_disable_stream(uint32_t dma, uint8_t stream)
+{
+    get(dma, stream)->cr &= ~DMA_SxCR_EN;
+}
+
+void dma_set_peripheral_address(uint32_t dma, uint8_t stream, uint32_t address)
+{
+    get_idle(dma, stream, "PAR")->par = address;
+}
+
+void dma_set_memory_address(uint32_t dma, uint8_t stream, uint32_t address)
+{
+    get_idle(dma, stream, "M0AR")->m0ar = address;
+}
+
+uint16_t dma_get_number_of_data(uint32_t dma, uint8_t stream)
+{
+    return get(dma, stream)->ndtr;
+}
+
+void dma_set_number_of_data(uint32_t dma, uint8_t stream, uint16_t number)
+{
+    get_idle(dma, stream, "NDTR")->ndtr = number;
+}
+
+/* -------------------------------------------------------------------------
+ * Transfers
+ * ------------------------------------------------------------------------- */
+
+static sim_dma_stream_t *route(uint32_t usart, uint8_t dir, uint32_t dr)
+{
+    uint32_t want_dir = dir == DIR_RX ? DMA_SxCR_DIR_PERIPHERAL_TO_MEM : DMA_SxCR_DIR_MEM_TO_PERIPHERAL;
+
+    for (size_t i = 0; i < sizeof(request_map) / sizeof(request_map[0]); i++) {
+        sim_dma_stream_t *s = &streams[request_map[i].controller][request_map[i].stream];
+
+        if (request_map[i].usart != usart || request_map[i].dir != dir)
+            continue;
+        if (!(s->cr & DMA_SxCR_EN) ||
+            (s->cr & DMA_SxCR_CHSEL_MASK) >> DMA_SxCR_CHSEL_SHIFT != request_map[i].channel)
+            continue;
+
+        if ((s->cr & DMA_SxCR_DIR_MASK) != want_dir || s->par != dr) {
+            /* Wired to this USART but pointed elsewhere */
+            s->flags |= DMA_TEIF;
+            s->cr &= ~DMA_SxCR_EN;
+            continue;
+        }
+        return s;
+    }
+    return NULL;
+}
+
+static uint8_t *mem(sim_dma_stream_t *s)
+{
+    uint32_t off = (s->cr & DMA_SxCR_MINC) ? s->loaded - s->ndtr : 0;
+
+    return (uint8_t *)(uintptr_t)(s->m0ar + off);
+}
+
+static void count(sim_dma_stream_t *s)
+{
+    s->ndtr--;
+    if (s->ndtr == s->loaded / 2)
+        s->flags |= DMA_HTIF;
+    if (s->ndtr == 0) {
+        s->flags |= DMA_TCIF;
+        if (s->cr & DMA_SxCR_CIRC)
+            s->ndtr = s->loaded;
+        else
+            s->cr &= ~DMA_SxCR_EN;
+    }
+}
+
+bool sim_dma_usart_rx(uint32_t usart, uint32_t dr_addr, uint8_t byte)
+{
+    sim_dma_stream_t *s = route(usart, DIR_RX, dr_addr);
+
+    if (s == NULL)
+        return false;
+    *mem(s) = byte;
+    count(s);
+    return true;
+}
+
+bool sim_dma_usart_tx(uint32_t usart, uint32_t dr_addr, uint8_t *byte)
+{
+    sim_dma_stream_t *s = route(usart, DIR_TX, dr_addr);
+
+    if (s == NULL)
+        return false;
+    *byte = *mem(s);
+    count(s);
+    return true;
+}
+
+bool sim_dma_irq_pending(int controller, int stream)
+{
+    const sim_dma_stream_t *s = &streams[controller][stream];
+
+    return ((s->cr & DMA_SxCR_TCIE) && (s->flags & DMA_TCIF)) ||
+           ((s->cr & DMA_SxCR_HTIE) && (s->flags & DMA_HTIF)) ||
+           ((s->cr & DMA_SxCR_TEIE) && (s->flags & DMA_TEIF)) ||
+           ((s->cr & DMA_SxCR_DMEIE) && (s->flags & DMA_DMEIF));
+}
+
+void sim_dma_reset(void)
+{
+    memset(streams, 0, sizeof(streams));
+}
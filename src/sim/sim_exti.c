@@ -0,0 +1,95 @@
+/*
+ * EXTI model, GPIO lines only.  Each line follows the pin of the same
+ * number on the port SYSCFG selects, and latches PR on the enabled edges.
+ * Pins are sampled whenever their level can change: external drive from
+ * the host, and the GPIO API on the firmware side (not direct ODR writes).
+ */
+#include <string.h>
+
+#include <libopencm3/stm32/exti.h>
+#include <libopencm3/stm32/gpio.h>
+
+#include "sim.h"
+#include "sim_internal.h"
+
+static uint32_t imr, rtsr, ftsr, pr;
+static uint32_t source[16];     /* GPIO port per line */
+static uint16_t level;          /* last sampled, per line */
+
+static uint16_t line_level(unsigned line)
+{
+    return (sim_gpio_regs(source[line])->idr >> line) & 1;
+}
+
+void sim_exti_sample(void)
+{
+    for (unsigned line = 0; line < 16; line++) {
+        uint16_t bit = 1 << line;
+        uint16_t now = line_level(line) << line;
+
+        if ((level & bit) == now)
+            continue;
+        if ((now && (rtsr & bit)) || (!now && (ftsr & bit)))
+            pr |= bit;
+        level = (level & ~bit) | now;
+    }
+    sim_irq_update();
+}
+
+bool sim_exti_irq_pending(uint32_t lines)
+{
+    return (pr & imr & lines) != 0;
+}
+
+void exti_set_trigger(uint32_t extis, enum exti_trigger_type trig)
+{
+    rtsr &= ~extis;
+    ftsr &= ~extis;
+    if (trig != EXTI_TRIGGER_FALLING)
+        rtsr |= extis;
+    if (trig != EXTI_TRIGGER_RISING)
+        ftsr |= extis;
+}
+
+void exti_enable_request(uint32_t extis)
+{
+    imr |= extis;
+    sim_irq_update();
+}
+
+void exti_disable_request(uint32_t extis)
+{
+    imr &= ~extis;
+}
+
+void exti_reset_request(uint32_t extis)
+{
+    pr &= ~extis;
+}
+
+void exti_select_source(uint32_t exti, uint32_t gpioport)
+{
+    sim_check_clock(RCC_SYSCFG, "SYSCFG");
+
+    for (unsigned line = 0; line < 16; line++) {
+        if (!(exti & (1 << line)))
+            continue;
+        source[line] = gpioport;
+        level = (level & ~(1 << line)) | (line_level(line) << line);
+    }
+}
+
+uint32_t exti_get_flag_status(uint32_t exti)
+{
+    return pr & exti;
+}
+
+void sim_exti_reset(void)
+{
+    imr = rtsr = ftsr = pr = 0;
+    for (unsigned line = 0; line < 16; line++)
+        source[line] = GPIOA;
+    level = 0;
+    for (unsigned line = 0; line < 16; line++)
+        level |= line_level(line) << line;
+}
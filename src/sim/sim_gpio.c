@@ -0,0 +1,167 @@
+/*
+ * GPIO model.  IDR is recomputed on every register access: output pins
+ * read back ODR, open-drain pins and inputs read the external drive, then
+ * the pull resistor, and float high otherwise.  EXTI is told about every
+ * change made through the API or the host drive.
+ */
+#include <stddef.h>
+#include <string.h>
+
+#include <libopencm3/stm32/gpio.h>
+
+#include "sim.h"
+#include "sim_internal.h"
+
+#define SIM_GPIO_PORTS 8    /* A..H at 0x400 spacing */
+
+static sim_gpio_regs_t regs[SIM_GPIO_PORTS];
+static uint16_t ext_driven[SIM_GPIO_PORTS];
+static uint16_t ext_level[SIM_GPIO_PORTS];
+
+static unsigned port_index(uint32_t gpioport)
+{
+    unsigned i = (gpioport - PERIPH_BASE_AHB1) / 0x400;
+
+    if (gpioport < PERIPH_BASE_AHB1 || (gpioport & 0x3ff) || i >= SIM_GPIO_PORTS)
+        sim_fatal("0x%08x is not a GPIO port", (unsigned)gpioport);
+    return i;
+}
+
+static uint16_t pin_level(unsigned p, unsigned pin)
+{
+    const sim_gpio_regs_t *r = &regs[p];
+    uint32_t mode = (r->moder >> (2 * pin)) & 3;
+    uint32_t pull = (r->pupdr >> (2 * pin)) & 3;
+    uint16_t bit = 1 << pin;
+
+    if (mode == GPIO_MODE_OUTPUT && !(r->otyper & bit))
+        return (r->odr & bit) ? 1 : 0;
+    if (mode == GPIO_MODE_OUTPUT && !(r->odr & bit))
+        return 0;   /* open drain pulling low */
+    if (ext_driven[p] & bit)
+        return (ext_level[p] & bit) ? 1 : 0;
+    if (pull == GPIO_PUPD_PULLDOWN)
+        return 0;
+    return 1;
+}
+
+sim_gpio_regs_t *sim_gpio_regs(uint32_t gpioport)
+{
+    unsigned p = port_index(gpioport);
+    uint32_t idr = 0;
+
+    for (unsigned pin = 0; pin < 16; pin++)
+        idr |= (uint32_t)pin_level(p, pin) << pin;
+    regs[p].idr = idr;
+    return &regs[p];
+}
+
+void gpio_set(uint32_t gpioport, uint16_t gpios)
+{
+    GPIO_ODR(gpioport) |= gpios;
+    sim_exti_sample();
+}
+
+void gpio_clear(uint32_t gpioport, uint16_t gpios)
+{
+    GPIO_ODR(gpioport) &= ~(uint32_t)gpios;
+    sim_exti_sample();
+}
+
+uint16_t gpio_get(uint32_t gpioport, uint16_t gpios)
+{
+    return GPIO_IDR(gpioport) & gpios;
+}
+
+void gpio_toggle(uint32_t gpioport, uint16_t gpios)
+{
+    GPIO_ODR(gpioport) ^= gpios;
+    sim_exti_sample();
+}
+
+uint16_t gpio_port_read(uint32_t gpioport)
+{
+    return GPIO_IDR(gpioport);
+}
+
+void gpio_port_write(uint32_t gpioport, uint16_t data)
+{
+    GPIO_ODR(gpioport) = data;
+    sim_exti_sample();
+}
+
+void gpio_mode_setup(uint32_t gpioport, uint8_t mode, uint8_t pull_up_down, uint16_t gpios)
+{
+    sim_gpio_regs_t *r = sim_gpio_regs(gpioport);
+
+    for (unsigned pin = 0; pin < 16; pin++) {
+        if (!(gpios & (1 << pin)))
+            continue;
+        r->moder = (r->moder & ~(3U << (2 * pin))) | ((uint32_t)mode << (2 * pin));
+        r->pupdr = (r->pupdr & ~(3U << (2 * pin))) | ((uint32_t)pull_up_down << (2 * pin));
+    }
+    sim_exti_sample();
+}
+
+void gpio_set_output_options(uint32_t gpioport, uint8_t otype, uint8_t speed, uint16_t gpios)
+{
+    sim_gpio_regs_t *r = sim_gpio_regs(gpioport);
+
+    for (unsigned pin = 0; pin < 16; pin++) {
+        if (!(gpios & (1 << pin)))
+            continue;
+        if (otype == GPIO_OTYPE_OD)
+            r->otyper |= 1U << pin;
+        else
+            r->otyper &= ~(1U << pin);
+        r->ospeedr = (r->ospeedr & ~(3U << (2 * pin))) | ((uint32_t)speed << (2 * pin));
+    }
+}
+
+void gpio_set_af(uint32_t gpioport, uint8_t alt_func_num, uint16_t gpios)
+{
+    sim_gpio_regs_t *r = sim_gpio_regs(gpioport);
+
+    for (unsigned pin = 0; pin < 16; pin++) {
+        if (!(gpios & (1 << pin)))
+            continue;
+        if (pin < 8)
+            r->afrl = (r->afrl & ~(0xfU << (4 * pin))) | ((uint32_t)alt_func_num << (4 * pin));
+        else
+            r->afrh = (r->afrh & ~(0xfU << (4 * (pin - 8)))) | ((uint32_t)alt_func_num << (4 * (pin - 8)));
+    }
+}
+
+void sim_gpio_drive(uint32_t port, uint16_t pins, bool level)
+{
+    unsigned p = port_index(port);
+
+    ext_driven[p] |= pins;
+    if (level)
+        ext_level[p] |= pins;
+    else
+        ext_level[p] &= ~pins;
+    sim_exti_sample();
+}
+
+void sim_gpio_release(uint32_t port, uint16_t pins)
+{
+    ext_driven[port_index(port)] &= ~pins;
+    sim_exti_sample();
+}
+
+uint16_t sim_gpio_output(uint32_t port)
+{
+    return sim_gpio_regs(port)->odr;
+}
+
+void sim_gpio_reset(void)
+{
+    memset(regs, 0, sizeof(regs));
+    memset(ext_driven, 0, sizeof(ext_driven));
+    memset(ext_level, 0, sizeof(ext_level));
+
+    /* Debug pins PA13-15 / PB3-4 come out of reset in AF mode */
+    regs[0].moder = 0xa8000000;
+    regs[1].moder = 0x00000280;
+}
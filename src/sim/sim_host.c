@@ -0,0 +1,156 @@
+/*
+ * Runs the firmware as a Linux process with stdio on one side of the
+ * bridge.
+ *
+ *   default  stdin -> CDC OUT, CDC IN -> stdout, USART TX looped to RX
+ *   -e       stdin -> USART RX line, USART TX -> stdout, and the USB host
+ *            echoes every IN packet back OUT
+ *
+ * Exits when stdin is done and everything came back, or nothing moved for
+ * the idle timeout.  -v prints virtual time and throughput to stderr.
+ */
+#define _POSIX_C_SOURCE 200112L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <libopencm3/stm32/usart.h>
+#include <libopencm3/usb/cdc.h>
+
+#include "sim.h"
+#include "usb_descriptors.h"
+
+#define SLICE_NS        50000ULL        /* host frame between bus rounds */
+#define IDLE_TIMEOUT_NS 500000000ULL
+
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+            "usage: %s [-e] [-u 1|2|6] [-b host_baud] [-g gap_ns] [-p poll_ns] [-v]\n",
+            prog);
+    exit(2);
+}
+
+static uint32_t usart_base(int n)
+{
+    switch (n) {
+    case 1: return USART1;
+    case 2: return USART2;
+    case 6: return USART6;
+    default: return 0;
+    }
+}
+
+static void set_dtr(void)
+{
+    struct usb_setup_data req = {
+        USB_REQ_TYPE_CLASS | USB_REQ_TYPE_INTERFACE,
+        USB_CDC_REQ_SET_CONTROL_LINE_STATE, 0x3, IFACE_CDC0_COMM, 0
+    };
+    uint16_t len = 0;
+
+    if (sim_usb_host_control(&req, NULL, &len) != SIM_USB_ACK) {
+        fprintf(stderr, "SET_CONTROL_LINE_STATE failed\n");
+        exit(1);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    uint32_t usart = USART2;
+    uint32_t host_baud = 0, gap_ns = 0;
+    int external = 0, verbose = 0;
+    uint8_t out[CDC_DATA_PACKET_SIZE], in[CDC_DATA_PACKET_SIZE], buf[256];
+    uint16_t out_len = 0, len;
+    uint64_t sent = 0, received = 0, last_activity = 0;
+    int eof = 0, opt;
+
+    while ((opt = getopt(argc, argv, "eu:b:g:p:v")) != -1) {
+        switch (opt) {
+        case 'e': external = 1; break;
+        case 'u': usart = usart_base(atoi(optarg)); break;
+        case 'b': host_baud = strtoul(optarg, NULL, 0); break;
+        case 'g': gap_ns = strtoul(optarg, NULL, 0); break;
+        case 'p': sim_set_poll_cost_ns(strtoul(optarg, NULL, 0)); break;
+        case 'v': verbose = 1; break;
+        default: usage(argv[0]);
+        }
+    }
+    if (usart == 0)
+        usage(argv[0]);
+
+    sim_init();
+    sim_usart_connect(usart, external ? SIM_USART_HOST : usart);
+    sim_usart_set_line_timing(usart, host_baud, gap_ns);
+    sim_start(sim_firmware_main);
+
+    if (sim_usb_host_enumerate() != SIM_USB_ACK) {
+        fprintf(stderr, "enumeration failed\n");
+        return 1;
+    }
+    set_dtr();
+
+    for (;;) {
+        if (!external) {
+            /* stdin -> OUT, IN -> stdout */
+            if (!eof && out_len == 0) {
+                ssize_t n = read(STDIN_FILENO, out, sizeof(out));
+
+                if (n <= 0)
+                    eof = 1;
+                else
+                    out_len = n;
+            }
+            if (out_len > 0 && sim_usb_host_out(EP_CDC0_OUT, out, out_len) == SIM_USB_ACK) {
+                sent += out_len;
+                out_len = 0;
+                last_activity = sim_now_ns();
+            }
+            while (sim_usb_host_in(EP_CDC0_IN, in, sizeof(in), &len) == SIM_USB_ACK) {
+                fwrite(in, 1, len, stdout);
+                received += len;
+                last_activity = sim_now_ns();
+            }
+        } else {
+            /* stdin -> USART RX line, USART TX -> stdout, USB echoes */
+            if (!eof && sim_usart_rx_pending(usart) < sizeof(buf)) {
+                ssize_t n = read(STDIN_FILENO, buf, sizeof(buf));
+
+                if (n <= 0)
+                    eof = 1;
+                else
+                    sent += sim_usart_host_write(usart, buf, n);
+            }
+            if (out_len == 0 && sim_usb_host_in(EP_CDC0_IN, out, sizeof(out), &len) == SIM_USB_ACK) {
+                out_len = len;
+                last_activity = sim_now_ns();
+            }
+            if (out_len > 0 && sim_usb_host_out(EP_CDC0_OUT, out, out_len) == SIM_USB_ACK)
+                out_len = 0;
+            while ((len = sim_usart_host_read(usart, buf, sizeof(buf))) > 0) {
+                fwrite(buf, 1, len, stdout);
+                received += len;
+                last_activity = sim_now_ns();
+            }
+        }
+
+        if (eof && out_len == 0 &&
+            (received >= sent || sim_now_ns() - last_activity > IDLE_TIMEOUT_NS))
+            break;
+        sim_run_for(SLICE_NS);
+    }
+    fflush(stdout);
+
+    if (verbose) {
+        double s = sim_now_ns() / 1e9;
+
+        fprintf(stderr, "sent %llu received %llu in %.6f s virtual, %.0f B/s, "
+                "%u overruns, %u framing errors\n",
+                (unsigned long long)sent, (unsigned long long)received, s,
+                s > 0 ? received / s : 0.0,
+                sim_usart_overruns(usart), sim_usart_framing_errors(usart));
+    }
+    return received == sent ? 0 : 1;
+}
@@ -0,0 +1,52 @@
+#pragma once
+
+/* Between the simulator models; not for firmware or host code */
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include <libopencm3/stm32/rcc.h>
+
+#if defined(__GNUC__)
+#define SIM_NORETURN __attribute__((noreturn, format(printf, 1, 2)))
+#else
+#define SIM_NORETURN
+#endif
+
+void sim_fatal(const char *fmt, ...) SIM_NORETURN;
+
+/* Firmware side: time passes, due events fire and interrupts are taken */
+void sim_advance(uint64_t ns);
+uint32_t sim_poll_cost_ns(void);
+/* Something may have become pending: take it now if allowed */
+void sim_irq_update(void);
+bool sim_periph_clocked(enum rcc_periph_clken clken);
+void sim_check_clock(enum rcc_periph_clken clken, const char *what);
+
+void sim_gpio_reset(void);
+
+void sim_exti_reset(void);
+void sim_exti_sample(void);    /* a GPIO level may have changed */
+bool sim_exti_irq_pending(uint32_t lines);
+
+void sim_usart_reset(void);
+uint64_t sim_usart_next_event(void);
+void sim_usart_step(uint64_t now);
+bool sim_usart_irq_pending(int index);
+void sim_usart_service(void);   /* DMA requests after a stream change */
+
+void sim_dma_reset(void);
+bool sim_dma_irq_pending(int controller, int stream);
+/* Request from a USART; false when no enabled stream is wired to it */
+bool sim_dma_usart_rx(uint32_t usart, uint32_t dr_addr, uint8_t byte);
+bool sim_dma_usart_tx(uint32_t usart, uint32_t dr_addr, uint8_t *byte);
+
+void sim_usb_reset(void);
+bool sim_usb_irq_pending(void);
+
+void sim_timer_reset(void);
+uint64_t sim_timer_next_event(void);
+void sim_timer_step(uint64_t now);
+bool sim_timer_irq_pending(int index);
+
+#define SIM_NO_EVENT UINT64_MAX
@@ -0,0 +1,270 @@
+/*
+ * General purpose timer model, TIM2..TIM5 on the APB1 timer clock (twice
+ * APB1 when APB1 is divided down, as on the target).
+ *
+ * The counter is not stored; it is worked out from the time it was last
+ * (re)started, so it costs nothing while nothing waits on it.  Flags are
+ * brought up to date on every register access and at their own events,
+ * which sim_timer_next_event() offers to the clock for enabled interrupts.
+ * A new prescaler only takes effect at UG, not at the next overflow.
+ */
+#include <stddef.h>
+#include <string.h>
+
+#include <libopencm3/stm32/rcc.h>
+#include <libopencm3/stm32/timer.h>
+
+#include "sim.h"
+#include "sim_internal.h"
+
+#define SIM_TIMERS  4
+#define CHANNELS    4
+
+typedef struct {
+    bool enabled;
+    uint32_t psc;           /* in use */
+    uint32_t psc_preload;   /* PSC register */
+    uint32_t arr;
+    uint32_t ccr[CHANNELS];
+    uint32_t dier;
+    uint32_t sr;
+    uint32_t cnt0;          /* count at base_ns */
+    uint64_t base_ns;
+    uint64_t done;          /* ticks since base_ns with their flags set */
+} sim_tim_t;
+
+static sim_tim_t timers[SIM_TIMERS];
+
+static const struct {
+    uint32_t base;
+    enum rcc_periph_clken clken;
+    uint32_t max;
+} timer_map[SIM_TIMERS] = {
+    { TIM2, RCC_TIM2, 0xffffffff },
+    { TIM3, RCC_TIM3, 0xffff },
+    { TIM4, RCC_TIM4, 0xffff },
+    { TIM5, RCC_TIM5, 0xffffffff },
+};
+
+static uint32_t timer_clock(void)
+{
+    return rcc_apb1_frequency == rcc_ahb_frequency ? rcc_apb1_frequency : 2 * rcc_apb1_frequency;
+}
+
+/* Whole ticks since base_ns, and the time of tick k */
+static uint64_t ticks_at(const sim_tim_t *t, uint64_t now)
+{
+    return (uint64_t)((unsigned __int128)(now - t->base_ns) * timer_clock() /
+                      ((unsigned __int128)(t->psc + 1) * 1000000000u));
+}
+
+static uint64_t tick_time(const sim_tim_t *t, uint64_t k)
+{
+    unsigned __int128 num = (unsigned __int128)k * (t->psc + 1) * 1000000000u;
+
+    return t->base_ns + (uint64_t)((num + timer_clock() - 1) / timer_clock());
+}
+
+/* First tick after done at which the count reaches value */
+static uint64_t tick_of(const sim_tim_t *t, uint32_t value)
+{
+    uint64_t period = (uint64_t)t->arr + 1;
+    uint64_t at = (t->cnt0 + t->done + 1) % period;
+
+    if (value > t->arr)
+        return UINT64_MAX;
+    return t->done + 1 + ((uint64_t)value + period - at) % period;
+}
+
+static void sync(sim_tim_t *t, uint64_t now)
+{
+    if (!t->enabled)
+        return;
+
+    uint64_t ticks = ticks_at(t, now);
+
+    if (ticks <= t->done)
+        return;
+    if (tick_of(t, 0) <= ticks)
+        t->sr |= TIM_SR_UIF;
+    for (int ch = 0; ch < CHANNELS; ch++) {
+        if (tick_of(t, t->ccr[ch]) <= ticks)
+            t->sr |= TIM_SR_CC1IF << ch;
+    }
+    t->done = ticks;
+}
+
+static uint32_t count(const sim_tim_t *t)
+{
+    if (!t->enabled)
+        return t->cnt0;
+    return (uint32_t)((t->cnt0 + ticks_at(t, sim_now_ns())) % ((uint64_t)t->arr + 1));
+}
+
+/* Changes to the count or its rate: restart from the current count */
+static void rebase(sim_tim_t *t, uint32_t cnt)
+{
+    t->cnt0 = cnt;
+    t->base_ns = sim_now_ns();
+    t->done = 0;
+}
+
+static sim_tim_t *get(uint32_t timer_peripheral)
+{
+    for (int i = 0; i < SIM_TIMERS; i++) {
+        if (timer_map[i].base == timer_peripheral) {
+            sim_check_clock(timer_map[i].clken, "timer");
+            sync(&timers[i], sim_now_ns());
+            return &timers[i];
+        }
+    }
+    sim_fatal("0x%08x is not a simulated timer", (unsigned)timer_peripheral);
+}
+
+static uint32_t width(uint32_t timer_peripheral)
+{
+    for (int i = 0; i < SIM_TIMERS; i++) {
+        if (timer_map[i].base == timer_peripheral)
+            return timer_map[i].max;
+    }
+    return 0;
+}
+
+void timer_set_prescaler(uint32_t timer_peripheral, uint32_t value)
+{
+    get(timer_peripheral)->psc_preload = value & 0xffff;
+}
+
+void timer_set_period(uint32_t timer_peripheral, uint32_t period)
+{
+    sim_tim_t *t = get(timer_peripheral);
+    uint32_t cnt = count(t);
+
+    t->arr = period & width(timer_peripheral);
+    rebase(t, cnt);
+}
+
+void timer_enable_counter(uint32_t timer_peripheral)
+{
+    sim_tim_t *t = get(timer_peripheral);
+
+    if (!t->enabled) {
+        t->enabled = true;
+        rebase(t, t->cnt0);
+    }
+}
+
+void timer_disable_counter(uint32_t timer_peripheral)
+{
+    sim_tim_t *t = get(timer_peripheral);
+
+    t->cnt0 = count(t);
+    t->enabled = false;
+}
+
+uint32_t timer_get_counter(uint32_t timer_peripheral)
+{
+    return count(get(timer_peripheral));
+}
+
+void timer_set_counter(uint32_t timer_peripheral, uint32_t value)
+{
+    rebase(get(timer_peripheral), value & width(timer_peripheral));
+}
+
+void timer_set_oc_value(uint32_t timer_peripheral, enum tim_oc_id oc_id, uint32_t value)
+{
+    static const int8_t channel[] = {
+        [TIM_OC1] = 0, [TIM_OC1N] = -1, [TIM_OC2] = 1, [TIM_OC2N] = -1,
+        [TIM_OC3] = 2, [TIM_OC3N] = -1, [TIM_OC4] = 3,
+    };
+
+    if (oc_id > TIM_OC4 || channel[oc_id] < 0)
+        sim_fatal("timer_set_oc_value: complementary outputs are not simulated");
+    get(timer_peripheral)->ccr[channel[oc_id]] = value & width(timer_peripheral);
+}
+
+void timer_enable_irq(uint32_t timer_peripheral, uint32_t irq)
+{
+    get(timer_peripheral)->dier |= irq;
+    sim_irq_update();
+}
+
+void timer_disable_irq(uint32_t timer_peripheral, uint32_t irq)
+{
+    get(timer_peripheral)->dier &= ~irq;
+}
+
+bool timer_get_flag(uint32_t timer_peripheral, uint32_t flag)
+{
+    return (get(timer_peripheral)->sr & flag) != 0;
+}
+
+void timer_clear_flag(uint32_t timer_peripheral, uint32_t flag)
+{
+    get(timer_peripheral)->sr &= ~flag;
+}
+
+bool timer_interrupt_source(uint32_t timer_peripheral, uint32_t flag)
+{
+    sim_tim_t *t = get(timer_peripheral);
+
+    return (t->sr & t->dier & flag) != 0;
+}
+
+void timer_generate_event(uint32_t timer_peripheral, uint32_t event)
+{
+    sim_tim_t *t = get(timer_peripheral);
+
+    if (event & TIM_EGR_UG) {
+        t->psc = t->psc_preload;
+        t->sr |= TIM_SR_UIF;
+        rebase(t, 0);
+        sim_irq_update();
+    }
+}
+
+/* ------------------------------------------------------------------------- */
+
+bool sim_timer_irq_pending(int index)
+{
+    const sim_tim_t *t = &timers[index];
+
+    return (t->sr & t->dier & (TIM_SR_UIF | TIM_SR_CC1IF | TIM_SR_CC2IF |
+                               TIM_SR_CC3IF | TIM_SR_CC4IF)) != 0;
+}
+
+uint64_t sim_timer_next_event(void)
+{
+    uint64_t next = SIM_NO_EVENT;
+
+    for (int i = 0; i < SIM_TIMERS; i++) {
+        const sim_tim_t *t = &timers[i];
+
+        if (!t->enabled)
+            continue;
+        for (int bit = 0; bit <= CHANNELS; bit++) {
+            uint32_t value = bit == 0 ? 0 : t->ccr[bit - 1];
+            uint64_t k;
+
+            if (!(t->dier & (1u << bit)) || (t->sr & (1u << bit)))
+                continue;
+            if ((k = tick_of(t, value)) != UINT64_MAX && tick_time(t, k) < next)
+                next = tick_time(t, k);
+        }
+    }
+    return next;
+}
+
+void sim_timer_step(uint64_t now)
+{
+    for (int i = 0; i < SIM_TIMERS; i++)
+        sync(&timers[i], now);
+}
+
+void sim_timer_reset(void)
+{
+    memset(timers, 0, sizeof(timers));
+    for (int i = 0; i < SIM_TIMERS; i++)
+        timers[i].arr = timer_map[i].max;
+}
@@ -0,0 +1,579 @@
+/*
+ * USART model with line timing.
+ *
+ * TX: DR -> TDR -> shift register.  A byte leaves the shifter one frame
+ * after it entered, then lands on the peer's RX line (or the host queue).
+ * With HDSEL it lands on its own RX line as well.
+ * RX: bytes arrive at their stop bit.  Without DMA a byte that finds RXNE
+ * still set is lost and sets ORE.  IDLE sets one frame after the last
+ * byte.  Bit rate comes from BRR and the bus clock, as on the target.
+ *
+ * Status flags clear the way RM0383 describes, as far as the API shows it:
+ * usart_recv() clears RXNE, and IDLE/ORE/FE/PE too after a usart_get_flag()
+ * or a USART_SR read.  A break is received as a 0 with FE.
+ */
+#include <stddef.h>
+#include <string.h>
+
+#include <libopencm3/stm32/rcc.h>
+#include <libopencm3/stm32/usart.h>
+#include <libopencm3/cm3/nvic.h>
+
+#include "sim.h"
+#include "sim_internal.h"
+
+#define SIM_USARTS      3
+#define RXQ_LEN         16384   /* power of two */
+#define TXQ_LEN         65536   /* power of two */
+
+#define SR_RESET        (USART_SR_TXE | USART_SR_TC)
+#define SR_ERRORS       (USART_SR_PE | USART_SR_FE | USART_SR_NE | USART_SR_ORE)
+
+#define RX_PARITY_ERROR 0x01
+#define RX_BREAK        0x02
+
+typedef struct {
+    uint16_t data;
+    uint8_t fault;          /* RX_PARITY_ERROR, RX_BREAK */
+    uint64_t at;            /* stop bit received */
+    uint64_t bit_ns;        /* sender's bit time, 0 = matched */
+} rx_byte_t;
+
+typedef struct {
+    uint32_t base;
+    enum rcc_periph_clken clken;
+    bool apb2;
+    sim_usart_regs_t regs;
+    bool sr_read;
+
+    bool tdr_full;
+    uint16_t tdr;
+    bool shifting;
+    uint16_t shift;
+    uint64_t shift_done;
+
+    rx_byte_t rxq[RXQ_LEN];
+    uint32_t rxq_head, rxq_tail;
+    uint64_t host_next;
+    uint32_t host_baud;
+    uint32_t gap_ns;
+    bool idle_armed;
+    uint64_t idle_at;
+
+    uint32_t peer;
+    uint8_t txq[TXQ_LEN];
+    uint32_t txq_head, txq_tail;
+
+    uint32_t overruns;
+    uint32_t framing_errors;
+} sim_usart_t;
+
+static sim_usart_t usarts[SIM_USARTS];
+
+static sim_usart_t *find(uint32_t usart)
+{
+    for (int i = 0; i < SIM_USARTS; i++) {
+        if (usarts[i].base == usart)
+            return &usarts[i];
+    }
+    sim_fatal("0x%08x is not a USART", (unsigned)usart);
+}
+
+sim_usart_regs_t *sim_usart_regs(uint32_t usart)
+{
+    return &find(usart)->regs;
+}
+
+sim_usart_regs_t *sim_usart_regs_sr(uint32_t usart)
+{
+    sim_usart_t *u = find(usart);
+
+    u->sr_read = true;
+    return &u->regs;
+}
+
+static uint32_t dr_addr(sim_usart_t *u)
+{
+    return (uint32_t)(uintptr_t)&u->regs.dr;
+}
+
+/* -------------------------------------------------------------------------
+ * Timing
+ * ------------------------------------------------------------------------- */
+
+static uint64_t bit_ns(const sim_usart_t *u)
+{
+    uint32_t clock = u->apb2 ? rcc_apb2_frequency : rcc_apb1_frequency;
+    uint32_t brr = u->regs.brr;
+    double div;
+
+    if (brr == 0)
+        sim_fatal("USART 0x%08x used before its baud rate was set", (unsigned)u->base);
+
+    if (u->regs.cr1 & USART_CR1_OVER8)
+        div = 8.0 * ((brr >> 4) + (brr & 7) / 8.0);
+    else
+        div = brr;
+    return (uint64_t)(div * 1e9 / clock + 0.5);
+}
+
+/* Frame in half bits: start, data (+parity, 9 with M), stop */
+static uint64_t frame_ns(const sim_usart_t *u)
+{
+    static const unsigned stop_half_bits[4] = { 2, 1, 4, 3 };
+    unsigned half = 2 + ((u->regs.cr1 & USART_CR1_M) ? 18 : 16) +
+                    stop_half_bits[(u->regs.cr2 & USART_CR2_STOPBITS_MASK) >> 12];
+
+    return bit_ns(u) * half / 2;
+}
+
+uint64_t sim_usart_frame_ns(uint32_t usart)
+{
+    return frame_ns(find(usart));
+}
+
+static bool enabled(const sim_usart_t *u, uint32_t dir)
+{
+    return (u->regs.cr1 & USART_CR1_UE) && (u->regs.cr1 & dir);
+}
+
+/* -------------------------------------------------------------------------
+ * RX side
+ * ------------------------------------------------------------------------- */
+
+static void rxq_push(sim_usart_t *u, uint16_t data, uint8_t fault, uint64_t at, uint64_t sender_bit_ns)
+{
+    if (u->rxq_head - u->rxq_tail == RXQ_LEN)
+        sim_fatal("USART 0x%08x RX line queue full", (unsigned)u->base);
+    u->rxq[u->rxq_head % RXQ_LEN] = (rx_byte_t){ data, fault, at, sender_bit_ns };
+    u->rxq_head++;
+}
+
+static void receive(sim_usart_t *u, const rx_byte_t *b)
+{
+    uint16_t data = b->data;
+    bool framing = (b->fault & RX_BREAK) != 0;
+    bool parity = (b->fault & RX_PARITY_ERROR) && (u->regs.cr1 & USART_CR1_PCE);
+    uint32_t errors;
+
+    if (!enabled(u, USART_CR1_RE))
+        return;
+
+    /* A receiver more than 3% off the sender samples the wrong bits */
+    if (b->bit_ns != 0) {
+        uint64_t mine = bit_ns(u);
+        uint64_t diff = mine > b->bit_ns ? mine - b->bit_ns : b->bit_ns - mine;
+
+        if (diff * 100 > mine * 3) {
+            framing = true;
+            data ^= 0x55;
+            u->framing_errors++;
+        }
+    }
+
+    u->idle_armed = true;
+    u->idle_at = b->at + frame_ns(u);
+    data &= (u->regs.cr1 & USART_CR1_M) ? 0x1ff : 0xff;
+    errors = (framing ? USART_SR_FE : 0) | (parity ? USART_SR_PE : 0);
+
+    /* DMA reads DR, which keeps the character */
+    if ((u->regs.cr3 & USART_CR3_DMAR) && sim_dma_usart_rx(u->base, dr_addr(u), data)) {
+        u->regs.dr = data;
+        u->regs.sr |= errors;
+        return;
+    }
+
+    if (u->regs.sr & USART_SR_RXNE) {
+        u->regs.sr |= USART_SR_ORE;
+        u->overruns++;
+        return;
+    }
+    u->regs.dr = data;
+    u->regs.sr |= USART_SR_RXNE | errors;
+}
+
+/* -------------------------------------------------------------------------
+ * TX side
+ * ------------------------------------------------------------------------- */
+
+static void line_out(sim_usart_t *u, uint16_t data, uint64_t at)
+{
+    /* Half-duplex: the receiver listens to its own transmitter */
+    if (u->regs.cr3 & USART_CR3_HDSEL)
+        rxq_push(u, data, 0, at, bit_ns(u));
+    if (u->peer == SIM_USART_HOST) {
+        if (u->txq_head - u->txq_tail == TXQ_LEN)
+            sim_fatal("USART 0x%08x host TX queue full, host is not reading", (unsigned)u->base);
+        u->txq[u->txq_head % TXQ_LEN] = (uint8_t)data;
+        u->txq_head++;
+        return;
+    }
+    rxq_push(find(u->peer), data, 0, at, bit_ns(u));
+}
+
+/* Move TDR into an idle shifter */
+static void tx_kick(sim_usart_t *u, uint64_t start)
+{
+    if (u->shifting || !u->tdr_full || !enabled(u, USART_CR1_TE))
+        return;
+
+    u->shift = u->tdr;
+    u->tdr_full = false;
+    u->shifting = true;
+    u->shift_done = start + frame_ns(u);
+    u->regs.sr |= USART_SR_TXE;
+    u->regs.sr &= ~USART_SR_TC;
+}
+
+static void tdr_write(sim_usart_t *u, uint16_t data)
+{
+    u->tdr = data;
+    u->tdr_full = true;
+    u->regs.sr &= ~(USART_SR_TXE | USART_SR_TC);
+    tx_kick(u, sim_now_ns());
+}
+
+/* TX DMA request while TDR is empty */
+static void service(sim_usart_t *u)
+{
+    uint8_t b;
+
+    while ((u->regs.cr3 & USART_CR3_DMAT) && (u->regs.sr & USART_SR_TXE) &&
+           enabled(u, USART_CR1_TE) && sim_dma_usart_tx(u->base, dr_addr(u), &b)) {
+        tdr_write(u, b);
+    }
+}
+
+void sim_usart_service(void)
+{
+    for (int i = 0; i < SIM_USARTS; i++) {
+        if (sim_periph_clocked(usarts[i].clken))
+            service(&usarts[i]);
+    }
+}
+
+/* -------------------------------------------------------------------------
+ * Event loop hooks
+ * ------------------------------------------------------------------------- */
+
+uint64_t sim_usart_next_event(void)
+{
+    uint64_t next = SIM_NO_EVENT;
+
+    for (int i = 0; i < SIM_USARTS; i++) {
+        const sim_usart_t *u = &usarts[i];
+
+        if (u->shifting && u->shift_done < next)
+            next = u->shift_done;
+        if (u->rxq_head != u->rxq_tail && u->rxq[u->rxq_tail % RXQ_LEN].at < next)
+            next = u->rxq[u->rxq_tail % RXQ_LEN].at;
+        if (u->idle_armed && u->idle_at < next)
+            next = u->idle_at;
+    }
+    return next;
+}
+
+void sim_usart_step(uint64_t now)
+{
+    for (int i = 0; i < SIM_USARTS; i++) {
+        sim_usart_t *u = &usarts[i];
+
+        if (u->shifting && u->shift_done <= now) {
+            uint64_t done = u->shift_done;
+
+            u->shifting = false;
+            line_out(u, u->shift, done);
+            if (u->tdr_full)
+                tx_kick(u, done);   /* back to back */
+            else
+                u->regs.sr |= USART_SR_TC;
+        }
+
+        while (u->rxq_head != u->rxq_tail && u->rxq[u->rxq_tail % RXQ_LEN].at <= now) {
+            receive(u, &u->rxq[u->rxq_tail % RXQ_LEN]);
+            u->rxq_tail++;
+        }
+
+        if (u->idle_armed && u->idle_at <= now &&
+            (u->rxq_head == u->rxq_tail || u->rxq[u->rxq_tail % RXQ_LEN].at > u->idle_at)) {
+            u->idle_armed = false;
+            u->regs.sr |= USART_SR_IDLE;
+        }
+
+        service(u);
+    }
+}
+
+bool sim_usart_irq_pending(int index)
+{
+    const sim_usart_t *u = &usarts[index];
+    uint32_t sr = u->regs.sr, cr1 = u->regs.cr1;
+
+    if (!(cr1 & USART_CR1_UE))
+        return false;
+    return ((cr1 & USART_CR1_RXNEIE) && (sr & (USART_SR_RXNE | USART_SR_ORE))) ||
+           ((cr1 & USART_CR1_TXEIE) && (sr & USART_SR_TXE)) ||
+           ((cr1 & USART_CR1_TCIE) && (sr & USART_SR_TC)) ||
+           ((cr1 & USART_CR1_IDLEIE) && (sr & USART_SR_IDLE)) ||
+           ((cr1 & USART_CR1_PEIE) && (sr & USART_SR_PE)) ||
+           ((u->regs.cr3 & USART_CR3_EIE) && (u->regs.cr3 & USART_CR3_DMAR) &&
+            (sr & (USART_SR_FE | USART_SR_NE | USART_SR_ORE)));
+}
+
+/* -------------------------------------------------------------------------
+ * libopencm3 API
+ * ------------------------------------------------------------------------- */
+
+static sim_usart_t *use(uint32_t usart)
+{
+    sim_usart_t *u = find(usart);
+
+    sim_check_clock(u->clken, "USART");
+    return u;
+}
+
+/* Register write that may change what is pending or requested */
+static void changed(sim_usart_t *u)
+{
+    tx_kick(u, sim_now_ns());
+    service(u);
+    sim_irq_update();
+}
+
+void usart_set_baudrate(uint32_t usart, uint32_t baud)
+{
+    sim_usart_t *u = use(usart);
+    uint32_t clock = u->apb2 ? rcc_apb2_frequency : rcc_apb1_frequency;
+
+    u->regs.brr = (clock + baud / 2) / baud;
+}
+
+void usart_set_databits(uint32_t usart, uint32_t bits)
+{
+    sim_usart_t *u = use(usart);
+
+    if (bits == 8)
+        u->regs.cr1 &= ~USART_CR1_M;
+    else
+        u->regs.cr1 |= USART_CR1_M;
+}
+
+void usart_set_stopbits(uint32_t usart, uint32_t stopbits)
+{
+    sim_usart_t *u = use(usart);
+
+    u->regs.cr2 = (u->regs.cr2 & ~USART_CR2_STOPBITS_MASK) | stopbits;
+}
+
+void usart_set_parity(uint32_t usart, uint32_t parity)
+{
+    sim_usart_t *u = use(usart);
+
+    u->regs.cr1 = (u->regs.cr1 & ~USART_PARITY_MASK) | parity;
+}
+
+void usart_set_mode(uint32_t usart, uint32_t mode)
+{
+    sim_usart_t *u = use(usart);
+
+    u->regs.cr1 = (u->regs.cr1 & ~USART_MODE_MASK) | mode;
+    changed(u);
+}
+
+void usart_set_flow_control(uint32_t usart, uint32_t flowcontrol)
+{
+    sim_usart_t *u = use(usart);
+
+    u->regs.cr3 = (u->regs.cr3 & ~USART_FLOWCONTROL_MASK) | flowcontrol;
+}
+
+void usart_enable(uint32_t usart)
+{
+    sim_usart_t *u = use(usart);
+
+    u->regs.cr1 |= USART_CR1_UE;
+    changed(u);
+}
+
+void usart_disable(uint32_t usart)
+{
+    use(usart)->regs.cr1 &= ~USART_CR1_UE;
+}
+
+void usart_send(uint32_t usart, uint16_t data)
+{
+    sim_usart_t *u = use(usart);
+
+    if (u->tdr_full)
+        sim_fatal("USART 0x%08x DR written with TXE clear, byte lost", (unsigned)usart);
+    tdr_write(u, data);
+    sim_irq_update();
+}
+
+uint16_t usart_recv(uint32_t usart)
+{
+    sim_usart_t *u = use(usart);
+
+    if (u->sr_read)
+        u->regs.sr &= ~(SR_ERRORS | USART_SR_IDLE);
+    u->sr_read = false;
+    u->regs.sr &= ~USART_SR_RXNE;
+    return u->regs.dr;
+}
+
+void usart_wait_send_ready(uint32_t usart)
+{
+    while (!(use(usart)->regs.sr & USART_SR_TXE))
+        sim_advance(sim_poll_cost_ns());
+}
+
+void usart_wait_recv_ready(uint32_t usart)
+{
+    while (!(use(usart)->regs.sr & USART_SR_RXNE))
+        sim_advance(sim_poll_cost_ns());
+}
+
+void usart_send_blocking(uint32_t usart, uint16_t data)
+{
+    usart_wait_send_ready(usart);
+    usart_send(usart, data);
+}
+
+uint16_t usart_recv_blocking(uint32_t usart)
+{
+    usart_wait_recv_ready(usart);
+    return usart_recv(usart);
+}
+
+#define SIM_USART_CR_BIT(name, reg, bit, set)      \
+void name(uint32_t usart)                          \
+{                                                  \
+    sim_usart_t *u = use(usart);                   \
+    if (set)                                       \
+        u->regs.reg |= (bit);                      \
+    else                                           \
+        u->regs.reg &= ~(uint32_t)(bit);           \
+    changed(u);                                    \
+}
+
+SIM_USART_CR_BIT(usart_enable_rx_dma, cr3, USART_CR3_DMAR, true)
+SIM_USART_CR_BIT(usart_disable_rx_dma, cr3, USART_CR3_DMAR, false)
+SIM_USART_CR_BIT(usart_enable_tx_dma, cr3, USART_CR3_DMAT, true)
+SIM_USART_CR_BIT(usart_disable_tx_dma, cr3, USART_CR3_DMAT, false)
+SIM_USART_CR_BIT(usart_enable_rx_interrupt, cr1, USART_CR1_RXNEIE, true)
+SIM_USART_CR_BIT(usart_disable_rx_interrupt, cr1, USART_CR1_RXNEIE, false)
+SIM_USART_CR_BIT(usart_enable_tx_interrupt, cr1, USART_CR1_TXEIE, true)
+SIM_USART_CR_BIT(usart_disable_tx_interrupt, cr1, USART_CR1_TXEIE, false)
+SIM_USART_CR_BIT(usart_enable_tx_complete_interrupt, cr1, USART_CR1_TCIE, true)
+SIM_USART_CR_BIT(usart_disable_tx_complete_interrupt, cr1, USART_CR1_TCIE, false)
+SIM_USART_CR_BIT(usart_enable_error_interrupt, cr3, USART_CR3_EIE, true)
+SIM_USART_CR_BIT(usart_disable_error_interrupt, cr3, USART_CR3_EIE, false)
+
+bool usart_get_flag(uint32_t usart, uint32_t flag)
+{
+    sim_usart_t *u = use(usart);
+
+    u->sr_read = true;
+    return (u->regs.sr & flag) != 0;
+}
+
+/* -------------------------------------------------------------------------
+ * Host side
+ * ------------------------------------------------------------------------- */
+
+void sim_usart_connect(uint32_t usart, uint32_t peer)
+{
+    if (peer != SIM_USART_HOST)
+        (void)find(peer);
+    find(usart)->peer = peer;
+}
+
+void sim_usart_set_line_timing(uint32_t usart, uint32_t host_baud, uint32_t gap_ns)
+{
+    sim_usart_t *u = find(usart);
+
+    u->host_baud = host_baud;
+    u->gap_ns = gap_ns;
+}
+
+static size_t host_send(sim_usart_t *u, const uint8_t *p, size_t len, uint8_t fault)
+{
+    uint64_t sender_bit = u->host_baud ? (1000000000ULL + u->host_baud / 2) / u->host_baud : 0;
+    uint64_t frame = u->host_baud ? sender_bit * 10 : frame_ns(u);
+    size_t n;
+
+    for (n = 0; n < len && u->rxq_head - u->rxq_tail < RXQ_LEN; n++) {
+        uint64_t start = u->host_next > sim_now_ns() ? u->host_next : sim_now_ns();
+
+        rxq_push(u, p[n], fault, start + frame, sender_bit);
+        u->host_next = start + frame + u->gap_ns;
+    }
+    return n;
+}
+
+size_t sim_usart_host_write(uint32_t usart, const void *buf, size_t len)
+{
+    return host_send(find(usart), buf, len, 0);
+}
+
+bool sim_usart_host_write_parity_error(uint32_t usart, uint8_t byte)
+{
+    return host_send(find(usart), &byte, 1, RX_PARITY_ERROR) == 1;
+}
+
+bool sim_usart_host_break(uint32_t usart)
+{
+    static const uint8_t zero = 0;
+
+    return host_send(find(usart), &zero, 1, RX_BREAK) == 1;
+}
+
+size_t sim_usart_host_read(uint32_t usart, void *buf, size_t len)
+{
+    sim_usart_t *u = find(usart);
+    uint8_t *p = buf;
+    size_t n;
+
+    for (n = 0; n < len && u->txq_tail != u->txq_head; n++) {
+        p[n] = u->txq[u->txq_tail % TXQ_LEN];
+        u->txq_tail++;
+    }
+    return n;
+}
+
+size_t sim_usart_rx_pending(uint32_t usart)
+{
+    sim_usart_t *u = find(usart);
+
+    return u->rxq_head - u->rxq_tail;
+}
+
+uint32_t sim_usart_overruns(uint32_t usart)
+{
+    return find(usart)->overruns;
+}
+
+uint32_t sim_usart_framing_errors(uint32_t usart)
+{
+    return find(usart)->framing_errors;
+}
+
+void sim_usart_reset(void)
+{
+    static const struct { uint32_t base; enum rcc_periph_clken clken; bool apb2; } map[SIM_USARTS] = {
+        { USART1, RCC_USART1, true },
+        { USART2, RCC_USART2, false },
+        { USART6, RCC_USART6, true },
+    };
+
+    for (int i = 0; i < SIM_USARTS; i++) {
+        sim_usart_t *u = &usarts[i];
+
+        memset(u, 0, sizeof(*u));
+        u->base = map[i].base;
+        u->clken = map[i].clken;
+        u->apb2 = map[i].apb2;
+        u->regs.sr = SR_RESET;
+        u->peer = SIM_USART_HOST;
+    }
+}
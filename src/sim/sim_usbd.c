@@ -0,0 +1,717 @@
+/*
+ * USB device model: the libopencm3 usbd API on top of an OTG_FS-like
+ * core, plus the packet-level host side declared in sim.h.
+ *
+ * Follows what libopencm3's dwc_otg driver does on the F411:
+ *  - endpoints 1-3 only besides EP0 (SIM_USB_EPS), IN FIFOs carved from 320 words of
+ *    FIFO RAM after the 128 word RX FIFO and 16 word EP0 FIFO
+ *  - one RX FIFO entry handled per usbd_poll(); OUT data not read by the
+ *    endpoint callback is discarded
+ *  - a forced NAK (usbd_ep_nak_set) holds off further OUT packets
+ *  - usbd_ep_write_packet() returns 0 while the last IN packet is unsent
+ *  - SET_CONFIGURATION drops the user control callbacks before calling
+ *    the set-config callbacks, which re-register them
+ */
+#include <stddef.h>
+#include <string.h>
+
+#include <libopencm3/usb/usbd.h>
+#include <libopencm3/usb/usbstd.h>
+
+#include "sim.h"
+#include "sim_internal.h"
+
+/* EP0 included: 4 on the F411, build with -DSIM_USB_EPS=6 for an F412/F446 */
+#ifndef SIM_USB_EPS
+#define SIM_USB_EPS                 4
+#endif
+#define SIM_USB_FIFO_WORDS          320
+#define SIM_USB_FIFO_WORDS_EP0      (128 + 16)
+#define MAX_USER_CONTROL_CALLBACK   4
+#define MAX_USER_SET_CONFIG_CALLBACK 4
+#define SIM_USB_CONTROL_TIMEOUT_NS  100000000ULL
+
+typedef struct {
+    bool configured;
+    uint8_t type;
+    uint16_t max;
+    usbd_endpoint_callback cb;
+    bool stall;
+    bool nak;           /* OUT: forced NAK */
+    bool full;          /* OUT: waiting for the device, IN: for the host */
+    bool done;          /* IN: taken by the host, completion callback due */
+    uint8_t buf[1023];
+    uint16_t len;
+} sim_ep_t;
+
+struct _usbd_driver {
+    const char *name;
+};
+
+const usbd_driver otgfs_usb_driver = { "otgfs" };
+
+struct _usbd_device {
+    const struct usb_device_descriptor *desc;
+    const struct usb_config_descriptor *config;
+    const char * const *strings;
+    int num_strings;
+    uint8_t *ctrl_buf;
+    uint16_t ctrl_buf_size;
+
+    struct {
+        usbd_control_callback cb;
+        uint8_t type;
+        uint8_t type_mask;
+    } user_control[MAX_USER_CONTROL_CALLBACK];
+    usbd_set_config_callback set_config[MAX_USER_SET_CONFIG_CALLBACK];
+    usbd_set_altsetting_callback set_altsetting;
+    void (*reset_cb)(void);
+    void (*suspend_cb)(void);
+    void (*resume_cb)(void);
+    void (*sof_cb)(void);
+
+    uint8_t address;
+    uint8_t current_config;
+    sim_ep_t out[SIM_USB_EPS];
+    sim_ep_t in[SIM_USB_EPS];
+    uint16_t fifo_words;
+
+    /* OUT packet being handed to its callback */
+    sim_ep_t *rx_ep;
+    uint16_t rx_off;
+
+    /* Control transfer from the host */
+    bool setup_pending;
+    bool setup_done;
+    struct usb_setup_data req;
+    uint8_t ctrl_data[4096];
+    uint16_t ctrl_len;
+    int ctrl_status;
+
+    bool connected;
+};
+
+static usbd_device device;
+static bool device_up;
+
+static unsigned ep_index(uint8_t addr)
+{
+    if ((addr & 0x7f) >= SIM_USB_EPS)
+        sim_fatal("endpoint 0x%02x: OTG_FS has endpoints 0-%d", addr, SIM_USB_EPS - 1);
+    return addr & 0x7f;
+}
+
+static usbd_device *check(usbd_device *dev)
+{
+    if (dev != &device || !device_up)
+        sim_fatal("usbd call with a device that usbd_init() did not return");
+    return dev;
+}
+
+/* -------------------------------------------------------------------------
+ * Device API
+ * ------------------------------------------------------------------------- */
+
+usbd_device *usbd_init(const usbd_driver *driver,
+                       const struct usb_device_descriptor *dev,
+                       const struct usb_config_descriptor *conf,
+                       const char * const *strings, int num_strings,
+                       uint8_t *control_buffer,
+                       uint16_t control_buffer_size)
+{
+    if (driver != &otgfs_usb_driver)
+        sim_fatal("usbd_init: only otgfs_usb_driver is simulated");
+    sim_check_clock(RCC_OTGFS, "OTG_FS");
+
+    memset(&device, 0, sizeof(device));
+    device.desc = dev;
+    device.config = conf;
+    device.strings = strings;
+    device.num_strings = num_strings;
+    device.ctrl_buf = control_buffer;
+    device.ctrl_buf_size = control_buffer_size;
+    device.fifo_words = SIM_USB_FIFO_WORDS_EP0;
+    device.connected = true;
+    device_up = true;
+    return &device;
+}
+
+void usbd_register_reset_callback(usbd_device *usbd_dev, void (*callback)(void))
+{
+    check(usbd_dev)->reset_cb = callback;
+}
+
+void usbd_register_suspend_callback(usbd_device *usbd_dev, void (*callback)(void))
+{
+    check(usbd_dev)->suspend_cb = callback;
+}
+
+void usbd_register_resume_callback(usbd_device *usbd_dev, void (*callback)(void))
+{
+    check(usbd_dev)->resume_cb = callback;
+}
+
+void usbd_register_sof_callback(usbd_device *usbd_dev, void (*callback)(void))
+{
+    check(usbd_dev)->sof_cb = callback;
+}
+
+int usbd_register_control_callback(usbd_device *usbd_dev, uint8_t type,
+                                   uint8_t type_mask,
+                                   usbd_control_callback callback)
+{
+    check(usbd_dev);
+    for (int i = 0; i < MAX_USER_CONTROL_CALLBACK; i++) {
+        if (usbd_dev->user_control[i].cb)
+            continue;
+        usbd_dev->user_control[i].type = type;
+        usbd_dev->user_control[i].type_mask = type_mask;
+        usbd_dev->user_control[i].cb = callback;
+        return 0;
+    }
+    return -1;
+}
+
+int usbd_register_set_config_callback(usbd_device *usbd_dev,
+                                      usbd_set_config_callback callback)
+{
+    check(usbd_dev);
+    for (int i = 0; i < MAX_USER_SET_CONFIG_CALLBACK; i++) {
+        if (usbd_dev->set_config[i])
+            continue;
+        usbd_dev->set_config[i] = callback;
+        return 0;
+    }
+    return -1;
+}
+
+void usbd_register_set_altsetting_callback(usbd_device *usbd_dev,
+                                           usbd_set_altsetting_callback callback)
+{
+    check(usbd_dev)->set_altsetting = callback;
+}
+
+void usbd_disconnect(usbd_device *usbd_dev, bool disconnected)
+{
+    check(usbd_dev)->connected = !disconnected;
+}
+
+void usbd_ep_setup(usbd_device *usbd_dev, uint8_t addr, uint8_t type,
+                   uint16_t max_size, usbd_endpoint_callback callback)
+{
+    uint8_t ep = addr & 0x7f;
+    sim_ep_t *e;
+
+    check(usbd_dev);
+    if (ep == 0 || ep >= SIM_USB_EPS)
+        sim_fatal("usbd_ep_setup(0x%02x): OTG_FS has endpoints 1-%d besides EP0",
+                  addr, SIM_USB_EPS - 1);
+    if (max_size > (type == USB_ENDPOINT_ATTR_ISOCHRONOUS ? 1023 : 64))
+        sim_fatal("usbd_ep_setup(0x%02x): %u byte packets are too big for full speed",
+                  addr, max_size);
+
+    if (addr & 0x80) {
+        e = &usbd_dev->in[ep];
+        usbd_dev->fifo_words += max_size / 4;
+        if (usbd_dev->fifo_words > SIM_USB_FIFO_WORDS)
+            sim_fatal("usbd_ep_setup(0x%02x): IN FIFOs need %u words, OTG_FS has %d",
+                      addr, usbd_dev->fifo_words, SIM_USB_FIFO_WORDS);
+    } else {
+        e = &usbd_dev->out[ep];
+    }
+
+    memset(e, 0, sizeof(*e));
+    e->configured = true;
+    e->type = type;
+    e->max = max_size;
+    e->cb = callback;
+}
+
+uint16_t usbd_ep_write_packet(usbd_device *usbd_dev, uint8_t addr,
+                              const void *buf, uint16_t len)
+{
+    sim_ep_t *e = &check(usbd_dev)->in[ep_index(addr)];
+
+    if (!(addr & 0x80) || (addr & 0x7f) == 0 || !e->configured)
+        sim_fatal("usbd_ep_write_packet(0x%02x): not a configured IN endpoint", addr);
+    if (len > e->max)
+        sim_fatal("usbd_ep_write_packet(0x%02x): %u bytes, packet size is %u", addr, len, e->max);
+
+    if (e->full)
+        return 0;
+    memcpy(e->buf, buf, len);
+    e->len = len;
+    e->full = true;
+    e->done = false;
+    return len;
+}
+
+uint16_t usbd_ep_read_packet(usbd_device *usbd_dev, uint8_t addr,
+                             void *buf, uint16_t len)
+{
+    sim_ep_t *e = &check(usbd_dev)->out[ep_index(addr)];
+    uint16_t n;
+
+    /* Only the packet at the head of the RX FIFO can be read */
+    if (usbd_dev->rx_ep != e)
+        return 0;
+
+    n = e->len - usbd_dev->rx_off;
+    if (n > len)
+        n = len;
+    memcpy(buf, &e->buf[usbd_dev->rx_off], n);
+    usbd_dev->rx_off += n;
+    return n;
+}
+
+void usbd_ep_stall_set(usbd_device *usbd_dev, uint8_t addr, uint8_t stall)
+{
+    uint8_t ep = ep_index(addr);
+
+    check(usbd_dev);
+    if (addr & 0x80)
+        usbd_dev->in[ep].stall = stall;
+    else
+        usbd_dev->out[ep].stall = stall;
+}
+
+uint8_t usbd_ep_stall_get(usbd_device *usbd_dev, uint8_t addr)
+{
+    uint8_t ep = ep_index(addr);
+
+    check(usbd_dev);
+    return (addr & 0x80) ? usbd_dev->in[ep].stall : usbd_dev->out[ep].stall;
+}
+
+void usbd_ep_nak_set(usbd_device *usbd_dev, uint8_t addr, uint8_t nak)
+{
+    /* Forcing NAK on an IN endpoint means nothing */
+    if (addr & 0x80)
+        return;
+    check(usbd_dev)->out[ep_index(addr)].nak = nak;
+}
+
+/* -------------------------------------------------------------------------
+ * Standard requests
+ * ------------------------------------------------------------------------- */
+
+static uint16_t put(uint8_t *buf, uint16_t at, uint16_t max, const void *src, uint16_t n)
+{
+    if (at < max)
+        memcpy(&buf[at], src, at + n <= max ? n : max - at);
+    return at + n;
+}
+
+static uint16_t build_config_descriptor(const struct usb_config_descriptor *cfg,
+                                        uint8_t *buf, uint16_t max)
+{
+    uint16_t total = put(buf, 0, max, cfg, cfg->bLength);
+
+    for (int i = 0; i < cfg->bNumInterfaces; i++) {
+        const struct usb_interface *iface = &cfg->interface[i];
+
+        if (iface->iface_assoc)
+            total = put(buf, total, max, iface->iface_assoc, iface->iface_assoc->bLength);
+
+        for (int j = 0; j < iface->num_altsetting; j++) {
+            const struct usb_interface_descriptor *alt = &iface->altsetting[j];
+
+            total = put(buf, total, max, alt, alt->bLength);
+            if (alt->extra)
+                total = put(buf, total, max, alt->extra, alt->extralen);
+
+            for (int k = 0; k < alt->bNumEndpoints; k++) {
+                const struct usb_endpoint_descriptor *ep = &alt->endpoint[k];
+
+                total = put(buf, total, max, ep, ep->bLength);
+                if (ep->extra)
+                    total = put(buf, total, max, ep->extra, ep->extralen);
+            }
+        }
+    }
+
+    if (max >= 4) {
+        buf[2] = total & 0xff;
+        buf[3] = total >> 8;
+    }
+    return total;
+}
+
+static enum usbd_request_return_codes
+get_descriptor(usbd_device *dev, struct usb_setup_data *req, uint8_t **buf, uint16_t *len)
+{
+    uint8_t idx = req->wValue & 0xff;
+    uint16_t n;
+
+    switch (req->wValue >> 8) {
+    case USB_DT_DEVICE:
+        *buf = (uint8_t *)dev->desc;
+        if (*len > dev->desc->bLength)
+            *len = dev->desc->bLength;
+        return USBD_REQ_HANDLED;
+
+    case USB_DT_CONFIGURATION:
+        if (idx != 0)
+            return USBD_REQ_NOTSUPP;
+        n = build_config_descriptor(dev->config, dev->ctrl_buf, dev->ctrl_buf_size);
+        if (n > dev->ctrl_buf_size)
+            sim_fatal("configuration descriptor is %u bytes, control buffer only %u",
+                      n, dev->ctrl_buf_size);
+        *buf = dev->ctrl_buf;
+        if (*len > n)
+            *len = n;
+        return USBD_REQ_HANDLED;
+
+    case USB_DT_STRING:
+        *buf = dev->ctrl_buf;
+        if (idx == 0) {
+            n = 4;
+            dev->ctrl_buf[2] = USB_LANGID_ENGLISH_US & 0xff;
+            dev->ctrl_buf[3] = USB_LANGID_ENGLISH_US >> 8;
+        } else {
+            const char *s;
+
+            if (dev->strings == NULL || idx > dev->num_strings)
+                return USBD_REQ_NOTSUPP;
+            s = dev->strings[idx - 1];
+            n = 2 + 2 * strlen(s);
+            if (n > dev->ctrl_buf_size)
+                sim_fatal("string %u does not fit the control buffer", idx);
+            for (size_t i = 0; s[i]; i++) {
+                dev->ctrl_buf[2 + 2 * i] = s[i];
+                dev->ctrl_buf[3 + 2 * i] = 0;
+            }
+        }
+        dev->ctrl_buf[0] = n;
+        dev->ctrl_buf[1] = USB_DT_STRING;
+        if (*len > n)
+            *len = n;
+        return USBD_REQ_HANDLED;
+
+    default:
+        return USBD_REQ_NOTSUPP;
+    }
+}
+
+static enum usbd_request_return_codes
+set_configuration(usbd_device *dev, struct usb_setup_data *req)
+{
+    const struct usb_config_descriptor *cfg = dev->config;
+
+    if (req->wValue != 0 && req->wValue != cfg->bConfigurationValue)
+        return USBD_REQ_NOTSUPP;
+
+    dev->current_config = req->wValue;
+
+    /* Endpoints and FIFO RAM start over */
+    for (int ep = 1; ep < SIM_USB_EPS; ep++) {
+        memset(&dev->in[ep], 0, sizeof(dev->in[ep]));
+        memset(&dev->out[ep], 0, sizeof(dev->out[ep]));
+    }
+    dev->fifo_words = SIM_USB_FIFO_WORDS_EP0;
+
+    for (int i = 0; i < cfg->bNumInterfaces; i++) {
+        if (cfg->interface[i].cur_altsetting)
+            *cfg->interface[i].cur_altsetting = 0;
+    }
+
+    memset(dev->user_control, 0, sizeof(dev->user_control));
+    for (int i = 0; i < MAX_USER_SET_CONFIG_CALLBACK; i++) {
+        if (dev->set_config[i])
+            dev->set_config[i](dev, req->wValue);
+    }
+    return USBD_REQ_HANDLED;
+}
+
+static enum usbd_request_return_codes
+standard_request(usbd_device *dev, struct usb_setup_data *req, uint8_t **buf, uint16_t *len)
+{
+    uint8_t recipient = req->bmRequestType & USB_REQ_TYPE_RECIPIENT;
+    const struct usb_config_descriptor *cfg = dev->config;
+
+    if ((req->bmRequestType & USB_REQ_TYPE_TYPE) != USB_REQ_TYPE_STANDARD)
+        return USBD_REQ_NOTSUPP;
+
+    switch (req->bRequest) {
+    case USB_REQ_GET_DESCRIPTOR:
+        return get_descriptor(dev, req, buf, len);
+
+    case USB_REQ_SET_ADDRESS:
+        dev->address = req->wValue & 0x7f;
+        return USBD_REQ_HANDLED;
+
+    case USB_REQ_SET_CONFIGURATION:
+        return set_configuration(dev, req);
+
+    case USB_REQ_GET_CONFIGURATION:
+        (*buf)[0] = dev->current_config;
+        *len = 1;
+        return USBD_REQ_HANDLED;
+
+    case USB_REQ_GET_STATUS:
+        (*buf)[0] = 0;
+        (*buf)[1] = 0;
+        if (recipient == USB_REQ_TYPE_ENDPOINT)
+            (*buf)[0] = usbd_ep_stall_get(dev, req->wIndex);
+        *len = 2;
+        return USBD_REQ_HANDLED;
+
+    case USB_REQ_GET_INTERFACE:
+        if (req->wIndex >= cfg->bNumInterfaces)
+            return USBD_REQ_NOTSUPP;
+        (*buf)[0] = cfg->interface[req->wIndex].cur_altsetting ?
+                    *cfg->interface[req->wIndex].cur_altsetting : 0;
+        *len = 1;
+        return USBD_REQ_HANDLED;
+
+    case USB_REQ_SET_INTERFACE:
+        if (req->wIndex >= cfg->bNumInterfaces ||
+            req->wValue >= cfg->interface[req->wIndex].num_altsetting)
+            return USBD_REQ_NOTSUPP;
+        if (cfg->interface[req->wIndex].cur_altsetting)
+            *cfg->interface[req->wIndex].cur_altsetting = req->wValue;
+        else if (req->wValue > 0)
+            return USBD_REQ_NOTSUPP;
+        if (dev->set_altsetting)
+            dev->set_altsetting(dev, req->wIndex, req->wValue);
+        *len = 0;
+        return USBD_REQ_HANDLED;
+
+    case USB_REQ_CLEAR_FEATURE:
+    case USB_REQ_SET_FEATURE:
+        if (recipient != USB_REQ_TYPE_ENDPOINT || req->wValue != USB_FEAT_ENDPOINT_HALT)
+            return USBD_REQ_NOTSUPP;
+        usbd_ep_stall_set(dev, req->wIndex, req->bRequest == USB_REQ_SET_FEATURE);
+        return USBD_REQ_HANDLED;
+
+    default:
+        return USBD_REQ_NOTSUPP;
+    }
+}
+
+static enum usbd_request_return_codes
+dispatch(usbd_device *dev, struct usb_setup_data *req, uint8_t **buf, uint16_t *len,
+         usbd_control_complete_callback *complete)
+{
+    for (int i = 0; i < MAX_USER_CONTROL_CALLBACK; i++) {
+        enum usbd_request_return_codes result;
+
+        if (dev->user_control[i].cb == NULL)
+            break;
+        if ((req->bmRequestType & dev->user_control[i].type_mask) != dev->user_control[i].type)
+            continue;
+
+        result = dev->user_control[i].cb(dev, req, buf, len, complete);
+        if (result == USBD_REQ_HANDLED || result == USBD_REQ_NOTSUPP)
+            return result;
+    }
+    return standard_request(dev, req, buf, len);
+}
+
+static void control_transfer(usbd_device *dev)
+{
+    struct usb_setup_data req = dev->req;
+    usbd_control_complete_callback complete = NULL;
+    uint8_t *buf = dev->ctrl_buf;
+    uint16_t len = req.wLength;
+    bool in = req.bmRequestType & USB_REQ_TYPE_IN;
+
+    dev->ctrl_status = SIM_USB_STALL;
+    dev->ctrl_len = 0;
+
+    /* Data stage of an OUT request lands in the control buffer first */
+    if (!in && len > 0) {
+        if (len > dev->ctrl_buf_size)
+            return;
+        memcpy(dev->ctrl_buf, dev->ctrl_data, len);
+    }
+
+    if (dispatch(dev, &req, &buf, &len, &complete) != USBD_REQ_HANDLED)
+        return;
+
+    if (in) {
+        if (len > req.wLength)
+            len = req.wLength;
+        memcpy(dev->ctrl_data, buf, len);
+        dev->ctrl_len = len;
+    }
+    dev->ctrl_status = SIM_USB_ACK;
+
+    /* Status stage done */
+    if (complete)
+        complete(dev, &req);
+}
+
+void usbd_poll(usbd_device *usbd_dev)
+{
+    check(usbd_dev);
+
+    if (usbd_dev->connected) {
+        if (usbd_dev->setup_pending) {
+            usbd_dev->setup_pending = false;
+            control_transfer(usbd_dev);
+            usbd_dev->setup_done = true;
+        } else {
+            /* One RX FIFO entry */
+            for (int ep = 1; ep < SIM_USB_EPS; ep++) {
+                sim_ep_t *e = &usbd_dev->out[ep];
+
+                if (!e->full)
+                    continue;
+                usbd_dev->rx_ep = e;
+                usbd_dev->rx_off = 0;
+                if (e->cb)
+                    e->cb(usbd_dev, ep);
+                usbd_dev->rx_ep = NULL;
+                e->full = false;    /* whatever was not read is gone */
+                break;
+            }
+        }
+
+        for (int ep = 1; ep < SIM_USB_EPS; ep++) {
+            sim_ep_t *e = &usbd_dev->in[ep];
+
+            if (!e->done)
+                continue;
+            e->done = false;
+            if (e->cb)
+                e->cb(usbd_dev, ep);
+        }
+    }
+
+    sim_advance(sim_poll_cost_ns());
+}
+
+bool sim_usb_irq_pending(void)
+{
+    if (!device_up || !device.connected)
+        return false;
+    if (device.setup_pending)
+        return true;
+    for (int ep = 1; ep < SIM_USB_EPS; ep++) {
+        if (device.out[ep].full || device.in[ep].done)
+            return true;
+    }
+    return false;
+}
+
+void sim_usb_reset(void)
+{
+    memset(&device, 0, sizeof(device));
+    device_up = false;
+}
+
+/* -------------------------------------------------------------------------
+ * Host side
+ * ------------------------------------------------------------------------- */
+
+static bool control_done(void *arg)
+{
+    (void)arg;
+    return device.setup_done;
+}
+
+int sim_usb_host_control(const struct usb_setup_data *req, void *data, uint16_t *len)
+{
+    bool in = req->bmRequestType & USB_REQ_TYPE_IN;
+
+    if (!device_up || !device.connected)
+        return SIM_USB_TIMEOUT;
+    if (req->wLength > sizeof(device.ctrl_data))
+        sim_fatal("control transfer of %u bytes is too long", req->wLength);
+
+    device.req = *req;
+    if (!in && req->wLength > 0)
+        memcpy(device.ctrl_data, data, req->wLength);
+    device.setup_done = false;
+    device.setup_pending = true;
+
+    if (!sim_run_until(control_done, NULL, SIM_USB_CONTROL_TIMEOUT_NS)) {
+        device.setup_pending = false;
+        return SIM_USB_TIMEOUT;
+    }
+
+    if (device.ctrl_status == SIM_USB_ACK && in) {
+        memcpy(data, device.ctrl_data, device.ctrl_len);
+        *len = device.ctrl_len;
+    }
+    return device.ctrl_status;
+}
+
+int sim_usb_host_out(uint8_t ep, const void *buf, uint16_t len)
+{
+    sim_ep_t *e = &device.out[ep_index(ep)];
+
+    if (!device_up || !device.connected || !e->configured)
+        return SIM_USB_TIMEOUT;
+    if (e->stall)
+        return SIM_USB_STALL;
+    if (len > e->max)
+        sim_fatal("host OUT of %u bytes to a %u byte endpoint", len, e->max);
+    if (e->nak || e->full)
+        return SIM_USB_NAK;
+
+    memcpy(e->buf, buf, len);
+    e->len = len;
+    e->full = true;
+    return SIM_USB_ACK;
+}
+
+int sim_usb_host_in(uint8_t ep, void *buf, uint16_t maxlen, uint16_t *len)
+{
+    sim_ep_t *e = &device.in[ep_index(ep)];
+
+    if (!device_up || !device.connected || !e->configured)
+        return SIM_USB_TIMEOUT;
+    if (e->stall)
+        return SIM_USB_STALL;
+    if (!e->full)
+        return SIM_USB_NAK;
+    if (e->len > maxlen)
+        sim_fatal("host IN buffer of %u bytes for a %u byte packet", maxlen, e->len);
+
+    memcpy(buf, e->buf, e->len);
+    *len = e->len;
+    e->full = false;
+    e->done = true;
+    return SIM_USB_ACK;
+}
+
+bool sim_usb_configured(void)
+{
+    return device_up && device.current_config != 0;
+}
+
+int sim_usb_host_enumerate(void)
+{
+    uint8_t buf[1024];
+    struct usb_setup_data req;
+    uint16_t len;
+    int rc;
+
+    req = (struct usb_setup_data){ USB_REQ_TYPE_IN, USB_REQ_GET_DESCRIPTOR,
+                                   USB_DT_DEVICE << 8, 0, 64 };
+    len = req.wLength;
+    if ((rc = sim_usb_host_control(&req, buf, &len)) != SIM_USB_ACK)
+        return rc;
+
+    req = (struct usb_setup_data){ USB_REQ_TYPE_OUT, USB_REQ_SET_ADDRESS, 5, 0, 0 };
+    len = 0;
+    if ((rc = sim_usb_host_control(&req, NULL, &len)) != SIM_USB_ACK)
+        return rc;
+
+    req = (struct usb_setup_data){ USB_REQ_TYPE_IN, USB_REQ_GET_DESCRIPTOR,
+                                   USB_DT_CONFIGURATION << 8, 0, 9 };
+    len = req.wLength;
+    if ((rc = sim_usb_host_control(&req, buf, &len)) != SIM_USB_ACK)
+        return rc;
+
+    req.wLength = buf[2] | (buf[3] << 8);
+    len = req.wLength;
+    if ((rc = sim_usb_host_control(&req, buf, &len)) != SIM_USB_ACK)
+        return rc;
+
+    req = (struct usb_setup_data){ USB_REQ_TYPE_OUT, USB_REQ_SET_CONFIGURATION, 1, 0, 0 };
+    len = 0;
+    return sim_usb_host_control(&req, NULL, &len);
+}
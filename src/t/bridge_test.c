@@ -0,0 +1,1445 @@
+/*
+ * Whole bridge on the simulated HAL: main.c, usb_cdc.c, usart.c and
+ * usb_core.c unchanged, driven from the USB host and the USART line.
+ * Built once with USART DMA (default), once with -DUSE_USART_IRQ, both
+ * with RTS/CTS, and once with two CDC functions on a 6 endpoint core.
+ * Every build has the vendor interface.
+ */
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+
+#include <libopencm3/stm32/usart.h>
+#include <libopencm3/stm32/gpio.h>
+#include <libopencm3/usb/cdc.h>
+
+#include "sim.h"
+#include "usb_descriptors.h"
+#include "usb_cdc.h"
+#include "ft_frame.h"
+#include "capture.h"
+#include "usb_core.h"
+#include "usb_vendor.h"
+#include "usart.h"
+#include "cpu_stats.h"
+#include "ptt.h"
+#include "prbs.h"
+#include "sched.h"
+#include "prof.h"
+
+#define BRIDGE_USART USART2
+#define MS 1000000ULL
+
+static uint8_t rx[8192];
+static size_t rx_len;
+
+/* Collect everything the device sends on CDC IN, returns packets read */
+static int drain_in(void)
+{
+    uint16_t len;
+    int n = 0;
+
+    while (sim_usb_host_in(EP_CDC0_IN, &rx[rx_len], CDC_DATA_PACKET_SIZE, &len) == SIM_USB_ACK) {
+        assert(rx_len + len <= sizeof(rx));
+        rx_len += len;
+        n++;
+    }
+    return n;
+}
+
+static bool in_has(void *arg)
+{
+    drain_in();
+    return rx_len >= *(size_t *)arg;
+}
+
+/* Read CDC IN one packet at a time until it NAKs, keeping each length */
+static int read_packets(uint16_t *lens, int max)
+{
+    int n = 0;
+
+    while (sim_usb_host_in(EP_CDC0_IN, &rx[rx_len], CDC_DATA_PACKET_SIZE, &lens[n]) == SIM_USB_ACK) {
+        rx_len += lens[n];
+        assert(++n < max);
+        sim_run_for(20 * 1000);
+    }
+    return n;
+}
+
+/* Host polling CDC IN every 100 us for a while, keeping packet lengths and
+   when each came */
+static int poll_packets(uint16_t *lens, uint64_t *at, int max, uint64_t duration_ns)
+{
+    uint64_t end = sim_now_ns() + duration_ns;
+    int n = 0;
+
+    while (sim_now_ns() < end) {
+        sim_run_for(100 * 1000);
+        if (sim_usb_host_in(EP_CDC0_IN, &rx[rx_len], CDC_DATA_PACKET_SIZE, &lens[n]) == SIM_USB_ACK) {
+            rx_len += lens[n];
+            at[n] = sim_now_ns();
+            assert(++n < max);
+        }
+    }
+    return n;
+}
+
+#if USB_CDC_NUM > 1
+static uint8_t rx1[1024];
+static size_t rx1_len;
+
+static bool in1_has(void *arg)
+{
+    uint16_t len;
+
+    while (sim_usb_host_in(EP_CDC_IN(1), &rx1[rx1_len], CDC_DATA_PACKET_SIZE, &len) == SIM_USB_ACK) {
+        rx1_len += len;
+    }
+    drain_in();
+    return rx1_len >= *(size_t *)arg;
+}
+#endif
+
+static size_t line_len;
+static uint8_t line[8192];
+
+static bool line_has(void *arg)
+{
+    line_len += sim_usart_host_read(BRIDGE_USART, &line[line_len], sizeof(line) - line_len);
+    return line_len >= *(size_t *)arg;
+}
+
+static int control(uint8_t type, uint8_t request, uint16_t value, uint16_t index,
+                   void *data, uint16_t *len)
+{
+    struct usb_setup_data req = { type, request, value, index, *len };
+
+    return sim_usb_host_control(&req, data, len);
+}
+
+static void set_dtr(uint8_t n, bool on)
+{
+    uint16_t len = 0;
+
+    assert(control(USB_REQ_TYPE_CLASS | USB_REQ_TYPE_INTERFACE,
+                   USB_CDC_REQ_SET_CONTROL_LINE_STATE, on ? 3 : 0,
+                   IFACE_CDC_COMM(n), NULL, &len) == SIM_USB_ACK);
+}
+
+#define SERIAL_STATE_LEVELS 0x03    /* DCD, DSR */
+#define SERIAL_STATE_BREAK  0x04
+#define SERIAL_STATE_FRAMING 0x10
+#define SERIAL_STATE_PARITY 0x20
+#define SERIAL_STATE_OVERRUN 0x40
+
+/* Next SERIAL_STATE bitmap from function n, -1 if none is waiting */
+static int serial_state(uint8_t n)
+{
+    uint8_t notif[16];
+    uint16_t len;
+
+    if (sim_usb_host_in(EP_CDC_NOTIFY(n), notif, sizeof(notif), &len) != SIM_USB_ACK)
+        return -1;
+    assert(len == 10 && notif[0] == 0xa1 && notif[1] == USB_CDC_NOTIFY_SERIAL_STATE);
+    assert((notif[4] | notif[5] << 8) == IFACE_CDC_COMM(n) && notif[6] == 2);
+    return notif[8] | notif[9] << 8;
+}
+
+/* Next PTT notification from function n, false if none is waiting */
+static bool ptt_notify(uint8_t n, usb_cdc_ptt_event_t *ev)
+{
+    uint8_t notif[16];
+    uint16_t len;
+
+    if (sim_usb_host_in(EP_CDC_NOTIFY(n), notif, sizeof(notif), &len) != SIM_USB_ACK)
+        return false;
+    assert(len == 8 + sizeof(*ev) && notif[0] == 0xc1 && notif[1] == USB_CDC_NOTIFY_PTT);
+    assert((notif[4] | notif[5] << 8) == IFACE_CDC_COMM(n) && notif[6] == sizeof(*ev));
+    memcpy(ev, &notif[8], sizeof(*ev));
+    return true;
+}
+
+/* Poll for it the way a host would, every 10 us, for up to 10 ms */
+static bool ptt_wait(uint8_t n, usb_cdc_ptt_event_t *ev)
+{
+    for (int i = 0; i < 1000; i++) {
+        if (ptt_notify(n, ev))
+            return true;
+        sim_run_for(10000);
+    }
+    return false;
+}
+
+static void get_cpu_stats(cpu_stats_t *stats, bool reset)
+{
+    uint16_t len = sizeof(*stats);
+
+    assert(control(USB_REQ_TYPE_IN | USB_REQ_TYPE_VENDOR | USB_REQ_TYPE_DEVICE,
+                   USB_CORE_VENDOR_REQ_GET_CPU_STATS, reset, 0, stats, &len) == SIM_USB_ACK);
+    assert(len == sizeof(*stats));
+}
+
+static void set_line(uint32_t baud, uint8_t parity)
+{
+    struct usb_cdc_line_coding coding = { baud, USB_CDC_1_STOP_BITS, parity, 8 };
+    uint16_t len = sizeof(coding);
+
+    assert(control(USB_REQ_TYPE_CLASS | USB_REQ_TYPE_INTERFACE, USB_CDC_REQ_SET_LINE_CODING,
+                   0, IFACE_CDC0_COMM, &coding, &len) == SIM_USB_ACK);
+}
+
+static void set_rx_aggr(uint16_t bytes, uint32_t max_us, uint32_t gap_us)
+{
+    usb_cdc_rx_aggr_t aggr = { bytes, max_us, gap_us };
+    uint16_t len = sizeof(aggr);
+
+    assert(control(USB_REQ_TYPE_VENDOR | USB_REQ_TYPE_INTERFACE, USB_CDC_VENDOR_REQ_RX_AGGREGATION,
+                   0, IFACE_CDC0_COMM, &aggr, &len) == SIM_USB_ACK);
+}
+
+static void selftest(uint8_t mode)
+{
+    uint16_t len = 0;
+
+    assert(control(USB_REQ_TYPE_VENDOR | USB_REQ_TYPE_INTERFACE, USB_CDC_VENDOR_REQ_SELFTEST,
+                   mode, IFACE_CDC0_COMM, NULL, &len) == SIM_USB_ACK);
+}
+
+static void selftest_status(usb_cdc_selftest_status_t *st)
+{
+    uint16_t len = sizeof(*st);
+
+    assert(control(USB_REQ_TYPE_IN | USB_REQ_TYPE_VENDOR | USB_REQ_TYPE_INTERFACE,
+                   USB_CDC_VENDOR_REQ_SELFTEST, 0, IFACE_CDC0_COMM, st, &len) == SIM_USB_ACK);
+    assert(len == sizeof(*st));
+}
+
+#if USB_VENDOR
+/* A batch on the vendor interface, ended by a short packet or ZLP.  OUT
+   stays NAKed until the device has seen the last answer go */
+static void vendor_out(const uint8_t *cmd, uint16_t len)
+{
+    for (uint16_t off = 0, n = VENDOR_PACKET_SIZE; n == VENDOR_PACKET_SIZE; off += n) {
+        n = len - off < VENDOR_PACKET_SIZE ? len - off : VENDOR_PACKET_SIZE;
+        for (int tries = 0; sim_usb_host_out(EP_VENDOR_OUT, &cmd[off], n) != SIM_USB_ACK; tries++) {
+            assert(tries < 100);
+            sim_run_for(20 * 1000);
+        }
+    }
+}
+
+/* Its answer: IN packets up to the short one or ZLP that ends it */
+static uint16_t vendor_in(uint8_t *rsp, uint64_t timeout_ns)
+{
+    uint64_t end = sim_now_ns() + timeout_ns;
+    uint16_t total = 0, len = VENDOR_PACKET_SIZE;
+
+    while (len == VENDOR_PACKET_SIZE) {
+        while (sim_usb_host_in(EP_VENDOR_IN, &rsp[total], VENDOR_PACKET_SIZE, &len) != SIM_USB_ACK) {
+            assert(sim_now_ns() < end);
+            sim_run_for(100 * 1000);
+        }
+        total += len;
+        assert(total <= USB_VENDOR_BATCH_MAX);
+    }
+    return total;
+}
+#endif
+
+/*********************************************************************
+ *  Regression Tests
+ *********************************************************************/
+int main(void)
+{
+    static const uint32_t uid[3] = { 0x11223344, 0x55667788, 0x99aabbcc };
+    static uint8_t burst[16 * CDC_DATA_PACKET_SIZE];
+    uint8_t buf[512], pkt[CDC_DATA_PACKET_SIZE];
+    usb_cdc_line_status_t status;
+    uint16_t len;
+    size_t want;
+
+    sim_init();
+    sim_desig_set_unique_id(uid);
+#ifdef USE_USART_RTSCTS
+    /* Far ends ready, USART2's and USART1's */
+    sim_gpio_drive(GPIOA, GPIO4, false);
+    sim_gpio_drive(GPIOB, GPIO1, false);
+#endif
+    sim_start(sim_firmware_main);
+
+    /*************************************************************
+     * 1. Enumeration
+     *************************************************************/
+    len = 18;
+    assert(control(USB_REQ_TYPE_IN, USB_REQ_GET_DESCRIPTOR, USB_DT_DEVICE << 8, 0,
+                   buf, &len) == SIM_USB_ACK);
+    assert(len == 18 && buf[1] == USB_DT_DEVICE);
+    assert((buf[8] | buf[9] << 8) == 0x1209);
+
+    len = 255;
+    assert(control(USB_REQ_TYPE_IN, USB_REQ_GET_DESCRIPTOR, USB_DT_CONFIGURATION << 8, 0,
+                   buf, &len) == SIM_USB_ACK);
+    assert(len == (buf[2] | buf[3] << 8));
+    assert(buf[4] == IFACE_COUNT);
+    assert(buf[9 + 1] == USB_DT_INTERFACE_ASSOCIATION && buf[9 + 2] == IFACE_CDC0_COMM);
+
+    /* Serial number is the unique ID in hex, high word first */
+    len = 255;
+    assert(control(USB_REQ_TYPE_IN, USB_REQ_GET_DESCRIPTOR, (USB_DT_STRING << 8) | 3, 0x409,
+                   buf, &len) == SIM_USB_ACK);
+    assert(len == 2 + 2 * 24);
+    for (int i = 0; i < 24; i++)
+        assert(buf[2 + 2 * i] == "99AABBCC5566778811223344"[i]);
+
+    assert(sim_usb_host_enumerate() == SIM_USB_ACK);
+    assert(sim_usb_configured());
+
+    /*************************************************************
+     * 2. No DTR: USART data is dropped, not queued for later
+     *************************************************************/
+    sim_usart_host_write(BRIDGE_USART, "lost", 4);
+    sim_run_for(20 * MS);
+    drain_in();
+    assert(rx_len == 0);
+
+    /*************************************************************
+     * 3. USB OUT -> USART TX at line rate
+     *************************************************************/
+    set_dtr(0, true);
+    assert(serial_state(0) == SERIAL_STATE_LEVELS);
+    assert(serial_state(0) == -1);
+    for (int i = 0; i < CDC_DATA_PACKET_SIZE; i++)
+        pkt[i] = i;
+
+    uint64_t t0 = sim_now_ns();
+    assert(sim_usb_host_out(EP_CDC0_OUT, pkt, sizeof(pkt)) == SIM_USB_ACK);
+    want = sizeof(pkt);
+    assert(sim_run_until(line_has, &want, 100 * MS));
+    assert(line_len == sizeof(pkt) && memcmp(line, pkt, sizeof(pkt)) == 0);
+    assert(sim_now_ns() - t0 >= sizeof(pkt) * sim_usart_frame_ns(BRIDGE_USART));
+
+    /* More than the ring holds: OUT is NAKed while it is full and taken
+       again as soon as a packet fits, so the line never goes idle */
+    for (size_t i = 0; i < sizeof(burst); i++)
+        burst[i] = i * 7;
+    line_len = 0;
+    want = sizeof(burst);
+    t0 = sim_now_ns();
+    for (size_t off = 0; off < sizeof(burst); ) {
+        if (sim_usb_host_out(EP_CDC0_OUT, &burst[off], CDC_DATA_PACKET_SIZE) == SIM_USB_ACK)
+            off += CDC_DATA_PACKET_SIZE;
+        else
+            sim_run_for(50 * 1000);
+        line_has(&want);
+    }
+    assert(sim_run_until(line_has, &want, 200 * MS));
+    assert(line_len == sizeof(burst) && memcmp(line, burst, sizeof(burst)) == 0);
+    assert(sim_now_ns() - t0 < (sizeof(burst) + 2) * sim_usart_frame_ns(BRIDGE_USART));
+
+    len = sizeof(status);
+    assert(control(USB_REQ_TYPE_IN | USB_REQ_TYPE_VENDOR | USB_REQ_TYPE_INTERFACE,
+                   USB_CDC_VENDOR_REQ_GET_LINE_STATUS, 0, IFACE_CDC0_COMM, &status, &len) == SIM_USB_ACK);
+    assert(status.out_holds > 0 && status.out_held_us > 0);
+
+    /*************************************************************
+     * 4. USART RX -> USB IN, short burst flushed without more data
+     *************************************************************/
+    assert(sim_usart_host_write(BRIDGE_USART, "hello", 5) == 5);
+    want = 5;
+    assert(sim_run_until(in_has, &want, 100 * MS));
+    assert(rx_len == 5 && memcmp(rx, "hello", 5) == 0);
+
+    /* More than a ring's worth, host reading as it goes */
+    for (size_t i = 0; i < 1000; i++)
+        buf[i % sizeof(buf)] = (uint8_t)(i * 7);
+    rx_len = 0;
+    for (size_t i = 0; i < 1000; i += sizeof(buf))
+        sim_usart_host_write(BRIDGE_USART, buf, 1000 - i < sizeof(buf) ? 1000 - i : sizeof(buf));
+    want = 1000;
+    assert(sim_run_until(in_has, &want, 1000 * MS));
+    assert(rx_len == 1000);
+    for (size_t i = 0; i < 1000; i++)
+        assert(rx[i] == (uint8_t)(i * 7));
+    assert(sim_usart_overruns(BRIDGE_USART) == 0);
+
+    /*************************************************************
+     * 5. Loopback through both directions, paced by the echo
+     *************************************************************/
+    sim_usart_connect(BRIDGE_USART, BRIDGE_USART);
+    rx_len = 0;
+    for (int round = 0; round < 16; round++) {
+        for (int i = 0; i < CDC_DATA_PACKET_SIZE; i++)
+            pkt[i] = round * 16 + i;
+        assert(sim_usb_host_out(EP_CDC0_OUT, pkt, sizeof(pkt)) == SIM_USB_ACK);
+        want = (round + 1) * sizeof(pkt);
+        assert(sim_run_until(in_has, &want, 100 * MS));
+    }
+    assert(rx_len == 16 * sizeof(pkt));
+    for (size_t i = 0; i < rx_len; i++)
+        assert(rx[i] == (uint8_t)((i / 64) * 16 + i % 64));
+
+    /*************************************************************
+     * 6. Line coding reaches the USART
+     *************************************************************/
+    struct usb_cdc_line_coding coding;
+
+    len = sizeof(coding);
+    assert(control(USB_REQ_TYPE_IN | USB_REQ_TYPE_CLASS | USB_REQ_TYPE_INTERFACE,
+                   USB_CDC_REQ_GET_LINE_CODING, 0, IFACE_CDC0_COMM, &coding, &len) == SIM_USB_ACK);
+    assert(len == 7 && coding.dwDTERate == 19200 && coding.bDataBits == 8 &&
+           coding.bParityType == USB_CDC_NO_PARITY && coding.bCharFormat == USB_CDC_1_STOP_BITS);
+
+    /* Mark parity and a rate beyond the divider are refused, setting kept */
+    coding.bParityType = USB_CDC_MARK_PARITY;
+    len = sizeof(coding);
+    assert(control(USB_REQ_TYPE_CLASS | USB_REQ_TYPE_INTERFACE, USB_CDC_REQ_SET_LINE_CODING,
+                   0, IFACE_CDC0_COMM, &coding, &len) == SIM_USB_STALL);
+    coding.bParityType = USB_CDC_NO_PARITY;
+    coding.dwDTERate = 10000000;
+    len = sizeof(coding);
+    assert(control(USB_REQ_TYPE_CLASS | USB_REQ_TYPE_INTERFACE, USB_CDC_REQ_SET_LINE_CODING,
+                   0, IFACE_CDC0_COMM, &coding, &len) == SIM_USB_STALL);
+
+    /* 115200 8E1: APB1 48 MHz / 417 */
+    coding.dwDTERate = 115200;
+    coding.bParityType = USB_CDC_EVEN_PARITY;
+    len = sizeof(coding);
+    assert(control(USB_REQ_TYPE_CLASS | USB_REQ_TYPE_INTERFACE, USB_CDC_REQ_SET_LINE_CODING,
+                   0, IFACE_CDC0_COMM, &coding, &len) == SIM_USB_ACK);
+    memset(&coding, 0, sizeof(coding));
+    len = sizeof(coding);
+    assert(control(USB_REQ_TYPE_IN | USB_REQ_TYPE_CLASS | USB_REQ_TYPE_INTERFACE,
+                   USB_CDC_REQ_GET_LINE_CODING, 0, IFACE_CDC0_COMM, &coding, &len) == SIM_USB_ACK);
+    assert(coding.dwDTERate == 115200 && coding.bParityType == USB_CDC_EVEN_PARITY &&
+           coding.bDataBits == 8);
+
+    len = sizeof(status);
+    assert(control(USB_REQ_TYPE_IN | USB_REQ_TYPE_VENDOR | USB_REQ_TYPE_INTERFACE,
+                   USB_CDC_VENDOR_REQ_GET_LINE_STATUS, 0, IFACE_CDC0_COMM, &status, &len) == SIM_USB_ACK);
+    assert(len == sizeof(status));
+    assert(status.baud == 115200 && status.baud_actual == 115108 && status.baud_error_ppm == -799);
+
+    /* 9 bit frame (8 data + parity) at the new rate, looped back */
+    assert(sim_usart_frame_ns(BRIDGE_USART) == 11 * (uint64_t)(417 * 1e9 / 48e6 + 0.5));
+    rx_len = 0;
+    t0 = sim_now_ns();
+    assert(sim_usb_host_out(EP_CDC0_OUT, pkt, sizeof(pkt)) == SIM_USB_ACK);
+    want = sizeof(pkt);
+    assert(sim_run_until(in_has, &want, 100 * MS));
+    assert(rx_len == sizeof(pkt) && memcmp(rx, pkt, sizeof(pkt)) == 0);
+    assert(sim_now_ns() - t0 < 10 * MS);
+
+    /* 4 Mbaud needs 8x oversampling: 48 MHz / 12 */
+    coding.dwDTERate = 4000000;
+    coding.bParityType = USB_CDC_NO_PARITY;
+    len = sizeof(coding);
+    assert(control(USB_REQ_TYPE_CLASS | USB_REQ_TYPE_INTERFACE, USB_CDC_REQ_SET_LINE_CODING,
+                   0, IFACE_CDC0_COMM, &coding, &len) == SIM_USB_ACK);
+    assert(USART_CR1(BRIDGE_USART) & USART_CR1_OVER8);
+    assert(USART_BRR(BRIDGE_USART) == 0x14);
+    len = sizeof(status);
+    assert(control(USB_REQ_TYPE_IN | USB_REQ_TYPE_VENDOR | USB_REQ_TYPE_INTERFACE,
+                   USB_CDC_VENDOR_REQ_GET_LINE_STATUS, 0, IFACE_CDC0_COMM, &status, &len) == SIM_USB_ACK);
+    assert(status.baud_actual == 4000000 && status.baud_error_ppm == 0);
+    rx_len = 0;
+    assert(sim_usb_host_out(EP_CDC0_OUT, pkt, sizeof(pkt)) == SIM_USB_ACK);
+    assert(sim_run_until(in_has, &want, 100 * MS));
+    assert(rx_len == sizeof(pkt) && memcmp(rx, pkt, sizeof(pkt)) == 0);
+
+    /*************************************************************
+     * 7. Line errors and breaks as SERIAL_STATE
+     *************************************************************/
+    sim_usart_connect(BRIDGE_USART, SIM_USART_HOST);
+    set_line(115200, USB_CDC_EVEN_PARITY);
+
+    /* Host 4% slow */
+    sim_usart_set_line_timing(BRIDGE_USART, 110592, 0);
+    sim_usart_host_write(BRIDGE_USART, "x", 1);
+    sim_run_for(5 * MS);
+    assert(serial_state(0) == (SERIAL_STATE_LEVELS | SERIAL_STATE_FRAMING));
+    assert(serial_state(0) == -1);
+    sim_usart_set_line_timing(BRIDGE_USART, 0, 0);
+
+    assert(sim_usart_host_write_parity_error(BRIDGE_USART, 'p'));
+    sim_run_for(5 * MS);
+    assert(serial_state(0) == (SERIAL_STATE_LEVELS | SERIAL_STATE_PARITY));
+
+    /* Events while the last notification is unread go in the next one */
+    assert(sim_usart_host_break(BRIDGE_USART));
+    sim_run_for(5 * MS);
+    assert(sim_usart_host_write_parity_error(BRIDGE_USART, 'q'));
+    sim_run_for(5 * MS);
+    assert(serial_state(0) == (SERIAL_STATE_LEVELS | SERIAL_STATE_BREAK));
+    sim_run_for(MS);
+    assert(serial_state(0) == (SERIAL_STATE_LEVELS | SERIAL_STATE_PARITY));
+    assert(serial_state(0) == -1);
+
+    /* Host not reading IN: the RX ring fills and data is lost */
+    memset(buf, 'o', sizeof(buf));
+    sim_usart_host_write(BRIDGE_USART, buf, sizeof(buf));
+    sim_run_for(100 * MS);
+    assert(serial_state(0) == (SERIAL_STATE_LEVELS | SERIAL_STATE_OVERRUN));
+    do {
+        sim_run_for(5 * MS);
+    } while (drain_in() > 0);
+    assert(rx_len < sizeof(buf));
+    assert(sim_usart_overruns(BRIDGE_USART) == 0);
+    /* Overruns after the first were merged into at most one more */
+    sim_run_for(MS);
+    int state = serial_state(0);
+    assert(state == -1 || state == (SERIAL_STATE_LEVELS | SERIAL_STATE_OVERRUN));
+    sim_run_for(MS);
+    assert(serial_state(0) == -1);
+
+    /* DMA may still hold part of the lapped data, a line change drops it */
+    set_line(115200, USB_CDC_EVEN_PARITY);
+
+#ifdef USE_USART_RTSCTS
+    /*************************************************************
+     * 8. RTS follows the RX ring, CTS gates TX
+     *************************************************************/
+    assert(!(sim_gpio_output(GPIOA) & GPIO1));
+
+    /* IN not read: RTS goes up before the ring is full */
+    for (int i = 0; i < 200; i++)
+        buf[i] = i;
+    rx_len = 0;
+    sim_usart_host_write(BRIDGE_USART, buf, 200);
+    sim_run_for(50 * MS);
+    assert(sim_gpio_output(GPIOA) & GPIO1);
+    want = 200;
+    assert(sim_run_until(in_has, &want, 100 * MS));
+    assert(rx_len == 200 && memcmp(rx, buf, 200) == 0);
+    assert(!(sim_gpio_output(GPIOA) & GPIO1));
+    assert(serial_state(0) == -1);
+
+    /* Nothing is sent while CTS is deasserted */
+    sim_gpio_drive(GPIOA, GPIO4, true);
+    line_len = 0;
+    assert(sim_usb_host_out(EP_CDC0_OUT, pkt, sizeof(pkt)) == SIM_USB_ACK);
+    sim_run_for(20 * MS);
+    assert(sim_usart_host_read(BRIDGE_USART, line, sizeof(line)) == 0);
+    sim_gpio_drive(GPIOA, GPIO4, false);
+    want = sizeof(pkt);
+    assert(sim_run_until(line_has, &want, 100 * MS));
+    assert(line_len == sizeof(pkt) && memcmp(line, pkt, sizeof(pkt)) == 0);
+
+    /* Deasserted mid-packet: at most a burst goes after it */
+    line_len = 0;
+    assert(sim_usb_host_out(EP_CDC0_OUT, pkt, sizeof(pkt)) == SIM_USB_ACK);
+    sim_run_for(5 * sim_usart_frame_ns(BRIDGE_USART));
+    sim_gpio_drive(GPIOA, GPIO4, true);
+    sim_run_for(20 * MS);
+    line_len = sim_usart_host_read(BRIDGE_USART, line, sizeof(line));
+    assert(line_len > 0 && line_len <= 5 + USART_CTS_BURST + 2);
+    sim_gpio_drive(GPIOA, GPIO4, false);
+    assert(sim_run_until(line_has, &want, 100 * MS));
+    assert(line_len == sizeof(pkt) && memcmp(line, pkt, sizeof(pkt)) == 0);
+#endif
+
+    /*************************************************************
+     * 9. Main loop sleeps, USB runs from its interrupt
+     *************************************************************/
+    cpu_stats_t stats;
+
+    get_cpu_stats(&stats, true);
+    sim_run_for(100 * MS);
+    get_cpu_stats(&stats, false);
+    assert(stats.cpu_hz == 96000000);
+    assert(stats.cycles >= 9600000 && stats.cycles < 9700000);
+    assert(stats.idle_cycles > stats.cycles / 100 * 99);
+
+    /* Loopback traffic: each USB event is one interrupt of one poll */
+    sim_usart_connect(BRIDGE_USART, BRIDGE_USART);
+    get_cpu_stats(&stats, true);
+    rx_len = 0;
+    assert(sim_usb_host_out(EP_CDC0_OUT, pkt, sizeof(pkt)) == SIM_USB_ACK);
+    want = sizeof(pkt);
+    assert(sim_run_until(in_has, &want, 100 * MS));
+    get_cpu_stats(&stats, false);
+    assert(stats.usb_irqs >= 2);
+    assert(stats.usb_max_cycles >= 96 && stats.usb_max_cycles < 96 * 10);
+    assert(stats.usb_cycles <= stats.cycles - stats.idle_cycles);
+
+    /* PTT: an edge goes to the host at once, timestamped, with the LED
+       following it; bounces after it wait out the debounce */
+    usb_cdc_ptt_event_t press, release;
+    usb_cdc_ptt_status_t ptt_status;
+    uint64_t bounce = 200000;       // ns
+
+    assert(!ptt_notify(0, &press));
+    sim_gpio_drive(GPIOA, GPIO0, false);
+    assert(ptt_wait(0, &press));
+    assert(press.active == 1 && press.seq == 1);
+    assert(!(sim_gpio_output(GPIOC) & GPIO13));
+
+    for (int i = 0; i < 3; i++) {
+        sim_gpio_drive(GPIOA, GPIO0, true);
+        sim_run_for(bounce);
+        sim_gpio_drive(GPIOA, GPIO0, false);
+        sim_run_for(bounce);
+    }
+    sim_gpio_drive(GPIOA, GPIO0, true);
+    sim_run_for(MS);
+    assert(!ptt_notify(0, &release));
+    assert(!(sim_gpio_output(GPIOC) & GPIO13));
+
+    /* It settled released: that is reported when the debounce ends */
+    assert(ptt_wait(0, &release));
+    assert(release.active == 0 && release.seq == 2);
+    assert(release.time_us - press.time_us >= PTT_DEBOUNCE_US);
+    assert(sim_gpio_output(GPIOC) & GPIO13);
+
+    /* The latency is counted when the device sees the transfer done */
+    sim_run_for(MS);
+    len = sizeof(ptt_status);
+    assert(control(USB_REQ_TYPE_IN | USB_REQ_TYPE_VENDOR | USB_REQ_TYPE_INTERFACE,
+                   USB_CDC_VENDOR_REQ_PTT_STATUS, 0, IFACE_CDC0_COMM, &ptt_status, &len) == SIM_USB_ACK);
+    assert(len == sizeof(ptt_status) && ptt_status.active == 0);
+    assert(ptt_status.events == 2 && ptt_status.replaced == 0);
+    assert(ptt_status.latency_max_us < 100 && ptt_status.latency_total_us < 200);
+
+    /* The LED is a main loop task that only the edges run, behind each
+       function's RX task */
+    sched_task_stats_t tasks[SCHED_TASKS_MAX];
+    sched_task_stats_t *led = &tasks[USB_CDC_NUM];
+
+    len = sizeof(tasks);
+    assert(control(USB_REQ_TYPE_IN | USB_REQ_TYPE_VENDOR | USB_REQ_TYPE_DEVICE,
+                   USB_CORE_VENDOR_REQ_GET_TASK_STATS, 1, 0, tasks, &len) == SIM_USB_ACK);
+    assert(len == (USB_CDC_NUM + 1) * sizeof(tasks[0]));
+    for (int i = 0; i < USB_CDC_NUM; i++) {
+        assert(tasks[i].id == 1 + i && tasks[i].prio == 2 && tasks[i].period_us == 0);
+    }
+    assert(led->id == 0 && led->period_us == 0);
+    assert(led->runs >= 2 && led->late == 0);
+    assert(led->latency_max_cycles < 96 * 10);
+    /* Plain bridged RX is no work for the RX task */
+    rx_len = 0;
+    sim_usart_host_write(BRIDGE_USART, "idle", 4);
+    want = 4;
+    assert(sim_run_until(in_has, &want, 100 * MS));
+    sim_run_for(100 * MS);
+    len = sizeof(tasks);
+    assert(control(USB_REQ_TYPE_IN | USB_REQ_TYPE_VENDOR | USB_REQ_TYPE_DEVICE,
+                   USB_CORE_VENDOR_REQ_GET_TASK_STATS, 0, 0, tasks, &len) == SIM_USB_ACK);
+    assert(led->runs == 0 && tasks[0].runs == 0);
+    assert(sim_gpio_output(GPIOC) & GPIO13);
+    sim_run_for(PTT_DEBOUNCE_US * 1000ULL);
+
+    /*************************************************************
+     * 10. IN transfers: full packets across the ring wrap, then a ZLP
+     *************************************************************/
+    uint16_t lens[16];
+    int npkt;
+
+    for (int i = 0; i < 200; i++)
+        buf[i] = 0x80 + i;
+    sim_usart_connect(BRIDGE_USART, SIM_USART_HOST);
+    set_line(115200, USB_CDC_EVEN_PARITY);     /* rings restart at 0 */
+    rx_len = 0;
+    sim_usart_host_write(BRIDGE_USART, buf, 150);
+    want = 150;
+    assert(sim_run_until(in_has, &want, 100 * MS));
+
+    /* IN not read while 200 bytes arrive, so the ring holds them across its
+       end.  Only the packet taken on arrival and the last may be short */
+    rx_len = 0;
+    sim_usart_host_write(BRIDGE_USART, buf, 200);
+    sim_run_for(50 * MS);
+    npkt = read_packets(lens, 16);
+    assert(rx_len == 200 && memcmp(rx, buf, 200) == 0);
+    for (int i = 1; i < npkt - 1; i++)
+        assert(lens[i] == CDC_DATA_PACKET_SIZE);
+    assert(lens[npkt - 1] > 0 && lens[npkt - 1] < CDC_DATA_PACKET_SIZE);
+
+    /* Ending on a full packet: a ZLP closes the transfer, then NAK.  The
+       ring is at 94; DMA sends at the half-buffer flush, 34 bytes in, and
+       the interrupt path sends the first byte alone */
+#ifdef USE_USART_IRQ
+    want = 1 + 2 * CDC_DATA_PACKET_SIZE;
+#else
+    want = 34 + 2 * CDC_DATA_PACKET_SIZE;
+#endif
+    rx_len = 0;
+    sim_usart_host_write(BRIDGE_USART, buf, want);
+    sim_run_for(50 * MS);
+    npkt = read_packets(lens, 16);
+    assert(rx_len == want && memcmp(rx, buf, want) == 0);
+    assert(npkt == 4 && lens[2] == CDC_DATA_PACKET_SIZE && lens[3] == 0);
+    sim_run_for(MS);
+    assert(sim_usb_host_in(EP_CDC0_IN, rx, sizeof(rx), &len) == SIM_USB_NAK);
+
+    /*************************************************************
+     * 11. RX aggregation: packets held for a count, an age or a gap
+     *************************************************************/
+    usb_cdc_rx_aggr_t aggr;
+    uint64_t at[16], frame = sim_usart_frame_ns(BRIDGE_USART);
+
+    set_rx_aggr(32, 20000, 2000);
+    len = sizeof(aggr);
+    assert(control(USB_REQ_TYPE_IN | USB_REQ_TYPE_VENDOR | USB_REQ_TYPE_INTERFACE,
+                   USB_CDC_VENDOR_REQ_RX_AGGREGATION, 0, IFACE_CDC0_COMM, &aggr, &len) == SIM_USB_ACK);
+    assert(len == sizeof(aggr) && aggr.bytes == 32 && aggr.max_us == 20000 && aggr.gap_us == 2000);
+
+    /* A short burst goes as one packet, once the line has been quiet for
+       the gap */
+    rx_len = 0;
+    t0 = sim_now_ns();
+    sim_usart_host_write(BRIDGE_USART, buf, 10);
+    npkt = poll_packets(lens, at, 16, 10 * frame + 5 * MS);
+    assert(npkt == 1 && lens[0] == 10 && memcmp(rx, buf, 10) == 0);
+    assert(at[0] - t0 >= 10 * frame + 2 * MS && at[0] - t0 < 10 * frame + 3 * MS);
+
+    /* A stream goes in packets of at least the count, the tail after the gap */
+    rx_len = 0;
+    sim_usart_host_write(BRIDGE_USART, buf, 100);
+    npkt = poll_packets(lens, at, 16, 100 * frame + 5 * MS);
+    assert(rx_len == 100 && memcmp(rx, buf, 100) == 0);
+    assert(npkt <= 4);
+    for (int i = 0; i < npkt - 1; i++)
+        assert(lens[i] >= 32);
+
+    /* No gap timer: the first byte waits at most max_us */
+    set_rx_aggr(0, 3000, 0);
+    rx_len = 0;
+    t0 = sim_now_ns();
+    sim_usart_host_write(BRIDGE_USART, buf, 60);
+    npkt = poll_packets(lens, at, 16, 60 * frame + 5 * MS);
+    assert(rx_len == 60 && memcmp(rx, buf, 60) == 0);
+    assert(npkt <= 2 && at[0] - t0 >= 3 * MS);
+
+    /* Off again: a byte goes as soon as it is in */
+    set_rx_aggr(0, 0, 0);
+    rx_len = 0;
+    t0 = sim_now_ns();
+    sim_usart_host_write(BRIDGE_USART, buf, 1);
+    npkt = poll_packets(lens, at, 16, 2 * MS);
+    assert(npkt == 1 && lens[0] == 1 && at[0] - t0 < frame + 300 * 1000);
+
+    /*************************************************************
+     * 12. Retention: RX kept while DTR is low, oldest dropped first
+     *************************************************************/
+    uint16_t depth;
+
+    len = 0;
+    assert(control(USB_REQ_TYPE_VENDOR | USB_REQ_TYPE_INTERFACE, USB_CDC_VENDOR_REQ_RX_RETENTION,
+                   100, IFACE_CDC0_COMM, NULL, &len) == SIM_USB_ACK);
+    set_dtr(0, false);
+    for (int i = 0; i < 150; i++)
+        buf[i] = i;
+    sim_usart_host_write(BRIDGE_USART, buf, 150);
+    sim_run_for(150 * frame + 5 * MS);
+    rx_len = 0;
+    drain_in();
+    assert(rx_len == 0);
+
+    len = sizeof(status);
+    assert(control(USB_REQ_TYPE_IN | USB_REQ_TYPE_VENDOR | USB_REQ_TYPE_INTERFACE,
+                   USB_CDC_VENDOR_REQ_GET_LINE_STATUS, 0, IFACE_CDC0_COMM, &status, &len) == SIM_USB_ACK);
+    assert(status.rx_retained == 100 && status.rx_dropped == 50);
+
+    /* Reopening delivers the newest 100 */
+    set_dtr(0, true);
+    want = 100;
+    assert(sim_run_until(in_has, &want, 100 * MS));
+    assert(rx_len == 100 && memcmp(rx, &buf[50], 100) == 0);
+    while (serial_state(0) != -1)
+        ;
+
+    /* Depth 0 is flush on close again */
+    len = 0;
+    assert(control(USB_REQ_TYPE_VENDOR | USB_REQ_TYPE_INTERFACE, USB_CDC_VENDOR_REQ_RX_RETENTION,
+                   0, IFACE_CDC0_COMM, NULL, &len) == SIM_USB_ACK);
+    len = sizeof(depth);
+    assert(control(USB_REQ_TYPE_IN | USB_REQ_TYPE_VENDOR | USB_REQ_TYPE_INTERFACE,
+                   USB_CDC_VENDOR_REQ_RX_RETENTION, 0, IFACE_CDC0_COMM, &depth, &len) == SIM_USB_ACK);
+    assert(len == sizeof(depth) && depth == 0);
+    set_dtr(0, false);
+    sim_usart_host_write(BRIDGE_USART, buf, 10);
+    sim_run_for(10 * frame + 5 * MS);
+    set_dtr(0, true);
+    sim_run_for(20 * MS);
+    rx_len = 0;
+    drain_in();
+    assert(rx_len == 0);
+    while (serial_state(0) != -1)
+        ;
+
+    /*************************************************************
+     * 13. Frames only: noise and bad frames stay on the device
+     *************************************************************/
+    const ft_frame_t frame_in = { 3, { 1, 2, 3 } };
+    uint8_t good[FT_FRAME_OVERHEAD + FT_FRAME_PAYLOAD_MAX];
+    uint16_t good_len = ft_frame_encode(&frame_in, good);
+    ft_frame_stats_t fstats;
+    size_t off = 0;
+
+    len = 0;
+    assert(control(USB_REQ_TYPE_VENDOR | USB_REQ_TYPE_INTERFACE, USB_CDC_VENDOR_REQ_RX_FRAMES,
+                   1, IFACE_CDC0_COMM, NULL, &len) == SIM_USB_ACK);
+    memcpy(&buf[off], "noise", 5);
+    off += 5;
+    memcpy(&buf[off], good, good_len);
+    off += good_len;
+    memcpy(&buf[off], good, good_len);
+    buf[off + good_len - 1] ^= 0xff;
+    off += good_len;
+    memcpy(&buf[off], "xx", 2);
+    off += 2;
+    memcpy(&buf[off], good, good_len);
+    off += good_len;
+
+    rx_len = 0;
+    sim_usart_host_write(BRIDGE_USART, buf, off);
+    sim_run_for(off * frame + 5 * MS);
+    do {
+        sim_run_for(MS);
+    } while (drain_in() > 0);
+    assert(rx_len == 2u * good_len);
+    assert(memcmp(rx, good, good_len) == 0 && memcmp(&rx[good_len], good, good_len) == 0);
+
+    len = sizeof(fstats);
+    assert(control(USB_REQ_TYPE_IN | USB_REQ_TYPE_VENDOR | USB_REQ_TYPE_INTERFACE,
+                   USB_CDC_VENDOR_REQ_RX_FRAMES, 0, IFACE_CDC0_COMM, &fstats, &len) == SIM_USB_ACK);
+    assert(len == sizeof(fstats) && fstats.frames == 2 && fstats.bad_sum == 1 && fstats.noise >= 7);
+
+    /* Back to every byte */
+    len = 0;
+    assert(control(USB_REQ_TYPE_VENDOR | USB_REQ_TYPE_INTERFACE, USB_CDC_VENDOR_REQ_RX_FRAMES,
+                   0, IFACE_CDC0_COMM, NULL, &len) == SIM_USB_ACK);
+    rx_len = 0;
+    sim_usart_host_write(BRIDGE_USART, "raw", 3);
+    want = 3;
+    assert(sim_run_until(in_has, &want, 100 * MS));
+    assert(rx_len == 3 && memcmp(rx, "raw", 3) == 0);
+
+    /*************************************************************
+     * 14. Change-only frames: repeats stay on the device, the
+     *     whole state comes back on request and as a keyframe
+     *************************************************************/
+    const ft_frame_t disp_a = { 3, { 0x10, 'A', 'B' } };
+    const ft_frame_t disp_a2 = { 3, { 0x10, 'A', 'C' } };
+    const ft_frame_t disp_b = { 2, { 0x20, 1 } };
+    const ft_frame_t *feed[] = { &disp_a, &disp_a, &disp_b, &disp_a, &disp_b, &disp_a2, &disp_a2 };
+    uint8_t expect[4 * (FT_FRAME_OVERHEAD + FT_FRAME_PAYLOAD_MAX)];
+    size_t expect_len = 0;
+    ft_delta_stats_t dstats;
+
+    len = 0;
+    assert(control(USB_REQ_TYPE_VENDOR | USB_REQ_TYPE_INTERFACE, USB_CDC_VENDOR_REQ_RX_FRAMES,
+                   1, IFACE_CDC0_COMM, NULL, &len) == SIM_USB_ACK);
+    assert(control(USB_REQ_TYPE_VENDOR | USB_REQ_TYPE_INTERFACE, USB_CDC_VENDOR_REQ_RX_DELTA,
+                   1000, IFACE_CDC0_COMM, NULL, &len) == SIM_USB_ACK);
+    off = 0;
+    for (size_t i = 0; i < sizeof(feed) / sizeof(feed[0]); i++) {
+        off += ft_frame_encode(feed[i], &buf[off]);
+    }
+    expect_len += ft_frame_encode(&disp_a, &expect[expect_len]);
+    expect_len += ft_frame_encode(&disp_b, &expect[expect_len]);
+    expect_len += ft_frame_encode(&disp_a2, &expect[expect_len]);
+
+    rx_len = 0;
+    sim_usart_host_write(BRIDGE_USART, buf, off);
+    sim_run_for(off * frame + 5 * MS);
+    do {
+        sim_run_for(MS);
+    } while (drain_in() > 0);
+    assert(rx_len == expect_len && memcmp(rx, expect, expect_len) == 0);
+
+    len = sizeof(dstats);
+    assert(control(USB_REQ_TYPE_IN | USB_REQ_TYPE_VENDOR | USB_REQ_TYPE_INTERFACE,
+                   USB_CDC_VENDOR_REQ_RX_DELTA, 0, IFACE_CDC0_COMM, &dstats, &len) == SIM_USB_ACK);
+    assert(len == sizeof(dstats) && dstats.passed == 3 && dstats.suppressed == 4);
+
+    /* Refresh: the last of each type, now */
+    expect_len = 0;
+    expect_len += ft_frame_encode(&disp_a2, &expect[expect_len]);
+    expect_len += ft_frame_encode(&disp_b, &expect[expect_len]);
+    rx_len = 0;
+    len = 0;
+    assert(control(USB_REQ_TYPE_VENDOR | USB_REQ_TYPE_INTERFACE, USB_CDC_VENDOR_REQ_RX_REFRESH,
+                   0, IFACE_CDC0_COMM, NULL, &len) == SIM_USB_ACK);
+    want = expect_len;
+    assert(sim_run_until(in_has, &want, 100 * MS));
+    assert(rx_len == expect_len && memcmp(rx, expect, expect_len) == 0);
+
+    /* Nothing more until the keyframe, a period after the refresh */
+    rx_len = 0;
+    sim_run_for(900 * MS);
+    drain_in();
+    assert(rx_len == 0);
+    assert(sim_run_until(in_has, &want, 200 * MS));
+    assert(rx_len == expect_len && memcmp(rx, expect, expect_len) == 0);
+
+    /* Off: every frame again, then raw bytes */
+    len = 0;
+    assert(control(USB_REQ_TYPE_VENDOR | USB_REQ_TYPE_INTERFACE, USB_CDC_VENDOR_REQ_RX_DELTA,
+                   0, IFACE_CDC0_COMM, NULL, &len) == SIM_USB_ACK);
+    off = ft_frame_encode(&disp_b, buf);
+    off += ft_frame_encode(&disp_b, &buf[off]);
+    rx_len = 0;
+    sim_usart_host_write(BRIDGE_USART, buf, off);
+    want = off;
+    assert(sim_run_until(in_has, &want, 100 * MS));
+    assert(rx_len == off && memcmp(rx, buf, off) == 0);
+    assert(control(USB_REQ_TYPE_VENDOR | USB_REQ_TYPE_INTERFACE, USB_CDC_VENDOR_REQ_RX_FRAMES,
+                   0, IFACE_CDC0_COMM, NULL, &len) == SIM_USB_ACK);
+
+    /*************************************************************
+     * 15. Capture: both directions as timestamped records
+     *************************************************************/
+    uint8_t cap_rx[16], cap_tx[16];
+    size_t cap_rx_len = 0, cap_tx_len = 0;
+    uint32_t rx_first = 0, tx_first = 0, last_us = 0;
+    uint64_t gap = 20 * MS;
+
+    len = 0;
+    assert(control(USB_REQ_TYPE_VENDOR | USB_REQ_TYPE_INTERFACE, USB_CDC_VENDOR_REQ_CAPTURE,
+                   1, IFACE_CDC0_COMM, NULL, &len) == SIM_USB_ACK);
+    rx_len = 0;
+    sim_usart_host_write(BRIDGE_USART, "ping", 4);
+    sim_run_for(4 * frame + gap);
+    assert(sim_usb_host_out(EP_CDC0_OUT, "pong", 4) == SIM_USB_ACK);
+    line_len = 0;
+    want = 4;
+    assert(sim_run_until(line_has, &want, 100 * MS));
+    do {
+        sim_run_for(MS);
+    } while (drain_in() > 0);
+
+    for (size_t at_off = 0; at_off < rx_len; ) {
+        capture_hdr_t hdr;
+
+        assert(rx_len - at_off >= sizeof(hdr));
+        memcpy(&hdr, &rx[at_off], sizeof(hdr));
+        at_off += sizeof(hdr);
+        assert(hdr.len > 0 && hdr.len <= rx_len - at_off);
+        assert(!(hdr.flags & CAPTURE_LOST));
+        assert((int32_t)(hdr.time_us - last_us) >= 0 || last_us == 0);
+        last_us = hdr.time_us;
+        if (hdr.flags & CAPTURE_TX) {
+            tx_first = (cap_tx_len == 0) ? hdr.time_us : tx_first;
+            memcpy(&cap_tx[cap_tx_len], &rx[at_off], hdr.len);
+            cap_tx_len += hdr.len;
+        } else {
+            rx_first = (cap_rx_len == 0) ? hdr.time_us : rx_first;
+            memcpy(&cap_rx[cap_rx_len], &rx[at_off], hdr.len);
+            cap_rx_len += hdr.len;
+        }
+        at_off += hdr.len;
+    }
+    assert(cap_rx_len == 4 && memcmp(cap_rx, "ping", 4) == 0);
+    assert(cap_tx_len == 4 && memcmp(cap_tx, "pong", 4) == 0);
+
+    /* Device time from RX to TX is the gap and the rest of "ping": less
+       with DMA, where RX is stamped at the idle line after it */
+    uint32_t apart_us = tx_first - rx_first;
+    assert(apart_us >= (gap - 2 * frame) / 1000 && apart_us <= (gap + 3 * frame) / 1000 + 1000);
+
+    len = 0;
+    assert(control(USB_REQ_TYPE_VENDOR | USB_REQ_TYPE_INTERFACE, USB_CDC_VENDOR_REQ_CAPTURE,
+                   0, IFACE_CDC0_COMM, NULL, &len) == SIM_USB_ACK);
+    rx_len = 0;
+    sim_usart_host_write(BRIDGE_USART, "raw", 3);
+    want = 3;
+    assert(sim_run_until(in_has, &want, 100 * MS));
+    assert(rx_len == 3 && memcmp(rx, "raw", 3) == 0);
+
+    /*************************************************************
+     * 16. Self-test: PRBS out of the USART and back, then over USB
+     *************************************************************/
+    usb_cdc_selftest_status_t st, st2;
+    uint32_t line_rate = 1000000000ull / frame;
+
+    /* Jumper from TX to RX: every byte back intact, at line rate */
+    sim_usart_connect(BRIDGE_USART, BRIDGE_USART);
+    rx_len = 0;
+    selftest(USB_CDC_SELFTEST_USART_JUMPER);
+    assert(sim_usb_host_out(EP_CDC0_OUT, "dropped", 7) == SIM_USB_ACK);
+    sim_run_for(200 * MS);
+    selftest_status(&st);
+    assert(st.mode == USB_CDC_SELFTEST_USART_JUMPER && st.locked);
+    assert(st.bit_errors == 0 && st.resyncs == 0 && st.overruns == 0);
+    assert(st.rx_bytes > 0 && st.tx_bytes >= st.rx_bytes && st.tx_bytes - st.rx_bytes < 256);
+    assert(st.elapsed_us >= 200000 && st.elapsed_us < 201000);
+    assert(st.rx_bytes_per_s > line_rate * 95 / 100 && st.rx_bytes_per_s <= line_rate);
+    assert(st.rx_ring_hwm > 0 && st.tx_ring_lwm < 255);
+    assert(drain_in() == 0);
+
+    /* Stopped: the figures stay as they were */
+    selftest(USB_CDC_SELFTEST_STOP);
+    selftest_status(&st);
+    sim_run_for(50 * MS);
+    selftest_status(&st2);
+    assert(st.mode == USB_CDC_SELFTEST_STOP && memcmp(&st, &st2, sizeof(st)) == 0);
+    assert(st.rx_bytes_per_s > line_rate * 95 / 100);
+
+    /* Internal loopback: no jumper, the pattern still on the line.  Bytes
+       from outside are extra bytes to the checker */
+    sim_usart_connect(BRIDGE_USART, SIM_USART_HOST);
+    drain_in();
+    sim_usart_host_read(BRIDGE_USART, line, sizeof(line));
+    selftest(USB_CDC_SELFTEST_USART_LOOPBACK);
+    assert(USART_CR3(BRIDGE_USART) & USART_CR3_HDSEL);
+    line_len = 0;
+    for (int i = 0; i < 20; i++) {
+        sim_run_for(10 * MS);
+        line_len += sim_usart_host_read(BRIDGE_USART, line, sizeof(line));
+    }
+    selftest_status(&st);
+    assert(st.mode == USB_CDC_SELFTEST_USART_LOOPBACK && st.locked);
+    assert(st.bit_errors == 0 && st.resyncs == 0);
+    assert(st.rx_bytes_per_s > line_rate * 95 / 100);
+    assert(line_len >= st.rx_bytes);
+
+    sim_usart_host_write(BRIDGE_USART, "noise", 5);
+    for (int i = 0; i < 5; i++) {
+        sim_run_for(10 * MS);
+        sim_usart_host_read(BRIDGE_USART, line, sizeof(line));
+    }
+    selftest_status(&st);
+    assert(st.locked && st.resyncs + st.bit_errors > 0);
+
+    /* Switching straight to USB ends the loopback */
+    selftest(USB_CDC_SELFTEST_USB);
+    assert(!(USART_CR3(BRIDGE_USART) & USART_CR3_HDSEL));
+
+    /* USB: the host checks IN, the device OUT */
+    prbs_gen_t host_gen;
+    prbs_check_t host_check;
+    uint32_t out_bytes = 0;
+
+    prbs_init(&host_gen);
+    prbs_check_init(&host_check);
+    for (int i = 0; i < 50; i++) {
+        /* A ZLP may still close the last transfer before the test */
+        for (int j = 0; j < 4; ) {
+            if (sim_usb_host_in(EP_CDC0_IN, rx, CDC_DATA_PACKET_SIZE, &len) != SIM_USB_ACK) {
+                sim_run_for(10 * 1000);
+            } else if (len != 0) {
+                assert(len == CDC_DATA_PACKET_SIZE);
+                prbs_check(&host_check, rx, len);
+                j++;
+            } else {
+                assert(host_check.bytes == 0);
+            }
+        }
+        prbs_fill(&host_gen, pkt, sizeof(pkt));
+        if (i == 40) {
+            pkt[10] ^= 0x04;
+        }
+        assert(sim_usb_host_out(EP_CDC0_OUT, pkt, sizeof(pkt)) == SIM_USB_ACK);
+        out_bytes += sizeof(pkt);
+        sim_run_for(MS);
+        sim_usart_host_read(BRIDGE_USART, line, sizeof(line));
+    }
+    assert(host_check.locked && host_check.bit_errors == 0 && host_check.resyncs == 0);
+    selftest_status(&st);
+    assert(st.mode == USB_CDC_SELFTEST_USB && st.locked);
+    assert(st.rx_bytes == out_bytes && st.bit_errors == 1 && st.resyncs == 0);
+    assert(st.tx_bytes - host_check.bytes <= CDC_DATA_PACKET_SIZE);
+    assert(st.tx_bytes_per_s > 0 && st.rx_bytes_per_s > 0);
+
+    /* Back to bridging, once what was queued for the test has gone */
+    selftest(USB_CDC_SELFTEST_STOP);
+    sim_run_for(50 * MS);
+    drain_in();
+    sim_usart_host_read(BRIDGE_USART, line, sizeof(line));
+    rx_len = 0;
+    sim_usart_host_write(BRIDGE_USART, "raw", 3);
+    want = 3;
+    assert(sim_run_until(in_has, &want, 100 * MS));
+    assert(rx_len == 3 && memcmp(rx, "raw", 3) == 0);
+
+#if USB_VENDOR
+    /*************************************************************
+     * 17. Vendor interface: batched commands, one answer
+     *************************************************************/
+    static const uint8_t batch[] = {
+        USB_VENDOR_OP_SEND, 0, 3, 'A', 'T', '\r',
+        USB_VENDOR_OP_WAIT, 0, 5, 100, 0, 'O', 'K', '\r',
+        USB_VENDOR_OP_PTT, 0, 1, 1,
+        USB_VENDOR_OP_COUNTERS, USB_CDC_NUM, 0,
+        0x7f, 0, 0,
+    };
+    static const uint8_t answer[] = {
+        USB_VENDOR_OP_SEND, USB_VENDOR_OK, 0,
+        USB_VENDOR_OP_WAIT, USB_VENDOR_OK, 5, '\r', '\n', 'O', 'K', '\r',
+        USB_VENDOR_OP_PTT, USB_VENDOR_OK, 0,
+        USB_VENDOR_OP_COUNTERS, USB_VENDOR_BAD_PORT, 0,
+        0x7f, USB_VENDOR_BAD_OP, 0,
+    };
+    uint8_t rsp[USB_VENDOR_BATCH_MAX];
+    usart_counters_t counters;
+
+    /* SEND goes out, WAIT holds the batch until the reply's pattern, and
+       OUT is NAKed until the answer has been read */
+    line_len = 0;
+    vendor_out(batch, sizeof(batch));
+    want = 3;
+    assert(sim_run_until(line_has, &want, 100 * MS));
+    assert(line_len == 3 && memcmp(line, "AT\r", 3) == 0);
+    sim_run_for(10 * MS);
+    assert(sim_usb_host_in(EP_VENDOR_IN, rsp, sizeof(rsp), &len) == SIM_USB_NAK);
+    sim_usart_host_write(BRIDGE_USART, "\r\nOK\r\n", 6);
+    assert(vendor_in(rsp, 100 * MS) == sizeof(answer));
+    assert(memcmp(rsp, answer, sizeof(answer)) == 0);
+    assert(sim_usb_host_out(EP_VENDOR_OUT, batch, 1) == SIM_USB_NAK);
+
+    /* The host keys PTT on the open drain line the switch also pulls, and
+       the LED follows it through all that TX */
+    assert(!(sim_gpio_output(GPIOA) & GPIO0));
+    sim_run_for(10 * MS);
+    assert(!(sim_gpio_output(GPIOC) & GPIO13));
+
+    /* WAIT gives up at its timeout; the counters saw the traffic */
+    static const uint8_t timeout_batch[] = {
+        USB_VENDOR_OP_PTT, 0, 1, 0,
+        USB_VENDOR_OP_WAIT, 0, 3, 5, 0, '#',
+        USB_VENDOR_OP_COUNTERS, 0, 0,
+    };
+    uint64_t t1 = sim_now_ns();
+
+    vendor_out(timeout_batch, sizeof(timeout_batch));
+    assert(vendor_in(rsp, 100 * MS) == 3 + 3 + 3 + sizeof(counters));
+    assert(sim_now_ns() - t1 >= 5 * MS && sim_now_ns() - t1 < 7 * MS);
+    assert(rsp[4] == USB_VENDOR_TIMEOUT && rsp[5] == 0);
+    assert(rsp[6] == USB_VENDOR_OP_COUNTERS && rsp[7] == USB_VENDOR_OK && rsp[8] == sizeof(counters));
+    memcpy(&counters, &rsp[9], sizeof(counters));
+    assert(counters.tx_bytes >= 3 && counters.rx_bytes >= 6);
+    assert(sim_gpio_output(GPIOA) & GPIO0);
+
+    /* An answer of whole packets ends with a ZLP */
+    static const uint8_t full_batch[] = { USB_VENDOR_OP_WAIT, 0, 3, 100, 0, '!' };
+
+    vendor_out(full_batch, sizeof(full_batch));
+    sim_run_for(MS);
+    memset(buf, '.', VENDOR_PACKET_SIZE - 4);
+    buf[VENDOR_PACKET_SIZE - 4] = '!';
+    sim_usart_host_write(BRIDGE_USART, buf, VENDOR_PACKET_SIZE - 3);
+    assert(vendor_in(rsp, 100 * MS) == VENDOR_PACKET_SIZE);
+    assert(rsp[1] == USB_VENDOR_OK && rsp[2] == VENDOR_PACKET_SIZE - 3);
+    sim_run_for(MS);
+    assert(sim_usb_host_in(EP_VENDOR_IN, rsp, sizeof(rsp), &len) == SIM_USB_NAK);
+
+    /* A command cut short ends the batch */
+    static const uint8_t cut_batch[] = { USB_VENDOR_OP_SEND, 0, 10, 'x' };
+
+    vendor_out(cut_batch, sizeof(cut_batch));
+    assert(vendor_in(rsp, 100 * MS) == 3);
+    assert(rsp[0] == 0 && rsp[1] == USB_VENDOR_TRUNCATED && rsp[2] == 0);
+
+    /* CDC saw the same RX, a copy went to the batch */
+    rx_len = 0;
+    do {
+        sim_run_for(5 * MS);
+    } while (drain_in() > 0);
+    assert(rx_len == 6 + VENDOR_PACKET_SIZE - 3 && rx[rx_len - 1] == '!');
+    rx_len = 0;
+
+    /* A SEND that leaves no room for a packet holds CDC OUT too, so the
+       next OUT packet waits for the ring rather than being lost */
+    uint8_t send_batch[3 + 250];
+    int tries;
+
+    send_batch[0] = USB_VENDOR_OP_SEND;
+    send_batch[1] = 0;
+    send_batch[2] = 250;
+    for (int i = 0; i < 250; i++)
+        send_batch[3 + i] = 'a' + i % 26;
+    for (int i = 0; i < CDC_DATA_PACKET_SIZE; i++)
+        pkt[i] = 'A' + i % 26;
+    line_len = 0;
+    vendor_out(send_batch, sizeof(send_batch));
+    assert(vendor_in(rsp, 100 * MS) == 3);
+    assert(rsp[0] == USB_VENDOR_OP_SEND && rsp[1] == USB_VENDOR_OK);
+    assert(sim_usb_host_out(EP_CDC0_OUT, pkt, sizeof(pkt)) == SIM_USB_NAK);
+    for (tries = 0; sim_usb_host_out(EP_CDC0_OUT, pkt, sizeof(pkt)) != SIM_USB_ACK; tries++) {
+        assert(tries < 1000);
+        sim_run_for(MS);
+    }
+    want = 250 + sizeof(pkt);
+    assert(sim_run_until(line_has, &want, 500 * MS));
+    assert(line_len == want && memcmp(line, &send_batch[3], 250) == 0);
+    assert(memcmp(&line[250], pkt, sizeof(pkt)) == 0);
+    len = sizeof(status);
+    assert(control(USB_REQ_TYPE_IN | USB_REQ_TYPE_VENDOR | USB_REQ_TYPE_INTERFACE,
+                   USB_CDC_VENDOR_REQ_GET_LINE_STATUS, 0, IFACE_CDC0_COMM, &status, &len) == SIM_USB_ACK);
+    assert(len == sizeof(status) && status.out_dropped == 0);
+#endif
+
+#if USB_CDC_NUM > 1
+    /*************************************************************
+     * 18. Second function: USART1, own DTR, rings and line coding
+     *************************************************************/
+    sim_usart_connect(BRIDGE_USART, BRIDGE_USART);
+    sim_usart_connect(USART1, SIM_USART_HOST);
+    want = sizeof(pkt);
+
+    /* No DTR on CDC1 yet, its data is dropped while CDC0 carries on */
+    sim_usart_host_write(USART1, "lost", 4);
+    rx_len = 0;
+    assert(sim_usb_host_out(EP_CDC0_OUT, pkt, sizeof(pkt)) == SIM_USB_ACK);
+    assert(sim_run_until(in_has, &want, 100 * MS));
+    assert(rx_len == sizeof(pkt) && memcmp(rx, pkt, sizeof(pkt)) == 0);
+    sim_run_for(20 * MS);
+    assert(sim_usb_host_in(EP_CDC_IN(1), rx1, sizeof(rx1), &len) == SIM_USB_NAK);
+
+    set_dtr(1, true);
+    len = sizeof(coding);
+    assert(control(USB_REQ_TYPE_IN | USB_REQ_TYPE_CLASS | USB_REQ_TYPE_INTERFACE,
+                   USB_CDC_REQ_GET_LINE_CODING, 0, IFACE_CDC_COMM(1), &coding, &len) == SIM_USB_ACK);
+    assert(coding.dwDTERate == 19200);
+
+    /* Both directions of both functions at once */
+    rx_len = 0;
+    line_len = 0;
+    assert(sim_usart_host_write(USART1, "body", 4) == 4);
+    assert(sim_usb_host_out(EP_CDC0_OUT, pkt, sizeof(pkt)) == SIM_USB_ACK);
+    assert(sim_usb_host_out(EP_CDC_OUT(1), "head", 4) == SIM_USB_ACK);
+    want = 4;
+    assert(sim_run_until(in1_has, &want, 100 * MS));
+    assert(rx1_len == 4 && memcmp(rx1, "body", 4) == 0);
+    want = sizeof(pkt);
+    assert(sim_run_until(in_has, &want, 100 * MS));
+    assert(memcmp(rx, pkt, sizeof(pkt)) == 0);
+    for (int i = 0; i < 100 && line_len < 4; i++) {
+        sim_run_for(MS);
+        line_len += sim_usart_host_read(USART1, &line[line_len], sizeof(line) - line_len);
+    }
+    assert(line_len == 4 && memcmp(line, "head", 4) == 0);
+
+    /*************************************************************
+     * 19. Linked USARTs: inline between two devices, mirrored to
+     *     both functions, with injection between bursts
+     *************************************************************/
+    struct usb_cdc_line_coding coding1 = { 115200, USB_CDC_1_STOP_BITS, USB_CDC_EVEN_PARITY, 8 };
+    usb_cdc_link_status_t link;
+    static uint8_t line1[1024];
+    size_t line1_len = 0;
+
+    len = sizeof(coding1);
+    assert(control(USB_REQ_TYPE_CLASS | USB_REQ_TYPE_INTERFACE, USB_CDC_REQ_SET_LINE_CODING,
+                   0, IFACE_CDC_COMM(1), &coding1, &len) == SIM_USB_ACK);
+    sim_usart_connect(BRIDGE_USART, SIM_USART_HOST);
+    len = 0;
+    assert(control(USB_REQ_TYPE_VENDOR | USB_REQ_TYPE_INTERFACE, USB_CDC_VENDOR_REQ_LINK,
+                   1, IFACE_CDC_COMM(1), NULL, &len) == SIM_USB_ACK);
+
+    /* Each way, a character time and the interrupt behind the sender */
+    frame = sim_usart_frame_ns(BRIDGE_USART);
+    rx_len = 0;
+    rx1_len = 0;
+    t0 = sim_now_ns();
+    assert(sim_usart_host_write(BRIDGE_USART, buf, 100) == 100);
+    while (line1_len < 100) {
+        assert(sim_now_ns() - t0 < 102 * frame);
+        sim_run_for(frame / 4);
+        line1_len += sim_usart_host_read(USART1, &line1[line1_len], sizeof(line1) - line1_len);
+    }
+    assert(memcmp(line1, buf, 100) == 0);
+    assert(sim_usart_host_write(USART1, "body", 4) == 4);
+    line_len = 0;
+    want = 4;
+    assert(sim_run_until(line_has, &want, 100 * MS));
+    assert(line_len == 4 && memcmp(line, "body", 4) == 0);
+
+    /* Both still reach the host, each on its own function */
+    want = 100;
+    assert(sim_run_until(in_has, &want, 100 * MS));
+    assert(rx_len == 100 && memcmp(rx, buf, 100) == 0);
+    want = 4;
+    assert(sim_run_until(in1_has, &want, 100 * MS));
+    assert(rx1_len == 4 && memcmp(rx1, "body", 4) == 0);
+
+    len = sizeof(link);
+    assert(control(USB_REQ_TYPE_IN | USB_REQ_TYPE_VENDOR | USB_REQ_TYPE_INTERFACE,
+                   USB_CDC_VENDOR_REQ_LINK, 0, IFACE_CDC0_COMM, &link, &len) == SIM_USB_ACK);
+    assert(len == sizeof(link) && link.linked);
+    assert(link.out[1].bytes == 100 && link.out[0].bytes == 4);
+    assert(link.out[0].dropped == 0 && link.out[1].dropped == 0 && link.out[1].queued == 0);
+    assert(link.out[1].latency_max_ns < frame / 10 && link.out[0].latency_max_ns < frame / 10);
+
+    /* Injected on CDC1 during a burst into USART2: it waits for the gap */
+    line1_len = 0;
+    assert(sim_usart_host_write(BRIDGE_USART, buf, 50) == 50);
+    sim_run_for(10 * frame);
+    assert(sim_usb_host_out(EP_CDC_OUT(1), "INJ", 3) == SIM_USB_ACK);
+    for (int i = 0; i < 100 && line1_len < 53; i++) {
+        sim_run_for(MS);
+        line1_len += sim_usart_host_read(USART1, &line1[line1_len], sizeof(line1) - line1_len);
+    }
+    assert(line1_len == 53 && memcmp(line1, buf, 50) == 0 && memcmp(&line1[50], "INJ", 3) == 0);
+
+    /* Unlinked, back to two bridges on DMA */
+    len = 0;
+    assert(control(USB_REQ_TYPE_VENDOR | USB_REQ_TYPE_INTERFACE, USB_CDC_VENDOR_REQ_LINK,
+                   0, IFACE_CDC0_COMM, NULL, &len) == SIM_USB_ACK);
+    sim_run_for(10 * MS);
+    drain_in();
+    rx_len = 0;
+    assert(sim_usart_host_write(BRIDGE_USART, "solo", 4) == 4);
+    want = 4;
+    assert(sim_run_until(in_has, &want, 100 * MS));
+    assert(rx_len == 4 && memcmp(rx, "solo", 4) == 0);
+    assert(sim_usart_host_read(USART1, line1, sizeof(line1)) == 0);
+    assert(USART_CR3(BRIDGE_USART) & USART_CR3_DMAR);
+#else
+    /*************************************************************
+     * 19. Tap: USART1 as CDC0's peer, inline with USART2, both
+     *     directions as capture records, injection either way
+     *************************************************************/
+    usb_cdc_link_status_t link;
+    static uint8_t line1[256];
+    size_t line1_len = 0;
+    uint8_t tap[4][16];         // by CAPTURE_TX | CAPTURE_PEER
+    size_t tap_len[4] = { 0 };
+
+    set_line(115200, USB_CDC_EVEN_PARITY);      /* the peer follows */
+    sim_usart_connect(BRIDGE_USART, SIM_USART_HOST);
+    sim_usart_connect(USART1, SIM_USART_HOST);
+    len = 0;
+    assert(control(USB_REQ_TYPE_VENDOR | USB_REQ_TYPE_INTERFACE, USB_CDC_VENDOR_REQ_LINK,
+                   USB_CDC_LINK_INJECT, IFACE_CDC0_COMM, NULL, &len) == SIM_USB_ACK);
+
+    frame = sim_usart_frame_ns(BRIDGE_USART);
+    assert(sim_usart_frame_ns(USART1) > frame - frame / 100 &&
+           sim_usart_frame_ns(USART1) < frame + frame / 100);
+    rx_len = 0;
+    assert(sim_usart_host_write(BRIDGE_USART, "abc", 3) == 3);
+    for (int i = 0; i < 100 && line1_len < 3; i++) {
+        sim_run_for(frame);
+        line1_len += sim_usart_host_read(USART1, &line1[line1_len], sizeof(line1) - line1_len);
+    }
+    assert(line1_len == 3 && memcmp(line1, "abc", 3) == 0);
+    sim_run_for(4 * frame);
+    assert(sim_usart_host_write(USART1, "xyz", 3) == 3);
+    line_len = 0;
+    want = 3;
+    assert(sim_run_until(line_has, &want, 100 * MS));
+    assert(line_len == 3 && memcmp(line, "xyz", 3) == 0);
+    do {
+        sim_run_for(MS);
+    } while (drain_in() > 0);
+
+    for (size_t at_off = 0; at_off < rx_len; ) {
+        capture_hdr_t hdr;
+        uint8_t k;
+
+        memcpy(&hdr, &rx[at_off], sizeof(hdr));
+        at_off += sizeof(hdr);
+        assert(hdr.len > 0 && hdr.len <= rx_len - at_off && !(hdr.flags & CAPTURE_LOST));
+        k = ((hdr.flags & CAPTURE_TX) ? 1 : 0) | ((hdr.flags & CAPTURE_PEER) ? 2 : 0);
+        assert(tap_len[k] + hdr.len <= sizeof(tap[k]));
+        memcpy(&tap[k][tap_len[k]], &rx[at_off], hdr.len);
+        tap_len[k] += hdr.len;
+        at_off += hdr.len;
+    }
+    assert(tap_len[0] == 3 && memcmp(tap[0], "abc", 3) == 0);   /* USART2 RX */
+    assert(tap_len[3] == 3 && memcmp(tap[3], "abc", 3) == 0);   /* USART1 TX */
+    assert(tap_len[2] == 3 && memcmp(tap[2], "xyz", 3) == 0);   /* USART1 RX */
+    assert(tap_len[1] == 3 && memcmp(tap[1], "xyz", 3) == 0);   /* USART2 TX */
+
+    len = sizeof(link);
+    assert(control(USB_REQ_TYPE_IN | USB_REQ_TYPE_VENDOR | USB_REQ_TYPE_INTERFACE,
+                   USB_CDC_VENDOR_REQ_LINK, 0, IFACE_CDC0_COMM, &link, &len) == SIM_USB_ACK);
+    assert(len == sizeof(link) && link.linked == USB_CDC_LINK_INJECT);
+    assert(link.out[0].bytes == 3 && link.out[1].bytes == 3);
+    assert(link.out[0].dropped == 0 && link.out[1].dropped == 0);
+
+    /* OUT goes out of USART2, then of USART1 */
+    line_len = 0;
+    assert(sim_usb_host_out(EP_CDC0_OUT, "INJ", 3) == SIM_USB_ACK);
+    assert(sim_run_until(line_has, &want, 100 * MS));
+    assert(line_len == 3 && memcmp(line, "INJ", 3) == 0);
+    len = 0;
+    assert(control(USB_REQ_TYPE_VENDOR | USB_REQ_TYPE_INTERFACE, USB_CDC_VENDOR_REQ_LINK,
+                   USB_CDC_LINK_INJECT_PEER, IFACE_CDC0_COMM, NULL, &len) == SIM_USB_ACK);
+    line1_len = 0;
+    assert(sim_usb_host_out(EP_CDC0_OUT, "PEER", 4) == SIM_USB_ACK);
+    for (int i = 0; i < 100 && line1_len < 4; i++) {
+        sim_run_for(MS);
+        line1_len += sim_usart_host_read(USART1, &line1[line1_len], sizeof(line1) - line1_len);
+    }
+    assert(line1_len == 4 && memcmp(line1, "PEER", 4) == 0);
+    assert(sim_usart_host_read(BRIDGE_USART, line, sizeof(line)) == 0);
+
+    /* Unlinked: capture stops, USART1 RX goes nowhere, OUT is USART2's */
+    len = 0;
+    assert(control(USB_REQ_TYPE_VENDOR | USB_REQ_TYPE_INTERFACE, USB_CDC_VENDOR_REQ_LINK,
+                   USB_CDC_LINK_OFF, IFACE_CDC0_COMM, NULL, &len) == SIM_USB_ACK);
+    do {
+        sim_run_for(MS);
+    } while (drain_in() > 0);
+    rx_len = 0;
+    assert(sim_usart_host_write(USART1, "lost", 4) == 4);
+    sim_run_for(10 * MS);
+    assert(sim_usart_host_write(BRIDGE_USART, "solo", 4) == 4);
+    want = 4;
+    assert(sim_run_until(in_has, &want, 100 * MS));
+    sim_run_for(10 * MS);
+    drain_in();
+    assert(rx_len == 4 && memcmp(rx, "solo", 4) == 0);
+    line_len = 0;
+    assert(sim_usb_host_out(EP_CDC0_OUT, "back", 4) == SIM_USB_ACK);
+    assert(sim_run_until(line_has, &want, 100 * MS));
+    assert(line_len == 4 && memcmp(line, "back", 4) == 0);
+    assert(sim_usart_host_read(USART1, line1, sizeof(line1)) == 0);
+#endif
+
+    /*************************************************************
+     * 20. Profile: ISR and callback durations, timer latency
+     *************************************************************/
+    prof_point_t point;
+
+    len = sizeof(point);
+#if PROF
+    uint8_t probed[] = { PROF_USB_ISR, PROF_USART_ISR, PROF_TIMER_ISR,
+                         PROF_CDC_RX_NOTIFY, PROF_CDC_RX_DRAINED, PROF_USART_TX_NOTIFY };
+
+    for (unsigned i = 0; i < sizeof(probed); i++) {
+        uint32_t sum = 0;
+
+        len = sizeof(point);
+        assert(control(USB_REQ_TYPE_IN | USB_REQ_TYPE_VENDOR | USB_REQ_TYPE_DEVICE,
+                       USB_CORE_VENDOR_REQ_GET_PROFILE, 1, probed[i], &point, &len) == SIM_USB_ACK);
+        assert(len == sizeof(point) && point.duration.count > 0);
+        assert(point.duration.min_cycles <= point.duration.max_cycles);
+        assert(point.duration.total_cycles <= (uint64_t)point.duration.count * point.duration.max_cycles);
+        for (int b = 0; b < PROF_BUCKETS; b++)
+            sum += point.duration.hist[b];
+        assert(sum == point.duration.count);
+    }
+
+    /* Timers are entered within a few us of their compare; a cleared
+       point starts again, and only ISRs that ran count.  A 10 ms keyframe
+       period keeps one running */
+    len = 0;
+    assert(control(USB_REQ_TYPE_VENDOR | USB_REQ_TYPE_INTERFACE, USB_CDC_VENDOR_REQ_RX_DELTA,
+                   10, IFACE_CDC0_COMM, NULL, &len) == SIM_USB_ACK);
+    sim_run_for(100 * MS);
+    assert(control(USB_REQ_TYPE_VENDOR | USB_REQ_TYPE_INTERFACE, USB_CDC_VENDOR_REQ_RX_DELTA,
+                   0, IFACE_CDC0_COMM, NULL, &len) == SIM_USB_ACK);
+    len = sizeof(point);
+    assert(control(USB_REQ_TYPE_IN | USB_REQ_TYPE_VENDOR | USB_REQ_TYPE_DEVICE,
+                   USB_CORE_VENDOR_REQ_GET_PROFILE, 0, PROF_TIMER_ISR, &point, &len) == SIM_USB_ACK);
+    assert(point.duration.count >= 9 && point.latency.count >= 9);
+    assert(point.latency.count <= point.duration.count);
+    assert(point.latency.max_cycles < 96 * 20);
+    len = sizeof(point);
+    assert(control(USB_REQ_TYPE_IN | USB_REQ_TYPE_VENDOR | USB_REQ_TYPE_DEVICE,
+                   USB_CORE_VENDOR_REQ_GET_PROFILE, 0, PROF_USART_DMA_RX_ISR, &point, &len) == SIM_USB_ACK);
+    assert(point.duration.count == 0 && point.duration.min_cycles == 0);
+    len = sizeof(point);
+    assert(control(USB_REQ_TYPE_IN | USB_REQ_TYPE_VENDOR | USB_REQ_TYPE_DEVICE,
+                   USB_CORE_VENDOR_REQ_GET_PROFILE, 0, PROF_POINTS, &point, &len) == SIM_USB_STALL);
+#else
+    /* Built without it, there is nothing to read */
+    assert(control(USB_REQ_TYPE_IN | USB_REQ_TYPE_VENDOR | USB_REQ_TYPE_DEVICE,
+                   USB_CORE_VENDOR_REQ_GET_PROFILE, 0, PROF_USB_ISR, &point, &len) == SIM_USB_STALL);
+#endif
+
+    printf("ALL BRIDGE TESTS PASSED.\n");
+    return 0;
+}
@@ -0,0 +1,95 @@
+
+#include <stdio.h>
+#include <string.h>
+#include <stdbool.h>
+#include <assert.h>
+
+#include "../ft_delta.h"
+
+#define MAX_FRAMES 64
+
+static ft_frame_t got[MAX_FRAMES];
+static int ngot;
+
+static void frame_fn(void *ctx, const ft_frame_t *frame)
+{
+    (void)ctx;
+    assert(ngot < MAX_FRAMES);
+    got[ngot++] = *frame;
+}
+
+static bool same(const ft_frame_t *a, const ft_frame_t *b)
+{
+    return a->len == b->len && memcmp(a->payload, b->payload, a->len) == 0;
+}
+
+/*********************************************************************
+ *  Regression Tests
+ *********************************************************************/
+int main(void)
+{
+    ft_delta_t d;
+    const ft_frame_t a = { 3, { 0x10, 'A', 'B' } };
+    const ft_frame_t a2 = { 3, { 0x10, 'A', 'C' } };
+    const ft_frame_t a3 = { 2, { 0x10, 'A' } };
+    const ft_frame_t b = { 2, { 0x20, 1 } };
+
+    /*************************************************************
+     * 1. First of a type passes, repeats don't, changes do
+     *************************************************************/
+    ft_delta_init(&d);
+    assert(ft_delta_changed(&d, &a));
+    assert(!ft_delta_changed(&d, &a));
+    assert(ft_delta_changed(&d, &b));
+    assert(!ft_delta_changed(&d, &a));
+    assert(!ft_delta_changed(&d, &b));
+    assert(ft_delta_changed(&d, &a2));
+    assert(!ft_delta_changed(&d, &a2));
+    assert(ft_delta_changed(&d, &a3));      // same start, shorter
+    assert(ft_delta_changed(&d, &a));
+    assert(d.stats.passed == 5 && d.stats.suppressed == 4 && d.stats.evicted == 0);
+
+    /*************************************************************
+     * 2. Replay gives the last of each type
+     *************************************************************/
+    ngot = 0;
+    ft_delta_replay(&d, frame_fn, NULL);
+    assert(ngot == 2 && same(&got[0], &a) && same(&got[1], &b));
+    assert(d.stats.replayed == 2);
+
+    /* Reset forgets them, the stats stay */
+    ft_delta_reset(&d);
+    ngot = 0;
+    ft_delta_replay(&d, frame_fn, NULL);
+    assert(ngot == 0);
+    assert(ft_delta_changed(&d, &a) && ft_delta_changed(&d, &b));
+    assert(d.stats.passed == 7);
+
+    /*************************************************************
+     * 3. More types than slots: the least recently seen goes
+     *************************************************************/
+    ft_frame_t f = { 2, { 0, 0 } };
+
+    ft_delta_init(&d);
+    for (int t = 0; t < FT_DELTA_SLOTS; t++) {
+        f.payload[0] = t;
+        assert(ft_delta_changed(&d, &f));
+    }
+    f.payload[0] = 0;
+    assert(!ft_delta_changed(&d, &f));      // type 0 seen again, 1 is oldest
+    f.payload[0] = FT_DELTA_SLOTS;
+    assert(ft_delta_changed(&d, &f));
+    assert(d.stats.evicted == 1);
+    f.payload[0] = 0;
+    assert(!ft_delta_changed(&d, &f));
+    f.payload[0] = 1;
+    assert(ft_delta_changed(&d, &f));       // forgotten, new again
+    assert(d.stats.evicted == 2);
+
+    ngot = 0;
+    ft_delta_replay(&d, frame_fn, NULL);
+    assert(ngot == FT_DELTA_SLOTS);
+
+    printf("ALL FT_DELTA TESTS PASSED.\n");
+    return 0;
+}
@@ -0,0 +1,179 @@
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <assert.h>
+
+#include "../ft_frame.h"
+
+#define MAX_FRAMES 512
+
+static ft_frame_t got[MAX_FRAMES];
+static int ngot;
+
+static void frame_fn(void *ctx, const ft_frame_t *frame)
+{
+    (void)ctx;
+    assert(ngot < MAX_FRAMES);
+    got[ngot++] = *frame;
+}
+
+static bool same(const ft_frame_t *a, const ft_frame_t *b)
+{
+    return a->len == b->len && memcmp(a->payload, b->payload, a->len) == 0;
+}
+
+/* Noise that can't be taken for a sync */
+static uint8_t noise_byte(void)
+{
+    uint8_t b;
+
+    do {
+        b = rand();
+    } while (b == FT_FRAME_SYNC);
+    return b;
+}
+
+/*********************************************************************
+ *  Regression Tests
+ *********************************************************************/
+int main(void)
+{
+    static uint8_t stream[64 * 1024];
+    static ft_frame_t sent[MAX_FRAMES];
+    ft_frame_parser_t p;
+    ft_frame_t f = { 4, { 0x10, 0x20, 0x30, FT_FRAME_SYNC } };
+    uint8_t wire[FT_FRAME_OVERHEAD + FT_FRAME_PAYLOAD_MAX];
+    uint16_t n;
+
+    /*************************************************************
+     * 1. Encoding: sync, len, payload, sum of len and payload
+     *************************************************************/
+    n = ft_frame_encode(&f, wire);
+    assert(n == FT_FRAME_OVERHEAD + 4);
+    assert(wire[0] == FT_FRAME_SYNC && wire[1] == 4);
+    assert(wire[6] == (uint8_t)(4 + 0x10 + 0x20 + 0x30 + FT_FRAME_SYNC));
+
+    /*************************************************************
+     * 2. One frame, whole and split at every point
+     *************************************************************/
+    ft_frame_parser_init(&p, frame_fn, NULL);
+    ngot = 0;
+    ft_frame_parse(&p, wire, n);
+    assert(ngot == 1 && same(&got[0], &f));
+
+    for (uint16_t cut = 0; cut <= n; cut++) {
+        ft_frame_parser_init(&p, frame_fn, NULL);
+        ngot = 0;
+        ft_frame_parse(&p, wire, cut);
+        assert(ngot == (cut == n));
+        ft_frame_parse(&p, &wire[cut], n - cut);
+        assert(ngot == 1 && same(&got[0], &f));
+        assert(p.stats.frames == 1 && p.stats.noise == 0);
+    }
+
+    /*************************************************************
+     * 3. Noise around frames is skipped and counted
+     *************************************************************/
+    ft_frame_parser_init(&p, frame_fn, NULL);
+    ngot = 0;
+    ft_frame_parse(&p, (const uint8_t *)"xyz", 3);
+    ft_frame_parse(&p, wire, n);
+    ft_frame_parse(&p, (const uint8_t *)"q", 1);
+    ft_frame_parse(&p, wire, n);
+    assert(ngot == 2 && p.stats.noise == 4 && p.stats.frames == 2);
+
+    /*************************************************************
+     * 4. False syncs: a bad length or checksum, and the frame
+     *    starting inside it is still found
+     *************************************************************/
+    const uint8_t bad_len[][2] = { { FT_FRAME_SYNC, 0 }, { FT_FRAME_SYNC, FT_FRAME_PAYLOAD_MAX + 1 } };
+
+    for (int i = 0; i < 2; i++) {
+        ft_frame_parser_init(&p, frame_fn, NULL);
+        ngot = 0;
+        ft_frame_parse(&p, bad_len[i], 2);
+        ft_frame_parse(&p, wire, n);
+        assert(ngot == 1 && same(&got[0], &f));
+        assert(p.stats.bad_len == 1);
+    }
+
+    /* A sync and a length swallow the real frame's first bytes as payload;
+       its checksum fails and the real frame is parsed again */
+    for (uint8_t false_len = 1; false_len <= n + 2; false_len++) {
+        const uint8_t hdr[2] = { FT_FRAME_SYNC, false_len };
+
+        ft_frame_parser_init(&p, frame_fn, NULL);
+        ngot = 0;
+        ft_frame_parse(&p, hdr, 2);
+        for (uint16_t i = 0; i < n; i++)
+            ft_frame_parse(&p, &wire[i], 1);
+        ft_frame_parse(&p, wire, n);
+        assert(ngot >= 1 && same(&got[ngot - 1], &f));
+    }
+
+    /* Corrupt checksum: that frame is lost, the next ones are not.  The
+       sync inside its payload starts another false frame, which holds the
+       next real one until enough bytes have come to rule it out */
+    wire[n - 1] ^= 0x01;
+    ft_frame_parser_init(&p, frame_fn, NULL);
+    ngot = 0;
+    ft_frame_parse(&p, wire, n);
+    wire[n - 1] ^= 0x01;
+    ft_frame_parse(&p, wire, n);
+    ft_frame_parse(&p, wire, n);
+    assert(ngot == 2 && same(&got[0], &f) && same(&got[1], &f));
+    assert(p.stats.bad_sum == 2);
+
+    /*************************************************************
+     * 5. From a ring, across its wrap
+     *************************************************************/
+    uint8_t storage[16];
+    ringbuf_t rb;
+
+    ringbuf_init(&rb, storage, sizeof(storage));
+    ft_frame_parser_init(&p, frame_fn, NULL);
+    ngot = 0;
+    for (int round = 0; round < 8; round++) {
+        assert(ringbuf_write(&rb, wire, n) == n);
+        assert(ft_frame_parse_ring(&p, &rb) == n);
+        assert(ringbuf_empty(&rb));
+    }
+    assert(ngot == 8);
+
+    /*************************************************************
+     * 6. Random frames in random noise, fed in random pieces
+     *************************************************************/
+    size_t len = 0;
+    int nsent = 0;
+
+    srand(7900);
+    while (nsent < MAX_FRAMES && len + 8 + sizeof(wire) <= sizeof(stream)) {
+        ft_frame_t *s = &sent[nsent++];
+
+        for (int k = rand() % 8; k > 0; k--)
+            stream[len++] = noise_byte();
+        s->len = 1 + rand() % FT_FRAME_PAYLOAD_MAX;
+        for (int k = 0; k < s->len; k++)
+            s->payload[k] = rand();
+        len += ft_frame_encode(s, &stream[len]);
+    }
+
+    ft_frame_parser_init(&p, frame_fn, NULL);
+    ngot = 0;
+    for (size_t off = 0; off < len; ) {
+        size_t piece = 1 + rand() % 70;
+
+        if (piece > len - off)
+            piece = len - off;
+        ft_frame_parse(&p, &stream[off], piece);
+        off += piece;
+    }
+    assert(ngot == nsent);
+    for (int i = 0; i < nsent; i++)
+        assert(same(&got[i], &sent[i]));
+
+    printf("ALL FT_FRAME TESTS PASSED.\n");
+    return 0;
+}
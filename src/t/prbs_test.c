@@ -0,0 +1,76 @@
+
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+
+#include "../prbs.h"
+
+#define PERIOD 32767    // bytes as well as bits: 8 and 2^15 - 1 share no factor
+
+/*********************************************************************
+ *  Regression Tests
+ *********************************************************************/
+int main(void)
+{
+    static uint8_t stream[3 * PERIOD];
+    prbs_gen_t g;
+    prbs_check_t c;
+
+    /*************************************************************
+     * 1. Generator: maximal length, back where it started
+     *************************************************************/
+    prbs_init(&g);
+    uint16_t start = g.state;
+
+    prbs_fill(&g, stream, sizeof(stream));
+    assert(g.state == start);
+    assert(memcmp(stream, &stream[PERIOD], PERIOD) == 0);
+    for (int i = 1; i < PERIOD; i++) {
+        assert(memcmp(stream, &stream[i], 16) != 0);
+    }
+
+    /*************************************************************
+     * 2. Checker locks from anywhere in the stream, in any pieces
+     *************************************************************/
+    for (int off = 0; off < 300; off += 37) {
+        prbs_check_init(&c);
+        for (int i = 0; i < 4000; i += 1 + off % 7) {
+            prbs_check(&c, &stream[off + i], 1 + off % 7);
+        }
+        assert(c.locked && c.bit_errors == 0 && c.resyncs == 0);
+    }
+
+    /*************************************************************
+     * 3. Flipped bits are counted one by one
+     *************************************************************/
+    static uint8_t bad[4096];
+
+    memcpy(bad, stream, sizeof(bad));
+    bad[100] ^= 0x01;
+    bad[500] ^= 0x81;
+    bad[501] ^= 0x10;
+    bad[2000] ^= 0xff;
+    prbs_check_init(&c);
+    prbs_check(&c, bad, sizeof(bad));
+    assert(c.bit_errors == 1 + 2 + 1 + 8 && c.resyncs == 0);
+    assert(c.bytes == sizeof(bad));
+
+    /*************************************************************
+     * 4. Lost bytes are a resync, not a burst of bit errors
+     *************************************************************/
+    prbs_check_init(&c);
+    prbs_check(&c, stream, 1000);
+    prbs_check(&c, &stream[1003], 1000);
+    assert(c.resyncs == 1 && c.bit_errors == 0 && c.locked);
+
+    /*************************************************************
+     * 5. A dead line never locks
+     *************************************************************/
+    memset(bad, 0, sizeof(bad));
+    prbs_check_init(&c);
+    prbs_check(&c, bad, sizeof(bad));
+    assert(!c.locked && c.bit_errors == 0);
+
+    printf("ALL PRBS TESTS PASSED.\n");
+    return 0;
+}
@@ -0,0 +1,149 @@
+
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+
+#include "../recq.h"
+
+#define Q_SIZE 32   /* must be power-of-two */
+
+static int notified;
+
+static void notify_fn(void *ctx)
+{
+    (void)ctx;
+    notified++;
+}
+
+/*********************************************************************
+ *  Regression Tests
+ *********************************************************************/
+int main(void)
+{
+    uint8_t storage[Q_SIZE];
+    uint8_t out[Q_SIZE];
+    recq_t q;
+    int n;
+
+    /*************************************************************
+     * 1. Empty queue
+     *************************************************************/
+    recq_init(&q, storage, Q_SIZE, 0);
+    assert(recq_empty(&q));
+    assert(recq_peek_len(&q) == -1);
+    assert(recq_read(&q, out, sizeof(out)) == -1);
+
+    /*************************************************************
+     * 2. Whole records keep their boundaries
+     *************************************************************/
+    const uint8_t a[3] = { 1, 2, 3 };
+    const uint8_t b[5] = { 4, 5, 6, 7, 8 };
+
+    assert(recq_write(&q, a, sizeof(a)) == 1);
+    assert(recq_write(&q, b, sizeof(b)) == 1);
+    assert(recq_used(&q) == 2 * RECQ_HDR_SIZE + 8);
+
+    assert(recq_peek_len(&q) == 3);
+    n = recq_read(&q, out, sizeof(out));
+    assert(n == 3 && memcmp(out, a, 3) == 0);
+    n = recq_read(&q, out, sizeof(out));
+    assert(n == 5 && memcmp(out, b, 5) == 0);
+    assert(recq_empty(&q));
+
+    /* zero length records are records too */
+    assert(recq_write(&q, NULL, 0) == 1);
+    assert(recq_peek_len(&q) == 0);
+    assert(recq_read(&q, out, sizeof(out)) == 0);
+    assert(recq_empty(&q));
+
+    /*************************************************************
+     * 3. Records wrap the end of storage
+     *************************************************************/
+    uint8_t big[20];
+    for (int i = 0; i < 20; i++) big[i] = 100 + i;
+
+    for (int round = 0; round < 10; round++) {
+        assert(recq_write(&q, big, 13) == 1);
+        n = recq_read(&q, out, sizeof(out));
+        assert(n == 13 && memcmp(out, big, 13) == 0);
+    }
+
+    /*************************************************************
+     * 4. Incremental build: invisible until commit, abort discards
+     *************************************************************/
+    recq_begin(&q);
+    recq_append(&q, a, 2);
+    recq_append(&q, &a[2], 1);
+    assert(recq_empty(&q));
+    assert(recq_commit(&q) == 1);
+    n = recq_read(&q, out, sizeof(out));
+    assert(n == 3 && memcmp(out, a, 3) == 0);
+
+    recq_begin(&q);
+    recq_append(&q, b, 5);
+    recq_abort(&q);
+    assert(recq_empty(&q));
+    assert(recq_commit(&q) == 0);   /* nothing open */
+
+    /*************************************************************
+     * 5. Full queue rejects the new record
+     *************************************************************/
+    recq_init(&q, storage, Q_SIZE, 0);
+    assert(recq_write(&q, big, 12) == 1);   /* 14 bytes */
+    assert(recq_write(&q, big, 12) == 1);   /* 28 bytes */
+    assert(recq_write(&q, big, 2) == 0);    /* 32 > 31 */
+    assert(q.dropped == 1);
+    assert(recq_peek_len(&q) == 12);
+
+    /* too big for the whole queue is always rejected */
+    assert(recq_write(&q, big, 30) == 0);
+
+    /*************************************************************
+     * 6. Drop-oldest evicts whole records, newest survive
+     *************************************************************/
+    recq_init(&q, storage, Q_SIZE, RECQ_DROP_OLDEST);
+    uint8_t rec[8];
+    for (int i = 0; i < 6; i++) {
+        memset(rec, i, sizeof(rec));
+        assert(recq_write(&q, rec, sizeof(rec)) == 1);  /* 10 bytes each */
+    }
+    assert(q.dropped == 3);     /* only 3 x 10 fit in 31 */
+    for (int i = 3; i < 6; i++) {
+        n = recq_read(&q, out, sizeof(out));
+        assert(n == 8 && out[0] == i && out[7] == i);
+    }
+    assert(recq_empty(&q));
+
+    /* an oversize record does not flush the queue for nothing */
+    assert(recq_write(&q, a, 3) == 1);
+    assert(recq_write(&q, big, 30) == 0);
+    assert(recq_peek_len(&q) == 3);
+
+    /*************************************************************
+     * 7. Truncating read and discard
+     *************************************************************/
+    recq_init(&q, storage, Q_SIZE, 0);
+    recq_write(&q, b, 5);
+    recq_write(&q, a, 3);
+    n = recq_read(&q, out, 2);
+    assert(n == 5);                 /* full length reported */
+    assert(out[0] == 4 && out[1] == 5);
+    recq_discard(&q);
+    assert(recq_empty(&q));
+
+    /*************************************************************
+     * 8. Commit notifies, aborted/rejected records do not
+     *************************************************************/
+    recq_init(&q, storage, Q_SIZE, 0);
+    recq_set_write_notify_fn(&q, notify_fn, NULL);
+    recq_write(&q, a, 3);
+    assert(notified == 1);
+    recq_begin(&q);
+    recq_append(&q, a, 3);
+    recq_abort(&q);
+    recq_write(&q, big, 30);
+    assert(notified == 1);
+
+    printf("ALL RECQ TESTS PASSED.\n");
+    return 0;
+}
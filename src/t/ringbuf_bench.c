@@ -0,0 +1,256 @@
+
+#define _POSIX_C_SOURCE 200112L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "../ringbuf.h"
+
+/*
+ * Ring buffer micro-benchmarks.
+ *
+ * Every case moves BYTES_PER_CASE bytes through a ring in one timed loop.
+ * Write cases flush the ring whenever it fills, read cases re-mark the ring
+ * full whenever it empties; both are O(1) index updates, so the numbers are
+ * the cost of the operation itself.  The best of REPEATS runs is kept to
+ * reject scheduler noise.
+ *
+ * Output is CSV on stdout (or -o file):
+ *     op,ring,chunk,ns_per_byte
+ *
+ * With -b baseline.csv every case is compared against the same row of a
+ * previous run on the same machine and the program exits 1 if any case is
+ * more than -t percent (default 25) slower.  Differences below -f ns/byte
+ * (default 0.1) are treated as timer noise.
+ *
+ * Usage: bench_ringbuf [-o out.csv] [-b baseline.csv] [-t percent] [-f ns]
+ */
+
+#define BYTES_PER_CASE  (1000u * 1000u)
+#define REPEATS         7
+#define MAX_RING        32768
+#define MAX_CHUNK       64
+#define MAX_RESULTS     512
+
+typedef struct {
+    char     op[16];
+    unsigned ring;
+    unsigned chunk;
+    double   ns_per_byte;
+} result_t;
+
+static result_t results[MAX_RESULTS];
+static int      nresults;
+
+static uint8_t storage[MAX_RING];
+static uint8_t src[MAX_CHUNK];
+static uint8_t dst[MAX_CHUNK];
+
+/* Keep the compiler from discarding reads */
+static volatile uint8_t sink;
+
+static int notify_calls;
+
+static void bench_notify_cb(void *ctx)
+{
+    (void)ctx;
+    notify_calls++;
+}
+
+static double now_ns(void)
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec * 1e9 + t.tv_nsec;
+}
+
+static void add_result(const char *op, unsigned ring, unsigned chunk, double ns_per_byte)
+{
+    if (nresults == MAX_RESULTS) {
+        fprintf(stderr, "too many results\n");
+        exit(2);
+    }
+    result_t *r = &results[nresults++];
+    snprintf(r->op, sizeof(r->op), "%s", op);
+    r->ring = ring;
+    r->chunk = chunk;
+    r->ns_per_byte = ns_per_byte;
+}
+
+/* Producer side: chunk == 0 selects the single byte ringbuf_put() path */
+static double bench_write(unsigned ring, unsigned chunk, int with_notify)
+{
+    double best = 1e30;
+
+    for (int rep = 0; rep < REPEATS; rep++) {
+        ringbuf_t rb;
+        unsigned moved = 0;
+
+        ringbuf_init(&rb, storage, ring);
+        if (with_notify)
+            ringbuf_set_write_notify_fn(&rb, bench_notify_cb, NULL);
+
+        double t0 = now_ns();
+        while (moved < BYTES_PER_CASE) {
+            if (chunk == 0) {
+                if (ringbuf_full(&rb)) {
+                    ringbuf_flush(&rb);
+                }
+                ringbuf_put(&rb, (uint8_t)moved);
+                moved++;
+            } else {
+                int n = ringbuf_write(&rb, src, chunk);
+                if (n < (int)chunk) {
+                    ringbuf_flush(&rb);
+                }
+                moved += n;
+            }
+        }
+        double t = (now_ns() - t0) / moved;
+        if (t < best)
+            best = t;
+    }
+    return best;
+}
+
+/* Consumer side: chunk == 0 selects the single byte ringbuf_get() path */
+static double bench_read(unsigned ring, unsigned chunk)
+{
+    double best = 1e30;
+
+    for (int rep = 0; rep < REPEATS; rep++) {
+        ringbuf_t rb;
+        unsigned moved = 0;
+
+        ringbuf_init(&rb, storage, ring);
+
+        double t0 = now_ns();
+        while (moved < BYTES_PER_CASE) {
+            int n;
+            if (chunk == 0) {
+                uint8_t b = 0;
+                n = ringbuf_get(&rb, &b);
+                sink = b;
+            } else {
+                n = ringbuf_read(&rb, dst, chunk);
+                sink = dst[0];
+            }
+            if (n == 0) {
+                /* Empty: mark everything readable again */
+                ringbuf_publish_head(&rb, (ringbuf_load_tail(&rb, memory_order_relaxed) - 1) & (ring - 1));
+            }
+            moved += n;
+        }
+        double t = (now_ns() - t0) / moved;
+        if (t < best)
+            best = t;
+    }
+    return best;
+}
+
+static const result_t *find_result(const char *op, unsigned ring, unsigned chunk)
+{
+    for (int i = 0; i < nresults; i++) {
+        if (strcmp(results[i].op, op) == 0 &&
+            results[i].ring == ring && results[i].chunk == chunk)
+            return &results[i];
+    }
+    return NULL;
+}
+
+/* Compare against a baseline CSV, returns the number of regressions */
+static int compare_baseline(const char *path, double tolerance_pct, double floor_ns)
+{
+    FILE *f = fopen(path, "r");
+    char line[128];
+    int regressions = 0;
+
+    if (f == NULL) {
+        perror(path);
+        return 1;
+    }
+
+    while (fgets(line, sizeof(line), f)) {
+        char op[16];
+        unsigned ring, chunk;
+        double base;
+
+        if (sscanf(line, "%15[^,],%u,%u,%lf", op, &ring, &chunk, &base) != 4)
+            continue;   /* header or junk */
+
+        const result_t *r = find_result(op, ring, chunk);
+        if (r == NULL)
+            continue;
+        if (r->ns_per_byte > base * (1.0 + tolerance_pct / 100.0) &&
+            r->ns_per_byte - base > floor_ns) {
+            fprintf(stderr, "REGRESSION %s ring=%u chunk=%u: %.3f ns/byte (baseline %.3f)\n",
+                    op, ring, chunk, r->ns_per_byte, base);
+            regressions++;
+        }
+    }
+    fclose(f);
+    return regressions;
+}
+
+int main(int argc, char **argv)
+{
+    const char *out_path = NULL;
+    const char *baseline = NULL;
+    double tolerance = 25.0;
+    double floor_ns = 0.1;
+    FILE *out = stdout;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "o:b:t:f:")) != -1) {
+        switch (opt) {
+        case 'o': out_path = optarg; break;
+        case 'b': baseline = optarg; break;
+        case 't': tolerance = atof(optarg); break;
+        case 'f': floor_ns = atof(optarg); break;
+        default:
+            fprintf(stderr, "usage: %s [-o out.csv] [-b baseline.csv] [-t percent] [-f ns]\n", argv[0]);
+            return 2;
+        }
+    }
+
+    for (int i = 0; i < MAX_CHUNK; i++)
+        src[i] = (uint8_t)i;
+
+    for (unsigned ring = 8; ring <= MAX_RING; ring <<= 1) {
+        add_result("put", ring, 1, bench_write(ring, 0, 0));
+        add_result("get", ring, 1, bench_read(ring, 0));
+        for (unsigned chunk = 1; chunk <= MAX_CHUNK; chunk <<= 1) {
+            add_result("write", ring, chunk, bench_write(ring, chunk, 0));
+            add_result("write_notify", ring, chunk, bench_write(ring, chunk, 1));
+            add_result("read", ring, chunk, bench_read(ring, chunk));
+        }
+    }
+
+    if (out_path) {
+        out = fopen(out_path, "w");
+        if (out == NULL) {
+            perror(out_path);
+            return 2;
+        }
+    }
+    fprintf(out, "op,ring,chunk,ns_per_byte\n");
+    for (int i = 0; i < nresults; i++) {
+        fprintf(out, "%s,%u,%u,%.3f\n", results[i].op, results[i].ring,
+                results[i].chunk, results[i].ns_per_byte);
+    }
+    if (out != stdout)
+        fclose(out);
+
+    if (baseline) {
+        int bad = compare_baseline(baseline, tolerance, floor_ns);
+        if (bad) {
+            fprintf(stderr, "%d ring benchmark regression(s) over %.0f%%\n", bad, tolerance);
+            return 1;
+        }
+        fprintf(stderr, "no ring benchmark regressions against %s\n", baseline);
+    }
+    return 0;
+}
@@ -0,0 +1,200 @@
+
+#define _POSIX_C_SOURCE 200112L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+
+#include "../ringbuf.h"
+
+/*
+ * Multi-threaded SPSC stress test.
+ *
+ * One producer thread and one consumer thread share a ring, exactly like
+ * usart_irq_handler() and the USB path do on the device.  The producer
+ * emits a known byte sequence using every producer API, the consumer
+ * checks the order using every consumer API.  Any lost, duplicated or
+ * stale byte fails the run.  Throughput is reported in MB/s.
+ *
+ * Usage: stress_ringbuf [megabytes]
+ */
+
+#define DEFAULT_MBYTES  32
+
+/* Prime period so the sequence never lines up with a ring size */
+#define SEQ_PERIOD      251
+
+typedef struct {
+    ringbuf_t *rb;
+    size_t     total;
+    size_t     errors;
+    size_t     first_error;
+} stress_ctx_t;
+
+static uint8_t seq_byte(size_t pos)
+{
+    return (uint8_t)(pos % SEQ_PERIOD);
+}
+
+/* Small xorshift so chunk sizes vary without libc rand() state sharing */
+static uint32_t xorshift(uint32_t *s)
+{
+    uint32_t x = *s;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    return *s = x;
+}
+
+static void *producer(void *arg)
+{
+    stress_ctx_t *c = (stress_ctx_t *)arg;
+    uint8_t chunk[256];
+    uint32_t rng = 0x12345678;
+    size_t pos = 0;
+
+    while (pos < c->total) {
+        uint32_t r = xorshift(&rng);
+        size_t len = 1 + (r % sizeof(chunk));
+        if (len > c->total - pos)
+            len = c->total - pos;
+
+        switch ((r >> 16) % 3) {
+        case 0: {   /* bulk write */
+            for (size_t i = 0; i < len; i++)
+                chunk[i] = seq_byte(pos + i);
+            size_t done = 0;
+            while (done < len) {
+                int n = ringbuf_write(c->rb, &chunk[done], (int)(len - done));
+                if (n == 0)
+                    sched_yield();
+                done += n;
+            }
+            break;
+        }
+        case 1: {   /* zero-copy span */
+            uint8_t *span;
+            ringbuf_idx_t room = ringbuf_write_span(c->rb, &span);
+            if (room == 0) {
+                sched_yield();
+                continue;
+            }
+            if (room > len)
+                room = len;
+            for (ringbuf_idx_t i = 0; i < room; i++)
+                span[i] = seq_byte(pos + i);
+            ringbuf_write_commit(c->rb, room);
+            len = room;
+            break;
+        }
+        default:    /* single byte */
+            while (ringbuf_full(c->rb))
+                sched_yield();
+            ringbuf_put(c->rb, seq_byte(pos));
+            len = 1;
+            break;
+        }
+        pos += len;
+    }
+    return NULL;
+}
+
+static void check(stress_ctx_t *c, size_t pos, const uint8_t *p, size_t n)
+{
+    for (size_t i = 0; i < n; i++) {
+        if (p[i] != seq_byte(pos + i)) {
+            if (c->errors++ == 0)
+                c->first_error = pos + i;
+        }
+    }
+}
+
+static void *consumer(void *arg)
+{
+    stress_ctx_t *c = (stress_ctx_t *)arg;
+    uint8_t chunk[256];
+    uint32_t rng = 0x87654321;
+    size_t pos = 0;
+
+    while (pos < c->total) {
+        uint32_t r = xorshift(&rng);
+        size_t got;
+
+        switch ((r >> 16) % 3) {
+        case 0: {   /* bulk read */
+            got = ringbuf_read(c->rb, chunk, 1 + (r % sizeof(chunk)));
+            check(c, pos, chunk, got);
+            break;
+        }
+        case 1: {   /* zero-copy span */
+            uint8_t *span;
+            got = ringbuf_read_span(c->rb, &span);
+            check(c, pos, span, got);
+            ringbuf_read_commit(c->rb, got);
+            break;
+        }
+        default: {  /* single byte */
+            uint8_t b;
+            got = ringbuf_get(c->rb, &b);
+            check(c, pos, &b, got);
+            break;
+        }
+        }
+        if (got == 0)
+            sched_yield();
+        pos += got;
+    }
+    return NULL;
+}
+
+static double run(uint16_t size, size_t total)
+{
+    uint8_t *storage = malloc(size);
+    ringbuf_t rb;
+    stress_ctx_t c = { .rb = &rb, .total = total };
+    pthread_t prod, cons;
+    struct timespec t0, t1;
+
+    assert(storage != NULL);
+    ringbuf_init(&rb, storage, size);
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    pthread_create(&cons, NULL, consumer, &c);
+    pthread_create(&prod, NULL, producer, &c);
+    pthread_join(prod, NULL);
+    pthread_join(cons, NULL);
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+
+    double secs = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+    double mbps = total / secs / 1e6;
+
+    printf("ring %5u: %8zu bytes %8.1f MB/s  %s\n", size, total, mbps,
+           c.errors ? "FAIL" : "ok");
+    if (c.errors) {
+        printf("  %zu bad bytes, first at offset %zu\n", c.errors, c.first_error);
+        exit(1);
+    }
+    assert(ringbuf_empty(&rb));
+
+    free(storage);
+    return mbps;
+}
+
+int main(int argc, char **argv)
+{
+    size_t mbytes = (argc > 1) ? (size_t)atoi(argv[1]) : DEFAULT_MBYTES;
+    size_t total = mbytes * 1000 * 1000;
+
+    /* Small rings force constant wrap and full/empty races */
+    run(8, total / 16);
+    run(64, total / 4);
+    run(256, total);
+    run(4096, total);
+
+    printf("ALL RINGBUF STRESS TESTS PASSED.\n");
+    return 0;
+}
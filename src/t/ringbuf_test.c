@@ -6,6 +6,15 @@
 
 #define RB_SIZE 8   /* must be power-of-two */
 
+RINGBUF_DEFINE(test_ring, 16);
+
+#if RINGBUF_INDEX_BITS == 32
+/* Larger than a 16-bit index can address */
+#define BIG_RING_SIZE (128UL * 1024UL)
+RINGBUF_DEFINE(big_ring, BIG_RING_SIZE);
+static big_ring_t big;
+#endif
+
 /*********************************************************************
  *  Callback tracking structure
  *********************************************************************/
@@ -83,6 +92,12 @@ int main(void)
     n = ringbuf_write(&rb, wrap_in, 4);
     assert(n == 4);
 
+    /* peek copies across the wrap too, and leaves the data in place */
+    n = ringbuf_peek(&rb, wrap_out, sizeof(wrap_out));
+    assert(n == 4 && memcmp(wrap_in, wrap_out, 4) == 0);
+    assert(ringbuf_count(&rb) == 4);
+    memset(wrap_out, 0, sizeof(wrap_out));
+
     n = ringbuf_read(&rb, wrap_out, 4);
     assert(memcmp(wrap_in, wrap_out, 4) == 0);
 
@@ -161,6 +176,176 @@ int main(void)
     n = ringbuf_write(NULL, cbdata, 2);
     assert(n == 0);
 
+    /*************************************************************
+     * 10. Zero-copy spans stop at the wrap point
+     *************************************************************/
+    ringbuf_set_write_notify_fn(&rb, NULL, NULL);
+    ringbuf_flush(&rb);
+    rb.head = RB_SIZE - 3;   /* 3 slots to the end of storage */
+    rb.tail = RB_SIZE - 3;
+
+    uint8_t *span;
+    ringbuf_idx_t room = ringbuf_write_span(&rb, &span);
+    assert(room == 3);
+    assert(span == &storage[RB_SIZE - 3]);
+    memcpy(span, wrap_in, 3);
+    ringbuf_write_commit(&rb, 3);
+    assert(rb.head == 0);
+
+    /* tail is not at 0, so the second span may run up to tail - 1 */
+    room = ringbuf_write_span(&rb, &span);
+    assert(room == RB_SIZE - 4);
+    assert(span == &storage[0]);
+    span[0] = wrap_in[3];
+    ringbuf_write_commit(&rb, 1);
+    assert(ringbuf_count(&rb) == 4);
+
+    ringbuf_idx_t avail = ringbuf_read_span(&rb, &span);
+    assert(avail == 3);
+    assert(memcmp(span, wrap_in, 3) == 0);
+    ringbuf_read_commit(&rb, 3);
+
+    avail = ringbuf_read_span(&rb, &span);
+    assert(avail == 1);
+    assert(span[0] == wrap_in[3]);
+    ringbuf_read_commit(&rb, 1);
+    assert(ringbuf_empty(&rb));
+    assert(ringbuf_read_span(&rb, &span) == 0);
+
+    /* with tail at 0 the write span must leave the last slot free */
+    ringbuf_flush(&rb);
+    rb.head = 0;
+    rb.tail = 0;
+    assert(ringbuf_write_span(&rb, &span) == RB_SIZE - 1);
+
+    /* write_commit runs the notify callback like ringbuf_write() */
+    cb_reset(&cb);
+    ringbuf_set_write_notify_fn(&rb, test_callback_fn, &cb);
+    ringbuf_write_commit(&rb, 0);
+    assert(cb.called == 1);
+
+    /*************************************************************
+     * 11. EDGE policy: only a write into a drained ring notifies
+     *************************************************************/
+    ringbuf_flush(&rb);
+    ringbuf_set_write_notify_policy(&rb, RINGBUF_NOTIFY_EDGE, 0);
+    cb_reset(&cb);
+
+    ringbuf_write(&rb, cbdata, 1);          /* empty -> 1: notify */
+    assert(cb.called == 1);
+    ringbuf_write(&rb, cbdata, 1);          /* 1 -> 2: quiet */
+    assert(cb.called == 1);
+    ringbuf_read(&rb, recover, RB_SIZE);    /* drained by consumer */
+    ringbuf_write_commit(&rb, 0);           /* nothing written: quiet */
+    assert(cb.called == 1);
+    ringbuf_write(&rb, cbdata, 2);          /* empty -> 2: notify */
+    assert(cb.called == 2);
+
+    /* full ring, nothing fits: no notify outside EVERY_WRITE */
+    ringbuf_write(&rb, fill, RB_SIZE);
+    cb_reset(&cb);
+    assert(ringbuf_write(&rb, cbdata, 1) == 0);
+    assert(cb.called == 0);
+
+    /*************************************************************
+     * 12. HIGH_WM policy: notify once when the fill level crosses it
+     *************************************************************/
+    ringbuf_flush(&rb);
+    ringbuf_set_write_notify_policy(&rb, RINGBUF_NOTIFY_HIGH_WM, 4);
+    cb_reset(&cb);
+
+    ringbuf_write(&rb, fill, 3);            /* 0 -> 3 */
+    assert(cb.called == 0);
+    ringbuf_write(&rb, fill, 2);            /* 3 -> 5 crosses 4 */
+    assert(cb.called == 1);
+    ringbuf_write(&rb, fill, 1);            /* 5 -> 6 already above */
+    assert(cb.called == 1);
+
+    /* EDGE | HIGH_WM: both conditions fire */
+    ringbuf_flush(&rb);
+    ringbuf_set_write_notify_policy(&rb, RINGBUF_NOTIFY_EDGE | RINGBUF_NOTIFY_HIGH_WM, 4);
+    cb_reset(&cb);
+    ringbuf_write(&rb, fill, 1);            /* edge */
+    ringbuf_write(&rb, fill, 4);            /* 1 -> 5 crosses 4 */
+    assert(cb.called == 2);
+
+    /*************************************************************
+     * 13. Read notify: consumer drained the ring down to low_wm
+     *************************************************************/
+    cb_state_t rcb;
+    cb_reset(&rcb);
+    ringbuf_set_write_notify_fn(&rb, NULL, NULL);
+    ringbuf_flush(&rb);
+    ringbuf_set_read_notify_fn(&rb, test_callback_fn, &rcb, 2);
+
+    ringbuf_write(&rb, fill, 6);
+    assert(rcb.called == 0);                /* writes never read-notify */
+    ringbuf_read(&rb, recover, 3);          /* 6 -> 3 */
+    assert(rcb.called == 0);
+    assert(ringbuf_get(&rb, &b) == 1);      /* 3 -> 2 reaches low_wm */
+    assert(rcb.called == 1);
+    assert(rcb.ctx_seen == &rcb);
+    assert(ringbuf_get(&rb, &b) == 1);      /* 2 -> 1 already below */
+    assert(rcb.called == 1);
+
+    ringbuf_write(&rb, fill, 4);            /* 1 -> 5 */
+    avail = ringbuf_read_span(&rb, &span);
+    ringbuf_read_commit(&rb, avail);        /* span commit counts too */
+    assert(rcb.called == 2);
+
+    ringbuf_write(&rb, fill, 4);
+    ringbuf_flush(&rb);                     /* so does a flush */
+    assert(rcb.called == 3);
+    ringbuf_set_read_notify_fn(&rb, NULL, NULL, 0);
+
+    /*************************************************************
+     * 14. Statically sized ring type
+     *************************************************************/
+    test_ring_t sr;
+    test_ring_init(&sr);
+    assert(test_ring_count(&sr) == 0);
+    assert(test_ring_free(&sr) == 15);
+
+    for (int i = 0; i < 20; i++)
+        test_ring_put(&sr, (uint8_t)i);     /* last 5 dropped: full */
+    assert(test_ring_count(&sr) == 15);
+    assert(test_ring_free(&sr) == 0);
+
+    /* the embedded ringbuf_t works with the generic API */
+    assert(ringbuf_full(test_ring_rb(&sr)));
+    n = ringbuf_read(test_ring_rb(&sr), recover, 4);
+    assert(n == 4 && recover[0] == 0 && recover[3] == 3);
+    for (int i = 4; i < 15; i++) {
+        assert(test_ring_get(&sr, &b) == 1);
+        assert(b == i);
+    }
+    assert(test_ring_get(&sr, &b) == 0);
+
+    /* storage arrays can be size-checked at build time too */
+    ringbuf_t checked;
+    ringbuf_init_array(&checked, storage);
+    assert(checked.size == RB_SIZE);
+
+#if RINGBUF_INDEX_BITS == 32
+    /*************************************************************
+     * 15. 32-bit indices: rings beyond 64 KB
+     *************************************************************/
+    big_ring_init(&big);
+    assert(big_ring_free(&big) == BIG_RING_SIZE - 1);
+
+    static uint8_t big_in[BIG_RING_SIZE];
+    static uint8_t big_out[BIG_RING_SIZE];
+    for (unsigned long i = 0; i < BIG_RING_SIZE; i++)
+        big_in[i] = (uint8_t)(i * 7);
+
+    n = ringbuf_write(big_ring_rb(&big), big_in, BIG_RING_SIZE);
+    assert(n == BIG_RING_SIZE - 1);
+    assert(big_ring_count(&big) == BIG_RING_SIZE - 1);
+    n = ringbuf_read(big_ring_rb(&big), big_out, BIG_RING_SIZE);
+    assert(n == BIG_RING_SIZE - 1);
+    assert(memcmp(big_in, big_out, BIG_RING_SIZE - 1) == 0);
+#endif
+
     printf("ALL RINGBUF TESTS PASSED.\n");
     return 0;
 }
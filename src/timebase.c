@@ -0,0 +1,138 @@
+#include <stddef.h>
+#include <libopencm3/stm32/rcc.h>
+#include <libopencm3/stm32/timer.h>
+#include <libopencm3/cm3/nvic.h>
+#include <libopencm3/cm3/cortex.h>
+
+#include "timebase.h"
+#include "prof.h"
+
+static timebase_timer_t *armed;
+
+void timebase_init(void)
+{
+    /* APB1 is divided down, so its timers run at twice its clock */
+    uint32_t clock = (rcc_apb1_frequency == rcc_ahb_frequency) ? rcc_apb1_frequency
+                                                                 : 2 * rcc_apb1_frequency;
+
+    rcc_periph_clock_enable(RCC_TIM2);
+    rcc_periph_reset_pulse(RST_TIM2);
+
+    timer_set_prescaler(TIM2, clock / 1000000 - 1);
+    timer_set_period(TIM2, 0xffffffff);
+    /* The prescaler is only loaded at an update event */
+    timer_generate_event(TIM2, TIM_EGR_UG);
+    timer_clear_flag(TIM2, TIM_SR_UIF);
+    timer_enable_counter(TIM2);
+
+    armed = NULL;
+    nvic_enable_irq(NVIC_TIM2_IRQ);
+}
+
+void timebase_timer_init(timebase_timer_t *t, void (*fn)(void *ctx), void *ctx)
+{
+    t->fn = fn;
+    t->ctx = ctx;
+    t->armed = false;
+    t->next = NULL;
+}
+
+/* Compare channel on the soonest timer.  A deadline the counter has
+   already passed will not match until it wraps, so take the IRQ now */
+static void timebase_program(void)
+{
+    if (armed == NULL) {
+        timer_disable_irq(TIM2, TIM_DIER_CC1IE);
+        return;
+    }
+    timer_set_oc_value(TIM2, TIM_OC1, armed->deadline);
+    timer_enable_irq(TIM2, TIM_DIER_CC1IE);
+    if ((int32_t)(armed->deadline - timebase_now_us()) <= 0) {
+        nvic_set_pending_irq(NVIC_TIM2_IRQ);
+    }
+}
+
+static void timebase_unlink(timebase_timer_t *t)
+{
+    timebase_timer_t **p = &armed;
+
+    while (*p != NULL && *p != t) {
+        p = &(*p)->next;
+    }
+    if (*p == t) {
+        *p = t->next;
+    }
+    t->armed = false;
+}
+
+void timebase_timer_start(timebase_timer_t *t, uint32_t delay_us)
+{
+    uint32_t masked = cm_mask_interrupts(1);
+    uint32_t now = timebase_now_us();
+
+    if (t->armed) {
+        timebase_unlink(t);
+    }
+    t->deadline = now + delay_us;
+
+    timebase_timer_t **p = &armed;
+    while (*p != NULL && (int32_t)((*p)->deadline - now) <= (int32_t)delay_us) {
+        p = &(*p)->next;
+    }
+    t->next = *p;
+    *p = t;
+    t->armed = true;
+
+    if (armed == t) {
+        timebase_program();
+    }
+    cm_mask_interrupts(masked);
+}
+
+void timebase_timer_stop(timebase_timer_t *t)
+{
+    uint32_t masked = cm_mask_interrupts(1);
+
+    if (t->armed) {
+        bool first = (armed == t);
+
+        timebase_unlink(t);
+        if (first) {
+            timebase_program();
+        }
+    }
+    cm_mask_interrupts(masked);
+}
+
+void timebase_irq_handler(void)
+{
+    timer_clear_flag(TIM2, TIM_SR_CC1IF);
+
+#if PROF
+    /* The soonest deadline is what the compare fired for, to the us */
+    if (armed != NULL) {
+        int32_t late = (int32_t)(timebase_now_us() - armed->deadline);
+
+        if (late >= 0) {
+            prof_latency(PROF_TIMER_ISR, late * (rcc_ahb_frequency / 1000000));
+        }
+    }
+#endif
+
+    /* Callbacks may start timers, so the list is only held while popping */
+    for (;;) {
+        uint32_t masked = cm_mask_interrupts(1);
+        timebase_timer_t *t = armed;
+
+        if (t == NULL || (int32_t)(t->deadline - timebase_now_us()) > 0) {
+            timebase_program();
+            cm_mask_interrupts(masked);
+            return;
+        }
+        armed = t->next;
+        t->armed = false;
+        cm_mask_interrupts(masked);
+
+        t->fn(t->ctx);
+    }
+}
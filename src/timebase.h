@@ -0,0 +1,36 @@
+#ifndef TIMEBASE_H
+#define TIMEBASE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <libopencm3/stm32/timer.h>
+
+/*
+ * Microsecond time from TIM2, free running over its 32 bits (71 minutes),
+ * and one-shot software timers on its compare channel 1.  Compare times
+ * as (int32_t)(a - b), never directly.
+ */
+static inline uint32_t timebase_now_us(void)
+{
+    return timer_get_counter(TIM2);
+}
+
+/* Timer callbacks run from tim2_isr() */
+typedef struct timebase_timer {
+    uint32_t deadline;                  // timebase_now_us() it is due at
+    void (*fn)(void *ctx);
+    void *ctx;
+    bool armed;
+    struct timebase_timer *next;        // armed timers, soonest first
+} timebase_timer_t;
+
+void timebase_init(void);
+void timebase_timer_init(timebase_timer_t *t, void (*fn)(void *ctx), void *ctx);
+
+/* (Re)arm to run delay_us from now, or stop it if armed.  From any context */
+void timebase_timer_start(timebase_timer_t *t, uint32_t delay_us);
+void timebase_timer_stop(timebase_timer_t *t);
+
+void timebase_irq_handler(void);        // from tim2_isr()
+
+#endif /* TIMEBASE_H */
@@ -0,0 +1,140 @@
+/*
+ * Capture stream (capture.h) to CSV or pcap.
+ *
+ *   capture_dump [-f csv|pcap] [-o out] [in]
+ *
+ * in is the capture as read from the CDC port, e.g. with
+ * `cat /dev/ttyACM0 > cap.bin` while capture is on, or stdin.  Time is
+ * unwrapped past the device's 32-bit microsecond counter, from 0 at its
+ * first record.
+ *
+ * CSV: time_us, dir (rx/tx), lost (1 if records were dropped before this
+ * one), data in hex.  pcap: LINKTYPE_USER0, each record one packet of a
+ * direction byte (0 rx, 1 tx, | 2 lost) and the data.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "../capture.h"
+
+#define LINKTYPE_USER0 147
+
+static void put32(FILE *f, uint32_t v)
+{
+    fwrite(&v, sizeof(v), 1, f);    // pcap is read in the writer's byte order
+}
+
+static void put16(FILE *f, uint16_t v)
+{
+    fwrite(&v, sizeof(v), 1, f);
+}
+
+static void pcap_header(FILE *f)
+{
+    put32(f, 0xa1b2c3d4);
+    put16(f, 2);
+    put16(f, 4);
+    put32(f, 0);                    // thiszone
+    put32(f, 0);                    // sigfigs
+    put32(f, 65535);                // snaplen
+    put32(f, LINKTYPE_USER0);
+}
+
+static void usage(const char *argv0)
+{
+    fprintf(stderr, "usage: %s [-f csv|pcap] [-o out] [in]\n", argv0);
+    exit(2);
+}
+
+int main(int argc, char **argv)
+{
+    FILE *in = stdin;
+    FILE *out = stdout;
+    int pcap = 0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "f:o:")) != -1) {
+        switch (opt) {
+        case 'f':
+            if (strcmp(optarg, "pcap") == 0) {
+                pcap = 1;
+            } else if (strcmp(optarg, "csv") != 0) {
+                usage(argv[0]);
+            }
+            break;
+        case 'o':
+            out = fopen(optarg, "wb");
+            if (out == NULL) {
+                perror(optarg);
+                return 1;
+            }
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (optind < argc) {
+        in = fopen(argv[optind], "rb");
+        if (in == NULL) {
+            perror(argv[optind]);
+            return 1;
+        }
+    }
+
+    if (pcap) {
+        pcap_header(out);
+    } else {
+        fprintf(out, "time_us,dir,lost,data\n");
+    }
+
+    capture_hdr_t hdr;
+    uint8_t data[255];
+    uint32_t last = 0;
+    uint64_t now = 0;
+    int first = 1;
+    long records = 0;
+
+    while (fread(&hdr, sizeof(hdr), 1, in) == 1) {
+        if (hdr.len == 0 || fread(data, 1, hdr.len, in) != hdr.len) {
+            fprintf(stderr, "record %ld: bad or cut short, stopping\n", records);
+            break;
+        }
+
+        /* Records are in time order, so each step is forward */
+        if (!first) {
+            now += (uint32_t)(hdr.time_us - last);
+        }
+        first = 0;
+        last = hdr.time_us;
+        records++;
+
+        if (pcap) {
+            uint8_t dir = (hdr.flags & CAPTURE_TX) ? 1 : 0;
+
+            if (hdr.flags & CAPTURE_LOST) {
+                dir |= 2;
+            }
+            put32(out, (uint32_t)(now / 1000000));
+            put32(out, (uint32_t)(now % 1000000));
+            put32(out, 1u + hdr.len);
+            put32(out, 1u + hdr.len);
+            fwrite(&dir, 1, 1, out);
+            fwrite(data, 1, hdr.len, out);
+        } else {
+            fprintf(out, "%llu,%s,%d,", (unsigned long long)now,
+                    (hdr.flags & CAPTURE_TX) ? "tx" : "rx", (hdr.flags & CAPTURE_LOST) ? 1 : 0);
+            for (int i = 0; i < hdr.len; i++) {
+                fprintf(out, "%02x", data[i]);
+            }
+            fputc('\n', out);
+        }
+    }
+
+    if (out != stdout) {
+        fclose(out);
+    }
+    return 0;
+}
@@ -1,86 +1,759 @@
-#include <libopencm3/stm32/usart.h>
+#include <string.h>
 
+#include <libopencm3/stm32/usart.h>
+#include <libopencm3/stm32/dma.h>
 #include <libopencm3/stm32/gpio.h>
+#include <libopencm3/stm32/rcc.h>
+#include <libopencm3/stm32/exti.h>
+#include <libopencm3/cm3/cortex.h>
+#include <libopencm3/cm3/dwt.h>
 
 #include "ringbuf.h"
 #include "usart.h"
+#include "prof.h"
 
 
+#define USART_SR_ERRORS (USART_SR_PE | USART_SR_FE | USART_SR_NE | USART_SR_ORE)
+
 // Forward declarations
 void usart_tx_notify_cb(void *ctx);
+void usart_rx_drained_cb(void *ctx);
 static void usart_start_tx(usart_ctx_t *ctx);
+static void usart_start_tx_dma(usart_ctx_t *ctx);
+static uint8_t usart_dma_rx_flush(usart_ctx_t *ctx);
+static void usart_dma_rx_start(usart_ctx_t *ctx);
+static void usart_rts_release(usart_ctx_t *ctx);
+static void usart_dma_stop(usart_ctx_t *ctx);
 
 
 void usart_tx_notify_cb(void *ctx)
 {
+    PROF_BEGIN();
+
     usart_start_tx((usart_ctx_t *) ctx );
+    PROF_END(PROF_USART_TX_NOTIFY);
 }
 
-void usart_init(usart_ctx_t *ctx, uint32_t usart,
-                ringbuf_t *tx_rb_ptr, ringbuf_t *rx_rb_ptr)
+/* RX ring read down to its low_wm */
+void usart_rx_drained_cb(void *ctx)
+{
+    usart_rts_release((usart_ctx_t *) ctx );
+}
+
+/* Kernel clock: USART1 and USART6 sit on APB2, the rest on APB1 */
+static uint32_t usart_clock(uint32_t usart)
+{
+    return (usart == USART1 || usart == USART6) ? rcc_apb2_frequency : rcc_apb1_frequency;
+}
+
+/* clock / baud, rounded: BRR as is with 16x oversampling, and the same
+   divider in 1/8ths with 8x.  0 if the line can't be set up */
+static uint32_t usart_line_div(uint32_t usart, const usart_line_t *line)
+{
+    uint32_t div;
+
+    if (line->baud == 0)
+        return 0;
+    /* Frame is 8 or 9 bits including parity */
+    if (line->data_bits != 8 &&
+        !(line->data_bits == 7 && line->parity != USART_PARITY_NONE))
+        return 0;
+
+    div = (usart_clock(usart) + line->baud / 2) / line->baud;
+    if (div < 8 || div > 0xffff)
+        return 0;
+    return div;
+}
+
+/* Program the format, USART disabled */
+static void usart_apply_line(usart_ctx_t *ctx, const usart_line_t *line, uint32_t div)
+{
+    uint32_t us = ctx->usart;
+    uint32_t clock = usart_clock(us);
+
+    if (div >= 16) {
+        USART_CR1(us) &= ~USART_CR1_OVER8;
+        USART_BRR(us) = div;
+    } else {
+        /* 3-bit fraction, BRR[3] must stay clear */
+        USART_CR1(us) |= USART_CR1_OVER8;
+        USART_BRR(us) = ((div >> 3) << 4) | (div & 7);
+    }
+    usart_set_databits(us, line->data_bits + (line->parity != USART_PARITY_NONE));
+    usart_set_parity(us, line->parity);
+    usart_set_stopbits(us, line->stop_bits);
+
+    ctx->line = *line;
+    ctx->baud_actual = (clock + div / 2) / div;
+    ctx->baud_error_ppm = (int32_t)(((int64_t)clock - (int64_t)div * line->baud) * 1000000 /
+                                    ((int64_t)div * line->baud));
+}
+
+static void usart_setup(usart_ctx_t *ctx, uint32_t usart,
+                        ringbuf_t *tx_rb_ptr, ringbuf_t *rx_rb_ptr)
 {
     ctx->usart = usart;
     ctx->tx_rb_ptr = tx_rb_ptr;
     ctx->rx_rb_ptr = rx_rb_ptr;
     ctx->tx_idle = 1;
+    ctx->tx_dma_len = 0;
+    ctx->rx_overruns = 0;
+    ctx->event_cb = NULL;
+    ctx->event_cb_ctx = NULL;
+    ctx->flow = NULL;
+    ctx->rts_held = 0;
+    ctx->rx_tap = NULL;
+    ctx->rx_tap_ctx = NULL;
+    ctx->tx_tap = NULL;
+    ctx->tx_tap_ctx = NULL;
+    memset(&ctx->counters, 0, sizeof(ctx->counters));
+    ctx->link = NULL;
+    ctx->link_dma = NULL;
+    ctx->rx_busy = 0;
+    ctx->link_head = 0;
+    ctx->link_tail = 0;
+    memset(&ctx->link_stats, 0, sizeof(ctx->link_stats));
 
-    // Allow TX ring buffer to wake the USART driver 
+    // Allow TX ring buffer to wake the USART driver.  The TX ISR drains the
+    // ring until empty, so only a write into a drained ring needs a kick
     if (ctx->tx_rb_ptr != NULL) 
     { 
         ringbuf_set_write_notify_fn(ctx->tx_rb_ptr, usart_tx_notify_cb, (void *)ctx);
+        ringbuf_set_write_notify_policy(ctx->tx_rb_ptr, RINGBUF_NOTIFY_EDGE, 0);
     } 
 
-    // Configure USART hardware 
-    usart_set_baudrate(usart, 19200);
-    usart_set_databits(usart, 8);
-    usart_set_stopbits(usart, USART_STOPBITS_1);
+    // Configure USART hardware, 19200 8N1 until the host says otherwise
+    static const usart_line_t line = { 19200, 8, USART_PARITY_NONE, USART_STOPBITS_1 };
+    usart_apply_line(ctx, &line, usart_line_div(usart, &line));
     usart_set_mode(usart, USART_MODE_TX_RX);
-    usart_set_parity(usart, USART_PARITY_NONE);
     usart_set_flow_control(usart, USART_FLOWCONTROL_NONE);
+}
 
+void usart_init(usart_ctx_t *ctx, uint32_t usart,
+                ringbuf_t *tx_rb_ptr, ringbuf_t *rx_rb_ptr)
+{
+    ctx->dma = NULL;
+    usart_setup(ctx, usart, tx_rb_ptr, rx_rb_ptr);
 
     usart_enable_rx_interrupt(usart);
 
     usart_enable(usart);
 }
 
+void usart_init_dma(usart_ctx_t *ctx, uint32_t usart,
+                    ringbuf_t *tx_rb_ptr, ringbuf_t *rx_rb_ptr,
+                    const usart_dma_cfg_t *dma)
+{
+    ctx->dma = dma;
+    usart_setup(ctx, usart, tx_rb_ptr, rx_rb_ptr);
 
-static void usart_start_tx(usart_ctx_t *ctx)
+    /* RX: circular over the whole ring storage.  The DMA write position is
+       the ring head-to-be, so the ring size must fit NDTR (it always does,
+       RINGBUF_MAX_SIZE < 65536) */
+    dma_stream_reset(dma->dma, dma->rx_stream);
+    dma_channel_select(dma->dma, dma->rx_stream, dma->channel);
+    dma_set_priority(dma->dma, dma->rx_stream, DMA_SxCR_PL_HIGH);
+    dma_set_transfer_mode(dma->dma, dma->rx_stream, DMA_SxCR_DIR_PERIPHERAL_TO_MEM);
+    dma_set_peripheral_address(dma->dma, dma->rx_stream, (uint32_t)&USART_DR(usart));
+    dma_set_peripheral_size(dma->dma, dma->rx_stream, DMA_SxCR_PSIZE_8BIT);
+    dma_set_memory_size(dma->dma, dma->rx_stream, DMA_SxCR_MSIZE_8BIT);
+    dma_enable_memory_increment_mode(dma->dma, dma->rx_stream);
+    dma_enable_circular_mode(dma->dma, dma->rx_stream);
+    dma_enable_half_transfer_interrupt(dma->dma, dma->rx_stream);
+    dma_enable_transfer_complete_interrupt(dma->dma, dma->rx_stream);
+    usart_dma_rx_start(ctx);
+
+    /* TX: one-shot bursts, set up per span in usart_start_tx_dma() */
+    dma_stream_reset(dma->dma, dma->tx_stream);
+    dma_channel_select(dma->dma, dma->tx_stream, dma->channel);
+    dma_set_priority(dma->dma, dma->tx_stream, DMA_SxCR_PL_MEDIUM);
+    dma_set_transfer_mode(dma->dma, dma->tx_stream, DMA_SxCR_DIR_MEM_TO_PERIPHERAL);
+    dma_set_peripheral_address(dma->dma, dma->tx_stream, (uint32_t)&USART_DR(usart));
+    dma_set_peripheral_size(dma->dma, dma->tx_stream, DMA_SxCR_PSIZE_8BIT);
+    dma_set_memory_size(dma->dma, dma->tx_stream, DMA_SxCR_MSIZE_8BIT);
+    dma_enable_memory_increment_mode(dma->dma, dma->tx_stream);
+    dma_enable_transfer_complete_interrupt(dma->dma, dma->tx_stream);
+
+    usart_enable_rx_dma(usart);
+    usart_enable_tx_dma(usart);
+
+    /* Idle line ends a burst shorter than half the ring.  Errors come in
+       on their own, the characters having gone by DMA */
+    USART_CR1(usart) |= USART_CR1_IDLEIE | USART_CR1_PEIE;
+    usart_enable_error_interrupt(usart);
+
+    usart_enable(usart);
+}
+
+void usart_set_event_fn(usart_ctx_t *ctx, usart_event_cb_t fn, void *fn_ctx)
+{
+    ctx->event_cb_ctx = fn_ctx;
+    ctx->event_cb = fn;
+}
+
+void usart_set_rx_tap(usart_ctx_t *ctx, usart_rx_tap_t fn, void *fn_ctx)
+{
+    uint32_t masked = cm_mask_interrupts(1);
+
+    ctx->rx_tap_ctx = fn_ctx;
+    ctx->rx_tap = fn;
+    cm_mask_interrupts(masked);
+}
+
+void usart_set_tx_tap(usart_ctx_t *ctx, usart_tx_tap_t fn, void *fn_ctx)
+{
+    uint32_t masked = cm_mask_interrupts(1);
+
+    ctx->tx_tap_ctx = fn_ctx;
+    ctx->tx_tap = fn;
+    cm_mask_interrupts(masked);
+}
+
+void usart_set_loopback(usart_ctx_t *ctx, bool on)
+{
+    uint32_t masked = cm_mask_interrupts(1);
+
+    if (on) {
+        USART_CR3(ctx->usart) |= USART_CR3_HDSEL;
+    } else {
+        USART_CR3(ctx->usart) &= ~USART_CR3_HDSEL;
+    }
+    cm_mask_interrupts(masked);
+}
+
+void usart_get_counters(usart_ctx_t *ctx, usart_counters_t *counters)
+{
+    uint32_t masked = cm_mask_interrupts(1);
+
+    *counters = ctx->counters;
+    cm_mask_interrupts(masked);
+}
+
+static void usart_report(usart_ctx_t *ctx, uint8_t events)
+{
+    if (events == 0) {
+        return;
+    }
+    ctx->counters.overruns += (events & USART_EVENT_OVERRUN) != 0;
+    ctx->counters.framing_errors += (events & USART_EVENT_FRAMING) != 0;
+    ctx->counters.parity_errors += (events & USART_EVENT_PARITY) != 0;
+    ctx->counters.breaks += (events & USART_EVENT_BREAK) != 0;
+    if (ctx->event_cb != NULL) {
+        ctx->event_cb(ctx->event_cb_ctx, events);
+    }
+}
+
+/* Events for the character in DR, given the SR read before it */
+static uint8_t usart_sr_events(uint32_t sr, uint16_t data)
+{
+    uint8_t events = 0;
+
+    if (sr & USART_SR_ORE) {
+        events |= USART_EVENT_OVERRUN;
+    }
+    if (sr & USART_SR_PE) {
+        events |= USART_EVENT_PARITY;
+    }
+    if (sr & USART_SR_FE) {
+        events |= (data == 0) ? USART_EVENT_BREAK : USART_EVENT_FRAMING;
+    }
+    return events;
+}
+
+void usart_set_flow(usart_ctx_t *ctx, const usart_flow_cfg_t *flow)
+{
+    ctx->flow = flow;
+    ctx->rts_held = 0;
+
+    if (flow->rts_port != 0) {
+        gpio_clear(flow->rts_port, flow->rts_pin);
+        ringbuf_set_read_notify_fn(ctx->rx_rb_ptr, usart_rx_drained_cb, (void *)ctx,
+                                   ctx->rx_rb_ptr->size / 4);
+    }
+    /* Deasserting CTS needs nothing, TX checks it per byte or burst.  Only
+       asserting it has to restart TX */
+    if (flow->cts_port != 0) {
+        exti_select_source(flow->cts_pin, flow->cts_port);
+        exti_set_trigger(flow->cts_pin, EXTI_TRIGGER_FALLING);
+        exti_reset_request(flow->cts_pin);
+        exti_enable_request(flow->cts_pin);
+    }
+}
+
+/* Producer side, after publishing RX data.  Only the reader releases RTS */
+static void usart_rts_update(usart_ctx_t *ctx)
+{
+    const usart_flow_cfg_t *flow = ctx->flow;
+    ringbuf_t *rb = ctx->rx_rb_ptr;
+
+    if (flow == NULL || flow->rts_port == 0 || ctx->rts_held) {
+        return;
+    }
+    if (ringbuf_count(rb) >= rb->size / 4 + rb->size / 8) {
+        ctx->rts_held = 1;
+        gpio_set(flow->rts_port, flow->rts_pin);
+    }
+}
+
+static void usart_rts_release(usart_ctx_t *ctx)
+{
+    uint32_t masked = cm_mask_interrupts(1);
+
+    if (ctx->rts_held) {
+        ctx->rts_held = 0;
+        gpio_clear(ctx->flow->rts_port, ctx->flow->rts_pin);
+    }
+    cm_mask_interrupts(masked);
+}
+
+/* CTS asserted, or not in use */
+static int usart_cts_clear(const usart_ctx_t *ctx)
+{
+    const usart_flow_cfg_t *flow = ctx->flow;
+
+    return flow == NULL || flow->cts_port == 0 || gpio_get(flow->cts_port, flow->cts_pin) == 0;
+}
+
+/* Stop both streams.  A stream keeps EN set until its current transfer
+   is done, and must not be touched before */
+static void usart_dma_stop(usart_ctx_t *ctx)
+{
+    const usart_dma_cfg_t *dma = ctx->dma;
+
+    dma_disable_stream(dma->dma, dma->rx_stream);
+    dma_disable_stream(dma->dma, dma->tx_stream);
+    while (DMA_SCR(dma->dma, dma->rx_stream) & DMA_SxCR_EN);
+    while (DMA_SCR(dma->dma, dma->tx_stream) & DMA_SxCR_EN);
+    dma_clear_interrupt_flags(dma->dma, dma->rx_stream,
+                              DMA_TCIF | DMA_HTIF | DMA_TEIF | DMA_DMEIF | DMA_FEIF);
+    dma_clear_interrupt_flags(dma->dma, dma->tx_stream,
+                              DMA_TCIF | DMA_HTIF | DMA_TEIF | DMA_DMEIF | DMA_FEIF);
+}
+
+/* RX stream from the base of the (empty) ring */
+static void usart_dma_rx_start(usart_ctx_t *ctx)
+{
+    const usart_dma_cfg_t *dma = ctx->dma;
+
+    dma_set_memory_address(dma->dma, dma->rx_stream, (uint32_t)ctx->rx_rb_ptr->buf);
+    dma_set_number_of_data(dma->dma, dma->rx_stream, ctx->rx_rb_ptr->size);
+    dma_enable_stream(dma->dma, dma->rx_stream);
+}
+
+int usart_set_line(usart_ctx_t *ctx, const usart_line_t *line)
+{
+    const usart_dma_cfg_t *dma = ctx->dma;
+    uint32_t us = ctx->usart;
+    uint32_t div = usart_line_div(us, line);
+
+    if (div == 0)
+        return 0;
+
+    uint32_t masked = cm_mask_interrupts(1);
+
+    /* Stop both directions */
+    if (dma != NULL) {
+        usart_dma_stop(ctx);
+    } else {
+        usart_disable_tx_interrupt(us);
+    }
+    /* Clearing UE stops the USART at the end of the current character */
+    usart_disable(us);
+
+    usart_apply_line(ctx, line, div);
+
+    /* Both sides of both rings are stopped, queued data goes */
+    if (ctx->tx_rb_ptr != NULL) {
+        ringbuf_flush(ctx->tx_rb_ptr);
+    }
+    ringbuf_reset(ctx->rx_rb_ptr);
+    usart_rts_release(ctx);
+    ctx->tx_dma_len = 0;
+    ctx->tx_idle = 1;
+
+    /* A character received at the old setting */
+    (void)usart_get_flag(us, USART_SR_RXNE);
+    (void)usart_recv(us);
+
+    if (dma != NULL) {
+        usart_dma_rx_start(ctx);
+    }
+    usart_enable(us);
+
+    cm_mask_interrupts(masked);
+    return 1;
+}
+
+/* Next byte for an interrupt driven transmitter: the link's first, ring
+   bytes only while the link's line is idle.  USART_TX_FROM_*, 0 for none */
+#define USART_TX_FROM_RING  1
+#define USART_TX_FROM_LINK  2
+
+static int usart_tx_next(usart_ctx_t *ctx, uint8_t *b, uint32_t *at)
 {
+    if (ctx->link_tail != ctx->link_head) {
+        uint8_t i = ctx->link_tail++ & (USART_LINK_DEPTH - 1);
+
+        *b = ctx->link_q[i];
+        *at = ctx->link_at[i];
+        return USART_TX_FROM_LINK;
+    }
+    if (ctx->tx_rb_ptr == NULL || (ctx->link != NULL && ctx->link->rx_busy)) {
+        return 0;
+    }
+    return ringbuf_get(ctx->tx_rb_ptr, b) ? USART_TX_FROM_RING : 0;
+}
 
-    if (!ctx->tx_idle)
+static void usart_tx_byte(usart_ctx_t *ctx, uint8_t b, int from, uint32_t at)
+{
+    usart_send(ctx->usart, b);
+    ctx->counters.tx_bytes++;
+    if (from == USART_TX_FROM_LINK) {
+        /* In 64 bits: a byte held behind CTS or an injection can wait
+           longer than the 44.7 ms that fits 32 bits of ns */
+        uint64_t ns = (uint64_t)(dwt_read_cycle_counter() - at) * 1000u /
+                      ctx->link_cycles_per_us;
+
+        if (ns > UINT32_MAX) {
+            ns = UINT32_MAX;
+        }
+        ctx->link_stats.bytes++;
+        if (ns > ctx->link_stats.latency_max_ns) {
+            ctx->link_stats.latency_max_ns = ns;
+        }
+    }
+    if (ctx->tx_tap != NULL) {
+        ctx->tx_tap(ctx->tx_tap_ctx, &b, 1);
+    }
+}
+
+/* A byte from the link's RX, straight out if the transmitter is free */
+static void usart_link_tx(usart_ctx_t *ctx, uint8_t b, uint32_t at)
+{
+    if ((uint8_t)(ctx->link_head - ctx->link_tail) == USART_LINK_DEPTH) {
+        ctx->link_stats.dropped++;
+        return;
+    }
+    if (!ctx->tx_idle) {
+        ctx->link_stats.queued++;
+    }
+    ctx->link_q[ctx->link_head & (USART_LINK_DEPTH - 1)] = b;
+    ctx->link_at[ctx->link_head & (USART_LINK_DEPTH - 1)] = at;
+    ctx->link_head++;
+    usart_start_tx(ctx);
+}
+
+static void usart_start_tx(usart_ctx_t *ctx)
+{
+    if (ctx->dma != NULL) {
+        usart_start_tx_dma(ctx);
         return;
+    }
 
+    /* Called from the ring notify, the CTS EXTI ISR and the link */
     uint8_t b;
-    if (ringbuf_read(ctx->tx_rb_ptr, &b, 1) == 1) {
+    uint32_t at;
+    uint32_t masked = cm_mask_interrupts(1);
+    int from = 0;
+    if (ctx->tx_idle && usart_cts_clear(ctx)) {
+        from = usart_tx_next(ctx, &b, &at);
+    }
+    if (from) {
         ctx->tx_idle = 0;
-        gpio_clear(GPIOC,GPIO13);
-        usart_send(ctx->usart, b);
+    }
+    cm_mask_interrupts(masked);
+
+    if (from) {
+        usart_tx_byte(ctx, b, from, at);
         usart_enable_tx_interrupt(ctx->usart);
     }
 }
 
+/* Send the next contiguous run of the TX ring in one burst.  The bytes are
+   left in the ring until the transfer completes, so the producer can't
+   overwrite them */
+static void usart_start_tx_dma(usart_ctx_t *ctx)
+{
+    const usart_dma_cfg_t *dma = ctx->dma;
+    uint8_t *span;
+    ringbuf_idx_t n = 0;
+
+    if (ctx->tx_rb_ptr == NULL)
+        return;
+
+    /* Called from the ring notify, the transfer complete ISR and the CTS
+       EXTI ISR.  With CTS, bursts are kept short so a deassert takes
+       effect soon */
+    uint32_t masked = cm_mask_interrupts(1);
+    if (ctx->tx_idle && usart_cts_clear(ctx)) {
+        n = ringbuf_read_span(ctx->tx_rb_ptr, &span);
+        if (ctx->flow != NULL && ctx->flow->cts_port != 0 && n > USART_CTS_BURST) {
+            n = USART_CTS_BURST;
+        }
+        ctx->tx_idle = (n == 0);
+        ctx->tx_dma_len = n;
+    }
+    cm_mask_interrupts(masked);
+
+    if (n == 0)
+        return;
+
+    dma_clear_interrupt_flags(dma->dma, dma->tx_stream,
+                              DMA_TCIF | DMA_HTIF | DMA_TEIF | DMA_DMEIF | DMA_FEIF);
+    dma_set_memory_address(dma->dma, dma->tx_stream, (uint32_t)span);
+    dma_set_number_of_data(dma->dma, dma->tx_stream, n);
+    dma_enable_stream(dma->dma, dma->tx_stream);
+    if (ctx->tx_tap != NULL) {
+        ctx->tx_tap(ctx->tx_tap_ctx, span, n);
+    }
+}
+
+/* Publish whatever RX DMA has written since the last call.  The ring head
+   is the last published DMA position, so no extra state is needed.
+   Returns USART_EVENT_OVERRUN if DMA lapped the reader */
+static uint8_t usart_dma_rx_flush(usart_ctx_t *ctx)
+{
+    const usart_dma_cfg_t *dma = ctx->dma;
+    ringbuf_t *rb = ctx->rx_rb_ptr;
+    uint8_t events = 0;
+
+    /* Reached from both the USART and the DMA stream IRQ */
+    uint32_t masked = cm_mask_interrupts(1);
+
+    ringbuf_idx_t pos = (rb->size - dma_get_number_of_data(dma->dma, dma->rx_stream)) & ringbuf_mask(rb);
+    ringbuf_idx_t n = (pos - ringbuf_load_head(rb, memory_order_relaxed)) & ringbuf_mask(rb);
+    ringbuf_idx_t room = ringbuf_free(rb);
+
+    if (n > room) {
+        /* Unread bytes were overwritten; publish what the ring can hold */
+        ctx->rx_overruns++;
+        events = USART_EVENT_OVERRUN;
+        n = room;
+    }
+    if (n > 0) {
+        ringbuf_idx_t head = ringbuf_load_head(rb, memory_order_relaxed);
+
+        ringbuf_write_commit(rb, n);
+        usart_rts_update(ctx);
+        ctx->counters.rx_bytes += n;
+        if (ctx->rx_tap != NULL) {
+            ringbuf_idx_t first = rb->size - head;
+
+            if (first > n) {
+                first = n;
+            }
+            ctx->rx_tap(ctx->rx_tap_ctx, &rb->buf[head], first);
+            if (n > first) {
+                ctx->rx_tap(ctx->rx_tap_ctx, rb->buf, n - first);
+            }
+        }
+    }
+
+    cm_mask_interrupts(masked);
+    return events;
+}
+
+/* DMA set aside for the link: one interrupt per byte each way.  What RX
+   DMA had written is published, a TX burst keeps what went out */
+static void usart_link_irq_mode(usart_ctx_t *ctx)
+{
+    const usart_dma_cfg_t *dma = ctx->dma;
+    uint32_t us = ctx->usart;
+
+    USART_CR1(us) |= USART_CR1_IDLEIE;
+    if (dma == NULL) {
+        return;
+    }
+    usart_dma_stop(ctx);
+    usart_report(ctx, usart_dma_rx_flush(ctx));
+    if (ctx->tx_dma_len != 0) {
+        ringbuf_idx_t sent = ctx->tx_dma_len - dma_get_number_of_data(dma->dma, dma->tx_stream);
+
+        ringbuf_read_commit(ctx->tx_rb_ptr, sent);
+        ctx->counters.tx_bytes += sent;
+        ctx->tx_dma_len = 0;
+    }
+    usart_disable_rx_dma(us);
+    usart_disable_tx_dma(us);
+    ctx->link_dma = dma;
+    ctx->dma = NULL;
+
+    /* The last byte DMA wrote may still be in DR: TXE takes it from there */
+    ctx->tx_idle = 0;
+    usart_enable_rx_interrupt(us);
+    usart_enable_tx_interrupt(us);
+}
+
+/* And back.  DMA restarts RX at the base of the ring */
+static void usart_link_dma_mode(usart_ctx_t *ctx)
+{
+    const usart_dma_cfg_t *dma = ctx->link_dma;
+    uint32_t us = ctx->usart;
+
+    ctx->link_head = ctx->link_tail;
+    ctx->rx_busy = 0;
+    if (dma == NULL) {
+        USART_CR1(us) &= ~USART_CR1_IDLEIE;
+        return;
+    }
+    usart_disable_rx_interrupt(us);
+    usart_disable_tx_interrupt(us);
+    ctx->dma = dma;
+    ctx->link_dma = NULL;
+    ctx->tx_idle = 1;
+    ringbuf_reset(ctx->rx_rb_ptr);
+    usart_rts_release(ctx);
+    usart_dma_rx_start(ctx);
+    usart_enable_rx_dma(us);
+    usart_enable_tx_dma(us);
+    usart_start_tx_dma(ctx);
+}
+
+void usart_link(usart_ctx_t *a, usart_ctx_t *b)
+{
+    uint32_t masked = cm_mask_interrupts(1);
+
+    if (a->link == NULL) {
+        usart_link_irq_mode(a);
+        usart_link_irq_mode(b);
+        memset(&a->link_stats, 0, sizeof(a->link_stats));
+        memset(&b->link_stats, 0, sizeof(b->link_stats));
+        a->link_cycles_per_us = rcc_ahb_frequency / 1000000;
+        b->link_cycles_per_us = a->link_cycles_per_us;
+        a->link = b;
+        b->link = a;
+    }
+    cm_mask_interrupts(masked);
+}
+
+void usart_unlink(usart_ctx_t *a)
+{
+    uint32_t masked = cm_mask_interrupts(1);
+    usart_ctx_t *b = a->link;
+
+    if (b != NULL) {
+        a->link = NULL;
+        b->link = NULL;
+        usart_link_dma_mode(a);
+        usart_link_dma_mode(b);
+    }
+    cm_mask_interrupts(masked);
+}
+
+void usart_swap_tx(usart_ctx_t *a, usart_ctx_t *b)
+{
+    uint32_t masked = cm_mask_interrupts(1);
+    ringbuf_t *rb = a->tx_rb_ptr;
+
+    a->tx_rb_ptr = b->tx_rb_ptr;
+    b->tx_rb_ptr = rb;
+    if (a->tx_rb_ptr != NULL) {
+        ringbuf_set_write_notify_fn(a->tx_rb_ptr, usart_tx_notify_cb, (void *)a);
+    }
+    if (b->tx_rb_ptr != NULL) {
+        ringbuf_set_write_notify_fn(b->tx_rb_ptr, usart_tx_notify_cb, (void *)b);
+    }
+    usart_start_tx(a);
+    usart_start_tx(b);
+    cm_mask_interrupts(masked);
+}
+
 void usart_irq_handler(usart_ctx_t *ctx)
 {
     uint32_t us = ctx->usart;
 
-    /* RX interrupt */
-    if (usart_get_flag(us, USART_SR_RXNE)) {
+    if (ctx->dma != NULL) {
+        /* IDLE and the errors are cleared by reading SR then DR.  DR still
+           holds the last character DMA took, the one an error came with */
+        uint32_t sr = USART_SR(us);
+        if (sr & (USART_SR_IDLE | USART_SR_ERRORS)) {
+            uint16_t data = usart_recv(us);
+            uint8_t events = usart_dma_rx_flush(ctx);
+            usart_report(ctx, events | usart_sr_events(sr, data));
+        }
+        return;
+    }
+
+    /* RX interrupt.  The error flags belong to the character in DR.  A
+       linked USART gets it first, the rest can wait */
+    uint32_t sr = USART_SR(us);
+    if (sr & USART_SR_RXNE) {
+        uint32_t at = dwt_read_cycle_counter();
         uint8_t b = usart_recv(us);
- 	// could check for overrun here on 0 length returned  - but that is unlikely 
-        ringbuf_write(ctx->rx_rb_ptr, &b, 1);
+        uint8_t events = usart_sr_events(sr, b);
+        if (ctx->link != NULL) {
+            ctx->rx_busy = 1;
+            usart_link_tx(ctx->link, b, at);
+        }
+        if (ringbuf_write(ctx->rx_rb_ptr, &b, 1) == 0) {
+            events |= USART_EVENT_OVERRUN;
+        }
+        usart_rts_update(ctx);
+        ctx->counters.rx_bytes++;
+        if (ctx->rx_tap != NULL) {
+            ctx->rx_tap(ctx->rx_tap_ctx, &b, 1);
+        }
+        usart_report(ctx, events);
+    } else if (sr & USART_SR_IDLE) {
+        /* Only enabled while linked: a gap for the link's TX ring */
+        (void)usart_recv(us);
+        ctx->rx_busy = 0;
+        if (ctx->link != NULL) {
+            usart_start_tx(ctx->link);
+        }
     }
 
     /* TX interrupt */
     if (usart_get_flag(us, USART_SR_TXE)) {
         uint8_t b;
-        if (ringbuf_read(ctx->tx_rb_ptr, &b, 1) == 1) {
-            usart_send(us, b);
+        uint32_t at;
+        int from = usart_cts_clear(ctx) ? usart_tx_next(ctx, &b, &at) : 0;
+        if (from) {
+            usart_tx_byte(ctx, b, from, at);
         } else {
-            /* Nothing left → go idle */
-            gpio_set(GPIOC,GPIO13);
+            /* Nothing left, or CTS says stop → go idle */
             ctx->tx_idle = 1;
             usart_disable_tx_interrupt(us);
         }
     }
 }
+
+/* RX stream half / full transfer */
+void usart_dma_rx_irq_handler(usart_ctx_t *ctx)
+{
+    const usart_dma_cfg_t *dma = ctx->dma;
+
+    if (dma_get_interrupt_flag(dma->dma, dma->rx_stream, DMA_HTIF | DMA_TCIF)) {
+        dma_clear_interrupt_flags(dma->dma, dma->rx_stream, DMA_HTIF | DMA_TCIF);
+        usart_report(ctx, usart_dma_rx_flush(ctx));
+    }
+}
+
+/* TX stream transfer complete: release the burst and send the next one */
+void usart_dma_tx_irq_handler(usart_ctx_t *ctx)
+{
+    const usart_dma_cfg_t *dma = ctx->dma;
+
+    if (!dma_get_interrupt_flag(dma->dma, dma->tx_stream, DMA_TCIF))
+        return;
+    dma_clear_interrupt_flags(dma->dma, dma->tx_stream, DMA_TCIF);
+
+    ringbuf_read_commit(ctx->tx_rb_ptr, ctx->tx_dma_len);
+    ctx->counters.tx_bytes += ctx->tx_dma_len;
+    ctx->tx_dma_len = 0;
+    ctx->tx_idle = 1;
+
+    usart_start_tx_dma(ctx);
+}
+
+/* CTS asserted: restart TX if it stopped for it */
+void usart_cts_irq_handler(usart_ctx_t *ctx)
+{
+    const usart_flow_cfg_t *flow = ctx->flow;
+
+    if (flow == NULL || flow->cts_port == 0 || !exti_get_flag_status(flow->cts_pin))
+        return;
+    exti_reset_request(flow->cts_pin);
+
+    usart_start_tx(ctx);
+}
@@ -4,15 +4,194 @@
 #include <libopencm3/stm32/usart.h>
 #include "ringbuf.h"
 
+/*
+ * DMA streams for one USART (F411 RM0383 table 27/28):
+ *   USART1: DMA2, RX stream 2 (or 5), TX stream 7, channel 4
+ *   USART2: DMA1, RX stream 5,        TX stream 6, channel 4
+ * The DMA clock and the two stream IRQs are enabled by the caller, the same
+ * as the USART clock and IRQ.
+ */
 typedef struct {
+    uint32_t dma;           // DMA1 or DMA2
+    uint8_t rx_stream;      // DMA_STREAMn
+    uint8_t tx_stream;      // DMA_STREAMn
+    uint32_t channel;       // DMA_SxCR_CHSEL_n
+} usart_dma_cfg_t;
+
+/*
+ * Character format, in libopencm3 terms.  data_bits excludes the parity
+ * bit: 8, or 7 with parity (the frame is then 8 bits including parity).
+ */
+typedef struct {
+    uint32_t baud;
+    uint8_t data_bits;      // 7 or 8
+    uint32_t parity;        // USART_PARITY_NONE / _ODD / _EVEN
+    uint32_t stop_bits;     // USART_STOPBITS_1 / _1_5 / _2
+} usart_line_t;
+
+/*
+ * Line events, reported from the USART ISR as they are seen.  A break is
+ * a framing error on an all-zero character, which is still received.
+ */
+#define USART_EVENT_OVERRUN     (1 << 0)    // ORE, RX ring full, or DMA lapped
+#define USART_EVENT_FRAMING     (1 << 1)
+#define USART_EVENT_PARITY      (1 << 2)
+#define USART_EVENT_BREAK       (1 << 3)
+
+typedef void (*usart_event_cb_t)(void *ctx, uint8_t events);
+
+/* Sees received bytes as they are put in the RX ring, from the ISR.  With
+   DMA that is at each flush, in up to two runs at the ring's wrap */
+typedef void (*usart_rx_tap_t)(void *ctx, const uint8_t *data, uint16_t len);
+
+/* Sees bytes as they start out of the USART, from the ISR or the TX ring's
+   notify: a byte at a time, or with DMA a whole burst as it is started */
+typedef void (*usart_tx_tap_t)(void *ctx, const uint8_t *data, uint16_t len);
+
+/* Running totals since usart_init(), kept by the ISRs */
+typedef struct {
+    uint32_t rx_bytes;      // put in the RX ring, or dropped there for want of room
+    uint32_t tx_bytes;      // sent
+    uint32_t overruns;      // USART_EVENT_* reports
+    uint32_t framing_errors;
+    uint32_t parity_errors;
+    uint32_t breaks;
+} __attribute__((packed)) usart_counters_t;
+
+/*
+ * RTS/CTS on plain GPIOs, both active low; port 0 leaves that signal out.
+ * RTS is driven by the RX ring fill level, CTS gates the start of each TX
+ * byte (IRQ mode) or short burst (DMA mode).  The pin modes, SYSCFG clock
+ * and the EXTI IRQ of the CTS line are set up by the caller; the EXTI
+ * line itself is configured here.
+ */
+typedef struct {
+    uint32_t rts_port;      // output, push-pull
+    uint16_t rts_pin;
+    uint32_t cts_port;      // input, pulled up: nothing connected = stop
+    uint16_t cts_pin;       // a single GPIOn, also its EXTI line
+} usart_flow_cfg_t;
+
+/* Longest TX DMA burst with CTS in use: what still goes out after the
+   far end deasserts it */
+#define USART_CTS_BURST 16
+
+/* Bytes from a linked USART that can wait for the transmitter, a power of
+   two.  They only wait when the two lines run at different rates, or
+   behind a byte from the TX ring */
+#ifndef USART_LINK_DEPTH
+#define USART_LINK_DEPTH 16
+#endif
+
+/* Bytes a link sent out of this USART straight from the other one's RX */
+typedef struct {
+    uint32_t bytes;
+    uint32_t queued;            // had to wait behind another byte
+    uint32_t dropped;           // USART_LINK_DEPTH were already waiting
+    uint32_t latency_max_ns;    // from the other's RX interrupt to DR
+} __attribute__((packed)) usart_link_stats_t;
+
+typedef struct usart_ctx {
     uint32_t usart;
     ringbuf_t *tx_rb_ptr;
     ringbuf_t *rx_rb_ptr;
     volatile int tx_idle;
+    const usart_dma_cfg_t *dma;     // NULL: one interrupt per byte
+    ringbuf_idx_t tx_dma_len;       // TX bytes in flight
+    uint32_t rx_overruns;           // DMA lapped unread RX data
+    usart_line_t line;              // as last set
+    uint32_t baud_actual;           // rate the BRR divider gives, rounded
+    int32_t baud_error_ppm;         // baud_actual relative to line.baud
+    usart_event_cb_t event_cb;      // optional, called from the ISR
+    void *event_cb_ctx;
+    const usart_flow_cfg_t *flow;   // NULL: no flow control
+    volatile int rts_held;          // RTS deasserted until the RX ring drains
+    usart_rx_tap_t rx_tap;          // optional, called from the ISR
+    void *rx_tap_ctx;
+    usart_tx_tap_t tx_tap;          // optional
+    void *tx_tap_ctx;
+    usart_counters_t counters;
+    struct usart_ctx *link;         // optional, RX goes straight out of it too
+    const usart_dma_cfg_t *link_dma;    // DMA set aside while linked
+    volatile int rx_busy;           // linked: RX line active since the last IDLE
+    uint8_t link_q[USART_LINK_DEPTH];   // from the link's RX, ahead of the TX ring
+    uint32_t link_at[USART_LINK_DEPTH]; // cycle counter at their RX interrupt
+    uint8_t link_head;
+    uint8_t link_tail;
+    uint32_t link_cycles_per_us;    // set by usart_link()
+    usart_link_stats_t link_stats;
 } usart_ctx_t;
 
 void usart_init(usart_ctx_t *ctx, uint32_t usart,
                 ringbuf_t *tx_rb_ptr, ringbuf_t *rx_rb_ptr);
 
-void usart_irq_handler(usart_ctx_t *ctx);
+/*
+ * As usart_init(), but RX runs circular DMA straight into the RX ring
+ * storage and TX sends DMA bursts straight out of the TX ring storage.
+ * The RX ring is only published on idle line, half and full transfer, so
+ * it must be drained faster than half a ring per interrupt - DMA can't be
+ * held off and overwrites unread bytes (counted in rx_overruns).
+ */
+void usart_init_dma(usart_ctx_t *ctx, uint32_t usart,
+                    ringbuf_t *tx_rb_ptr, ringbuf_t *rx_rb_ptr,
+                    const usart_dma_cfg_t *dma);
+
+/*
+ * Change the character format while running.  Data queued in either ring
+ * was framed for the old setting, so both rings are flushed and any burst
+ * in flight is abandoned.  The USART runs 16x oversampling when the divider
+ * allows it, 8x above kernel clock / 16.  Returns 0, line unchanged, if the
+ * format isn't supported or the rate is out of reach of the divider.
+ */
+int usart_set_line(usart_ctx_t *ctx, const usart_line_t *line);
+
+/* Call fn with USART_EVENT_* as line errors and breaks are received */
+void usart_set_event_fn(usart_ctx_t *ctx, usart_event_cb_t fn, void *fn_ctx);
+
+/* Let fn watch the received data; the RX ring's reader is not affected */
+void usart_set_rx_tap(usart_ctx_t *ctx, usart_rx_tap_t fn, void *fn_ctx);
+
+/* Let fn watch the data sent, as it is sent */
+void usart_set_tx_tap(usart_ctx_t *ctx, usart_tx_tap_t fn, void *fn_ctx);
 
+/*
+ * Half-duplex (HDSEL): TX is looped back to RX inside the USART, so
+ * everything sent is also received, with no jumper.  The RX pin is not
+ * used meanwhile and the TX pin still drives the line.  A character on
+ * the wire as it changes may be lost.
+ */
+void usart_set_loopback(usart_ctx_t *ctx, bool on);
+
+/*
+ * Link two USARTs, as a tap inline between two devices: each byte received
+ * by one is sent out of the other from the RX interrupt, about a
+ * character time after it started, while both rings carry on as before.
+ * TX ring bytes only start on the other line's idle gaps, and a byte from
+ * the link goes ahead of them.  DMA is set aside while linked, for one
+ * interrupt per byte; when it comes back, RX not yet read is dropped
+ * and bytes still waiting for the link are lost.  Unlinking either one
+ * unlinks both.
+ */
+void usart_link(usart_ctx_t *a, usart_ctx_t *b);
+void usart_unlink(usart_ctx_t *a);
+
+/* Exchange the TX rings of two linked USARTs, so what is written for one
+   goes out of the other.  Only while linked: DMA may be sending from them
+   otherwise */
+void usart_swap_tx(usart_ctx_t *a, usart_ctx_t *b);
+
+/* Copy of the counters, consistent with each other */
+void usart_get_counters(usart_ctx_t *ctx, usart_counters_t *counters);
+
+/*
+ * Enable RTS/CTS, after usart_init() or usart_init_dma().  RTS is
+ * deasserted once the RX ring is 3/8 full (DMA publishes up to half a ring
+ * late) and asserted again when the reader has drained it to 1/4.  The RX
+ * ring's read notify is taken for this.
+ */
+void usart_set_flow(usart_ctx_t *ctx, const usart_flow_cfg_t *flow);
+
+void usart_irq_handler(usart_ctx_t *ctx);
+void usart_cts_irq_handler(usart_ctx_t *ctx);   // from the CTS line's EXTI ISR
+void usart_dma_rx_irq_handler(usart_ctx_t *ctx);
+void usart_dma_tx_irq_handler(usart_ctx_t *ctx);
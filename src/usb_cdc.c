@@ -1,4 +1,5 @@
 #include <stddef.h>
+#include <string.h>
 #include <libopencm3/usb/usbd.h>
 #include <libopencm3/usb/usbstd.h>
 #include <libopencm3/usb/cdc.h>
@@ -7,29 +8,127 @@
 #include "usb_core.h"
 #include "usb_cdc.h"
 #include "ringbuf.h"
+#include "recq.h"
+#include "timebase.h"
+#include "capture.h"
+#include "prbs.h"
+#include "prof.h"
+#include "sched.h"
 
 
-#include <libopencm3/stm32/gpio.h>
+#include <libopencm3/stm32/rcc.h>
+#include <libopencm3/cm3/cortex.h>
+#include <libopencm3/cm3/dwt.h>
 
 usbd_device *usbdev; 
 
+/* Largest record sent intact over several packets, longer ones are cut */
+#define USB_CDC_TX_RECORD_MAX 256
+
+/* USART TX seen by a capture tap, waiting for the RX task to make records
+   of it */
+#define USB_CDC_CAPTURE_STAGE 256
+
+typedef struct {
+    ringbuf_t rb;
+    uint8_t buf[USB_CDC_CAPTURE_STAGE];
+    uint32_t first_us;              // the oldest byte in rb went out
+    bool lost;                      // rb was full
+} usb_capture_stage_t;
+
 typedef struct {
+    uint8_t n;                   // function number, picks interfaces and endpoints
     ringbuf_t* tx_rb_ptr;        // TX ring buffer
     ringbuf_t* rx_rb_ptr;        // RX ring buffer
+    recq_t* tx_recq_ptr;         // optional TX record queue, sent ahead of the ring
+    uint8_t tx_rec[USB_CDC_TX_RECORD_MAX];  // record longer than one packet
+    uint16_t tx_rec_len;            // bytes in tx_rec
+    uint16_t tx_rec_off;            // bytes of tx_rec already sent
     bool tx_idle;                   // idle flag
+    bool tx_zlp;                    // last IN packet was full size, transfer still open
     bool control_line_DTR;          // 
     bool control_line_RTS;          // 
+    usart_ctx_t *usart;             // optional, SET_LINE_CODING applied to it
+    usart_ctx_t *peer;              // optional, the other side of a tap, as capture
+    struct usb_cdc_line_coding line_coding;     // as reported to the host
+    uint16_t serial_state;          // USB_CDC_SERIAL_STATE_*, errors until sent
+    bool serial_state_pending;      // notify endpoint was busy
+    usb_cdc_ptt_event_t ptt_event;  // latest PTT edge
+    bool ptt_pending;               // not yet sent, notify endpoint was busy
+    bool ptt_in_flight;             // the notify packet out now is a PTT edge
+    uint32_t ptt_in_flight_us;      // that edge's time
+    usb_cdc_ptt_status_t ptt_status;
+    bool out_held;                  // OUT NAKed until the RX ring drains
+    uint32_t out_held_start;        // cycle counter when it was
+    uint32_t out_holds;             // times OUT was held off
+    uint32_t out_held_us;           // for how long, in total
+    uint32_t out_dropped;           // OUT packets ACKed with no room for them
+    usb_cdc_rx_aggr_t rx_aggr;      // RX gathering, off while max_us is 0
+    bool rx_aggr_pending;           // RX is being held, its timers running
+    bool rx_aggr_flush;             // a time limit passed: send what is held
+    timebase_timer_t rx_aggr_max_timer;
+    timebase_timer_t rx_aggr_gap_timer;
+    ringbuf_t retain_rb;            // RX kept while DTR is low, sent ahead of the ring
+    uint8_t retain_buf[USB_CDC_RETAIN_MAX];
+    uint16_t retain_depth;          // 0: RX is dropped while DTR is low
+    uint32_t retain_dropped;        // oldest bytes dropped to stay within it
+    ft_frame_parser_t *rx_parser;   // optional, parses RX into frames
+    bool rx_frames;                 // only its good frames are sent
+    ft_delta_t *rx_delta;           // optional, last frame of each type
+    uint16_t rx_delta_keyframe_ms;  // 0: every frame is sent
+    timebase_timer_t rx_delta_timer;
+    bool capture;                   // RX and TX sent as capture records
+    uint32_t capture_dropped;       // record queue drops when the last was written
+    usb_capture_stage_t capture_tx[2];  // the function's USART, then the peer's
+    uint32_t peer_rx_us;            // peer RX arrived, for the task
+    uint8_t selftest;               // USB_CDC_SELFTEST_*, STOP: bridging
+    uint32_t selftest_start_us;
+    prbs_gen_t selftest_gen;
+    prbs_check_t selftest_check;
+    usart_counters_t selftest_counters;         // at the start
+    usb_cdc_selftest_status_t selftest_status;  // as of the stop, once stopped
+    sched_task_t rx_task;           // RX work that can wait for the main loop
+    uint32_t rx_seen_us;            // RX arrived, for the task
+    bool rx_delta_reset;            // for the task: forget the kept frames first
+    bool rx_keyframe_due;           // for the task: send them all again
 } usb_cdc_context;
 
-/* STATIC context for cdc state */
-static usb_cdc_context ctx; 
+/* STATIC context for cdc state, one per function */
+static usb_cdc_context cdc[USB_CDC_NUM];
+
+/* USB_CDC_LINK_*: there are only the two USARTs to link */
+static uint8_t link_mode;
 
 /* Forward declarations */
 void usb_set_config(usbd_device *usbd_dev, uint16_t wValue);
-static void usb_start_tx(void);
+static void usb_start_tx(usb_cdc_context *c);
+static void usb_start_tx_records(usb_cdc_context *c);
+static uint16_t usb_write_packet(usb_cdc_context *c, const uint8_t *buf, uint16_t len);
 static void cdc_data_rx_cb(usbd_device *dev, uint8_t ep);
 static void cdc_data_tx_cb(usbd_device *dev, uint8_t ep);
+static void cdc_notify_tx_cb(usbd_device *dev, uint8_t ep);
+static void usb_send_serial_state(usb_cdc_context *c);
+static void usb_send_ptt(usb_cdc_context *c);
+static void usb_rx_hold(usb_cdc_context *c);
+static void usb_rx_aggr_done(usb_cdc_context *c);
+static void usb_rx_delta_restart(usb_cdc_context *c);
+static void usb_rx_delta_keyframe_cb(void *passed_ctx);
+static void usb_capture_enable(usb_cdc_context *c, bool on);
+static bool usb_link_pair(usb_cdc_context *c, usart_ctx_t **a, usart_ctx_t **b);
+static bool usb_link_set(usb_cdc_context *c, uint16_t mode);
+static void usb_selftest_fill(usb_cdc_context *c);
+static void usb_selftest_send(usb_cdc_context *c);
+static void usb_selftest_rx(usb_cdc_context *c, const uint8_t *data, ringbuf_idx_t n);
+static bool usb_selftest_start(usb_cdc_context *c, uint8_t mode);
+static void usb_selftest_update(usb_cdc_context *c);
+static bool usb_rx_deferred(usb_cdc_context *c);
+static void usb_rx_arrived(usb_cdc_context *c);
+static void usb_cdc_frame_send(void *passed_ctx, const ft_frame_t *frame);
 void usb_cdc_ringbuf_write_notify_cb(void  *passed_ctx); 
+void usb_cdc_rx_drained_cb(void *passed_ctx);
+void usb_cdc_recq_write_notify_cb(void *passed_ctx);
+void usb_cdc_peer_rx_notify_cb(void *passed_ctx);
+void usb_cdc_usart_event_cb(void *passed_ctx, uint8_t events);
 
 /* --------------------------------------------------------------------------
  * Class hooks
@@ -39,6 +138,80 @@ void usb_cdc_ringbuf_write_notify_cb(void  *passed_ctx);
 #define USB_CDC_CONTROL_LINE_DTR   (1 << 0)
 #define USB_CDC_CONTROL_LINE_RTS   (1 << 1)
 
+/* SERIAL_STATE bitmap (PSTN 6.5.4).  DCD and DSR are levels, the rest are
+   one-shot and cleared once sent */
+#define USB_CDC_SERIAL_STATE_DCD       (1 << 0)
+#define USB_CDC_SERIAL_STATE_DSR       (1 << 1)
+#define USB_CDC_SERIAL_STATE_BREAK     (1 << 2)
+#define USB_CDC_SERIAL_STATE_RING      (1 << 3)
+#define USB_CDC_SERIAL_STATE_FRAMING   (1 << 4)
+#define USB_CDC_SERIAL_STATE_PARITY    (1 << 5)
+#define USB_CDC_SERIAL_STATE_OVERRUN   (1 << 6)
+#define USB_CDC_SERIAL_STATE_LEVELS    (USB_CDC_SERIAL_STATE_DCD | USB_CDC_SERIAL_STATE_DSR)
+
+
+static const uint32_t cdc_stop_bits[] = {
+    [USB_CDC_1_STOP_BITS] = USART_STOPBITS_1,
+    [USB_CDC_1_5_STOP_BITS] = USART_STOPBITS_1_5,
+    [USB_CDC_2_STOP_BITS] = USART_STOPBITS_2,
+};
+
+static const uint32_t cdc_parity[] = {
+    [USB_CDC_NO_PARITY] = USART_PARITY_NONE,
+    [USB_CDC_ODD_PARITY] = USART_PARITY_ODD,
+    [USB_CDC_EVEN_PARITY] = USART_PARITY_EVEN,
+};
+
+/* 0 for mark and space parity, the USART has neither */
+static int cdc_to_usart_line(const struct usb_cdc_line_coding *coding, usart_line_t *line)
+{
+    if (coding->bCharFormat > USB_CDC_2_STOP_BITS || coding->bParityType > USB_CDC_EVEN_PARITY) {
+        return 0;
+    }
+    line->baud = coding->dwDTERate;
+    line->data_bits = coding->bDataBits;
+    line->parity = cdc_parity[coding->bParityType];
+    line->stop_bits = cdc_stop_bits[coding->bCharFormat];
+    return 1;
+}
+
+static void usart_line_to_cdc(const usart_line_t *line, struct usb_cdc_line_coding *coding)
+{
+    coding->dwDTERate = line->baud;
+    coding->bDataBits = line->data_bits;
+    coding->bParityType = USB_CDC_NO_PARITY;
+    coding->bCharFormat = USB_CDC_1_STOP_BITS;
+    for (uint8_t i = 0; i < sizeof(cdc_parity) / sizeof(cdc_parity[0]); i++) {
+        if (cdc_parity[i] == line->parity) {
+            coding->bParityType = i;
+        }
+    }
+    for (uint8_t i = 0; i < sizeof(cdc_stop_bits) / sizeof(cdc_stop_bits[0]); i++) {
+        if (cdc_stop_bits[i] == line->stop_bits) {
+            coding->bCharFormat = i;
+        }
+    }
+}
+
+/* Function addressed by a request to its comm interface */
+static usb_cdc_context *cdc_from_iface(uint16_t iface)
+{
+    if (iface >= IFACE_COUNT || iface != IFACE_CDC_COMM(iface / 2)) {
+        return NULL;
+    }
+    return &cdc[iface / 2];
+}
+
+/* Data endpoint n + 1 belongs to function n, either direction */
+static usb_cdc_context *cdc_from_ep(uint8_t ep)
+{
+    return &cdc[(ep & 0x7f) - 1];
+}
+
+static usb_cdc_context *cdc_from_notify_ep(uint8_t ep)
+{
+    return &cdc[(ep & 0x7f) - USB_CDC_NUM - 1];
+}
 
 static enum usbd_request_return_codes
 cdc_control_request_cb(usbd_device *dev,
@@ -49,42 +222,59 @@ cdc_control_request_cb(usbd_device *dev,
 {
     (void)dev;
     (void)complete;
+    usb_cdc_context *c = cdc_from_iface(req->wIndex);
+
+    if (c == NULL) {
+        return USBD_REQ_NEXT_CALLBACK;
+    }
 
     switch (req->bRequest) {
     case USB_CDC_REQ_SET_CONTROL_LINE_STATE:
         /* You can watch req->wValue bits here if you care */
-	ctx.control_line_DTR = ((req->wValue & USB_CDC_CONTROL_LINE_DTR) != 0);
-        if (ctx.control_line_DTR ) 
-        { 
-            gpio_clear(GPIOC, GPIO13);
+	c->control_line_DTR = ((req->wValue & USB_CDC_CONTROL_LINE_DTR) != 0);
+	c->control_line_RTS = req->wValue & USB_CDC_CONTROL_LINE_RTS;
+        /* What the RX ring holds may change hands */
+        sched_post(&c->rx_task);
 
-        } else {
-           gpio_set(GPIOC, GPIO13);
+        /* Port opened: tell the host DCD and DSR are up, and send what was
+           kept for it */
+        if (c->control_line_DTR) {
+            usb_send_serial_state(c);
+            if (c->tx_idle && !ringbuf_empty(&c->retain_rb)) {
+                usb_start_tx(c);
+            }
         }
-
-	ctx.control_line_RTS = req->wValue & USB_CDC_CONTROL_LINE_RTS;
         return USBD_REQ_HANDLED;
 
-    case USB_CDC_REQ_SET_LINE_CODING:
-        /* Host sends 7 bytes; we just accept them */
-        if (*len == 7) {
-            return USBD_REQ_HANDLED;
+    case USB_CDC_REQ_SET_LINE_CODING: {
+        struct usb_cdc_line_coding coding;
+        usart_line_t line;
+
+        if (*len < sizeof(coding)) {
+            return USBD_REQ_NOTSUPP;
+        }
+        memcpy(&coding, *buf, sizeof(coding));
+        /* Stall what the USART can't do rather than run at the wrong rate */
+        if (!cdc_to_usart_line(&coding, &line)) {
+            return USBD_REQ_NOTSUPP;
         }
-        return USBD_REQ_NOTSUPP;
+        if (c->usart != NULL && !usart_set_line(c->usart, &line)) {
+            return USBD_REQ_NOTSUPP;
+        }
+        /* Both sides of a tap run the same line */
+        if (c->peer != NULL && !usart_set_line(c->peer, &line)) {
+            return USBD_REQ_NOTSUPP;
+        }
+        c->line_coding = coding;
+        return USBD_REQ_HANDLED;
+    }
 
     case USB_CDC_REQ_GET_LINE_CODING:
-        if (*len < 7) {
+        if (*len < sizeof(c->line_coding)) {
             return USBD_REQ_NOTSUPP;
         }
-        /* Fake 115200 8N1 for both functions */
-        (*buf)[0] = 0x00; /* 115200 = 0x0001C200 (little endian) */
-        (*buf)[1] = 0xC2;
-        (*buf)[2] = 0x01;
-        (*buf)[3] = 0x00;
-        (*buf)[4] = 0;    /* stop bits: 1 */
-        (*buf)[5] = 0;    /* parity: none */
-        (*buf)[6] = 8;    /* data bits: 8 */
-        *len = 7;
+        memcpy(*buf, &c->line_coding, sizeof(c->line_coding));
+        *len = sizeof(c->line_coding);
         return USBD_REQ_HANDLED;
 
     default:
@@ -94,33 +284,309 @@ cdc_control_request_cb(usbd_device *dev,
 
 
 
+static enum usbd_request_return_codes
+cdc_vendor_request_cb(usbd_device *dev,
+                      struct usb_setup_data *req,
+                      uint8_t **buf,
+                      uint16_t *len,
+                      usbd_control_complete_callback *complete)
+{
+    (void)dev;
+    (void)complete;
+    usb_cdc_line_status_t status;
+    usb_cdc_context *c = cdc_from_iface(req->wIndex);
+
+    if (c == NULL) {
+        return USBD_REQ_NEXT_CALLBACK;
+    }
+
+    switch (req->bRequest) {
+    case USB_CDC_VENDOR_REQ_GET_LINE_STATUS:
+        if (!(req->bmRequestType & USB_REQ_TYPE_IN) || c->usart == NULL) {
+            return USBD_REQ_NOTSUPP;
+        }
+        status.baud = c->usart->line.baud;
+        status.baud_actual = c->usart->baud_actual;
+        status.baud_error_ppm = c->usart->baud_error_ppm;
+        status.out_holds = c->out_holds;
+        status.out_held_us = c->out_held_us;
+        status.out_dropped = c->out_dropped;
+        status.rx_retained = ringbuf_count(&c->retain_rb);
+        status.rx_dropped = c->retain_dropped;
+        if (*len > sizeof(status)) {
+            *len = sizeof(status);
+        }
+        memcpy(*buf, &status, *len);
+        return USBD_REQ_HANDLED;
+
+    case USB_CDC_VENDOR_REQ_RX_AGGREGATION:
+        if (req->bmRequestType & USB_REQ_TYPE_IN) {
+            if (*len > sizeof(c->rx_aggr)) {
+                *len = sizeof(c->rx_aggr);
+            }
+            memcpy(*buf, &c->rx_aggr, *len);
+        } else {
+            usb_cdc_rx_aggr_t aggr;
+
+            if (*len != sizeof(aggr)) {
+                return USBD_REQ_NOTSUPP;
+            }
+            memcpy(&aggr, *buf, sizeof(aggr));
+            usb_cdc_set_rx_aggr(c->n, &aggr);
+        }
+        return USBD_REQ_HANDLED;
+
+    case USB_CDC_VENDOR_REQ_RX_RETENTION:
+        if (req->bmRequestType & USB_REQ_TYPE_IN) {
+            if (*len > sizeof(c->retain_depth)) {
+                *len = sizeof(c->retain_depth);
+            }
+            memcpy(*buf, &c->retain_depth, *len);
+        } else {
+            usb_cdc_set_rx_retention(c->n, req->wValue);
+        }
+        return USBD_REQ_HANDLED;
+
+    case USB_CDC_VENDOR_REQ_RX_FRAMES:
+        if (c->rx_parser == NULL) {
+            return USBD_REQ_NOTSUPP;
+        }
+        if (req->bmRequestType & USB_REQ_TYPE_IN) {
+            if (*len > sizeof(c->rx_parser->stats)) {
+                *len = sizeof(c->rx_parser->stats);
+            }
+            memcpy(*buf, &c->rx_parser->stats, *len);
+        } else {
+            c->rx_frames = (req->wValue != 0);
+            sched_post(&c->rx_task);
+        }
+        return USBD_REQ_HANDLED;
+
+    case USB_CDC_VENDOR_REQ_RX_DELTA:
+        if (c->rx_delta == NULL) {
+            return USBD_REQ_NOTSUPP;
+        }
+        if (req->bmRequestType & USB_REQ_TYPE_IN) {
+            if (*len > sizeof(c->rx_delta->stats)) {
+                *len = sizeof(c->rx_delta->stats);
+            }
+            memcpy(*buf, &c->rx_delta->stats, *len);
+        } else {
+            /* Start from nothing kept, so the first of each type goes out.
+               The RX task parses against it, so it forgets them itself */
+            c->rx_delta_reset = true;
+            c->rx_delta_keyframe_ms = req->wValue;
+            usb_rx_delta_restart(c);
+            sched_post(&c->rx_task);
+        }
+        return USBD_REQ_HANDLED;
+
+    case USB_CDC_VENDOR_REQ_CAPTURE:
+        if (c->usart == NULL || c->tx_recq_ptr == NULL || (req->bmRequestType & USB_REQ_TYPE_IN)) {
+            return USBD_REQ_NOTSUPP;
+        }
+        usb_capture_enable(c, req->wValue != 0);
+        return USBD_REQ_HANDLED;
+
+    case USB_CDC_VENDOR_REQ_PTT_STATUS:
+        if (!(req->bmRequestType & USB_REQ_TYPE_IN)) {
+            return USBD_REQ_NOTSUPP;
+        }
+        if (*len > sizeof(c->ptt_status)) {
+            *len = sizeof(c->ptt_status);
+        }
+        memcpy(*buf, &c->ptt_status, *len);
+        return USBD_REQ_HANDLED;
+
+    case USB_CDC_VENDOR_REQ_SELFTEST:
+        if (req->bmRequestType & USB_REQ_TYPE_IN) {
+            usb_selftest_update(c);
+            if (*len > sizeof(c->selftest_status)) {
+                *len = sizeof(c->selftest_status);
+            }
+            memcpy(*buf, &c->selftest_status, *len);
+        } else if (!usb_selftest_start(c, req->wValue)) {
+            return USBD_REQ_NOTSUPP;
+        }
+        return USBD_REQ_HANDLED;
+
+    case USB_CDC_VENDOR_REQ_LINK:
+        if (req->bmRequestType & USB_REQ_TYPE_IN) {
+            usb_cdc_link_status_t link;
+            usart_ctx_t *a, *b;
+
+            if (!usb_link_pair(c, &a, &b)) {
+                return USBD_REQ_NOTSUPP;
+            }
+            memset(&link, 0, sizeof(link));
+            link.linked = link_mode;
+            link.out[0] = a->link_stats;
+            link.out[1] = b->link_stats;
+            if (*len > sizeof(link)) {
+                *len = sizeof(link);
+            }
+            memcpy(*buf, &link, *len);
+        } else if (!usb_link_set(c, req->wValue)) {
+            return USBD_REQ_NOTSUPP;
+        }
+        return USBD_REQ_HANDLED;
+
+    case USB_CDC_VENDOR_REQ_RX_REFRESH:
+        if (c->rx_delta == NULL || (req->bmRequestType & USB_REQ_TYPE_IN)) {
+            return USBD_REQ_NOTSUPP;
+        }
+        c->rx_keyframe_due = true;
+        sched_post(&c->rx_task);
+        return USBD_REQ_HANDLED;
+
+    default:
+        return USBD_REQ_NEXT_CALLBACK;
+    }
+}
+
+
 static void cdc_data_rx_cb(usbd_device *dev, uint8_t ep)
 {
-    (void)ep;
-    uint8_t buf[64];
+    usb_cdc_context *c = cdc_from_ep(ep);
+    uint8_t *span;
+
+    /* Self-test: OUT is the USB pattern, or dropped */
+    if (c->selftest != USB_CDC_SELFTEST_STOP) {
+        uint8_t buf[CDC_DATA_PACKET_SIZE];
+        int len = usbd_ep_read_packet(dev, ep, buf, sizeof(buf));
+
+        if (c->selftest == USB_CDC_SELFTEST_USB) {
+            prbs_check(&c->selftest_check, buf, len);
+        }
+        return;
+    }
 
-    /* if we can not store the largest endpoint packete, then 
-       do not read the endpoint which will cause usb subsystem to NAK packet 
-       providing backpressure to host.  Host will retry packet later,  unstalling the pipeline
-    */
-   
-    if (ringbuf_free(ctx.rx_rb_ptr) < sizeof(buf))
+    /* Every write to the ring, this one's or usb_cdc_usart_send()'s, runs
+       usb_rx_hold(), which NAKs the endpoint before the ring gets this
+       full.  Should a packet get through anyway it has been ACKed: read it
+       so the endpoint is re-armed, hold OUT, and tell the host it was lost */
+    if (ringbuf_free(c->rx_rb_ptr) < CDC_DATA_PACKET_SIZE)
     {
-	/* No room at the inn */
+        uint8_t buf[CDC_DATA_PACKET_SIZE];
+
+        usbd_ep_read_packet(dev, ep, buf, sizeof(buf));
+        c->out_dropped++;
+        usb_rx_hold(c);
+        if (c->control_line_DTR) {
+            c->serial_state |= USB_CDC_SERIAL_STATE_OVERRUN;
+            if (!c->serial_state_pending) {
+                usb_send_serial_state(c);
+            }
+        }
         return;
-    }  
+    }
 
-    int len = usbd_ep_read_packet(dev, EP_CDC0_OUT, buf, sizeof(buf));
+    /* Read the packet straight into ring storage when it can not straddle
+       the wrap point.  Only the packet that does straddle it takes a bounce */
+    if (ringbuf_write_span(c->rx_rb_ptr, &span) >= CDC_DATA_PACKET_SIZE)
+    {
+        int len = usbd_ep_read_packet(dev, ep, span, CDC_DATA_PACKET_SIZE);
+        ringbuf_write_commit(c->rx_rb_ptr, len);
+    }
+    else
+    {
+        uint8_t buf[CDC_DATA_PACKET_SIZE];
+        int len = usbd_ep_read_packet(dev, ep, buf, sizeof(buf));
 
-    ringbuf_write(ctx.rx_rb_ptr, buf, len);
- 
+        ringbuf_write(c->rx_rb_ptr, buf, len);
+    }
+    usb_rx_hold(c);
+}
+
+/* No room left for another packet: NAK OUT in hardware so the host keeps
+   the next one, until the USART has drained a packet's worth */
+static void usb_rx_hold(usb_cdc_context *c)
+{
+    /* The drained callback runs from the USART side */
+    uint32_t masked = cm_mask_interrupts(1);
+
+    if (!c->out_held && ringbuf_free(c->rx_rb_ptr) < CDC_DATA_PACKET_SIZE) {
+        usbd_ep_nak_set(usbdev, EP_CDC_OUT(c->n), 1);
+        c->out_held = true;
+        c->out_held_start = dwt_read_cycle_counter();
+        c->out_holds++;
+    }
+    cm_mask_interrupts(masked);
+}
+
+/* Bytes for a USART's TX from outside CDC OUT, whole or not at all.  Its
+   ring may be a function's OUT ring, which must then be held as after an
+   OUT packet */
+bool usb_cdc_usart_send(usart_ctx_t *usart, const uint8_t *data, uint16_t len)
+{
+    ringbuf_t *rb = usart->tx_rb_ptr;
+
+    if (ringbuf_free(rb) < len) {
+        return false;
+    }
+    ringbuf_write(rb, data, len);
+    for (uint8_t n = 0; n < USB_CDC_NUM; n++) {
+        if (cdc[n].rx_rb_ptr == rb) {
+            usb_rx_hold(&cdc[n]);
+        }
+    }
+    return true;
+}
+
+/* RX ring read down to its low_wm: a whole packet fits again.  Clearing the
+   NAK lets the host's next retry of the held packet through */
+void usb_cdc_rx_drained_cb(void *passed_ctx)
+{
+    usb_cdc_context *c = passed_ctx;
+    PROF_BEGIN();
+    uint32_t masked = cm_mask_interrupts(1);
+
+    if (c->out_held) {
+        usbd_ep_nak_set(usbdev, EP_CDC_OUT(c->n), 0);
+        c->out_held = false;
+        c->out_held_us += (dwt_read_cycle_counter() - c->out_held_start) /
+                          (rcc_ahb_frequency / 1000000);
+    }
+    cm_mask_interrupts(masked);
+
+    /* A USART self-test keeps the ring topped up with its pattern */
+    if (c->selftest == USB_CDC_SELFTEST_USART_JUMPER ||
+        c->selftest == USB_CDC_SELFTEST_USART_LOOPBACK) {
+        usb_selftest_fill(c);
+    }
+    PROF_END(PROF_CDC_RX_DRAINED);
 }
 
 static void cdc_data_tx_cb(usbd_device *dev, uint8_t ep)
 {
-    (void)dev; (void)ep;
+    (void)dev;
+
+    usb_start_tx(cdc_from_ep(ep));
+}
 
-    usb_start_tx();
+static void cdc_notify_tx_cb(usbd_device *dev, uint8_t ep)
+{
+    usb_cdc_context *c = cdc_from_notify_ep(ep);
+
+    (void)dev;
+    if (c->ptt_in_flight) {
+        uint32_t latency = timebase_now_us() - c->ptt_in_flight_us;
+
+        c->ptt_in_flight = false;
+        c->ptt_status.events++;
+        c->ptt_status.latency_last_us = latency;
+        c->ptt_status.latency_total_us += latency;
+        if (latency > c->ptt_status.latency_max_us) {
+            c->ptt_status.latency_max_us = latency;
+        }
+    }
+
+    /* PTT first, it is the one waited on */
+    if (c->ptt_pending) {
+        usb_send_ptt(c);
+    } else if (c->serial_state_pending) {
+        usb_send_serial_state(c);
+    }
 }
 
 
@@ -128,73 +594,999 @@ void usb_set_config(usbd_device *usbd_dev, uint16_t wValue)
 {
     (void)wValue;
 
-    /* CDC0 endpoints */
-    usbd_ep_setup(usbd_dev, EP_CDC0_OUT,
-                  USB_ENDPOINT_ATTR_BULK, 64, cdc_data_rx_cb);
-    usbd_ep_setup(usbd_dev, EP_CDC0_IN,
-                  USB_ENDPOINT_ATTR_BULK, 64, cdc_data_tx_cb);
-    usbd_ep_setup(usbd_dev, EP_CDC0_NOTIFY,
-                  USB_ENDPOINT_ATTR_INTERRUPT, 16, NULL);
+    /* Every function in the descriptors, main.c starts them all */
+    for (uint8_t n = 0; n < USB_CDC_NUM; n++) {
+        usbd_ep_setup(usbd_dev, EP_CDC_OUT(n),
+                      USB_ENDPOINT_ATTR_BULK, CDC_DATA_PACKET_SIZE, cdc_data_rx_cb);
+        usbd_ep_setup(usbd_dev, EP_CDC_IN(n),
+                      USB_ENDPOINT_ATTR_BULK, CDC_DATA_PACKET_SIZE, cdc_data_tx_cb);
+        usbd_ep_setup(usbd_dev, EP_CDC_NOTIFY(n),
+                      USB_ENDPOINT_ATTR_INTERRUPT, 16, cdc_notify_tx_cb);
+        cdc[n].serial_state_pending = false;
+        cdc[n].ptt_pending = false;
+        cdc[n].ptt_in_flight = false;
+        cdc[n].out_held = false;
+    }
 
-    /* One control callback shared for both CDC functions */
+    /* One control callback shared by all CDC functions, routed by wIndex */
     usbd_register_control_callback(
         usbd_dev,
         USB_REQ_TYPE_CLASS | USB_REQ_TYPE_INTERFACE,
         USB_REQ_TYPE_TYPE  | USB_REQ_TYPE_RECIPIENT,
         cdc_control_request_cb);
+    usbd_register_control_callback(
+        usbd_dev,
+        USB_REQ_TYPE_VENDOR | USB_REQ_TYPE_INTERFACE,
+        USB_REQ_TYPE_TYPE  | USB_REQ_TYPE_RECIPIENT,
+        cdc_vendor_request_cb);
+}
+
+
+static bool usb_tx_records_pending(usb_cdc_context *c)
+{
+    return c->tx_rec_off < c->tx_rec_len ||
+           (c->tx_recq_ptr != NULL && !recq_empty(c->tx_recq_ptr));
+}
+
+/* Every IN data packet goes through here.  The host only completes a bulk
+   read on a short packet, so a transfer that ended on a full one still owes
+   it a zero length packet */
+static uint16_t usb_write_packet(usb_cdc_context *c, const uint8_t *buf, uint16_t len)
+{
+    uint16_t sent = usbd_ep_write_packet(usbdev, EP_CDC_IN(c->n), buf, len);
+
+    if (sent == len) {
+        c->tx_zlp = (len == CDC_DATA_PACKET_SIZE);
+    }
+    return sent;
+}
+
+/* --------------------------------------------------------------------------
+ * RX aggregation: hold USART RX back from IN until enough of it is waiting,
+ * or it has waited long enough
+ * -------------------------------------------------------------------------- */
+
+static bool usb_rx_aggr_ready(usb_cdc_context *c)
+{
+    return c->rx_aggr.max_us == 0 || c->rx_aggr_flush ||
+           ringbuf_count(c->tx_rb_ptr) >= c->rx_aggr.bytes;
+}
+
+/* RX came in: the first of it starts the max timer, all of it the gap one */
+static void usb_rx_aggr_arrived(usb_cdc_context *c)
+{
+    if (!c->rx_aggr_pending) {
+        c->rx_aggr_pending = true;
+        timebase_timer_start(&c->rx_aggr_max_timer, c->rx_aggr.max_us);
+    }
+    if (c->rx_aggr.gap_us != 0) {
+        timebase_timer_start(&c->rx_aggr_gap_timer, c->rx_aggr.gap_us);
+    }
+}
+
+/* Everything held has gone */
+static void usb_rx_aggr_done(usb_cdc_context *c)
+{
+    if (c->rx_aggr_pending || c->rx_aggr_flush) {
+        c->rx_aggr_pending = false;
+        c->rx_aggr_flush = false;
+        timebase_timer_stop(&c->rx_aggr_max_timer);
+        timebase_timer_stop(&c->rx_aggr_gap_timer);
+    }
+}
+
+static void usb_rx_aggr_timeout_cb(void *passed_ctx)
+{
+    usb_cdc_context *c = passed_ctx;
+
+    c->rx_aggr_flush = true;
+    if (c->tx_idle) {
+        usb_start_tx(c);
+    }
 }
 
+static void usb_start_tx(usb_cdc_context *c)
+{
+    uint8_t *span;
+    uint8_t pkt[CDC_DATA_PACKET_SIZE];
+
+    if (c->selftest == USB_CDC_SELFTEST_USB) {
+        usb_selftest_send(c);
+        return;
+    }
+
+    /* The USART ISR only notifies on empty -> non-empty, so deciding to go
+       idle must not interleave with it or that byte would be stranded */
+    uint32_t masked = cm_mask_interrupts(1);
+    bool records = usb_tx_records_pending(c);
+    /* RX kept while the port was closed is older than the ring's */
+    ringbuf_t *rb = ringbuf_empty(&c->retain_rb) ? c->tx_rb_ptr : &c->retain_rb;
+    /* RX the task has yet to take is not for IN */
+    ringbuf_idx_t n = (rb == c->tx_rb_ptr && usb_rx_deferred(c)) ? 0 : ringbuf_read_span(rb, &span);
+    /* Bytes being gathered leave IN idle, for the next write or a timer */
+    bool hold = (n > 0 && !records && rb == c->tx_rb_ptr && !usb_rx_aggr_ready(c));
+    c->tx_idle = (n == 0 && !records && !c->tx_zlp) || hold;
+    cm_mask_interrupts(masked);
+
+    if (records) {
+        usb_start_tx_records(c);
+        return;
+    }
+    if (hold) {
+        return;
+    }
+    if (n == 0) {
+        usb_rx_aggr_done(c);
+        /* Only reached with the endpoint free (completion, or idle), so the
+           ZLP goes out; its completion comes back here and goes idle */
+        if (c->tx_zlp) {
+            usb_write_packet(c, pkt, 0);
+        }
+        return;
+    }
+    if (n >= CDC_DATA_PACKET_SIZE) {
+        n = CDC_DATA_PACKET_SIZE;
+    } else {
+        /* Short span: the rest may sit past the wrap.  Fill the packet from
+           both ends so the ring layout does not cut the transfer short */
+        n = ringbuf_peek(rb, pkt, sizeof(pkt));
+        span = pkt;
+    }
+
+    /* The packet is copied into the endpoint FIFO before this returns, so the
+       ring space can be released immediately.  A busy endpoint returns 0 and
+       the bytes stay queued for the next completion */
+    uint16_t sent = usb_write_packet(c, span, n);
 
-static void usb_start_tx(void)
+    ringbuf_read_commit(rb, sent);
+    /* A short packet took everything that was held */
+    if (rb == c->tx_rb_ptr && sent > 0 && sent < CDC_DATA_PACKET_SIZE) {
+        usb_rx_aggr_done(c);
+    }
+}
+
+/* Pack as many whole records as fit into one packet, so a message is only
+   split across packets when it is longer than a packet itself */
+static void usb_start_tx_records(usb_cdc_context *c)
 {
-    uint8_t pkt[64];
-    int n = ringbuf_read(ctx.tx_rb_ptr, pkt, sizeof(pkt));
+    uint8_t pkt[CDC_DATA_PACKET_SIZE];
+    uint16_t n = 0;
+    int len = -1;
 
-    if (n <= 0) {
-        ctx.tx_idle = true;
+    /* Finish a long record first */
+    if (c->tx_rec_off < c->tx_rec_len) {
+        n = c->tx_rec_len - c->tx_rec_off;
+        if (n > CDC_DATA_PACKET_SIZE) {
+            n = CDC_DATA_PACKET_SIZE;
+        }
+        c->tx_rec_off += usb_write_packet(c, &c->tx_rec[c->tx_rec_off], n);
         return;
     }
 
-    ctx.tx_idle = false;
-    usbd_ep_write_packet(usbdev, EP_CDC0_IN, pkt, n);
+    while ((len = recq_peek_len(c->tx_recq_ptr)) >= 0 && n + len <= CDC_DATA_PACKET_SIZE) {
+        n += recq_read(c->tx_recq_ptr, &pkt[n], CDC_DATA_PACKET_SIZE - n);
+    }
+
+    if (n == 0 && len > CDC_DATA_PACKET_SIZE) {
+        len = recq_read(c->tx_recq_ptr, c->tx_rec, sizeof(c->tx_rec));
+        c->tx_rec_len = (len < (int)sizeof(c->tx_rec)) ? (uint16_t)len : (uint16_t)sizeof(c->tx_rec);
+        c->tx_rec_off = 0;
+        usb_start_tx_records(c);
+        return;
+    }
+
+    if (n == 0) {
+        /* only empty records were queued, carry on with the byte ring */
+        usb_start_tx(c);
+        return;
+    }
+    usb_write_packet(c, pkt, n);
 }
 
-void usb_cdc_ringbuf_write_notify_cb(void  *passed_ctx)  
+/* SERIAL_STATE on the notify endpoint.  While a notification is still
+   waiting for the host, further events are merged into the next one */
+static void usb_send_serial_state(usb_cdc_context *c)
+{
+    uint8_t pkt[sizeof(struct usb_cdc_notification) + 2];
+    struct usb_cdc_notification *notif = (struct usb_cdc_notification *)pkt;
+
+    /* From the USART ISR and from USB callbacks */
+    uint32_t masked = cm_mask_interrupts(1);
+
+    notif->bmRequestType = USB_REQ_TYPE_IN | USB_REQ_TYPE_CLASS | USB_REQ_TYPE_INTERFACE;
+    notif->bNotification = USB_CDC_NOTIFY_SERIAL_STATE;
+    notif->wValue = 0;
+    notif->wIndex = IFACE_CDC_COMM(c->n);
+    notif->wLength = 2;
+    pkt[8] = c->serial_state & 0xff;
+    pkt[9] = c->serial_state >> 8;
+
+    if (usbd_ep_write_packet(usbdev, EP_CDC_NOTIFY(c->n), pkt, sizeof(pkt)) == 0) {
+        c->serial_state_pending = true;
+    } else {
+        c->serial_state_pending = false;
+        c->serial_state &= USB_CDC_SERIAL_STATE_LEVELS;
+    }
+
+    cm_mask_interrupts(masked);
+}
+
+static void usb_send_ptt(usb_cdc_context *c)
+{
+    uint8_t pkt[sizeof(struct usb_cdc_notification) + sizeof(usb_cdc_ptt_event_t)];
+    struct usb_cdc_notification *notif = (struct usb_cdc_notification *)pkt;
+
+    /* From the PTT driver and from USB callbacks */
+    uint32_t masked = cm_mask_interrupts(1);
+
+    notif->bmRequestType = USB_REQ_TYPE_IN | USB_REQ_TYPE_VENDOR | USB_REQ_TYPE_INTERFACE;
+    notif->bNotification = USB_CDC_NOTIFY_PTT;
+    notif->wValue = 0;
+    notif->wIndex = IFACE_CDC_COMM(c->n);
+    notif->wLength = sizeof(usb_cdc_ptt_event_t);
+    memcpy(&pkt[sizeof(*notif)], &c->ptt_event, sizeof(c->ptt_event));
+
+    if (usbd_ep_write_packet(usbdev, EP_CDC_NOTIFY(c->n), pkt, sizeof(pkt)) != 0) {
+        c->ptt_pending = false;
+        c->ptt_in_flight = true;
+        c->ptt_in_flight_us = c->ptt_event.time_us;
+    }
+
+    cm_mask_interrupts(masked);
+}
+
+void usb_cdc_ptt_event(bool active, uint32_t time_us)
+{
+    for (uint8_t n = 0; n < USB_CDC_NUM; n++) {
+        usb_cdc_context *c = &cdc[n];
+
+        c->ptt_status.active = active;
+
+        /* Closed: nothing is reported, the same as line errors */
+        if (c->control_line_DTR == false) {
+            continue;
+        }
+
+        uint32_t masked = cm_mask_interrupts(1);
+
+        if (c->ptt_pending) {
+            c->ptt_status.replaced++;
+        }
+        c->ptt_event.time_us = time_us;
+        c->ptt_event.seq++;
+        c->ptt_event.active = active;
+        c->ptt_pending = true;
+        if (!c->ptt_in_flight && !c->serial_state_pending) {
+            usb_send_ptt(c);
+        }
+        cm_mask_interrupts(masked);
+    }
+}
+
+/* Line errors from the USART ISR.  Nothing is reported to a closed port,
+   its data is being dropped anyway */
+void usb_cdc_usart_event_cb(void *passed_ctx, uint8_t events)
+{
+    usb_cdc_context *c = passed_ctx;
+
+    if (c->control_line_DTR == false) {
+        return;
+    }
+    if (events & USART_EVENT_OVERRUN) {
+        c->serial_state |= USB_CDC_SERIAL_STATE_OVERRUN;
+    }
+    if (events & USART_EVENT_FRAMING) {
+        c->serial_state |= USB_CDC_SERIAL_STATE_FRAMING;
+    }
+    if (events & USART_EVENT_PARITY) {
+        c->serial_state |= USB_CDC_SERIAL_STATE_PARITY;
+    }
+    if (events & USART_EVENT_BREAK) {
+        c->serial_state |= USB_CDC_SERIAL_STATE_BREAK;
+    }
+    if (!c->serial_state_pending) {
+        usb_send_serial_state(c);
+    }
+}
+
+/* Port closed: RX taken by the task goes into retention, keeping the
+   newest retain_depth bytes.  Dropping the oldest is a read, which IN does
+   too once DTR rises */
+static void usb_retain(usb_cdc_context *c, const uint8_t *data, ringbuf_idx_t n)
+{
+    ringbuf_idx_t keep = (n < c->retain_depth) ? n : c->retain_depth;
+    uint32_t masked = cm_mask_interrupts(1);
+    ringbuf_idx_t excess = ringbuf_count(&c->retain_rb) + keep;
+
+    excess = (excess > c->retain_depth) ? excess - c->retain_depth : 0;
+    ringbuf_read_commit(&c->retain_rb, excess);
+    c->retain_dropped += excess + (n - keep);
+    ringbuf_write(&c->retain_rb, &data[n - keep], keep);
+    cm_mask_interrupts(masked);
+}
+
+/* --------------------------------------------------------------------------
+ * Capture
+ * -------------------------------------------------------------------------- */
+
+/* One chunk as records, from the RX task */
+static void usb_capture(usb_cdc_context *c, uint8_t flags, const uint8_t *data, uint16_t len,
+                        uint32_t time_us)
+{
+    recq_t *q = c->tx_recq_ptr;
+    capture_hdr_t hdr;
+
+    hdr.time_us = time_us;
+    while (len > 0) {
+        hdr.len = (len < CAPTURE_DATA_MAX) ? len : CAPTURE_DATA_MAX;
+        hdr.flags = flags;
+        if (q->dropped != c->capture_dropped) {
+            hdr.flags |= CAPTURE_LOST;
+        }
+        recq_begin(q);
+        recq_append(q, (const uint8_t *)&hdr, sizeof(hdr));
+        recq_append(q, data, hdr.len);
+        recq_commit(q);
+        c->capture_dropped = q->dropped;
+        data += hdr.len;
+        len -= hdr.len;
+    }
+}
+
+/* TX as it goes out, from the USART's ISR and notify: staged for the task */
+static void usb_capture_stage(usb_cdc_context *c, usb_capture_stage_t *st,
+                              const uint8_t *data, uint16_t len)
+{
+    if (ringbuf_empty(&st->rb)) {
+        st->first_us = timebase_now_us();
+    }
+    if (ringbuf_write(&st->rb, data, len) < len) {
+        st->lost = true;
+    }
+    sched_post(&c->rx_task);
+}
+
+static void usb_capture_tx_tap(void *passed_ctx, const uint8_t *data, uint16_t len)
+{
+    usb_cdc_context *c = passed_ctx;
+
+    usb_capture_stage(c, &c->capture_tx[0], data, len);
+}
+
+static void usb_capture_peer_tx_tap(void *passed_ctx, const uint8_t *data, uint16_t len)
+{
+    usb_cdc_context *c = passed_ctx;
+
+    usb_capture_stage(c, &c->capture_tx[1], data, len);
+}
+
+/* What was staged, as records.  Each chunk is stamped with the first byte
+   in the stage when it was taken, so records of different streams can be
+   out of time order by a chunk */
+static void usb_capture_stage_drain(usb_cdc_context *c, usb_capture_stage_t *st, uint8_t flags)
+{
+    uint8_t chunk[CAPTURE_DATA_MAX];
+    uint32_t time_us;
+    int n;
+
+    for (;;) {
+        uint32_t masked = cm_mask_interrupts(1);
+
+        time_us = st->first_us;
+        n = ringbuf_read(&st->rb, chunk, sizeof(chunk));
+        if (!c->capture) {
+            ringbuf_flush(&st->rb);
+            n = 0;
+        }
+        if (n > 0 && st->lost) {
+            st->lost = false;
+            flags |= CAPTURE_LOST;
+        }
+        cm_mask_interrupts(masked);
+
+        if (n <= 0) {
+            return;
+        }
+        usb_capture(c, flags, chunk, n, time_us);
+        flags &= ~CAPTURE_LOST;
+    }
+}
+
+static void usb_capture_enable(usb_cdc_context *c, bool on)
+{
+    c->capture_dropped = c->tx_recq_ptr->dropped;
+    c->capture = on;
+    usart_set_tx_tap(c->usart, on ? usb_capture_tx_tap : NULL, c);
+    if (c->peer != NULL) {
+        usart_set_tx_tap(c->peer, on ? usb_capture_peer_tx_tap : NULL, c);
+    }
+    sched_post(&c->rx_task);
+}
+
+/* The peer's RX has nowhere to go but capture, made by the task */
+void usb_cdc_peer_rx_notify_cb(void *passed_ctx)
 {
-	(void) passed_ctx;  /* Must use passed context and register is */
+    usb_cdc_context *c = passed_ctx;
+
+    if (c->capture && c->control_line_DTR) {
+        c->peer_rx_us = timebase_now_us();
+        sched_post(&c->rx_task);
+    } else {
+        ringbuf_flush(c->peer->rx_rb_ptr);
+    }
+}
 
-	/* Nothing listening  - flush buffer discarding data - probably should no so ringbuffers can have backpressure even if nothing listening */
-	if  ( ctx.control_line_DTR == false )
+/* --------------------------------------------------------------------------
+ * Link
+ * -------------------------------------------------------------------------- */
+
+/* The USARTs a link joins: functions 0's and 1's, or with one function
+   its own and its peer */
+static bool usb_link_pair(usb_cdc_context *c, usart_ctx_t **a, usart_ctx_t **b)
+{
+#if USB_CDC_NUM > 1
+    (void)c;
+    *a = cdc[0].usart;
+    *b = cdc[1].usart;
+#else
+    *a = c->usart;
+    *b = c->peer;
+#endif
+    return *a != NULL && *b != NULL;
+}
+
+static bool usb_link_set(usb_cdc_context *c, uint16_t mode)
+{
+    usart_ctx_t *a, *b;
+
+    if (!usb_link_pair(c, &a, &b) || mode > USB_CDC_LINK_INJECT_PEER) {
+        return false;
+    }
+    /* With one function the peer only reaches the host as capture */
+    if (USB_CDC_NUM == 1 && mode != USB_CDC_LINK_OFF && c->tx_recq_ptr == NULL) {
+        return false;
+    }
+
+    /* TX rings back where they belong first: DMA takes them back on unlink */
+    if (link_mode == USB_CDC_LINK_INJECT_PEER) {
+        usart_swap_tx(a, b);
+    }
+    if (mode == USB_CDC_LINK_OFF) {
+        usart_unlink(a);
+    } else {
+        usart_link(a, b);
+        if (mode == USB_CDC_LINK_INJECT_PEER) {
+            usart_swap_tx(a, b);
+        }
+    }
+#if USB_CDC_NUM == 1
+    if ((mode != USB_CDC_LINK_OFF) != (link_mode != USB_CDC_LINK_OFF)) {
+        usb_capture_enable(c, mode != USB_CDC_LINK_OFF);
+    }
+#endif
+    link_mode = mode;
+    return true;
+}
+
+/* --------------------------------------------------------------------------
+ * Self-test
+ * -------------------------------------------------------------------------- */
+
+/* USART TX ring: fill every free byte with the pattern.  From the ring's
+   read notify, so the USART never waits on the host */
+static void usb_selftest_fill(usb_cdc_context *c)
+{
+    ringbuf_t *rb = c->rx_rb_ptr;
+    ringbuf_idx_t count = ringbuf_count(rb);
+    ringbuf_idx_t n;
+    uint8_t *span;
+
+    if (count < c->selftest_status.tx_ring_lwm) {
+        c->selftest_status.tx_ring_lwm = count;
+    }
+    while ((n = ringbuf_write_span(rb, &span)) > 0) {
+        prbs_fill(&c->selftest_gen, span, n);
+        ringbuf_write_commit(rb, n);
+    }
+}
+
+/* One full IN packet of the pattern.  The generator only moves on once the
+   endpoint has taken it */
+static void usb_selftest_send(usb_cdc_context *c)
+{
+    uint8_t pkt[CDC_DATA_PACKET_SIZE];
+    prbs_gen_t gen = c->selftest_gen;
+
+    c->tx_idle = false;
+    prbs_fill(&gen, pkt, sizeof(pkt));
+    if (usb_write_packet(c, pkt, sizeof(pkt)) == sizeof(pkt)) {
+        c->selftest_gen = gen;
+        c->selftest_status.tx_bytes += sizeof(pkt);
+    }
+}
+
+/* USART RX during a test, in the RX task */
+static void usb_selftest_rx(usb_cdc_context *c, const uint8_t *data, ringbuf_idx_t n)
+{
+    prbs_check(&c->selftest_check, data, n);
+}
+
+/* Bring the figures up to now, while a test runs */
+static void usb_selftest_update(usb_cdc_context *c)
+{
+    usb_cdc_selftest_status_t *st = &c->selftest_status;
+    usart_counters_t now;
+
+    if (c->selftest == USB_CDC_SELFTEST_STOP) {
+        return;
+    }
+    st->elapsed_us = timebase_now_us() - c->selftest_start_us;
+    st->locked = c->selftest_check.locked;
+    st->rx_bytes = c->selftest_check.bytes;
+    st->bit_errors = c->selftest_check.bit_errors;
+    st->resyncs = c->selftest_check.resyncs;
+    if (c->usart != NULL) {
+        usart_get_counters(c->usart, &now);
+        st->overruns = now.overruns - c->selftest_counters.overruns;
+        if (c->selftest != USB_CDC_SELFTEST_USB) {
+            st->tx_bytes = now.tx_bytes - c->selftest_counters.tx_bytes;
+        }
+    }
+    if (st->elapsed_us != 0) {
+        st->tx_bytes_per_s = (uint64_t)st->tx_bytes * 1000000u / st->elapsed_us;
+        st->rx_bytes_per_s = (uint64_t)st->rx_bytes * 1000000u / st->elapsed_us;
+    }
+}
+
+/*
+ * Start a test, or stop one.  Pattern already queued for the USART still
+ * goes out after a stop: the ring can't be emptied under a DMA burst.
+ * False if the mode is unknown, or needs a USART there isn't
+ */
+static bool usb_selftest_start(usb_cdc_context *c, uint8_t mode)
+{
+    usb_cdc_selftest_status_t *st = &c->selftest_status;
+
+    if (mode > USB_CDC_SELFTEST_USB ||
+        (mode != USB_CDC_SELFTEST_STOP && mode != USB_CDC_SELFTEST_USB && c->usart == NULL)) {
+        return false;
+    }
+
+    /* Whatever ran before ends here, its figures kept */
+    usb_selftest_update(c);
+    if (c->selftest == USB_CDC_SELFTEST_USART_LOOPBACK) {
+        usart_set_loopback(c->usart, false);
+    }
+    c->selftest = USB_CDC_SELFTEST_STOP;
+    st->mode = USB_CDC_SELFTEST_STOP;
+    sched_post(&c->rx_task);
+    if (mode == USB_CDC_SELFTEST_STOP) {
+        return true;
+    }
+
+    if (c->capture) {
+        usb_capture_enable(c, false);
+    }
+    memset(st, 0, sizeof(*st));
+    st->mode = mode;
+    if (mode != USB_CDC_SELFTEST_USB) {
+        st->tx_ring_lwm = c->rx_rb_ptr->size - 1;
+    }
+    prbs_init(&c->selftest_gen);
+    prbs_check_init(&c->selftest_check);
+    if (c->usart != NULL) {
+        usart_get_counters(c->usart, &c->selftest_counters);
+    }
+    c->selftest_start_us = timebase_now_us();
+    ringbuf_flush(c->tx_rb_ptr);
+    c->selftest = mode;
+
+    if (mode == USB_CDC_SELFTEST_USB) {
+        if (c->tx_idle) {
+            usb_start_tx(c);
+        }
+        return true;
+    }
+    if (mode == USB_CDC_SELFTEST_USART_LOOPBACK) {
+        usart_set_loopback(c->usart, true);
+    }
+    usb_selftest_fill(c);
+    return true;
+}
+
+/* RX that the task takes out of the ring, rather than IN */
+static bool usb_rx_deferred(usb_cdc_context *c)
+{
+    if (c->selftest != USB_CDC_SELFTEST_STOP) {
+        return c->selftest != USB_CDC_SELFTEST_USB;
+    }
+    if (!c->control_line_DTR) {
+        return c->retain_depth != 0;
+    }
+    return c->capture || c->rx_frames;
+}
+
+/* USART RX written to the ring, on its way to IN */
+static void usb_rx_arrived(usb_cdc_context *c)
+{
+	/* Self-test, retention, capture and frames: the task's, when the
+	   main loop gets to it */
+	if (usb_rx_deferred(c)) {
+	    c->rx_seen_us = timebase_now_us();
+	    sched_post(&c->rx_task);
+	    return;
+	}
+
+	/* Nothing listening, or a USB self-test - drop it */
+	if (c->selftest != USB_CDC_SELFTEST_STOP || c->control_line_DTR == false)
         {
-	    ringbuf_flush(ctx.tx_rb_ptr);
+	    ringbuf_flush(c->tx_rb_ptr);
 	    return;
         }
 
+	if (c->rx_aggr.max_us != 0) {
+	    usb_rx_aggr_arrived(c);
+	}
+
 	/* TX Idle,  start it */
- 	if ( ctx.tx_idle ) 
+ 	if ( c->tx_idle ) 
         {
-           usb_start_tx();
+           usb_start_tx(c);
         }
 	
 	/* TX is running -  do nothing, ISR  will consume ring buffer */
 	return ;
 }
 
+/* The peer's RX, as capture records */
+static void usb_rx_task_peer(usb_cdc_context *c)
+{
+    ringbuf_t *rb = c->peer->rx_rb_ptr;
+    uint8_t chunk[CAPTURE_DATA_MAX];
+    uint32_t time_us;
+    int n;
+
+    for (;;) {
+        uint32_t masked = cm_mask_interrupts(1);
+
+        time_us = c->peer_rx_us;
+        n = ringbuf_read(rb, chunk, sizeof(chunk));
+        if (!c->capture || !c->control_line_DTR) {
+            ringbuf_flush(rb);
+            n = 0;
+        }
+        cm_mask_interrupts(masked);
+
+        if (n <= 0) {
+            return;
+        }
+        usb_capture(c, CAPTURE_PEER, chunk, n, time_us);
+    }
+}
+
+/*
+ * The RX work that can wait: PRBS checking, retention, capture records and
+ * frame parsing, with the keyframes.  The ring is read a chunk at a time,
+ * masked, as the ISRs flush it too; whatever the mode is once it is read
+ * decides where each chunk goes
+ */
+static void usb_rx_task_fn(void *passed_ctx)
+{
+    usb_cdc_context *c = passed_ctx;
+    uint8_t chunk[CAPTURE_DATA_MAX];
+    uint32_t time_us;
+    int n;
+
+    if (c->rx_delta_reset) {
+        c->rx_delta_reset = false;
+        ft_delta_reset(c->rx_delta);
+    }
+    if (c->rx_keyframe_due) {
+        c->rx_keyframe_due = false;
+        if (c->rx_frames && !c->capture && c->rx_delta_keyframe_ms != 0) {
+            ft_delta_replay(c->rx_delta, usb_cdc_frame_send, c);
+        }
+        usb_rx_delta_restart(c);
+    }
+
+    for (;;) {
+        uint32_t masked = cm_mask_interrupts(1);
+
+        if (!usb_rx_deferred(c)) {
+            /* Back to IN, or dropped, as if it had just come in */
+            if (!ringbuf_empty(c->tx_rb_ptr)) {
+                usb_rx_arrived(c);
+            }
+            cm_mask_interrupts(masked);
+            break;
+        }
+        ringbuf_idx_t count = ringbuf_count(c->tx_rb_ptr);
+        if (c->selftest != USB_CDC_SELFTEST_STOP && count > c->selftest_status.rx_ring_hwm) {
+            c->selftest_status.rx_ring_hwm = count;
+        }
+        time_us = c->rx_seen_us;
+        n = ringbuf_read(c->tx_rb_ptr, chunk, sizeof(chunk));
+        cm_mask_interrupts(masked);
+
+        if (n <= 0) {
+            break;
+        }
+        if (c->selftest != USB_CDC_SELFTEST_STOP) {
+            usb_selftest_rx(c, chunk, n);
+        } else if (!c->control_line_DTR) {
+            usb_retain(c, chunk, n);
+        } else if (c->capture) {
+            usb_capture(c, 0, chunk, n, time_us);
+        } else {
+            ft_frame_parse(c->rx_parser, chunk, n);
+        }
+    }
+
+    usb_capture_stage_drain(c, &c->capture_tx[0], CAPTURE_TX);
+    usb_capture_stage_drain(c, &c->capture_tx[1], CAPTURE_PEER | CAPTURE_TX);
+    if (c->peer != NULL) {
+        usb_rx_task_peer(c);
+    }
+}
+
+void usb_cdc_ringbuf_write_notify_cb(void  *passed_ctx)  
+{
+    PROF_BEGIN();
+
+    usb_rx_arrived(passed_ctx);
+    PROF_END(PROF_CDC_RX_NOTIFY);
+}
+
+void usb_cdc_recq_write_notify_cb(void *passed_ctx)
+{
+    usb_cdc_context *c = passed_ctx;
+
+    /* Records are written by the RX task, and IN reads them in its ISR */
+    uint32_t masked = cm_mask_interrupts(1);
+
+    /* Nothing listening - discard, same as the byte ring */
+    if (c->control_line_DTR == false)
+    {
+        while (!recq_empty(c->tx_recq_ptr)) {
+            recq_discard(c->tx_recq_ptr);
+        }
+    }
+    else if (c->tx_idle)
+    {
+        usb_start_tx(c);
+    }
+    cm_mask_interrupts(masked);
+}
+
 /* --------------------------------------------------------------------------
  * USB Setup
  * -------------------------------------------------------------------------- */
 
-void usb_cdc_init(ringbuf_t* tx_rb_ptr, ringbuf_t* rx_rb_ptr)
+void usb_cdc_init(uint8_t n, ringbuf_t* tx_rb_ptr, ringbuf_t* rx_rb_ptr)
 {
+    usb_cdc_context *c = &cdc[n];
+
     usbdev = usb_core_get_handle();
 
-    ctx.tx_rb_ptr = tx_rb_ptr;
-    ctx.rx_rb_ptr = rx_rb_ptr;
-    ringbuf_set_write_notify_fn(tx_rb_ptr, usb_cdc_ringbuf_write_notify_cb, &ctx);
+    c->n = n;
+    c->tx_rb_ptr = tx_rb_ptr;
+    c->rx_rb_ptr = rx_rb_ptr;
+    ringbuf_set_write_notify_fn(tx_rb_ptr, usb_cdc_ringbuf_write_notify_cb, c);
+    ringbuf_set_write_notify_policy(tx_rb_ptr, RINGBUF_NOTIFY_EDGE, 0);
+    ringbuf_set_read_notify_fn(rx_rb_ptr, usb_cdc_rx_drained_cb, c,
+                               rx_rb_ptr->size - 1 - CDC_DATA_PACKET_SIZE);
+
+    c->tx_recq_ptr = NULL;
+    c->tx_rec_len = 0;
+    c->tx_rec_off = 0;
+
+    c->tx_idle=true;
+    c->tx_zlp=false;
+    c->control_line_DTR=false;
+    c->control_line_RTS=false;
+
+    /* The bridge has no modem lines to pass on, it is always there */
+    c->serial_state = USB_CDC_SERIAL_STATE_LEVELS;
+    c->serial_state_pending = false;
+    memset(&c->ptt_event, 0, sizeof(c->ptt_event));
+    memset(&c->ptt_status, 0, sizeof(c->ptt_status));
+    c->ptt_pending = false;
+    c->ptt_in_flight = false;
+
+    c->out_held = false;
+    c->out_holds = 0;
+    c->out_held_us = 0;
+    c->out_dropped = 0;
+
+    c->rx_aggr.bytes = CDC_DATA_PACKET_SIZE;
+    c->rx_aggr.max_us = 0;
+    c->rx_aggr.gap_us = 0;
+    c->rx_aggr_pending = false;
+    c->rx_aggr_flush = false;
+    timebase_timer_init(&c->rx_aggr_max_timer, usb_rx_aggr_timeout_cb, c);
+    timebase_timer_init(&c->rx_aggr_gap_timer, usb_rx_aggr_timeout_cb, c);
+
+    c->rx_parser = NULL;
+    c->rx_frames = false;
+    c->rx_delta = NULL;
+    c->rx_delta_keyframe_ms = 0;
+    timebase_timer_init(&c->rx_delta_timer, usb_rx_delta_keyframe_cb, c);
+    c->capture = false;
+    c->capture_dropped = 0;
+    for (uint8_t i = 0; i < 2; i++) {
+        ringbuf_init(&c->capture_tx[i].rb, c->capture_tx[i].buf, sizeof(c->capture_tx[i].buf));
+        c->capture_tx[i].lost = false;
+    }
+    c->selftest = USB_CDC_SELFTEST_STOP;
+    memset(&c->selftest_status, 0, sizeof(c->selftest_status));
+    c->rx_delta_reset = false;
+    c->rx_keyframe_due = false;
+
+    ringbuf_init(&c->retain_rb, c->retain_buf, sizeof(c->retain_buf));
+    c->retain_depth = 0;
+    c->retain_dropped = 0;
+
+    c->usart = NULL;
+    c->peer = NULL;
+    c->line_coding.dwDTERate = 19200;
+    c->line_coding.bCharFormat = USB_CDC_1_STOP_BITS;
+    c->line_coding.bParityType = USB_CDC_NO_PARITY;
+    c->line_coding.bDataBits = 8;
+
+    /* One set-config callback sets up all functions */
+    if (n == 0) {
+        usbd_register_set_config_callback(usbdev, usb_set_config);
+        link_mode = USB_CDC_LINK_OFF;
+    }
+}
+
+/* A frame for the host, re-encoded as one record */
+static void usb_cdc_frame_send(void *passed_ctx, const ft_frame_t *frame)
+{
+    usb_cdc_context *c = passed_ctx;
+    uint8_t wire[FT_FRAME_OVERHEAD + FT_FRAME_PAYLOAD_MAX];
+
+    recq_write(c->tx_recq_ptr, wire, ft_frame_encode(frame, wire));
+}
+
+/* A good frame from the RX parser, unless it only repeats the last one */
+static void usb_cdc_frame_cb(void *passed_ctx, const ft_frame_t *frame)
+{
+    usb_cdc_context *c = passed_ctx;
+
+    if (c->rx_delta_keyframe_ms != 0 && !ft_delta_changed(c->rx_delta, frame)) {
+        return;
+    }
+    usb_cdc_frame_send(c, frame);
+}
+
+static void usb_rx_delta_restart(usb_cdc_context *c)
+{
+    if (c->rx_delta_keyframe_ms == 0 || c->rx_delta_keyframe_ms == USB_CDC_DELTA_NO_KEYFRAME) {
+        timebase_timer_stop(&c->rx_delta_timer);
+    } else {
+        timebase_timer_start(&c->rx_delta_timer, c->rx_delta_keyframe_ms * 1000u);
+    }
+}
+
+/* Keyframe: all of the state again, sent by the RX task */
+static void usb_rx_delta_keyframe_cb(void *passed_ctx)
+{
+    usb_cdc_context *c = passed_ctx;
+
+    c->rx_keyframe_due = true;
+    sched_post(&c->rx_task);
+}
+
+/* The function's RX task, to be run by the main loop */
+void usb_cdc_init_task(uint8_t n, uint8_t id, uint8_t prio)
+{
+    usb_cdc_context *c = &cdc[n];
+
+    sched_task_init(&c->rx_task, id, prio, usb_rx_task_fn, c);
+}
 
-    ctx.tx_idle=true;
-    ctx.control_line_DTR=false;
-    ctx.control_line_RTS=false;
+/* Send whole records from q ahead of the byte ring, one or more per packet */
+void usb_cdc_set_tx_recq(uint8_t n, recq_t *q)
+{
+    usb_cdc_context *c = &cdc[n];
 
-    usbd_register_set_config_callback(usbdev, usb_set_config);
+    c->tx_recq_ptr = q;
+    if (q != NULL) {
+        recq_set_write_notify_fn(q, usb_cdc_recq_write_notify_cb, c);
+    }
+}
+
+void usb_cdc_set_rx_parser(uint8_t n, ft_frame_parser_t *parser)
+{
+    usb_cdc_context *c = &cdc[n];
+
+    c->rx_parser = parser;
+    c->rx_frames = false;
+    if (parser != NULL) {
+        ft_frame_parser_init(parser, usb_cdc_frame_cb, c);
+    }
+}
+
+/* Change-only forwarding of the parser's frames, off until the host asks */
+void usb_cdc_set_rx_delta(uint8_t n, ft_delta_t *delta)
+{
+    usb_cdc_context *c = &cdc[n];
+
+    c->rx_delta = delta;
+    c->rx_delta_keyframe_ms = 0;
+    timebase_timer_stop(&c->rx_delta_timer);
+    if (delta != NULL) {
+        ft_delta_init(delta);
+    }
+}
+
+void usb_cdc_set_usart(uint8_t n, usart_ctx_t *usart)
+{
+    usb_cdc_context *c = &cdc[n];
+
+    c->usart = usart;
+    if (usart != NULL) {
+        usart_line_to_cdc(&usart->line, &c->line_coding);
+        usart_set_event_fn(usart, usb_cdc_usart_event_cb, c);
+    }
+}
+
+void usb_cdc_set_peer(uint8_t n, usart_ctx_t *peer)
+{
+    usb_cdc_context *c = &cdc[n];
+
+    c->peer = peer;
+    if (peer != NULL) {
+        ringbuf_set_write_notify_fn(peer->rx_rb_ptr, usb_cdc_peer_rx_notify_cb, c);
+        ringbuf_set_write_notify_policy(peer->rx_rb_ptr, RINGBUF_NOTIFY_EDGE, 0);
+    }
+}
+
+void usb_cdc_set_rx_aggr(uint8_t n, const usb_cdc_rx_aggr_t *aggr)
+{
+    usb_cdc_context *c = &cdc[n];
+    uint32_t masked = cm_mask_interrupts(1);
+
+    c->rx_aggr = *aggr;
+    if (c->rx_aggr.bytes == 0 || c->rx_aggr.bytes > CDC_DATA_PACKET_SIZE) {
+        c->rx_aggr.bytes = CDC_DATA_PACKET_SIZE;
+    }
+    /* Gathering needs to see every write, for the gap timer and the count */
+    ringbuf_set_write_notify_policy(c->tx_rb_ptr, c->rx_aggr.max_us != 0 ?
+                                    RINGBUF_NOTIFY_EVERY_WRITE : RINGBUF_NOTIFY_EDGE, 0);
+
+    /* Whatever was held under the old policy goes now */
+    usb_rx_aggr_done(c);
+    if (!ringbuf_empty(c->tx_rb_ptr)) {
+        c->rx_aggr_flush = true;
+        if (c->tx_idle) {
+            usb_start_tx(c);
+        }
+    }
+    cm_mask_interrupts(masked);
+}
+
+void usb_cdc_set_rx_retention(uint8_t n, uint16_t depth)
+{
+    usb_cdc_context *c = &cdc[n];
+    uint32_t masked = cm_mask_interrupts(1);
+
+    if (depth > USB_CDC_RETAIN_MAX - 1) {
+        depth = USB_CDC_RETAIN_MAX - 1;
+    }
+    c->retain_depth = depth;
+    sched_post(&c->rx_task);
+
+    /* While closed, what is kept already obeys the new depth.  While open
+       it is being sent, and goes out whole */
+    if (!c->control_line_DTR) {
+        ringbuf_idx_t count = ringbuf_count(&c->retain_rb);
+
+        if (count > depth) {
+            ringbuf_read_commit(&c->retain_rb, count - depth);
+            c->retain_dropped += count - depth;
+        }
+    }
+    cm_mask_interrupts(masked);
 }
@@ -1,5 +1,213 @@
 #pragma once
 
 #include "ringbuf.h"
+#include "recq.h"
+#include "usart.h"
+#include "ft_frame.h"
+#include "ft_delta.h"
 
-void usb_cdc_init(ringbuf_t* tx_rb, ringbuf_t* rx_rb);
+/*
+ * n is the CDC function, 0 .. USB_CDC_NUM - 1.  Function 0 must be
+ * initialised, and all of them before the host configures the device.
+ */
+void usb_cdc_init(uint8_t n, ringbuf_t* tx_rb, ringbuf_t* rx_rb);
+void usb_cdc_set_tx_recq(uint8_t n, recq_t *q);
+
+/* The main loop task (sched.h) for what RX needs beyond bridging: self-test
+   checking, retention, capture records, frames.  Without it that RX waits */
+void usb_cdc_init_task(uint8_t n, uint8_t id, uint8_t prio);
+
+/* Apply SET_LINE_CODING to this USART and report its line errors and
+   breaks as SERIAL_STATE.  Without one the coding is only remembered for
+   GET_LINE_CODING */
+void usb_cdc_set_usart(uint8_t n, usart_ctx_t *usart);
+
+/* Queue bytes for usart's TX from anything but CDC OUT, whole or false.
+   OUT is held as it is after a packet when they leave no room for one */
+bool usb_cdc_usart_send(usart_ctx_t *usart, const uint8_t *data, uint16_t len);
+
+/*
+ * Vendor IN request to the CDC comm interface (wIndex): the rate the USART
+ * really runs at and how often USB OUT had to wait for it, as
+ * usb_cdc_line_status_t
+ */
+#define USB_CDC_VENDOR_REQ_GET_LINE_STATUS  0x01
+
+typedef struct {
+    uint32_t baud;          // as set by SET_LINE_CODING
+    uint32_t baud_actual;   // achieved by the divider
+    int32_t baud_error_ppm;
+    uint32_t out_holds;     // OUT NAKed for want of RX ring space
+    uint32_t out_held_us;   // total time it was, from the DWT cycle counter
+    uint32_t rx_retained;   // RX kept while DTR is low, not yet sent
+    uint32_t rx_dropped;    // oldest RX dropped to keep within the retention depth
+    uint32_t out_dropped;   // OUT packets lost for want of ring space, also sent as an overrun
+} __attribute__((packed)) usb_cdc_line_status_t;
+
+/*
+ * Vendor OUT request to the CDC comm interface (wIndex): how USART RX is
+ * gathered into IN packets, as usb_cdc_rx_aggr_t.  The IN request of the
+ * same number reads back what is in effect
+ */
+#define USB_CDC_VENDOR_REQ_RX_AGGREGATION   0x02
+
+/*
+ * With max_us 0, the default, RX goes out as soon as IN is free, even a
+ * byte at a time.  Otherwise it is held until bytes are waiting (0 or more
+ * than a packet means a full packet), max_us after the first of them, or
+ * gap_us after the last (0: no gap timer), whichever comes first
+ */
+typedef struct {
+    uint16_t bytes;
+    uint32_t max_us;
+    uint32_t gap_us;
+} __attribute__((packed)) usb_cdc_rx_aggr_t;
+
+void usb_cdc_set_rx_aggr(uint8_t n, const usb_cdc_rx_aggr_t *aggr);
+
+/*
+ * Vendor OUT request to the CDC comm interface: wValue is how many bytes
+ * of USART RX to keep while DTR is low, the newest ones, sent when it rises.
+ * 0, the default, drops RX while the port is closed.  The IN request of
+ * the same number reads the depth back as a u16
+ */
+#define USB_CDC_VENDOR_REQ_RX_RETENTION     0x03
+
+/* Deepest retention, a power of two (one byte of it is never used) */
+#ifndef USB_CDC_RETAIN_MAX
+#define USB_CDC_RETAIN_MAX  2048
+#endif
+
+void usb_cdc_set_rx_retention(uint8_t n, uint16_t depth);
+
+/*
+ * Vendor OUT request to the CDC comm interface: wValue 1 sends only good
+ * FT-7900 frames (ft_frame.h) from USART RX, in wire form; 0, the default,
+ * all of it.  The IN request of the same number returns ft_frame_stats_t
+ */
+#define USB_CDC_VENDOR_REQ_RX_FRAMES        0x04
+
+/* Frames go out as records through the function's TX record queue, which
+   must be set first */
+void usb_cdc_set_rx_parser(uint8_t n, ft_frame_parser_t *parser);
+
+/*
+ * Vendor OUT request to the CDC comm interface, for frames only: wValue
+ * nonzero sends a frame only when it differs from the last of its type
+ * (ft_delta.h), with all of them sent again every wValue ms as a keyframe,
+ * never with USB_CDC_DELTA_NO_KEYFRAME.  0, the default, sends every good
+ * frame.  The IN request of the same number returns ft_delta_stats_t
+ */
+#define USB_CDC_VENDOR_REQ_RX_DELTA         0x05
+#define USB_CDC_DELTA_NO_KEYFRAME           0xFFFF
+
+/* Vendor OUT request to the CDC comm interface: send every frame kept for
+   change-only forwarding now, and start the keyframe period again */
+#define USB_CDC_VENDOR_REQ_RX_REFRESH       0x06
+
+void usb_cdc_set_rx_delta(uint8_t n, ft_delta_t *delta);
+
+/*
+ * Vendor OUT request to the CDC comm interface: wValue 1 sends the capture
+ * stream (capture.h) of the function's USART, both directions, in place of
+ * its RX; 0, the default, stops it.  Needs the USART and the TX record
+ * queue, and takes the place of frames while it runs
+ */
+#define USB_CDC_VENDOR_REQ_CAPTURE          0x07
+
+/*
+ * PTT edges, to every open function as a vendor notification on its
+ * notification endpoint: bmRequestType 0xC1, bNotification
+ * USB_CDC_NOTIFY_PTT, wIndex the comm interface, then usb_cdc_ptt_event_t.
+ * Only the latest edge waits for the endpoint; seq shows any in between
+ */
+#define USB_CDC_NOTIFY_PTT                  0x01
+
+typedef struct {
+    uint32_t time_us;       // timebase_now_us() at the edge
+    uint16_t seq;           // edges so far
+    uint8_t active;
+    uint8_t reserved;
+} __attribute__((packed)) usb_cdc_ptt_event_t;
+
+/*
+ * Vendor IN request to the CDC comm interface: PTT as usb_cdc_ptt_status_t.
+ * Latency runs from the edge to the host taking its notification
+ */
+#define USB_CDC_VENDOR_REQ_PTT_STATUS       0x08
+
+typedef struct {
+    uint8_t active;
+    uint8_t reserved[3];
+    uint32_t events;            // notifications taken by the host
+    uint32_t replaced;          // edges replaced by a later one before they went
+    uint32_t latency_last_us;
+    uint32_t latency_max_us;
+    uint32_t latency_total_us;  // over events, for the mean
+} __attribute__((packed)) usb_cdc_ptt_status_t;
+
+/* From the PTT driver's callback */
+void usb_cdc_ptt_event(bool active, uint32_t time_us);
+
+/*
+ * Vendor OUT request to the CDC comm interface: a PRBS-15 (prbs.h) self-test
+ * in place of the bridge, wValue one of USB_CDC_SELFTEST_*.  The USART ones
+ * send the pattern out of the USART and check what comes back, through a
+ * jumper from TX to RX or looped back inside it; USB OUT is dropped.  The
+ * USB one sends it on IN, for the host to check, and checks it on OUT;
+ * USART RX is dropped.  Starting a test clears the last one's figures,
+ * STOP keeps them.  The IN request of the same number returns
+ * usb_cdc_selftest_status_t
+ */
+#define USB_CDC_VENDOR_REQ_SELFTEST         0x09
+
+#define USB_CDC_SELFTEST_STOP               0
+#define USB_CDC_SELFTEST_USART_JUMPER       1
+#define USB_CDC_SELFTEST_USART_LOOPBACK     2
+#define USB_CDC_SELFTEST_USB                3
+
+typedef struct {
+    uint8_t mode;               // USB_CDC_SELFTEST_*, STOP once stopped
+    uint8_t locked;             // the checker has found the pattern
+    uint8_t reserved[2];
+    uint32_t elapsed_us;        // from the start, to the stop if stopped
+    uint32_t tx_bytes;          // pattern sent
+    uint32_t rx_bytes;          // checked
+    uint32_t tx_bytes_per_s;
+    uint32_t rx_bytes_per_s;
+    uint32_t bit_errors;
+    uint32_t resyncs;           // bytes lost or added, see prbs.h
+    uint32_t overruns;          // USART overruns during the test
+    uint16_t rx_ring_hwm;       // USART tests: RX ring, fullest when read
+    uint16_t tx_ring_lwm;       // USART tests: TX ring, emptiest when topped up
+} __attribute__((packed)) usb_cdc_selftest_status_t;
+
+/*
+ * Vendor OUT request to the CDC comm interface: link two USARTs
+ * (usart_link()), for the device to sit inline between the two devices on
+ * them.  With two functions they are functions 0's and 1's, and each still
+ * carries its own USART's RX.  With one, they are its own and the peer
+ * (usb_cdc_set_peer()): capture runs while linked and stops with it, so
+ * both directions come in on the one IN endpoint, the peer's tagged
+ * CAPTURE_PEER.  wValue USB_CDC_LINK_INJECT sends OUT out of the function's
+ * USART, _INJECT_PEER out of the other one (with two functions, each one's
+ * OUT goes out of the other's USART); either way between bursts from the
+ * other side.  USB_CDC_LINK_OFF, the default, unlinks them.  The IN request
+ * of the same number returns usb_cdc_link_status_t
+ */
+#define USB_CDC_VENDOR_REQ_LINK             0x0A
+
+#define USB_CDC_LINK_OFF                    0
+#define USB_CDC_LINK_INJECT                 1
+#define USB_CDC_LINK_INJECT_PEER            2
+
+typedef struct {
+    uint8_t linked;             // USB_CDC_LINK_*
+    uint8_t reserved[3];
+    usart_link_stats_t out[2];  // out of function 0's USART, then function 1's or the peer
+} __attribute__((packed)) usb_cdc_link_status_t;
+
+/* The USART on the other side of function n's tap, which has no function
+   of its own.  It follows the function's line coding, and its RX is only
+   sent as capture records */
+void usb_cdc_set_peer(uint8_t n, usart_ctx_t *peer);
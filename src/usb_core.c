@@ -1,29 +1,105 @@
 #include <stddef.h>
 #include <stdint.h>
+#include <string.h>
 #include <libopencm3/usb/usbd.h>
 #include <libopencm3/usb/usbstd.h>
 
 
 #include "usb_core.h"
 #include "usb_descriptors.h"
+#include "cpu_stats.h"
+#include "sched.h"
+#include "prof.h"
 
 /* Global USB device handle */
 static usbd_device *usbdev;
 
-uint8_t control_request_buffer[128]; // Buffer for control requests - ensure this is big enough for the entire descriptor
+uint8_t control_request_buffer[256]; // Buffer for control requests - ensure this is big enough for the entire descriptor (9 + 66 per CDC function + 23 vendor)
+
+static enum usbd_request_return_codes
+usb_core_vendor_request_cb(usbd_device *dev,
+                           struct usb_setup_data *req,
+                           uint8_t **buf,
+                           uint16_t *len,
+                           usbd_control_complete_callback *complete)
+{
+    (void)dev;
+    (void)complete;
+    cpu_stats_t stats;
+    sched_task_stats_t tasks[SCHED_TASKS_MAX];
+
+    if (req->bRequest == USB_CORE_VENDOR_REQ_GET_TASK_STATS) {
+        uint16_t n;
+
+        if (!(req->bmRequestType & USB_REQ_TYPE_IN)) {
+            return USBD_REQ_NOTSUPP;
+        }
+        n = sched_get_stats(tasks, SCHED_TASKS_MAX, req->wValue & 1) * sizeof(tasks[0]);
+        if (*len > n) {
+            *len = n;
+        }
+        memcpy(*buf, tasks, *len);
+        return USBD_REQ_HANDLED;
+    }
+#if PROF
+    if (req->bRequest == USB_CORE_VENDOR_REQ_GET_PROFILE) {
+        prof_point_t point;
+
+        if (!(req->bmRequestType & USB_REQ_TYPE_IN) || req->wIndex >= PROF_POINTS) {
+            return USBD_REQ_NOTSUPP;
+        }
+        prof_get(req->wIndex, &point, req->wValue & 1);
+        if (*len > sizeof(point)) {
+            *len = sizeof(point);
+        }
+        memcpy(*buf, &point, *len);
+        return USBD_REQ_HANDLED;
+    }
+#endif
+    if (req->bRequest != USB_CORE_VENDOR_REQ_GET_CPU_STATS) {
+        return USBD_REQ_NEXT_CALLBACK;
+    }
+    if (!(req->bmRequestType & USB_REQ_TYPE_IN)) {
+        return USBD_REQ_NOTSUPP;
+    }
+
+    cpu_stats_get(&stats);
+    if (req->wValue & 1) {
+        cpu_stats_reset();
+    }
+    if (*len > sizeof(stats)) {
+        *len = sizeof(stats);
+    }
+    memcpy(*buf, &stats, *len);
+    return USBD_REQ_HANDLED;
+}
+
+/* SET_CONFIGURATION drops the control callbacks, put ours back */
+static void usb_core_set_config(usbd_device *usbd_dev, uint16_t wValue)
+{
+    (void)wValue;
+
+    usbd_register_control_callback(
+        usbd_dev,
+        USB_REQ_TYPE_VENDOR | USB_REQ_TYPE_DEVICE,
+        USB_REQ_TYPE_TYPE  | USB_REQ_TYPE_RECIPIENT,
+        usb_core_vendor_request_cb);
+}
 
 void usb_core_init()
 {
     /* Replace placeholder with processor serial number to allow unique udev rules */
     usb_descriptors_set_unique_serial();
+    usb_descriptors_init();
 
     usbdev = usbd_init(&otgfs_usb_driver,
                        &dev_descriptor,
                        &config_descriptor,
                        usb_strings,
-                       3,
+                       4,
                        control_request_buffer,
                        sizeof(control_request_buffer));
+    usbd_register_set_config_callback(usbdev, usb_core_set_config);
 
 }
 
@@ -32,6 +108,8 @@ usbd_device* usb_core_get_handle()
   return usbdev;
 }
 
+/* From otg_fs_isr(): every USB event is serviced here, one per call, the
+   core keeps the interrupt asserted while more are waiting */
 void usb_core_poll() 
 {
     usbd_poll(usbdev);
@@ -7,3 +7,20 @@ void usb_core_init(void);
 usbd_device* usb_core_get_handle(void);
 void usb_core_poll(void);
 
+/*
+ * Vendor IN request to the device: cpu_stats_t for the current window.
+ * wValue bit 0 starts a new window once read.
+ */
+#define USB_CORE_VENDOR_REQ_GET_CPU_STATS   0x02
+
+/*
+ * Vendor IN request to the device: sched_task_stats_t for each main loop
+ * task, highest priority first.  wValue bit 0 clears them once read.
+ */
+#define USB_CORE_VENDOR_REQ_GET_TASK_STATS  0x03
+
+/*
+ * Vendor IN request to the device, built with -DPROF=1: prof_point_t for
+ * the point in wIndex, PROF_* (prof.h).  wValue bit 0 clears it once read.
+ */
+#define USB_CORE_VENDOR_REQ_GET_PROFILE     0x04
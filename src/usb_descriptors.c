@@ -15,9 +15,10 @@ const struct usb_device_descriptor dev_descriptor = {
     .bDescriptorType = USB_DT_DEVICE,
     .bcdUSB = 0x0200,
 
-    .bDeviceClass = USB_CLASS_CDC,
-    .bDeviceSubClass = 0,
-    .bDeviceProtocol = 0,
+    /* Composite: functions described by IADs */
+    .bDeviceClass = USB_CLASS_MISCELLANEOUS,
+    .bDeviceSubClass = 2,
+    .bDeviceProtocol = 1,
     .bMaxPacketSize0 = 64,
     .idVendor = 0x1209,
     .idProduct = 0x0001,
@@ -29,128 +30,202 @@ const struct usb_device_descriptor dev_descriptor = {
 };
 
 /* --------------------------------------------------------------------------
- * Endpoint descriptors
+ * CDC functions.  Endpoint addresses and interface numbers differ per
+ * function, the rest is the same; usb_descriptors_init() fills them in.
  * -------------------------------------------------------------------------- */
 
-/* CDC0 notification (interrupt IN) */
-static const struct usb_endpoint_descriptor cdc0_comm_endp[] = {{
-    .bLength = USB_DT_ENDPOINT_SIZE,
-    .bDescriptorType = USB_DT_ENDPOINT,
-    .bEndpointAddress = EP_CDC0_NOTIFY,
-    .bmAttributes = USB_ENDPOINT_ATTR_INTERRUPT,
-    .wMaxPacketSize = 16,
-    .bInterval = 255,
-}};
-
-
-
-/* CDC0 data (bulk IN/OUT) */
-static const struct usb_endpoint_descriptor cdc0_data_endp[] = {{
-    .bLength = USB_DT_ENDPOINT_SIZE,
-    .bDescriptorType = USB_DT_ENDPOINT,
-    .bEndpointAddress = EP_CDC0_OUT,
-    .bmAttributes = USB_ENDPOINT_ATTR_BULK,
-    .wMaxPacketSize = 64,
-    .bInterval = 1,
-}, {
-    .bLength = USB_DT_ENDPOINT_SIZE,
-    .bDescriptorType = USB_DT_ENDPOINT,
-    .bEndpointAddress = EP_CDC0_IN,
-    .bmAttributes = USB_ENDPOINT_ATTR_BULK,
-    .wMaxPacketSize = 64,
-    .bInterval = 1,
-}};
-
-/* --------------------------------------------------------------------------
- * CDC functional descriptors (one block per function)
- * NOTE: bDescriptorType = CS_INTERFACE (from libopencm3/usb/cdc.h)
- * -------------------------------------------------------------------------- */
-
-static const struct {
+typedef struct {
     struct usb_cdc_header_descriptor header;
     struct usb_cdc_call_management_descriptor call_mgmt;
     struct usb_cdc_acm_descriptor acm;
     struct usb_cdc_union_descriptor cdc_union;
-} __attribute__((packed)) cdc0_func_desc = {
-    .header = {
-        .bFunctionLength = sizeof(struct usb_cdc_header_descriptor),
-        .bDescriptorType = CS_INTERFACE,
-        .bDescriptorSubtype = USB_CDC_TYPE_HEADER,
-        .bcdCDC = 0x0110,
-    },
-    .call_mgmt = {
-        .bFunctionLength = sizeof(struct usb_cdc_call_management_descriptor),
-        .bDescriptorType = CS_INTERFACE,
-        .bDescriptorSubtype = USB_CDC_TYPE_CALL_MANAGEMENT,
-        .bmCapabilities = 0,
-        .bDataInterface = IFACE_CDC0_DATA,
-    },
-    .acm = {
-        .bFunctionLength = sizeof(struct usb_cdc_acm_descriptor),
-        .bDescriptorType = CS_INTERFACE,
-        .bDescriptorSubtype = USB_CDC_TYPE_ACM,
-        .bmCapabilities = 0x02, /* line coding + serial state */
-    },
-    .cdc_union = {
-        .bFunctionLength = sizeof(struct usb_cdc_union_descriptor),
-        .bDescriptorType = CS_INTERFACE,
-        .bDescriptorSubtype = USB_CDC_TYPE_UNION,
-        .bControlInterface = IFACE_CDC0_COMM,
-        .bSubordinateInterface0 = IFACE_CDC0_DATA,
-    },
-};
+} __attribute__((packed)) cdc_func_desc_t;
+
+typedef struct {
+    struct usb_iface_assoc_descriptor iad;
+    struct usb_endpoint_descriptor comm_endp[1];    /* notification (interrupt IN) */
+    struct usb_endpoint_descriptor data_endp[2];    /* data (bulk OUT / IN) */
+    cdc_func_desc_t func_desc;                      /* NOTE: bDescriptorType = CS_INTERFACE */
+    struct usb_interface_descriptor comm_iface[1];
+    struct usb_interface_descriptor data_iface[1];
+} cdc_function_desc_t;
+
+static cdc_function_desc_t cdc_function[USB_CDC_NUM];
+
+/* Interface table, two per function */
+static struct usb_interface interfaces[IFACE_COUNT];
+
+static void cdc_function_init(uint8_t n)
+{
+    cdc_function_desc_t *f = &cdc_function[n];
+
+    /* IAD: groups the two interfaces into one function for the host */
+    f->iad = (struct usb_iface_assoc_descriptor) {
+        .bLength = USB_DT_INTERFACE_ASSOCIATION_SIZE,
+        .bDescriptorType = USB_DT_INTERFACE_ASSOCIATION,
+        .bFirstInterface = IFACE_CDC_COMM(n),
+        .bInterfaceCount = 2,
+        .bFunctionClass = USB_CLASS_CDC,
+        .bFunctionSubClass = USB_CDC_SUBCLASS_ACM,
+        .bFunctionProtocol = USB_CDC_PROTOCOL_AT,
+        .iFunction = 0,
+    };
+
+    f->comm_endp[0] = (struct usb_endpoint_descriptor) {
+        .bLength = USB_DT_ENDPOINT_SIZE,
+        .bDescriptorType = USB_DT_ENDPOINT,
+        .bEndpointAddress = EP_CDC_NOTIFY(n),
+        .bmAttributes = USB_ENDPOINT_ATTR_INTERRUPT,
+        .wMaxPacketSize = 16,
+        .bInterval = 255,
+    };
+
+    f->data_endp[0] = (struct usb_endpoint_descriptor) {
+        .bLength = USB_DT_ENDPOINT_SIZE,
+        .bDescriptorType = USB_DT_ENDPOINT,
+        .bEndpointAddress = EP_CDC_OUT(n),
+        .bmAttributes = USB_ENDPOINT_ATTR_BULK,
+        .wMaxPacketSize = CDC_DATA_PACKET_SIZE,
+        .bInterval = 1,
+    };
+    f->data_endp[1] = (struct usb_endpoint_descriptor) {
+        .bLength = USB_DT_ENDPOINT_SIZE,
+        .bDescriptorType = USB_DT_ENDPOINT,
+        .bEndpointAddress = EP_CDC_IN(n),
+        .bmAttributes = USB_ENDPOINT_ATTR_BULK,
+        .wMaxPacketSize = CDC_DATA_PACKET_SIZE,
+        .bInterval = 1,
+    };
+
+    f->func_desc = (cdc_func_desc_t) {
+        .header = {
+            .bFunctionLength = sizeof(struct usb_cdc_header_descriptor),
+            .bDescriptorType = CS_INTERFACE,
+            .bDescriptorSubtype = USB_CDC_TYPE_HEADER,
+            .bcdCDC = 0x0110,
+        },
+        .call_mgmt = {
+            .bFunctionLength = sizeof(struct usb_cdc_call_management_descriptor),
+            .bDescriptorType = CS_INTERFACE,
+            .bDescriptorSubtype = USB_CDC_TYPE_CALL_MANAGEMENT,
+            .bmCapabilities = 0,
+            .bDataInterface = IFACE_CDC_DATA(n),
+        },
+        .acm = {
+            .bFunctionLength = sizeof(struct usb_cdc_acm_descriptor),
+            .bDescriptorType = CS_INTERFACE,
+            .bDescriptorSubtype = USB_CDC_TYPE_ACM,
+            .bmCapabilities = 0x02, /* line coding + serial state */
+        },
+        .cdc_union = {
+            .bFunctionLength = sizeof(struct usb_cdc_union_descriptor),
+            .bDescriptorType = CS_INTERFACE,
+            .bDescriptorSubtype = USB_CDC_TYPE_UNION,
+            .bControlInterface = IFACE_CDC_COMM(n),
+            .bSubordinateInterface0 = IFACE_CDC_DATA(n),
+        },
+    };
+
+    /* COMM interface */
+    f->comm_iface[0] = (struct usb_interface_descriptor) {
+        .bLength = USB_DT_INTERFACE_SIZE,
+        .bDescriptorType = USB_DT_INTERFACE,
+        .bInterfaceNumber = IFACE_CDC_COMM(n),
+        .bAlternateSetting = 0,
+        .bNumEndpoints = 1,
+        .bInterfaceClass = USB_CLASS_CDC,
+        .bInterfaceSubClass = USB_CDC_SUBCLASS_ACM,
+        .bInterfaceProtocol = USB_CDC_PROTOCOL_AT,
+        .iInterface = 0,
 
+        .endpoint = f->comm_endp,
+        .extra   = &f->func_desc,
+        .extralen = sizeof(f->func_desc),
+    };
 
+    /* DATA interface */
+    f->data_iface[0] = (struct usb_interface_descriptor) {
+        .bLength = USB_DT_INTERFACE_SIZE,
+        .bDescriptorType = USB_DT_INTERFACE,
+        .bInterfaceNumber = IFACE_CDC_DATA(n),
+        .bAlternateSetting = 0,
+        .bNumEndpoints = 2,
+        .bInterfaceClass = USB_CLASS_DATA,
+        .bInterfaceSubClass = 0,
+        .bInterfaceProtocol = 0,
+        .iInterface = 0,
+
+        .endpoint = f->data_endp,
+        .extra = NULL,
+        .extralen = 0,
+    };
+
+    interfaces[IFACE_CDC_COMM(n)] = (struct usb_interface) {
+        .num_altsetting = 1,
+        .iface_assoc    = &f->iad,
+        .altsetting     = f->comm_iface,
+    };
+    interfaces[IFACE_CDC_DATA(n)] = (struct usb_interface) {
+        .num_altsetting = 1,
+        .altsetting     = f->data_iface,
+    };
+}
+
+#if USB_VENDOR
 /* --------------------------------------------------------------------------
- * Interface descriptors
+ * Vendor interface: no class, the host finds it by its string
  * -------------------------------------------------------------------------- */
-
-/* CDC0 COMM interface */
-static const struct usb_interface_descriptor cdc0_comm_iface[] = {{
-    .bLength = USB_DT_INTERFACE_SIZE,
-    .bDescriptorType = USB_DT_INTERFACE,
-    .bInterfaceNumber = IFACE_CDC0_COMM,
-    .bAlternateSetting = 0,
-    .bNumEndpoints = 1,
-    .bInterfaceClass = USB_CLASS_CDC,
-    .bInterfaceSubClass = USB_CDC_SUBCLASS_ACM,
-    .bInterfaceProtocol = USB_CDC_PROTOCOL_AT,
-    .iInterface = 0,
-
-    .endpoint = cdc0_comm_endp,
-    .extra   = &cdc0_func_desc,
-    .extralen = sizeof(cdc0_func_desc),
-}};
-
-/* CDC0 DATA interface */
-static const struct usb_interface_descriptor cdc0_data_iface[] = {{
-    .bLength = USB_DT_INTERFACE_SIZE,
-    .bDescriptorType = USB_DT_INTERFACE,
-    .bInterfaceNumber = IFACE_CDC0_DATA,
-    .bAlternateSetting = 0,
-    .bNumEndpoints = 2,
-    .bInterfaceClass = USB_CLASS_DATA,
-    .bInterfaceSubClass = 0,
-    .bInterfaceProtocol = 0,
-    .iInterface = 0,
-
-    .endpoint = cdc0_data_endp,
-    .extra = NULL,
-    .extralen = 0,
-}};
-
-/* Interface table */
-static const struct usb_interface interfaces[] = {
+static const struct usb_endpoint_descriptor vendor_endp[2] = {
     {
-        .num_altsetting = 1,
-        .altsetting     = cdc0_comm_iface,
+        .bLength = USB_DT_ENDPOINT_SIZE,
+        .bDescriptorType = USB_DT_ENDPOINT,
+        .bEndpointAddress = EP_VENDOR_OUT,
+        .bmAttributes = USB_ENDPOINT_ATTR_BULK,
+        .wMaxPacketSize = VENDOR_PACKET_SIZE,
+        .bInterval = 1,
     },
     {
-        .num_altsetting = 1,
-        .altsetting     = cdc0_data_iface,
+        .bLength = USB_DT_ENDPOINT_SIZE,
+        .bDescriptorType = USB_DT_ENDPOINT,
+        .bEndpointAddress = EP_VENDOR_IN,
+        .bmAttributes = USB_ENDPOINT_ATTR_BULK,
+        .wMaxPacketSize = VENDOR_PACKET_SIZE,
+        .bInterval = 1,
     },
 };
 
+static const struct usb_interface_descriptor vendor_iface[1] = {
+    {
+        .bLength = USB_DT_INTERFACE_SIZE,
+        .bDescriptorType = USB_DT_INTERFACE,
+        .bInterfaceNumber = IFACE_VENDOR,
+        .bAlternateSetting = 0,
+        .bNumEndpoints = 2,
+        .bInterfaceClass = USB_CLASS_VENDOR,
+        .bInterfaceSubClass = 0,
+        .bInterfaceProtocol = 0,
+        .iInterface = 4,
+
+        .endpoint = vendor_endp,
+        .extra = NULL,
+        .extralen = 0,
+    },
+};
+#endif
+
+void usb_descriptors_init(void)
+{
+    for (uint8_t n = 0; n < USB_CDC_NUM; n++) {
+        cdc_function_init(n);
+    }
+#if USB_VENDOR
+    interfaces[IFACE_VENDOR] = (struct usb_interface) {
+        .num_altsetting = 1,
+        .altsetting     = vendor_iface,
+    };
+#endif
+}
+
 /* --------------------------------------------------------------------------
  * Configuration descriptor
  * -------------------------------------------------------------------------- */
@@ -158,7 +233,7 @@ const struct usb_config_descriptor config_descriptor = {
     .bLength = USB_DT_CONFIGURATION_SIZE,
     .bDescriptorType = USB_DT_CONFIGURATION,
     .wTotalLength = 0,  /* filled in by libopencm3 */
-    .bNumInterfaces = 2,
+    .bNumInterfaces = IFACE_COUNT,
     .bConfigurationValue = 1,
     .iConfiguration = 0,
     .bmAttributes = 0x80, /* bus-powered */
@@ -180,6 +255,7 @@ const char *usb_strings[] = {
     "VK3DCU - Code Hax",        /* 1 */
     "FT7900 Radio head adapter",       /* 2 */
     usb_serial,                /* 3 */  // The hexidecimal equivilent of the device unique ID registers
+    "FT7900 adapter control",  /* 4 */  // vendor interface
 };
 
 
@@ -4,21 +4,69 @@
 #include <libopencm3/usb/usbstd.h>
 #include <libopencm3/usb/cdc.h>
 
-/* Interface numbers */
+/*
+ * OTG_FS endpoints besides EP0, per direction: 3 on the F411, 5 on the
+ * F412 / F446.
+ */
+#ifndef USB_EP_COUNT
+#define USB_EP_COUNT 3
+#endif
+
+/*
+ * CDC ACM functions, each bridging one USART.  A function takes two IN
+ * endpoints (data and notify), so the F411 has room for one; build with
+ * -DUSB_CDC_NUM=2 -DUSB_EP_COUNT=5 on a part with the larger core.
+ */
+#ifndef USB_CDC_NUM
+#define USB_CDC_NUM 1
+#endif
+
+/*
+ * Vendor class interface after the CDC functions, one bulk endpoint each
+ * way for batched commands (usb_vendor.h).  -DUSB_VENDOR=0 leaves it out.
+ */
+#ifndef USB_VENDOR
+#define USB_VENDOR 1
+#endif
+
+#if USB_CDC_NUM < 1 || 2 * USB_CDC_NUM + USB_VENDOR > USB_EP_COUNT
+#error "USB_CDC_NUM CDC functions need 2 * USB_CDC_NUM IN endpoints, plus one for USB_VENDOR"
+#endif
+
+/* Interface numbers: comm and data interface per function, then vendor */
+#define IFACE_CDC_COMM(n)   (2 * (n))
+#define IFACE_CDC_DATA(n)   (2 * (n) + 1)
+#define IFACE_VENDOR        (2 * USB_CDC_NUM)
+#define IFACE_COUNT         (2 * USB_CDC_NUM + USB_VENDOR)
+
 enum {
-    IFACE_CDC0_COMM = 0,
-    IFACE_CDC0_DATA = 1,
+    IFACE_CDC0_COMM = IFACE_CDC_COMM(0),
+    IFACE_CDC0_DATA = IFACE_CDC_DATA(0),
 };
 
-/* Endpoints for first CDC function */
-#define EP_CDC0_OUT     0x01  /* Bulk OUT  */
-#define EP_CDC0_IN      0x81  /* Bulk IN   */
-#define EP_CDC0_NOTIFY  0x82  /* Interrupt IN */
+/* Endpoints: function n has data on endpoint n + 1 in both directions and
+   notify on the IN endpoints after the data ones */
+#define EP_CDC_OUT(n)       ((n) + 1)                           /* Bulk OUT  */
+#define EP_CDC_IN(n)        (0x80 | ((n) + 1))                  /* Bulk IN   */
+#define EP_CDC_NOTIFY(n)    (0x80 | (USB_CDC_NUM + (n) + 1))    /* Interrupt IN */
+
+#define EP_CDC0_OUT     EP_CDC_OUT(0)
+#define EP_CDC0_IN      EP_CDC_IN(0)
+#define EP_CDC0_NOTIFY  EP_CDC_NOTIFY(0)
+
+/* Vendor interface: the endpoints after the CDC ones */
+#define EP_VENDOR_OUT       (USB_CDC_NUM + 1)                   /* Bulk OUT  */
+#define EP_VENDOR_IN        (0x80 | (2 * USB_CDC_NUM + 1))      /* Bulk IN   */
+#define VENDOR_PACKET_SIZE  64
+
+/* Full-speed bulk max packet size for CDC data endpoints */
+#define CDC_DATA_PACKET_SIZE 64
 
 /* Descriptors exposed to main.c */
 extern const struct usb_device_descriptor dev_descriptor;
 extern const struct usb_config_descriptor config_descriptor;
 extern const char *usb_strings[];
 
+void usb_descriptors_init(void);              /* Fill in the per-function descriptors */
 void usb_descriptors_set_unique_serial(void); /* Set serial number to processor id */
 
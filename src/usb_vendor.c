@@ -0,0 +1,328 @@
+#include <stddef.h>
+#include <string.h>
+#include <libopencm3/usb/usbd.h>
+#include <libopencm3/usb/usbstd.h>
+#include <libopencm3/cm3/cortex.h>
+
+#include "usb_descriptors.h"
+#include "usb_core.h"
+#include "usb_vendor.h"
+#include "usb_cdc.h"
+#include "ringbuf.h"
+#include "timebase.h"
+
+#if USB_VENDOR
+
+/*
+ * A batch runs from the OUT callback, and a WAIT resumes it from the
+ * USART RX tap or the timebase ISR.  Those all run at the same priority
+ * and don't preempt each other, so the batch state is only ever in one of
+ * them, and SEND can share the TX ring's producer side with CDC OUT.
+ */
+typedef enum {
+    VENDOR_RECEIVING,       // collecting a batch
+    VENDOR_WAITING,         // a WAIT is watching RX
+    VENDOR_ANSWERING,       // responses going out on IN
+} vendor_state_t;
+
+static struct {
+    usbd_device *usbdev;
+    usart_ctx_t *ports;
+    uint8_t nports;
+    void (*set_ptt)(bool on);
+
+    vendor_state_t state;
+    uint8_t cmd[USB_VENDOR_BATCH_MAX];
+    uint16_t cmd_len;
+    uint16_t cmd_off;               // next command to run
+    bool cmd_overflow;              // batch longer than cmd[]
+
+    uint8_t rsp[USB_VENDOR_BATCH_MAX];
+    uint16_t rsp_len;
+    uint16_t rsp_sent;
+    bool rsp_zlp;                   // last packet was full size
+
+    /* WAIT in progress, its response at rsp[wait_rsp] */
+    usart_ctx_t *wait_port;
+    uint8_t pattern[USB_VENDOR_PATTERN_MAX];
+    uint8_t pattern_len;
+    uint8_t window[USB_VENDOR_PATTERN_MAX];     // last bytes received
+    uint8_t window_len;
+    uint16_t wait_rsp;
+    uint16_t wait_max;              // payload it may capture
+    timebase_timer_t wait_timer;
+} vendor;
+
+#define RSP_HDR 3
+
+static void vendor_run(void);
+
+/* Room for responses, less the TRUNCATED one that may end the batch */
+static uint16_t vendor_room(void)
+{
+    return USB_VENDOR_BATCH_MAX - RSP_HDR - vendor.rsp_len;
+}
+
+static void vendor_rsp(uint8_t op, uint8_t status, const void *payload, uint8_t len)
+{
+    uint8_t *r = &vendor.rsp[vendor.rsp_len];
+
+    r[0] = op;
+    r[1] = status;
+    r[2] = len;
+    memcpy(&r[RSP_HDR], payload, len);
+    vendor.rsp_len += RSP_HDR + len;
+}
+
+/* --------------------------------------------------------------------------
+ * Answer: the responses as one IN transfer
+ * -------------------------------------------------------------------------- */
+
+/* Next packet of the answer: a ZLP ends it after a full one, or if empty */
+static void vendor_send_next(void)
+{
+    uint16_t n = vendor.rsp_len - vendor.rsp_sent;
+
+    if (n > VENDOR_PACKET_SIZE) {
+        n = VENDOR_PACKET_SIZE;
+    }
+    usbd_ep_write_packet(vendor.usbdev, EP_VENDOR_IN, &vendor.rsp[vendor.rsp_sent], n);
+    vendor.rsp_sent += n;
+    vendor.rsp_zlp = (n == VENDOR_PACKET_SIZE);
+}
+
+static void vendor_tx_cb(usbd_device *dev, uint8_t ep)
+{
+    (void)ep;
+
+    if (vendor.state != VENDOR_ANSWERING) {
+        return;
+    }
+    if (vendor.rsp_sent < vendor.rsp_len || vendor.rsp_zlp) {
+        vendor_send_next();
+        return;
+    }
+
+    /* All taken: ready for the next batch */
+    vendor.state = VENDOR_RECEIVING;
+    vendor.cmd_len = 0;
+    vendor.cmd_overflow = false;
+    usbd_ep_nak_set(dev, EP_VENDOR_OUT, 0);
+}
+
+static void vendor_answer(void)
+{
+    vendor.state = VENDOR_ANSWERING;
+    vendor.rsp_sent = 0;
+    vendor.rsp_zlp = false;
+    vendor_send_next();
+}
+
+/* --------------------------------------------------------------------------
+ * WAIT
+ * -------------------------------------------------------------------------- */
+
+static void vendor_wait_done(uint8_t status)
+{
+    timebase_timer_stop(&vendor.wait_timer);
+    usart_set_rx_tap(vendor.wait_port, NULL, NULL);
+
+    vendor.rsp[vendor.wait_rsp + 1] = status;
+    vendor.rsp[vendor.wait_rsp + 2] = vendor.rsp_len - vendor.wait_rsp - RSP_HDR;
+    vendor_run();
+}
+
+static void vendor_wait_rx(void *ctx, const uint8_t *data, uint16_t len)
+{
+    (void)ctx;
+
+    for (uint16_t i = 0; i < len && vendor.state == VENDOR_WAITING; i++) {
+        if (vendor.rsp_len - vendor.wait_rsp - RSP_HDR < vendor.wait_max) {
+            vendor.rsp[vendor.rsp_len++] = data[i];
+        }
+        if (vendor.pattern_len == 0) {
+            continue;
+        }
+
+        /* The pattern is short, a sliding window is cheap enough */
+        if (vendor.window_len == vendor.pattern_len) {
+            memmove(vendor.window, &vendor.window[1], vendor.pattern_len - 1);
+            vendor.window_len--;
+        }
+        vendor.window[vendor.window_len++] = data[i];
+        if (vendor.window_len == vendor.pattern_len &&
+            memcmp(vendor.window, vendor.pattern, vendor.pattern_len) == 0) {
+            vendor_wait_done(USB_VENDOR_OK);
+        }
+    }
+}
+
+static void vendor_wait_timeout(void *ctx)
+{
+    (void)ctx;
+
+    if (vendor.state == VENDOR_WAITING) {
+        vendor_wait_done(vendor.pattern_len == 0 ? USB_VENDOR_OK : USB_VENDOR_TIMEOUT);
+    }
+}
+
+static void vendor_wait_start(usart_ctx_t *port, const uint8_t *payload, uint8_t len)
+{
+    uint16_t room = vendor_room() - RSP_HDR;
+
+    vendor.state = VENDOR_WAITING;
+    vendor.wait_port = port;
+    vendor.pattern_len = len - 2;
+    memcpy(vendor.pattern, &payload[2], vendor.pattern_len);
+    vendor.window_len = 0;
+
+    /* Response header now, filled in when the wait ends */
+    vendor.wait_rsp = vendor.rsp_len;
+    vendor_rsp(USB_VENDOR_OP_WAIT, USB_VENDOR_OK, NULL, 0);
+    vendor.wait_max = room < 255 ? room : 255;
+
+    usart_set_rx_tap(port, vendor_wait_rx, NULL);
+    timebase_timer_start(&vendor.wait_timer, (payload[0] | payload[1] << 8) * 1000u);
+}
+
+/* --------------------------------------------------------------------------
+ * Commands
+ * -------------------------------------------------------------------------- */
+
+/* Run commands until the batch ends or a WAIT has to wait */
+static void vendor_run(void)
+{
+    bool truncated = vendor.cmd_overflow;
+
+    vendor.state = VENDOR_RECEIVING;
+    while (!truncated && vendor.cmd_off < vendor.cmd_len) {
+        const uint8_t *c = &vendor.cmd[vendor.cmd_off];
+        uint16_t left = vendor.cmd_len - vendor.cmd_off;
+
+        if (left < RSP_HDR || left < RSP_HDR + c[2] || vendor_room() < RSP_HDR) {
+            truncated = true;
+            break;
+        }
+
+        uint8_t op = c[0];
+        uint8_t len = c[2];
+        const uint8_t *payload = &c[RSP_HDR];
+        usart_ctx_t *port = (c[1] < vendor.nports) ? &vendor.ports[c[1]] : NULL;
+
+        if (op == USB_VENDOR_OP_COUNTERS && vendor_room() < RSP_HDR + sizeof(usart_counters_t)) {
+            truncated = true;
+            break;
+        }
+        vendor.cmd_off += RSP_HDR + len;
+
+        switch (op) {
+        case USB_VENDOR_OP_SEND:
+            if (port == NULL) {
+                vendor_rsp(op, USB_VENDOR_BAD_PORT, NULL, 0);
+            } else if (!usb_cdc_usart_send(port, payload, len)) {
+                vendor_rsp(op, USB_VENDOR_FULL, NULL, 0);
+            } else {
+                vendor_rsp(op, USB_VENDOR_OK, NULL, 0);
+            }
+            break;
+
+        case USB_VENDOR_OP_WAIT:
+            if (port == NULL) {
+                vendor_rsp(op, USB_VENDOR_BAD_PORT, NULL, 0);
+            } else if (len < 2 || len > 2 + USB_VENDOR_PATTERN_MAX) {
+                vendor_rsp(op, USB_VENDOR_BAD_OP, NULL, 0);
+            } else {
+                vendor_wait_start(port, payload, len);
+                return;
+            }
+            break;
+
+        case USB_VENDOR_OP_COUNTERS:
+            if (port == NULL) {
+                vendor_rsp(op, USB_VENDOR_BAD_PORT, NULL, 0);
+            } else {
+                usart_counters_t counters;
+
+                usart_get_counters(port, &counters);
+                vendor_rsp(op, USB_VENDOR_OK, &counters, sizeof(counters));
+            }
+            break;
+
+        case USB_VENDOR_OP_PTT:
+            if (len != 1 || vendor.set_ptt == NULL) {
+                vendor_rsp(op, USB_VENDOR_BAD_OP, NULL, 0);
+            } else {
+                vendor.set_ptt(payload[0] != 0);
+                vendor_rsp(op, USB_VENDOR_OK, NULL, 0);
+            }
+            break;
+
+        default:
+            vendor_rsp(op, USB_VENDOR_BAD_OP, NULL, 0);
+            break;
+        }
+    }
+
+    if (truncated) {
+        vendor_rsp(0, USB_VENDOR_TRUNCATED, NULL, 0);
+    }
+    vendor_answer();
+}
+
+static void vendor_rx_cb(usbd_device *dev, uint8_t ep)
+{
+    uint8_t buf[VENDOR_PACKET_SIZE];
+    uint16_t len = usbd_ep_read_packet(dev, ep, buf, sizeof(buf));
+
+    if (vendor.state != VENDOR_RECEIVING) {
+        /* OUT is NAKed until the answer is taken, this can't happen */
+        return;
+    }
+    if (vendor.cmd_len + len <= sizeof(vendor.cmd)) {
+        memcpy(&vendor.cmd[vendor.cmd_len], buf, len);
+        vendor.cmd_len += len;
+    } else {
+        vendor.cmd_overflow = true;
+    }
+
+    /* A short packet ends the batch */
+    if (len < VENDOR_PACKET_SIZE) {
+        usbd_ep_nak_set(dev, EP_VENDOR_OUT, 1);
+        vendor.cmd_off = 0;
+        vendor.rsp_len = 0;
+        vendor_run();
+    }
+}
+
+static void vendor_set_config(usbd_device *usbd_dev, uint16_t wValue)
+{
+    (void)wValue;
+
+    usbd_ep_setup(usbd_dev, EP_VENDOR_OUT, USB_ENDPOINT_ATTR_BULK, VENDOR_PACKET_SIZE, vendor_rx_cb);
+    usbd_ep_setup(usbd_dev, EP_VENDOR_IN, USB_ENDPOINT_ATTR_BULK, VENDOR_PACKET_SIZE, vendor_tx_cb);
+
+    /* Whatever was going on belonged to the last configuration */
+    if (vendor.state == VENDOR_WAITING) {
+        timebase_timer_stop(&vendor.wait_timer);
+        usart_set_rx_tap(vendor.wait_port, NULL, NULL);
+    }
+    vendor.state = VENDOR_RECEIVING;
+    vendor.cmd_len = 0;
+    vendor.cmd_overflow = false;
+}
+
+void usb_vendor_init(usart_ctx_t *ports, uint8_t nports, void (*set_ptt)(bool on))
+{
+    vendor.usbdev = usb_core_get_handle();
+    vendor.ports = ports;
+    vendor.nports = nports;
+    vendor.set_ptt = set_ptt;
+    vendor.state = VENDOR_RECEIVING;
+    vendor.cmd_len = 0;
+    vendor.cmd_overflow = false;
+    timebase_timer_init(&vendor.wait_timer, vendor_wait_timeout, NULL);
+
+    usbd_register_set_config_callback(vendor.usbdev, vendor_set_config);
+}
+
+#endif
@@ -0,0 +1,54 @@
+#ifndef USB_VENDOR_H
+#define USB_VENDOR_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "usart.h"
+
+/*
+ * Vendor bulk interface (USB_VENDOR): a batch of commands in one OUT
+ * transfer, ended by a short packet or ZLP, answered by one IN transfer
+ * once the last command has finished.  OUT is NAKed from the end of a
+ * batch until its answer has been taken.
+ *
+ *   command:  op, port, len, payload[len]
+ *   response: op, status, len, payload[len]
+ *
+ * port is the CDC function whose USART the command is for.  Commands run
+ * in order; one whose response would not fit in what is left of
+ * USB_VENDOR_BATCH_MAX, and everything after it, is not run.
+ */
+#define USB_VENDOR_BATCH_MAX    512
+#define USB_VENDOR_PATTERN_MAX  16
+
+enum {
+    /* payload: bytes for USART TX, queued whole or not at all */
+    USB_VENDOR_OP_SEND      = 0x01,
+    /* payload: timeout in ms (u16 LE), then up to USB_VENDOR_PATTERN_MAX
+       bytes to wait for in RX from now on.  Response payload: what came
+       in until the pattern ended (or the timeout), as much as fits in one
+       response.  An empty pattern just waits out the timeout, status OK */
+    USB_VENDOR_OP_WAIT      = 0x02,
+    /* response payload: usart_counters_t */
+    USB_VENDOR_OP_COUNTERS  = 0x03,
+    /* payload: 1 byte, nonzero keys PTT */
+    USB_VENDOR_OP_PTT       = 0x04,
+};
+
+enum {
+    USB_VENDOR_OK           = 0x00,
+    USB_VENDOR_TIMEOUT      = 0x01,
+    USB_VENDOR_FULL         = 0x02,     // SEND: not enough room in the TX ring
+    USB_VENDOR_BAD_PORT     = 0x03,
+    USB_VENDOR_BAD_OP       = 0x04,     // unknown op, or payload the wrong size
+    USB_VENDOR_TRUNCATED    = 0x05,     // batch cut short or too long: op 0, the last response
+};
+
+/*
+ * ports[n] is CDC function n's USART, nports of them.  set_ptt keys (true)
+ * or releases the PTT line, NULL if there is none.
+ */
+void usb_vendor_init(usart_ctx_t *ports, uint8_t nports, void (*set_ptt)(bool on));
+
+#endif /* USB_VENDOR_H */